@@ -0,0 +1,34 @@
+#[============================================================[.rst:
+Findonnxruntime
+===============
+#]============================================================]
+if (NOT onnxruntime_FOUND)
+  find_path(onnxruntime_INCLUDE_DIR onnxruntime_cxx_api.h
+    PATH_SUFFIXES include include/onnxruntime include/onnxruntime/core/session)
+  mark_as_advanced(onnxruntime_INCLUDE_DIR)
+  find_library(onnxruntime_LIBRARY NAMES onnxruntime)
+  mark_as_advanced(onnxruntime_LIBRARY)
+  if (onnxruntime_INCLUDE_DIR AND EXISTS "${onnxruntime_INCLUDE_DIR}/onnxruntime_c_api.h")
+    file(STRINGS "${onnxruntime_INCLUDE_DIR}/onnxruntime_c_api.h"
+      _fort_version REGEX "^[ \t]*#[ \t]*define[ \t]+ORT_API_VERSION[ \t]+")
+    list(TRANSFORM _fort_version REPLACE "^.*[ \t]+([0-9]+).*$" "\\1")
+    if (_fort_version)
+      set(onnxruntime_VERSION "1.${_fort_version}")
+    endif()
+    unset(_fort_version)
+  endif()
+endif()
+
+include(FindPackageHandleStandardArgs)
+
+find_package_handle_standard_args(onnxruntime
+  REQUIRED_VARS onnxruntime_INCLUDE_DIR onnxruntime_LIBRARY
+  VERSION_VAR onnxruntime_VERSION
+)
+
+if (onnxruntime_FOUND AND NOT TARGET onnxruntime::onnxruntime)
+  add_library(onnxruntime::onnxruntime SHARED IMPORTED)
+  set_target_properties(onnxruntime::onnxruntime PROPERTIES
+    IMPORTED_LOCATION "${onnxruntime_LIBRARY}"
+    INTERFACE_INCLUDE_DIRECTORIES "${onnxruntime_INCLUDE_DIR}")
+endif()
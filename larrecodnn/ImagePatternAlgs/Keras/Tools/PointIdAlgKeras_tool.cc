@@ -26,9 +26,13 @@ namespace PointIdAlgTools {
     std::vector<float> Run(std::vector<std::vector<float>> const& inp2d) const override;
     std::vector<std::vector<float>> Run(std::vector<std::vector<std::vector<float>>> const& inps,
                                         int samples = -1) const override;
+    std::vector<std::vector<float>> Run(float const* inps, size_t samples) const override;
 
   private:
+    std::vector<std::vector<float>> runBatch() const;
+
     std::unique_ptr<keras::KerasModel> m;
+    mutable keras::KerasModel::Workspace fWorkspace; // activation buffers reused across calls
     std::string fNNetModelFilePath;
     std::string findFile(const char* fileName) const;
   };
@@ -50,8 +54,10 @@ namespace PointIdAlgTools {
       fNNetModelFilePath = "mycnn";
     }
 
-    if ((fNNetModelFilePath.length() > 5) &&
-        (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 5, 5, ".nnet") == 0)) {
+    if (((fNNetModelFilePath.length() > 5) &&
+         (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 5, 5, ".nnet") == 0)) ||
+        ((fNNetModelFilePath.length() > 6) &&
+         (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 6, 6, ".nnetb") == 0))) {
       m = std::make_unique<keras::KerasModel>(findFile(fNNetModelFilePath.c_str()).c_str());
       mf::LogInfo("PointIdAlgKeras") << "Keras model loaded.";
     }
@@ -82,12 +88,14 @@ namespace PointIdAlgTools {
   std::vector<float>
   PointIdAlgKeras::Run(std::vector<std::vector<float>> const& inp2d) const
   {
-    std::vector<std::vector<std::vector<float>>> inp3d;
-    inp3d.push_back(inp2d); // lots of copy, should add 2D to keras...
-
-    keras::DataChunk2D sample;
-    sample.set_data(inp3d);
-    return m->compute_output(&sample);
+    nnet::PerfTimer timer(fPerfInput);
+    const size_t rows = inp2d.size(), cols = rows ? inp2d.front().size() : 0;
+    auto& input = fWorkspace.input(1, 1, rows, cols);
+    for (size_t w = 0; w < rows; ++w) {
+      std::copy_n(inp2d[w].begin(), cols, input.plane(0) + w * cols);
+    }
+    timer.next(fPerfInference);
+    return m->compute_batch(fWorkspace).get_flat();
   }
 
   // ------------------------------------------------------
@@ -101,18 +109,45 @@ namespace PointIdAlgTools {
 
     if ((samples == -1) || (samples > (long long int)inps.size())) { samples = inps.size(); }
 
-    std::vector<std::vector<float>> out;
-
+    // whole batch copied once into the model input, then pushed through each layer at once
+    nnet::PerfTimer timer(fPerfInput);
+    const size_t rows = inps.front().size(), cols = inps.front().front().size();
+    auto& input = fWorkspace.input(samples, 1, rows, cols);
     for (long long int s = 0; s < samples; ++s) {
-      std::vector<std::vector<std::vector<float>>> inp3d;
-      inp3d.push_back(inps[s]); // lots of copy, should add 2D to keras...
-
-      keras::DataChunk* sample = new keras::DataChunk2D();
-      sample->set_data(inp3d); // and more copy...
-      out.push_back(m->compute_output(sample));
-      delete sample;
+      float* dst = input.sample(s);
+      for (size_t w = 0; w < rows; ++w, dst += cols) {
+        std::copy_n(inps[s][w].begin(), cols, dst);
+      }
     }
+    timer.stop();
+    return runBatch();
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgKeras::Run(float const* inps, size_t samples) const
+  {
+    if ((samples == 0) || !inps) { return std::vector<std::vector<float>>(); }
 
+    nnet::PerfTimer timer(fPerfInput);
+    auto& input = fWorkspace.input(samples, 1, fPatchSizeW, fPatchSizeD);
+    std::copy_n(inps, samples * fPatchSizeW * fPatchSizeD, input.get_flat_rw().begin());
+    timer.stop();
+    return runBatch();
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgKeras::runBatch() const
+  {
+    nnet::PerfTimer timer(fPerfInference);
+    auto const& result = m->compute_batch(fWorkspace);
+
+    timer.next(fPerfOutput);
+    std::vector<std::vector<float>> out(result.samples());
+    for (size_t s = 0; s < result.samples(); ++s) {
+      out[s].assign(result.sample(s), result.sample(s) + result.sample_size());
+    }
     return out;
   }
 
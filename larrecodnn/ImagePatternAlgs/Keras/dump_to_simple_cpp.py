@@ -1,68 +1,180 @@
+from __future__ import print_function
 import numpy as np
 np.random.seed(1337)
-from keras.models import Sequential, model_from_json
 import json
 import argparse
+import re
+import struct
 
 parser = argparse.ArgumentParser(description='This is a simple script to dump Keras model into simple format suitable for porting into pure C++ model')
 
-parser.add_argument('-a', '--architecture', help="JSON with model architecture", required=True)
-parser.add_argument('-w', '--weights', help="Model weights in HDF5 format", required=True)
+parser.add_argument('-a', '--architecture', help="JSON with model architecture")
+parser.add_argument('-w', '--weights', help="Model weights in HDF5 format")
+parser.add_argument('-t', '--text', help="Model already dumped to the text format, to be converted to binary")
 parser.add_argument('-o', '--output', help="Ouput file name", required=True)
+parser.add_argument('-b', '--binary', help="Write binary format, memory-mapped by the C++ loader (use .nnetb extension)", action='store_true')
 
 args = parser.parse_args()
 
-print 'Read architecture from', args.architecture
-print 'Read weights from', args.weights
-print 'Writing to', args.output
+if args.text is None and (args.architecture is None or args.weights is None):
+    parser.error('either -a and -w, or -t is required')
+if args.text is not None and not args.binary:
+    parser.error('-t is only used to convert to the binary format, add -b')
 
 
-arch = open(args.architecture).read()
-model = model_from_json(arch)
-model.load_weights(args.weights)
-model.compile(loss='categorical_crossentropy', optimizer='adadelta')
-arch = json.loads(arch)
+# layers as (class_name, parameters), weights in the layout of the text format
+def read_keras_model(arch_file, weights_file):
+    from keras.models import Sequential, model_from_json
 
-with open(args.output, 'w') as fout:
-    fout.write('layers ' + str(len(model.layers)) + '\n')
+    print('Read architecture from', arch_file)
+    print('Read weights from', weights_file)
+
+    arch = open(arch_file).read()
+    model = model_from_json(arch)
+    model.load_weights(weights_file)
+    model.compile(loss='categorical_crossentropy', optimizer='adadelta')
+    arch = json.loads(arch)
 
     layers = []
     for ind, l in enumerate(arch["config"]):
-        print ind, l
-        fout.write('layer ' + str(ind) + ' ' + l['class_name'] + '\n')
-
-        print str(ind), l['class_name']
-        layers += [l['class_name']]
-        if l['class_name'] == 'Convolution2D':
-            #fout.write(str(l['config']['nb_filter']) + ' ' + str(l['config']['nb_col']) + ' ' + str(l['config']['nb_row']) + ' ')
-
-            #if 'batch_input_shape' in l['config']:
-            #    fout.write(str(l['config']['batch_input_shape'][1]) + ' ' + str(l['config']['batch_input_shape'][2]) + ' ' + str(l['config']['batch_input_shape'][3]))
-            #fout.write('\n')
-
-            W = model.layers[ind].get_weights()[0]
-            print W.shape
-            fout.write(str(W.shape[0]) + ' ' + str(W.shape[1]) + ' ' + str(W.shape[2]) + ' ' + str(W.shape[3]) + ' ' + l['config']['border_mode'] + '\n')
-
-            for i in range(W.shape[0]):
-                for j in range(W.shape[1]):
-                    for k in range(W.shape[2]):
-                        fout.write(str(W[i,j,k]) + '\n')
-            fout.write(str(model.layers[ind].get_weights()[1]) + '\n')
-
-        if l['class_name'] == 'Activation':
-            fout.write(l['config']['activation'] + '\n')
-        if l['class_name'] == 'MaxPooling2D':
-            fout.write(str(l['config']['pool_size'][0]) + ' ' + str(l['config']['pool_size'][1]) + '\n')
-        #if l['class_name'] == 'Flatten':
-        #    print l['config']['name']
-        if l['class_name'] == 'Dense':
-            #fout.write(str(l['config']['output_dim']) + '\n')
-            W = model.layers[ind].get_weights()[0]
-            print W.shape
-            fout.write(str(W.shape[0]) + ' ' + str(W.shape[1]) + '\n')
-
-
-            for w in W:
-                fout.write(str(w) + '\n')
-            fout.write(str(model.layers[ind].get_weights()[1]) + '\n')
+        name = l['class_name']
+        if name == 'Convolution2D':
+            W, b = model.layers[ind].get_weights()[:2]
+            layers.append((name, {'W': W, 'b': b, 'border_mode': l['config']['border_mode']}))
+        elif name == 'Activation':
+            layers.append((name, {'activation': l['config']['activation']}))
+        elif name == 'MaxPooling2D':
+            layers.append((name, {'pool_size': l['config']['pool_size'][:2]}))
+        elif name == 'Dense':
+            W, b = model.layers[ind].get_weights()[:2]
+            layers.append((name, {'W': W, 'b': b}))
+        else:
+            layers.append((name, {}))
+    return layers
+
+
+def read_text_model(fname):
+    print('Read text model from', fname)
+    tokens = re.findall(r'\[|\]|[^\s\[\]]+', open(fname).read())
+    pos = [0]
+
+    def next_token():
+        pos[0] += 1
+        return tokens[pos[0] - 1]
+
+    def read_array(n):
+        assert next_token() == '['
+        v = [float(next_token()) for i in range(n)]
+        assert next_token() == ']'
+        return v
+
+    next_token() # 'layers'
+    nlayers = int(next_token())
+    layers = []
+    for ind in range(nlayers):
+        next_token(); next_token() # 'layer', index
+        name = next_token()
+        if name == 'Convolution2D':
+            k, d, r, c = [int(next_token()) for i in range(4)]
+            border_mode = 'valid'
+            if tokens[pos[0]] != '[':
+                border_mode = next_token()
+            W = np.array([read_array(c) for i in range(k * d * r)]).reshape(k, d, r, c)
+            layers.append((name, {'W': W, 'b': np.array(read_array(k)), 'border_mode': border_mode}))
+        elif name == 'Activation':
+            layers.append((name, {'activation': next_token()}))
+        elif name == 'MaxPooling2D':
+            layers.append((name, {'pool_size': [int(next_token()), int(next_token())]}))
+        elif name == 'Dense':
+            n_in, n_out = int(next_token()), int(next_token())
+            W = np.array([read_array(n_out) for i in range(n_in)])
+            layers.append((name, {'W': W, 'b': np.array(read_array(n_out))}))
+        else:
+            layers.append((name, {}))
+    return layers
+
+
+def write_text(fname, layers):
+    with open(fname, 'w') as fout:
+        fout.write('layers ' + str(len(layers)) + '\n')
+
+        for ind, (name, p) in enumerate(layers):
+            print(ind, name)
+            fout.write('layer ' + str(ind) + ' ' + name + '\n')
+
+            if name == 'Convolution2D':
+                W = p['W']
+                print(W.shape)
+                fout.write(str(W.shape[0]) + ' ' + str(W.shape[1]) + ' ' + str(W.shape[2]) + ' ' + str(W.shape[3]) + ' ' + p['border_mode'] + '\n')
+
+                for i in range(W.shape[0]):
+                    for j in range(W.shape[1]):
+                        for k in range(W.shape[2]):
+                            fout.write(str(W[i,j,k]) + '\n')
+                fout.write(str(p['b']) + '\n')
+
+            if name == 'Activation':
+                fout.write(p['activation'] + '\n')
+            if name == 'MaxPooling2D':
+                fout.write(str(p['pool_size'][0]) + ' ' + str(p['pool_size'][1]) + '\n')
+            if name == 'Dense':
+                W = p['W']
+                print(W.shape)
+                fout.write(str(W.shape[0]) + ' ' + str(W.shape[1]) + '\n')
+
+                for w in W:
+                    fout.write(str(w) + '\n')
+                fout.write(str(p['b']) + '\n')
+
+
+# see keras_model.h for the description of the binary format
+def write_binary(fname, layers):
+    layers = [(name, p) for name, p in layers if name != 'Dropout'] # not needed in prediction mode
+
+    with open(fname, 'wb') as fout:
+        def align(a):
+            fout.write(b'\0' * ((-fout.tell()) % a))
+
+        def u32(*v):
+            align(4)
+            fout.write(struct.pack('<%dI' % len(v), *v))
+
+        def string(s):
+            u32(len(s))
+            fout.write(s.encode('ascii'))
+
+        def floats(a):
+            align(64)
+            fout.write(np.ascontiguousarray(a, dtype='<f4').tobytes())
+
+        fout.write(b'KERASNNB')
+        u32(1, len(layers))
+        for ind, (name, p) in enumerate(layers):
+            print(ind, name)
+            string(name)
+            if name == 'Convolution2D':
+                W = p['W']
+                u32(*W.shape)
+                string(p['border_mode'])
+                floats(W[:, :, ::-1, ::-1]) # flipped for correlation, as done by the text loader
+                floats(p['b'])
+            elif name == 'Activation':
+                string(p['activation'])
+            elif name == 'MaxPooling2D':
+                u32(*p['pool_size'])
+            elif name == 'Dense':
+                u32(*p['W'].shape)
+                floats(p['W'])
+                floats(p['b'])
+
+
+if args.text is not None:
+    layers = read_text_model(args.text)
+else:
+    layers = read_keras_model(args.architecture, args.weights)
+
+print('Writing to', args.output)
+if args.binary:
+    write_binary(args.output, layers)
+else:
+    write_text(args.output, layers)
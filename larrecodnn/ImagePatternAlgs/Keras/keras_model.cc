@@ -4,9 +4,122 @@
 
 #include <fstream>
 #include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include <math.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
+namespace {
+
+  // y[0..n) += a * x[0..n)
+  inline void axpy(float * y, const float * x, float a, size_t n)
+  {
+    size_t k = 0;
+#if defined(__AVX512F__)
+    const __m512 va = _mm512_set1_ps(a);
+    for (; k + 16 <= n; k += 16) {
+      _mm512_storeu_ps(y + k, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + k), _mm512_loadu_ps(y + k)));
+    }
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256 va8 = _mm256_set1_ps(a);
+    for (; k + 8 <= n; k += 8) {
+      _mm256_storeu_ps(y + k, _mm256_fmadd_ps(va8, _mm256_loadu_ps(x + k), _mm256_loadu_ps(y + k)));
+    }
+#elif defined(__AVX__)
+    const __m256 va8 = _mm256_set1_ps(a);
+    for (; k + 8 <= n; k += 8) {
+      _mm256_storeu_ps(y + k, _mm256_add_ps(_mm256_loadu_ps(y + k), _mm256_mul_ps(va8, _mm256_loadu_ps(x + k))));
+    }
+#elif defined(__SSE2__)
+    const __m128 va4 = _mm_set1_ps(a);
+    for (; k + 4 <= n; k += 4) {
+      _mm_storeu_ps(y + k, _mm_add_ps(_mm_loadu_ps(y + k), _mm_mul_ps(va4, _mm_loadu_ps(x + k))));
+    }
+#endif
+    for (; k < n; ++k) { y[k] += a * x[k]; }
+  }
+
+  // y[0..n) += b
+  inline void add_scalar(float * y, float b, size_t n)
+  {
+    size_t k = 0;
+#if defined(__AVX__)
+    const __m256 vb = _mm256_set1_ps(b);
+    for (; k + 8 <= n; k += 8) { _mm256_storeu_ps(y + k, _mm256_add_ps(_mm256_loadu_ps(y + k), vb)); }
+#elif defined(__SSE2__)
+    const __m128 vb = _mm_set1_ps(b);
+    for (; k + 4 <= n; k += 4) { _mm_storeu_ps(y + k, _mm_add_ps(_mm_loadu_ps(y + k), vb)); }
+#endif
+    for (; k < n; ++k) { y[k] += b; }
+  }
+
+  // y[0..n) = max(x[0..n), 0)
+  inline void relu(float * y, const float * x, size_t n)
+  {
+    size_t k = 0;
+#if defined(__AVX__)
+    const __m256 z = _mm256_setzero_ps();
+    for (; k + 8 <= n; k += 8) { _mm256_storeu_ps(y + k, _mm256_max_ps(_mm256_loadu_ps(x + k), z)); }
+#elif defined(__SSE2__)
+    const __m128 z = _mm_setzero_ps();
+    for (; k + 4 <= n; k += 4) { _mm_storeu_ps(y + k, _mm_max_ps(_mm_loadu_ps(x + k), z)); }
+#endif
+    for (; k < n; ++k) { y[k] = (x[k] < 0) ? 0 : x[k]; }
+  }
+
+  // contiguous view of the layer input: the input itself if already a tensor, or copy in tmp
+  keras::DataChunkTensor const & as_tensor(keras::DataChunk * dc, keras::DataChunkTensor & tmp)
+  {
+    auto const * t = dynamic_cast<keras::DataChunkTensor const *>(dc);
+    if (t) { return *t; }
+    if (dc->get_data_dim() == 1) {
+      auto const & v = dc->get_1d();
+      tmp.resize(1, 1, 1, v.size());
+      std::copy(v.begin(), v.end(), tmp.f.begin());
+    }
+    else { tmp.set_data(dc->get_3d()); }
+    return tmp;
+  }
+
+}
+
+std::vector<std::vector<std::vector<float> > > const & keras::DataChunkTensor::get_3d() const {
+  m_3d.resize(m_depth);
+  for(size_t d = 0; d < m_depth; ++d) {
+    m_3d[d].resize(m_rows);
+    for(size_t r = 0; r < m_rows; ++r) {
+      const float * src = plane(d) + r * m_cols;
+      m_3d[d][r].assign(src, src + m_cols);
+    }
+  }
+  return m_3d;
+}
+
+void keras::DataChunkTensor::set_data(std::vector<std::vector<std::vector<float> > > const & d) {
+  resize(d.size(), d.empty() ? 0 : d[0].size(), (d.empty() || d[0].empty()) ? 0 : d[0][0].size());
+  float * dst = f.data();
+  for(auto const & p : d) {
+    for(auto const & r : p) {
+      std::copy_n(r.begin(), m_cols, dst);
+      dst += m_cols;
+    }
+  }
+}
+
+void keras::DataChunkTensor::resize(size_t samples, size_t depth, size_t rows, size_t cols) {
+  m_samples = samples; m_depth = depth; m_rows = rows; m_cols = cols;
+  f.resize(samples * depth * rows * cols);
+}
 
 std::vector<float> keras::read_1d_array(std::ifstream &fin, int cols) {
   vector<float> arr;
@@ -48,6 +161,7 @@ void keras::LayerConv2D::load_weights(std::ifstream &fin) {
   cout << "LayerConv2D " << m_kernels_cnt
     << "x" << m_depth << "x" << m_rows << "x" << m_cols << " border_mode " << m_border_mode << endl;
   // reading kernel weights
+  vector<vector<vector<vector<float> > > > kernels; // kernel, depth, rows, cols
   for(int k = 0; k < m_kernels_cnt; ++k) {
     vector<vector<vector<float> > > tmp_depths;
     for(int d = 0; d < m_depth; ++d) {
@@ -66,16 +180,42 @@ void keras::LayerConv2D::load_weights(std::ifstream &fin) {
       }
       tmp_depths.push_back(tmp_single_depth);
     }
-    m_kernels.push_back(tmp_depths);
+    kernels.push_back(tmp_depths);
   }
   // reading kernel biases
+  vector<float> bias;
   fin >> tmp_char; // for '['
   for(int k = 0; k < m_kernels_cnt; ++k) {
     fin >> tmp_float;
-    m_bias.push_back(tmp_float);
+    bias.push_back(tmp_float);
   }
   fin >> tmp_char; // for ']'
+  m_bias.assign(std::move(bias));
 
+  // flipped kernels in a contiguous block, so the convolution is a sum of shifted rows
+  vector<float> packed(m_kernels_cnt * m_depth * m_rows * m_cols);
+  float * dst = packed.data();
+  for(int k = 0; k < m_kernels_cnt; ++k) {
+    for(int d = 0; d < m_depth; ++d) {
+      for(int r = 0; r < m_rows; ++r) {
+        for(int c = 0; c < m_cols; ++c) {
+          *dst++ = kernels[k][d][m_rows-r-1][m_cols-c-1];
+        }
+      }
+    }
+  }
+  m_packed.assign(std::move(packed));
+}
+
+void keras::LayerConv2D::map_weights(keras::BinaryReader &in) {
+  m_kernels_cnt = in.u32(); m_depth = in.u32(); m_rows = in.u32(); m_cols = in.u32();
+  m_border_mode = in.str();
+  cout << "LayerConv2D " << m_kernels_cnt
+    << "x" << m_depth << "x" << m_rows << "x" << m_cols << " border_mode " << m_border_mode << endl;
+
+  const size_t n = m_kernels_cnt * m_depth * m_rows * m_cols;
+  m_packed.view(in.floats(n), n);
+  m_bias.view(in.floats(m_kernels_cnt), m_kernels_cnt);
 }
 
 void keras::LayerActivation::load_weights(std::ifstream &fin) {
@@ -83,93 +223,151 @@ void keras::LayerActivation::load_weights(std::ifstream &fin) {
   cout << "Activation type " << m_activation_type << endl;
 }
 
+void keras::LayerActivation::map_weights(keras::BinaryReader &in) {
+  m_activation_type = in.str();
+  cout << "Activation type " << m_activation_type << endl;
+}
+
 void keras::LayerMaxPooling::load_weights(std::ifstream &fin) {
   fin >> m_pool_x >> m_pool_y;
   cout << "MaxPooling " << m_pool_x << "x" << m_pool_y << endl;
 }
 
+void keras::LayerMaxPooling::map_weights(keras::BinaryReader &in) {
+  m_pool_x = in.u32(); m_pool_y = in.u32();
+  cout << "MaxPooling " << m_pool_x << "x" << m_pool_y << endl;
+}
+
 void keras::LayerDense::load_weights(std::ifstream &fin) {
   fin >> m_input_cnt >> m_neurons;
   float tmp_float;
   char tmp_char = ' ';
+  vector<float> packed; // input, neuron
+  packed.reserve(m_input_cnt * m_neurons);
   for(int i = 0; i < m_input_cnt; ++i) {
-    vector<float> tmp_n;
     fin >> tmp_char; // for '['
     for(int n = 0; n < m_neurons; ++n) {
       fin >> tmp_float;
-      tmp_n.push_back(tmp_float);
+      packed.push_back(tmp_float);
     }
     fin >> tmp_char; // for ']'
-    m_weights.push_back(tmp_n);
   }
-  cout << "weights " << m_weights.size() << endl;
+  cout << "weights " << m_input_cnt << endl;
+  vector<float> bias;
   fin >> tmp_char; // for '['
   for(int n = 0; n < m_neurons; ++n) {
     fin >> tmp_float;
-    m_bias.push_back(tmp_float);
+    bias.push_back(tmp_float);
   }
   fin >> tmp_char; // for ']'
+  cout << "bias " << bias.size() << endl;
+
+  m_packed.assign(std::move(packed));
+  m_bias.assign(std::move(bias));
+}
+
+void keras::LayerDense::map_weights(keras::BinaryReader &in) {
+  m_input_cnt = in.u32(); m_neurons = in.u32();
+  cout << "weights " << m_input_cnt << endl;
+
+  m_packed.view(in.floats(m_input_cnt * m_neurons), m_input_cnt * m_neurons);
+  m_bias.view(in.floats(m_neurons), m_neurons);
   cout << "bias " << m_bias.size() << endl;
+}
 
+keras::MappedFile::MappedFile(const std::string &fname) : m_data(nullptr), m_size(0) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) { throw std::runtime_error("Cannot open " + fname); }
+  struct stat st;
+  if (fstat(fd, &st) != 0) { close(fd); throw std::runtime_error("Cannot stat " + fname); }
+  m_size = st.st_size;
+  void * p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // mapping stays valid
+  if (p == MAP_FAILED) { throw std::runtime_error("Cannot map " + fname); }
+  m_data = static_cast<char const *>(p);
 }
 
-keras::KerasModel::KerasModel(const string &input_fname) {
-  load_weights(input_fname);
+keras::MappedFile::~MappedFile() {
+  if (m_data) { munmap(const_cast<char *>(m_data), m_size); }
 }
 
+void keras::BinaryReader::check(size_t n) const {
+  if (m_pos + n > m_size) { throw std::runtime_error("Binary model file is truncated"); }
+}
 
-keras::DataChunk* keras::LayerFlatten::compute_output(keras::DataChunk* dc) {
-  vector<vector<vector<float> > > im = dc->get_3d();
+uint32_t keras::BinaryReader::u32() {
+  align(4); check(4);
+  uint32_t v;
+  std::memcpy(&v, m_data + m_pos, 4);
+  m_pos += 4;
+  return v;
+}
 
-  size_t csize = im[0].size();
-  size_t rsize = im[0][0].size();
-  size_t size = im.size() * csize * rsize;
-  keras::DataChunkFlat *out = new DataChunkFlat(size);
-  float * y_ret = out->get_1d_rw().data();
-  for(size_t i = 0, dst = 0; i < im.size(); ++i) {
-    for(size_t j = 0; j < csize; ++j) {
-      float * row = im[i][j].data();
-      for(size_t k = 0; k < rsize; ++k) {
-        y_ret[dst++] = row[k];
-      }
-    }
-  }
+std::string keras::BinaryReader::str() {
+  size_t n = u32();
+  check(n);
+  std::string v(m_data + m_pos, n);
+  m_pos += n;
+  return v;
+}
+
+float const * keras::BinaryReader::floats(size_t n) {
+  align(64); check(n * sizeof(float));
+  float const * v = reinterpret_cast<float const *>(m_data + m_pos);
+  m_pos += n * sizeof(float);
+  return v;
+}
+
+keras::KerasModel::KerasModel(const string &input_fname) {
+  char head[8] = {0};
+  ifstream fin(input_fname.c_str(), ios::binary);
+  fin.read(head, sizeof(head));
+  fin.close();
+
+  if (std::memcmp(head, keras::BinaryReader::magic, sizeof(head)) == 0) { map_weights(input_fname); }
+  else { load_weights(input_fname); }
+}
+
+
+keras::DataChunk* keras::Layer::compute_output(keras::DataChunk* dc) {
+  keras::DataChunkTensor tmp;
+  auto const & in = as_tensor(dc, tmp);
 
+  keras::DataChunkTensor *out = new keras::DataChunkTensor();
+  compute_batch(in, *out);
   return out;
 }
 
 
-keras::DataChunk* keras::LayerMaxPooling::compute_output(keras::DataChunk* dc) {
-  vector<vector<vector<float> > > im = dc->get_3d();
-  vector<vector<vector<float> > > y_ret;
-  for(unsigned int i = 0; i < im.size(); ++i) {
-    vector<vector<float> > tmp_y;
-    for(unsigned int j = 0; j < (unsigned int)(im[0].size()/m_pool_x); ++j) {
-      tmp_y.push_back(vector<float>((int)(im[0][0].size()/m_pool_y), 0.0));
-    }
-    y_ret.push_back(tmp_y);
-  }
-  for(unsigned int d = 0; d < y_ret.size(); ++d) {
-    for(unsigned int x = 0; x < y_ret[0].size(); ++x) {
-      unsigned int start_x = x*m_pool_x;
-      unsigned int end_x = start_x + m_pool_x;
-      for(unsigned int y = 0; y < y_ret[0][0].size(); ++y) {
-        unsigned int start_y = y*m_pool_y;
-        unsigned int end_y = start_y + m_pool_y;
-
-        vector<float> values;
-        for(unsigned int i = start_x; i < end_x; ++i) {
-          for(unsigned int j = start_y; j < end_y; ++j) {
-            values.push_back(im[d][i][j]);
+void keras::LayerFlatten::compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const {
+  out.resize(in.samples(), 1, 1, in.sample_size()); // CHW order is the flatten order
+  std::copy_n(in.f.data(), in.samples() * in.sample_size(), out.f.data());
+}
+
+
+void keras::LayerMaxPooling::compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const {
+  const size_t rows = in.rows(), cols = in.cols();
+  const size_t out_rows = rows / m_pool_x, out_cols = cols / m_pool_y;
+  out.resize(in.samples(), in.depth(), out_rows, out_cols);
+
+  for(size_t s = 0; s < in.samples(); ++s) {
+    for(size_t d = 0; d < in.depth(); ++d) {
+      const float * src = in.plane(s, d);
+      float * dst = out.plane(s, d);
+      for(size_t x = 0; x < out_rows; ++x) {
+        for(size_t y = 0; y < out_cols; ++y) {
+          const float * win = src + x * m_pool_x * cols + y * m_pool_y;
+          float m = win[0];
+          for(int i = 0; i < m_pool_x; ++i) {
+            for(int j = 0; j < m_pool_y; ++j) {
+              m = std::max(m, win[i * cols + j]);
+            }
           }
+          dst[x * out_cols + y] = m;
         }
-        y_ret[d][x][y] = *max_element(values.begin(), values.end());
       }
     }
   }
-  keras::DataChunk *out = new keras::DataChunk2D();
-  out->set_data(y_ret);
-  return out;
 }
 
 void keras::missing_activation_impl(const string &act) {
@@ -178,68 +376,33 @@ void keras::missing_activation_impl(const string &act) {
   exit(1);
 }
 
-keras::DataChunk* keras::LayerActivation::compute_output(keras::DataChunk* dc) {
-
-  if (dc->get_data_dim() == 3) {
-    vector<vector<vector<float> > > y = dc->get_3d();
-    if(m_activation_type == "relu") {
-      for(unsigned int i = 0; i < y.size(); ++i) {
-        for(unsigned int j = 0; j < y[0].size(); ++j) {
-          for(unsigned int k = 0; k < y[0][0].size(); ++k) {
-            if(y[i][j][k] < 0) y[i][j][k] = 0;
-          }
-        }
-      }
-    } else if(m_activation_type == "tanh") {
-      for(unsigned int i = 0; i < y.size(); ++i) {
-        for(unsigned int j = 0; j < y[0].size(); ++j) {
-          for(unsigned int k = 0; k < y[0][0].size(); ++k) {
-            y[i][j][k] = tanh(y[i][j][k]);
-          }
-        }
-      }
-    } else {
-      keras::missing_activation_impl(m_activation_type);
-    }
-
-    keras::DataChunk *out = new keras::DataChunk2D();
-    out->set_data(y);
-    return out;
-
-  } else if (dc->get_data_dim() == 1) { // flat data, use 1D
-    vector<float> y = dc->get_1d();
-    if(m_activation_type == "relu") {
-      for(unsigned int k = 0; k < y.size(); ++k) {
-        if(y[k] < 0) y[k] = 0;
-      }
-    } else if(m_activation_type == "softmax") {
+void keras::LayerActivation::compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const {
+  out.resize(in.samples(), in.depth(), in.rows(), in.cols());
+  const size_t n = in.samples() * in.sample_size();
+  const float * x = in.f.data();
+  float * y = out.f.data();
+
+  if(m_activation_type == "relu") {
+    relu(y, x, n);
+  } else if(m_activation_type == "tanh") {
+    for(size_t k = 0; k < n; ++k) { y[k] = tanh(x[k]); }
+  } else if(m_activation_type == "sigmoid") {
+    for(size_t k = 0; k < n; ++k) { y[k] = 1.0F / (1.0F + exp(-x[k])); }
+  } else if(m_activation_type == "softmax") { // over each sample
+    const size_t size = in.sample_size();
+    for(size_t s = 0; s < in.samples(); ++s, x += size, y += size) {
       float sum = 0.0;
-      for(unsigned int k = 0; k < y.size(); ++k) {
-        y[k] = exp(y[k]);
+      for(size_t k = 0; k < size; ++k) {
+        y[k] = exp(x[k]);
         sum += y[k];
       }
-      for(unsigned int k = 0; k < y.size(); ++k) {
+      for(size_t k = 0; k < size; ++k) {
         y[k] /= sum;
       }
-    } else if(m_activation_type == "tanh") {
-      for(unsigned int k = 0; k < y.size(); ++k) {
-        y[k] = tanh(y[k]);
-      }
-    } else if(m_activation_type == "sigmoid") {
-      for(unsigned int k = 0; k < y.size(); ++k) {
-        y[k] = 1.0F / (1.0F + exp(-y[k]));
-      }
-    } else {
-      keras::missing_activation_impl(m_activation_type);
     }
-
-    keras::DataChunk *out = new DataChunkFlat();
-    out->set_data(y);
-    return out;
-
-  } else { throw "data dim not supported"; }
-
-  return dc;
+  } else {
+    keras::missing_activation_impl(m_activation_type);
+  }
 }
 
 // with border mode = valid
@@ -304,127 +467,95 @@ void keras::conv_single_depth_same(
   }
 }
 
-keras::DataChunk* keras::LayerConv2D::compute_output(keras::DataChunk* dc) {
-  unsigned int st_x = (m_kernels[0][0].size()-1) >> 1;
-  unsigned int st_y = (m_kernels[0][0][0].size()-1) >> 1;
-  auto const & im = dc->get_3d();
-
-  size_t size_x = (m_border_mode == "valid")? im[0].size() - 2 * st_x : im[0].size();
-  size_t size_y = (m_border_mode == "valid")? im[0][0].size() - 2 * st_y: im[0][0].size();
-
-  //                                                    depth         rows    cols
-  keras::DataChunk2D *out = new keras::DataChunk2D(m_kernels.size(), size_x, size_y, 0);
-  auto & y_ret = out->get_3d_rw();
-
-  //auto t1 = std::chrono::high_resolution_clock::now();
-
-  // Parallelize the kernal calculation
-  tbb::parallel_for( size_t(0), size_t(m_kernels.size()), [&]( size_t j ) {
-
-      for(unsigned int m = 0; m < im.size(); ++m) { // loop over image depth
-	if (m_border_mode == "valid")
-          keras::conv_single_depth_valid(y_ret[j], im[m], m_kernels[j][m]);
-	else
-          keras::conv_single_depth_same(y_ret[j], im[m], m_kernels[j][m]);
-      }
-
-      for(unsigned int x = 0; x < y_ret[0].size(); ++x) {
-
-	size_t size = y_ret[0][0].size();
-	float bias = m_bias[j];
-	size_t k = 0;
-
-	for(unsigned int y = 0; y < size/8; ++y) {
-	  y_ret[j][x][k] += bias;
-	  y_ret[j][x][k+1] += bias;
-	  y_ret[j][x][k+2] += bias;
-	  y_ret[j][x][k+3] += bias;
-	  y_ret[j][x][k+4] += bias;
-	  y_ret[j][x][k+5] += bias;
-	  y_ret[j][x][k+6] += bias;
-	  y_ret[j][x][k+7] += bias;
-	  k += 8;
-	}
-	while (k < size) { y_ret[j][x][k] += bias; ++k; }
-
+void keras::LayerConv2D::compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const {
+  const size_t kr = m_rows, kc = m_cols;
+  const size_t st_x = (kr - 1) >> 1, st_y = (kc - 1) >> 1;
+  const bool same = (m_border_mode != "valid");
+
+  const size_t depth = in.depth(), rows = in.rows(), cols = in.cols();
+  const size_t size_x = same ? rows : rows - 2 * st_x;
+  const size_t size_y = same ? cols : cols - 2 * st_y;
+
+  // with border mode = same the input is virtually zero-padded: out of range rows and
+  // columns are skipped
+  const long pad_x = same ? st_x : 0, pad_y = same ? st_y : 0;
+  const size_t ksize = depth * kr * kc;
+  const size_t nkernels = m_kernels_cnt;
+
+  //         samples       depth     rows    cols
+  out.resize(in.samples(), nkernels, size_x, size_y);
+
+  // Parallelize over samples and kernels; each output row is accumulated from depth x kr x kc
+  // shifted input rows, so one output row and the needed input rows stay in L1 cache
+  tbb::parallel_for( size_t(0), in.samples() * nkernels, [&]( size_t sj ) {
+      const size_t s = sj / nkernels, j = sj % nkernels;
+      const float * w = m_packed.data() + j * ksize;
+      float * y_ret = out.plane(s, j);
+      for(size_t x = 0; x < size_x; ++x) {
+        float * y_row = y_ret + x * size_y;
+        std::fill_n(y_row, size_y, 0.0F);
+        for(size_t m = 0; m < depth; ++m) {
+          const float * in_plane = in.plane(s, m);
+          for(size_t k1 = 0; k1 < kr; ++k1) {
+            const long r = (long)(x + k1) - pad_x;
+            if ((r < 0) || (r >= (long)rows)) continue;
+            const float * in_row = in_plane + r * cols;
+            const float * wk = w + (m * kr + k1) * kc;
+            for(size_t k2 = 0; k2 < kc; ++k2) {
+              const long c0 = (long)k2 - pad_y; // input column of the output column 0
+              const size_t j0 = (c0 < 0) ? -c0 : 0;
+              const size_t j1 = std::min<long>(size_y, (long)cols - c0);
+              if (j1 > j0) { axpy(y_row + j0, in_row + j0 + c0, wk[k2], j1 - j0); }
+            }
+          }
+        }
+        add_scalar(y_row, m_bias[j], size_y);
       }
     });
-
-  //auto t2 = std::chrono::high_resolution_clock::now();
-  /*
-  cout << "Parallal : "
-       << std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count()
-       << " microseconds." << endl;
-  */
-
-  return out;
 }
 
-keras::DataChunk* keras::LayerDense::compute_output(keras::DataChunk* dc) {
-  //cout << "weights: input size " << m_weights.size() << endl;
-  //cout << "weights: neurons size " << m_weights[0].size() << endl;
-  //cout << "bias " << m_bias.size() << endl;
-  size_t size = m_weights[0].size();
-  size_t size8 = size >> 3;
-
-  keras::DataChunkFlat *out = new DataChunkFlat(size, 0);
-  float * y_ret = out->get_1d_rw().data();
-
-  auto const & im = dc->get_1d();
-
-  for (size_t j = 0; j < m_weights.size(); ++j) { // iter over input
-    const float * w = m_weights[j].data();
-    float p = im[j];
-    size_t k = 0;
-    for (size_t i = 0; i < size8; ++i) { // iter over neurons
-      y_ret[k]   += w[k]   * p;          // vectorize if you can
-      y_ret[k+1] += w[k+1] * p;
-      y_ret[k+2] += w[k+2] * p;
-      y_ret[k+3] += w[k+3] * p;
-      y_ret[k+4] += w[k+4] * p;
-      y_ret[k+5] += w[k+5] * p;
-      y_ret[k+6] += w[k+6] * p;
-      y_ret[k+7] += w[k+7] * p;
-      k += 8;
+void keras::LayerDense::compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const {
+  const size_t size = m_neurons;
+  const size_t ninputs = m_input_cnt;
+  const size_t samples = in.samples();
+
+  out.resize(samples, 1, 1, size);
+  std::fill_n(out.f.data(), samples * size, 0.0F);
+
+  // blocks of weight rows are reused for all samples while in cache
+  const size_t block = 64;
+  for (size_t j0 = 0; j0 < ninputs; j0 += block) {
+    const size_t j1 = std::min(ninputs, j0 + block);
+    for (size_t s = 0; s < samples; ++s) {
+      float * y_ret = out.sample(s);
+      const float * im = in.sample(s);
+      const float * w = m_packed.data() + j0 * size;
+      for (size_t j = j0; j < j1; ++j, w += size) { // iter over input
+        axpy(y_ret, w, im[j], size);
+      }
     }
-    while (k < size) { y_ret[k] += w[k] * p; ++k; }
   }
-  for (size_t i = 0; i < size; ++i) { // add biases
-    y_ret[i] += m_bias[i];
+  for (size_t s = 0; s < samples; ++s) { // add biases
+    float * y_ret = out.sample(s);
+    for (size_t i = 0; i < size; ++i) { y_ret[i] += m_bias[i]; }
   }
-
-  return out;
 }
 
 
 std::vector<float> keras::KerasModel::compute_output(keras::DataChunk *dc) {
-  //cout << endl << "KerasModel compute output" << endl;
-  //cout << "Input data size:" << endl;
-  //dc->show_name();
-
-  keras::DataChunk *inp = dc;
-  keras::DataChunk *out = 0;
-  for(int l = 0; l < (int)m_layers.size(); ++l) {
-    //cout << "Processing layer " << m_layers[l]->get_name() << endl;
-    out = m_layers[l]->compute_output(inp);
-
-    //cout << "Input" << endl;
-    //inp->show_name();
-    //cout << "Output" << endl;
-    //out->show_name();
-
-    if (inp != dc) delete inp;
-    inp = 0L;
-    inp = out;
-  }
-
-  //cout << "Output: ";
-  //out->show_values();
-
-  std::vector<float> flat_out = out->get_1d();
-  delete out;
+  Workspace ws;
+  ws.arena[0] = as_tensor(dc, ws.arena[1]);
+  return compute_batch(ws).get_flat();
+}
 
-  return flat_out;
+keras::DataChunkTensor const & keras::KerasModel::compute_batch(Workspace & ws) const {
+  keras::DataChunkTensor * src = &ws.arena[0];
+  keras::DataChunkTensor * dst = &ws.arena[1];
+  for(size_t l = 0; l < m_layers.size(); ++l) {
+    m_layers[l]->compute_batch(*src, *dst);
+    std::swap(src, dst);
+  }
+  return *src;
 }
 
 void keras::KerasModel::load_weights(const string &input_fname) {
@@ -441,20 +572,10 @@ void keras::KerasModel::load_weights(const string &input_fname) {
     fin >> tmp_str >> tmp_int >> layer_type;
     cout << "Layer " << tmp_int << " " << layer_type << endl;
 
-    Layer *l = 0L;
-    if(layer_type == "Convolution2D") {
-      l = new LayerConv2D();
-    } else if(layer_type == "Activation") {
-      l = new LayerActivation();
-    } else if(layer_type == "MaxPooling2D") {
-      l = new LayerMaxPooling();
-    } else if(layer_type == "Flatten") {
-      l = new LayerFlatten();
-    } else if(layer_type == "Dense") {
-      l = new LayerDense();
-    } else if(layer_type == "Dropout") {
+    if(layer_type == "Dropout") {
       continue; // we dont need dropout layer in prediciton mode
     }
+    Layer *l = create_layer(layer_type);
     if(l == 0L) {
       cout << "Layer is empty, maybe it is not defined? Cannot define network." << endl;
       return;
@@ -466,6 +587,46 @@ void keras::KerasModel::load_weights(const string &input_fname) {
   fin.close();
 }
 
+void keras::KerasModel::map_weights(const string &input_fname) {
+  cout << "Mapping model from " << input_fname << endl;
+  m_file = std::make_unique<keras::MappedFile>(input_fname);
+  keras::BinaryReader in(m_file->data(), m_file->size());
+
+  in.u32(); in.u32(); // magic
+  if (in.u32() != keras::BinaryReader::version) {
+    throw std::runtime_error("Unsupported binary model version in " + input_fname);
+  }
+  m_layers_cnt = in.u32();
+  cout << "Layers " << m_layers_cnt << endl;
+
+  for(int layer = 0; layer < m_layers_cnt; ++layer) { // iterate over layers
+    string layer_type = in.str();
+    cout << "Layer " << layer << " " << layer_type << endl;
+
+    Layer *l = create_layer(layer_type);
+    if(l == 0L) {
+      throw std::runtime_error("Layer " + layer_type + " is not defined, cannot define network.");
+    }
+    m_layers.push_back(l);
+    l->map_weights(in);
+  }
+}
+
+keras::Layer * keras::KerasModel::create_layer(const string &layer_type) {
+  if(layer_type == "Convolution2D") {
+    return new LayerConv2D();
+  } else if(layer_type == "Activation") {
+    return new LayerActivation();
+  } else if(layer_type == "MaxPooling2D") {
+    return new LayerMaxPooling();
+  } else if(layer_type == "Flatten") {
+    return new LayerFlatten();
+  } else if(layer_type == "Dense") {
+    return new LayerDense();
+  }
+  return 0L;
+}
+
 keras::KerasModel::~KerasModel() {
   for(int i = 0; i < (int)m_layers.size(); ++i) {
     delete m_layers[i];
@@ -3,17 +3,22 @@
 // Authors:     P.Plonski,                                    from DUNE,   WUT,       since 2016
 //              R.Sulej: adopt to LArSoft, vectorize dense,   from DUNE,   FNAL/NCBJ, since 2016
 //              D.Smith: optimize Conv2D compute              from LArIAT, BU,      2017
+//              contiguous CHW tensors, SIMD conv/dense kernels
 //
 //
 // Simple implementation of running Keras models in the inference mode, see README.md.
+// Models are read from the plain text format (.nnet), or from binary format (.nnetb) which is
+// memory-mapped read-only, with weights used in place.
 //
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
 #ifndef KERAS_MODEL__H
 #define KERAS_MODEL__H
 
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -24,8 +29,13 @@ namespace keras
 	void conv_single_depth_valid(std::vector< std::vector<float> > & y, std::vector< std::vector<float> > const & im, std::vector< std::vector<float> > const & k);
 	void conv_single_depth_same(std::vector< std::vector<float> > & y, std::vector< std::vector<float> > const & im, std::vector< std::vector<float> > const & k);
 
+	class Weights;
+	class MappedFile;
+	class BinaryReader;
+
 	class DataChunk;
 	class DataChunk2D;
+	class DataChunkTensor;
 	class DataChunkFlat;
 
 	class Layer;
@@ -38,6 +48,70 @@ namespace keras
 	class KerasModel;
 }
 
+// Layer parameters, either owned (text format) or referenced in the mapped binary file.
+class keras::Weights {
+public:
+  Weights() : m_data(nullptr), m_size(0) {}
+  Weights(Weights const &) = delete;
+  Weights & operator=(Weights const &) = delete;
+
+  void assign(std::vector<float> && v) { m_own = std::move(v); m_data = m_own.data(); m_size = m_own.size(); }
+  void view(float const * p, size_t n) { m_own.clear(); m_data = p; m_size = n; }
+
+  float const * data() const { return m_data; }
+  size_t size() const { return m_size; }
+  float operator[](size_t i) const { return m_data[i]; }
+
+private:
+  std::vector<float> m_own;
+  float const * m_data;
+  size_t m_size;
+};
+
+// Read-only, shared memory mapping of the whole file.
+class keras::MappedFile {
+public:
+  MappedFile(const std::string &fname);
+  ~MappedFile();
+  MappedFile(MappedFile const &) = delete;
+  MappedFile & operator=(MappedFile const &) = delete;
+
+  char const * data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  char const * m_data;
+  size_t m_size;
+};
+
+// Binary format (native, little-endian), all items aligned to 4 bytes, float arrays to 64 bytes:
+//   "KERASNNB" u32:version u32:layers, then per layer str:type and parameters:
+//   Convolution2D: u32:kernels u32:depth u32:rows u32:cols str:border_mode
+//                  f32[kernels][depth][rows][cols] flipped kernels, f32[kernels] bias
+//   Activation:    str:activation
+//   MaxPooling2D:  u32:pool_x u32:pool_y
+//   Flatten:       -
+//   Dense:         u32:inputs u32:neurons f32[inputs][neurons] weights, f32[neurons] bias
+//   where str is u32:length and characters.
+class keras::BinaryReader {
+public:
+  static constexpr char const * magic = "KERASNNB";
+  static constexpr uint32_t version = 1;
+
+  BinaryReader(char const * data, size_t size) : m_data(data), m_size(size), m_pos(0) {}
+
+  uint32_t u32();
+  std::string str();
+  float const * floats(size_t n); // pointer to n floats in place
+
+private:
+  void align(size_t a) { m_pos = (m_pos + a - 1) / a * a; }
+  void check(size_t n) const;
+
+  char const * m_data;
+  size_t m_size, m_pos;
+};
+
 class keras::DataChunk {
 public:
   virtual ~DataChunk() {}
@@ -92,6 +166,56 @@ public:
   int m_cols;
 };
 
+// Contiguous [samples, depth, rows, cols] (NCHW) tensor, used between the layers of the model;
+// flat data (after Flatten or Dense) is kept as [samples, 1, 1, size].
+// Nested vectors view of the first sample, if requested, is made on demand.
+class keras::DataChunkTensor : public keras::DataChunk {
+public:
+  DataChunkTensor(size_t depth, size_t rows, size_t cols, float init = 0) :
+    f(depth * rows * cols, init), m_samples(1), m_depth(depth), m_rows(rows), m_cols(cols)
+  { }
+  DataChunkTensor(void) : m_samples(0), m_depth(0), m_rows(0), m_cols(0) { }
+
+  std::vector<float> & get_flat_rw() { return f; }
+  std::vector<float> const & get_flat() const { return f; }
+  std::vector<float> const & get_1d() const { return f; }
+  std::vector<std::vector<std::vector<float> > > const & get_3d() const;
+  void set_data(std::vector<std::vector<std::vector<float> > > const & d);
+  size_t get_data_dim(void) const { return ((m_depth == 1) && (m_rows == 1)) ? 1 : 3; }
+
+  // storage is only growing, so buffers reused across calls do not allocate in the steady state;
+  // values are not initialized
+  void resize(size_t samples, size_t depth, size_t rows, size_t cols);
+  void resize(size_t depth, size_t rows, size_t cols) { resize(1, depth, rows, cols); }
+
+  size_t samples() const { return m_samples; }
+  size_t depth() const { return m_depth; }
+  size_t rows() const { return m_rows; }
+  size_t cols() const { return m_cols; }
+  size_t sample_size() const { return m_depth * m_rows * m_cols; }
+  float * sample(size_t s) { return f.data() + s * sample_size(); }
+  float const * sample(size_t s) const { return f.data() + s * sample_size(); }
+  float * plane(size_t d) { return f.data() + d * m_rows * m_cols; }
+  float const * plane(size_t d) const { return f.data() + d * m_rows * m_cols; }
+  float * plane(size_t s, size_t d) { return sample(s) + d * m_rows * m_cols; }
+  float const * plane(size_t s, size_t d) const { return sample(s) + d * m_rows * m_cols; }
+
+  void show_name() {
+    std::cout << "DataChunkTensor " << m_samples << "x" << m_depth << "x" << m_rows << "x" << m_cols << std::endl;
+  }
+  void show_values() {
+    std::cout << "DataChunkTensor values:" << std::endl;
+    for(size_t i = 0; i < m_samples * sample_size(); ++i) std::cout << f[i] << " ";
+    std::cout << std::endl;
+  }
+
+  std::vector<float> f; // samples, depth, rows, cols
+
+private:
+  size_t m_samples, m_depth, m_rows, m_cols;
+  mutable std::vector<std::vector<std::vector<float> > > m_3d; // filled by get_3d()
+};
+
 class keras::DataChunkFlat : public keras::DataChunk {
 public:
   DataChunkFlat(size_t size) : f(size) { }
@@ -119,7 +243,11 @@ public:
 class keras::Layer {
 public:
   virtual void load_weights(std::ifstream &fin) = 0;
-  virtual keras::DataChunk* compute_output(keras::DataChunk*) = 0;
+  virtual void map_weights(keras::BinaryReader &in) = 0;
+  // single sample, returns new chunk owned by the caller
+  virtual keras::DataChunk* compute_output(keras::DataChunk*);
+  // all samples of the input at once, out is resized as needed
+  virtual void compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const = 0;
 
   Layer(std::string name) : m_name(name) {}
   virtual ~Layer() {}
@@ -137,7 +265,8 @@ class keras::LayerFlatten : public Layer {
 public:
   LayerFlatten() : Layer("Flatten") {}
   void load_weights(std::ifstream &fin) {};
-  keras::DataChunk* compute_output(keras::DataChunk*);
+  void map_weights(keras::BinaryReader &in) {};
+  void compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const;
 
   virtual unsigned int get_input_rows() const { return 0; } // look for the value in the preceding layer
   virtual unsigned int get_input_cols() const { return 0; } // same as for rows
@@ -150,7 +279,8 @@ public:
   LayerMaxPooling() : Layer("MaxPooling2D") {};
 
   void load_weights(std::ifstream &fin);
-  keras::DataChunk* compute_output(keras::DataChunk*);
+  void map_weights(keras::BinaryReader &in);
+  void compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const;
 
   virtual unsigned int get_input_rows() const { return 0; } // look for the value in the preceding layer
   virtual unsigned int get_input_cols() const { return 0; } // same as for rows
@@ -165,7 +295,8 @@ class keras::LayerActivation : public Layer {
 public:
   LayerActivation() : Layer("Activation") {}
   void load_weights(std::ifstream &fin);
-  keras::DataChunk* compute_output(keras::DataChunk*);
+  void map_weights(keras::BinaryReader &in);
+  void compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const;
 
   virtual unsigned int get_input_rows() const { return 0; } // look for the value in the preceding layer
   virtual unsigned int get_input_cols() const { return 0; } // same as for rows
@@ -179,9 +310,10 @@ public:
   LayerConv2D() : Layer("Conv2D") {}
 
   void load_weights(std::ifstream &fin);
-  keras::DataChunk* compute_output(keras::DataChunk*);
-  std::vector<std::vector<std::vector<std::vector<float> > > > m_kernels; // kernel, depth, rows, cols
-  std::vector<float> m_bias; // kernel
+  void map_weights(keras::BinaryReader &in);
+  void compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const;
+  keras::Weights m_bias; // kernel
+  keras::Weights m_packed; // kernel, depth, rows, cols: contiguous, flipped for correlation
 
   virtual unsigned int get_input_rows() const { return m_rows; }
   virtual unsigned int get_input_cols() const { return m_cols; }
@@ -199,9 +331,10 @@ public:
   LayerDense() : Layer("Dense") {}
 
   void load_weights(std::ifstream &fin);
-  keras::DataChunk* compute_output(keras::DataChunk*);
-  std::vector<std::vector<float> > m_weights; //input, neuron
-  std::vector<float> m_bias; // neuron
+  void map_weights(keras::BinaryReader &in);
+  void compute_batch(keras::DataChunkTensor const & in, keras::DataChunkTensor & out) const;
+  keras::Weights m_bias; // neuron
+  keras::Weights m_packed; // input, neuron: contiguous
 
   virtual unsigned int get_input_rows() const { return 1; } // flat, just one row
   virtual unsigned int get_input_cols() const { return m_input_cnt; }
@@ -213,9 +346,22 @@ public:
 
 class keras::KerasModel {
 public:
+  // ping-pong activation buffers, reused across layers and calls; one per calling thread
+  struct Workspace {
+    keras::DataChunkTensor arena[2];
+    // resized input buffer, to be filled by the caller before compute_batch
+    keras::DataChunkTensor & input(size_t samples, size_t depth, size_t rows, size_t cols) {
+      arena[0].resize(samples, depth, rows, cols);
+      return arena[0];
+    }
+  };
+
   KerasModel(const std::string &input_fname);
   ~KerasModel();
   std::vector<float> compute_output(keras::DataChunk *dc);
+  // run all samples of ws.input(...) through the model, returns [samples, 1, 1, outputs] tensor
+  // (one of the workspace buffers, valid until the next call with the same workspace)
+  keras::DataChunkTensor const & compute_batch(Workspace & ws) const;
 
   unsigned int get_input_rows() const { return m_layers.front()->get_input_rows(); }
   unsigned int get_input_cols() const { return m_layers.front()->get_input_cols(); }
@@ -223,9 +369,12 @@ public:
 
 private:
 
+  static keras::Layer * create_layer(const std::string &layer_type);
   void load_weights(const std::string &input_fname);
+  void map_weights(const std::string &input_fname);
   int m_layers_cnt; // number of layers
   std::vector<Layer *> m_layers; // container with layers
+  std::unique_ptr<keras::MappedFile> m_file; // binary model, referenced by layers
 
 };
 
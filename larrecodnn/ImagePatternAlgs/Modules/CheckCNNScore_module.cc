@@ -7,6 +7,7 @@
 // from cetlib version v3_07_02.
 ////////////////////////////////////////////////////////////////////////
 
+#include "larrecodnn/ImagePatternAlgs/Modules/TruthIndex.h"
 #include "lardata/ArtDataHelper/MVAReader.h"
 #include "lardataobj/RecoBase/Hit.h"
 
@@ -24,8 +25,11 @@
 
 #include "TTree.h"
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace pdsp {
@@ -56,6 +60,10 @@ private:
   art::InputTag fNNetModuleLabel; // label of the module used for CNN tagging
   art::InputTag fHitsModuleLabel; // label of hit finder module
   std::vector<std::string> fNNOutputs;  // label of network outputs
+  art::InputTag fSimChannelModuleLabel; // SimChannels for the true hit info, no truth if empty
+  art::InputTag fSimulationModuleLabel; // MCParticles
+
+  nnet::TruthIndex fTruth;
 
   TTree* ftree;
   int run;
@@ -68,6 +76,8 @@ private:
   std::vector<double> charge;
   std::vector<double> peakt;
   std::array<std::vector<double>, 4> scores;
+  std::vector<int> truepdg;       // PDG of the particle depositing most energy, 0 if unknown
+  std::vector<double> trueenergy; // deposited energy (MeV) within hit RMS
 };
 
 pdsp::CheckCNNScore::CheckCNNScore(fhicl::ParameterSet const& p)
@@ -75,6 +85,8 @@ pdsp::CheckCNNScore::CheckCNNScore(fhicl::ParameterSet const& p)
   , fNNetModuleLabel(p.get<art::InputTag>("NNetModuleLabel"))
   , fHitsModuleLabel(p.get<art::InputTag>("HitsModuleLabel"))
   , fNNOutputs(p.get<std::vector<std::string>>("NNOutputs"))
+  , fSimChannelModuleLabel(p.get<art::InputTag>("SimChannelModuleLabel", ""))
+  , fSimulationModuleLabel(p.get<art::InputTag>("SimulationModuleLabel", "largeant"))
 {}
 
 void
@@ -91,6 +103,11 @@ pdsp::CheckCNNScore::analyze(art::Event const& e)
   charge.clear();
   peakt.clear();
   scores = {};
+  truepdg.clear();
+  trueenergy.clear();
+
+  const bool useTruth = !fSimChannelModuleLabel.label().empty() && !e.isRealData();
+  if (useTruth) { fTruth.update(e, fSimChannelModuleLabel, fSimulationModuleLabel); }
 
   anab::MVAReader<recob::Hit, 4> hitResults(e, fNNetModuleLabel);
 
@@ -115,6 +132,39 @@ pdsp::CheckCNNScore::analyze(art::Event const& e)
       for (size_t i = 0; i<fNNOutputs.size(); ++i){
         scores[i].push_back(cnn_out[hitResults.getIndex(fNNOutputs[i])]);
       }
+      if (useTruth) {
+        // deposits within RMS from the hit peak, summed per track
+        std::vector<std::pair<int, double>> trackEnergy; // (pdg, energy) by track
+        std::vector<int> trackIDs;
+        double energy = 0;
+        auto addDeposit = [&](int time, nnet::TruthIndex::Deposit const& dep) {
+          if (std::abs(hit->TimeDistanceAsRMS(time)) >= 1.0) return;
+          energy += dep.energy;
+          auto it = std::find(trackIDs.begin(), trackIDs.end(), dep.trackID);
+          if (it == trackIDs.end()) {
+            trackIDs.push_back(dep.trackID);
+            trackEnergy.emplace_back(dep.pdg, dep.energy);
+          }
+          else {
+            trackEnergy[it - trackIDs.begin()].second += dep.energy;
+          }
+        };
+        fTruth.forEachDeposit(hit->Channel(),
+                              std::floor(hit->PeakTime() - hit->RMS()),
+                              std::ceil(hit->PeakTime() + hit->RMS()) + 1,
+                              addDeposit);
+
+        int pdg = 0;
+        double maxEnergy = 0;
+        for (auto const& t : trackEnergy) {
+          if (t.second > maxEnergy) {
+            maxEnergy = t.second;
+            pdg = t.first;
+          }
+        }
+        truepdg.push_back(pdg);
+        trueenergy.push_back(energy);
+      }
       //      std::cout<<hit->WireID().TPC<<" "
       //               <<hit->WireID().Wire<<" "
       //               <<hit->PeakTime()<<" "
@@ -142,6 +192,10 @@ pdsp::CheckCNNScore::beginJob()
   for (size_t i = 0; i < size(scores); ++i) {
     ftree->Branch(Form("score_%ld",i), &scores[i]);
   }
+  if (!fSimChannelModuleLabel.label().empty()) {
+    ftree->Branch("truepdg", &truepdg);
+    ftree->Branch("trueenergy", &trueenergy);
+  }
 }
 
 DEFINE_ART_MODULE(pdsp::CheckCNNScore)
@@ -1,7 +1,10 @@
 #ifndef EMTRACK_H
 #define EMTRACK_H
 
+#include "larrecodnn/ImagePatternAlgs/Modules/ScoreAccumulator.h"
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/BatchSizeTuner.h"
 #include "larrecodnn/ImagePatternAlgs/ToolInterfaces/IPointIdAlg.h"
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/PerfStats.h"
 #include "lardata/ArtDataHelper/MVAWriter.h"
 #include "lardata/DetectorInfoServices/DetectorClocksService.h"
 #include "lardata/DetectorInfoServices/DetectorPropertiesService.h"
@@ -29,8 +32,16 @@
 #include "cetlib/container_algorithms.h"
 #include "cetlib_except/exception.h"
 
+#include "tbb/parallel_for.h"
+#include "tbb/task_arena.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <tuple>
 #include <unordered_map>
@@ -52,7 +63,40 @@ namespace nnet {
         Name("PointIdAlg")};
       fhicl::Atom<size_t> BatchSize{
         Name("BatchSize"),
-        Comment("number of samples processed in one batch")};
+        Comment("number of samples processed in one batch, initial value if auto-tuned")};
+      fhicl::Atom<bool> AutoTuneBatchSize{
+        Name("AutoTuneBatchSize"),
+        Comment("choose the batch size with the best throughput at run time, see "
+                "BatchSizeTuner"),
+        false};
+      fhicl::Atom<size_t> MaxBatchSize{
+        Name("MaxBatchSize"),
+        Comment("auto-tune: largest batch size tried, also limited by the back-end "
+                "(e.g. server model max batch size); 0: back-end limit only"),
+        4096};
+      fhicl::Atom<double> MaxBatchLatencyMs{
+        Name("MaxBatchLatencyMs"),
+        Comment("auto-tune: ceiling of the mean batch latency [ms], 0: no ceiling"),
+        0.};
+      fhicl::Atom<size_t> QueueDepth{
+        Name("QueueDepth"),
+        Comment("max number of batches in flight: next batches are prepared while "
+                "the previous are processed by asynchronous back-ends; 1: no overlap"),
+        2};
+      fhicl::Atom<int> NumThreads{
+        Name("NumThreads"),
+        Comment("TPC/planes classified concurrently, each with its own PointIdAlg "
+                "tool instance; 1: serial, 0: TBB default"),
+        1};
+      fhicl::Atom<size_t> ScoreMapStrideW{
+        Name("ScoreMapStrideW"),
+        Comment("score map mode: network is applied on a grid with this spacing in wires, "
+                "hit outputs are interpolated; 0: patch for each hit"),
+        0};
+      fhicl::Atom<size_t> ScoreMapStrideD{
+        Name("ScoreMapStrideD"),
+        Comment("score map grid spacing in downsampled drift bins"),
+        1};
 
       fhicl::Atom<art::InputTag> WireLabel{
         Name("WireLabel"),
@@ -76,16 +120,42 @@ namespace nnet {
       fhicl::Sequence<int> Views{Name("Views"),
                                  Comment("tag clusters in selected views only, "
                                          "or in all views if empty list")};
+
+      fhicl::Atom<bool> AccumulateScores{
+        Name("AccumulateScores"),
+        Comment("cluster and track outputs are summed from hit outputs while hits are "
+                "classified, using a hit -> cluster/track index built once per event"),
+        false};
+
+      fhicl::Atom<bool> WarmUp{
+        Name("WarmUp"),
+        Comment("run the network once on a dummy batch at the begin of job, so the first "
+                "event does not pay the model initialization"),
+        false};
+
+      fhicl::Atom<std::string> PerfReportFile{
+        Name("PerfReportFile"),
+        Comment("JSON file for the end of job timing report of the CNN modules, "
+                "empty: table in the log only"),
+        ""};
     };
     explicit EmTrack(Config const& c,
                      std::string const& s,
                      art::ProducesCollector& pc);
+    void beginJob();
     void produce(art::Event& e);
+    void endJob();
 
   private:
     bool isViewSelected(int view) const;
     const size_t fBatchSize;
-    std::unique_ptr<PointIdAlgTools::IPointIdAlg> fPointIdAlgTool;
+    const size_t fQueueDepth;
+    const bool fWarmUp;
+    const bool fAccumulate;
+    const size_t fScoreMapStrideW, fScoreMapStrideD;
+    // one tool for each thread of the arena, indexed by the arena thread index
+    std::vector<std::unique_ptr<PointIdAlgTools::IPointIdAlg>> fPointIdAlgTools;
+    std::unique_ptr<tbb::task_arena> fArena; // only if planes are processed in parallel
     using writer = anab::MVAWriter<N>;
     writer fMVAWriter;
     const art::InputTag fWireProducerLabel;
@@ -97,17 +167,49 @@ namespace nnet {
     const std::vector<int> fViews;
     const art::InputTag
       fNewClustersTag; // input tag for the clusters produced by this module
+    const std::string fPerfReportFile;
+    PerfStats& fPerf; // stats of this module and its tools
+    PerfStage* fPerfEvent;
+    PerfStage* fPerfViewSetup;
+    PerfStage* fPerfHits;
+    PerfStage* fPerfPatches;
+    std::unique_ptr<BatchSizeTuner> fTuner; // only if the batch size is auto-tuned
+
+    // hits of the input clusters and tracks (best view only), read once per event; with
+    // AccumulateScores cluster/track outputs are summed while the hits are classified
+    struct OwnerHits {
+      std::optional<art::FindManyP<recob::Hit>> clusters;
+      std::vector<std::vector<art::Ptr<recob::Hit>>> tracks;
+      ScoreAccumulator<N> cluScores, trkScores;
+    };
+    OwnerHits read_owners(art::Event const& evt, size_t nHits) const;
     void make_clusters(art::Event& evt,
                        std::vector<art::Ptr<recob::Hit>> const& hitPtrList,
                        std::vector<char> const& hitInFA,
-                       EmTrack::cryo_tpc_view_keymap const& hitMap);
-    void make_tracks(art::Event const& evt, std::vector<char> const& hitInFA);
+                       EmTrack::cryo_tpc_view_keymap const& hitMap,
+                       OwnerHits const& owners);
+    void make_tracks(std::vector<char> const& hitInFA, OwnerHits const& owners);
     cryo_tpc_view_keymap create_hitmap(
       std::vector<art::Ptr<recob::Hit>> const& hitPtrList) const;
     std::vector<char> classify_hits(
       art::Event const& evt,
       EmTrack::cryo_tpc_view_keymap const& hitMap,
-      std::vector<art::Ptr<recob::Hit>> const& hitPtrList);
+      std::vector<art::Ptr<recob::Hit>> const& hitPtrList,
+      OwnerHits& owners);
+    using plane_list =
+      std::vector<typename cryo_tpc_view_keymap::value_type const*>;
+    // classify hits of the planes with the tool, outputs passed to setOutput(key, values)
+    template <typename Out>
+    void classify_planes(PointIdAlgTools::IPointIdAlg& tool,
+                         detinfo::DetectorClocksData const& clockData,
+                         detinfo::DetectorPropertiesData const& detProp,
+                         std::vector<recob::Wire> const& wires,
+                         plane_list const& planes,
+                         std::vector<art::Ptr<recob::Hit>> const& hitPtrList,
+                         std::vector<char>& hitInFA,
+                         std::atomic<size_t>& nHits,
+                         std::atomic<size_t>& nPatches,
+                         Out&& setOutput) const;
   };
 
   template <size_t N>
@@ -115,7 +217,8 @@ namespace nnet {
   EmTrack<N>::make_clusters(art::Event& evt,
                             std::vector<art::Ptr<recob::Hit>> const& hitPtrList,
                             std::vector<char> const& hitInFA,
-                            EmTrack::cryo_tpc_view_keymap const& hitMap)
+                            EmTrack::cryo_tpc_view_keymap const& hitMap,
+                            OwnerHits const& owners)
   {
     // **************** prepare for new clusters ****************
     auto clusters = std::make_unique<std::vector<recob::Cluster>>();
@@ -140,13 +243,12 @@ namespace nnet {
     }
 
     auto cluID = fMVAWriter.template initOutputs<recob::Cluster>(
-      fNewClustersTag, fPointIdAlgTool->outputLabels());
+      fNewClustersTag, fPointIdAlgTools.front()->outputLabels());
 
     unsigned int cidx = 0; // new clusters index
-    art::FindManyP<recob::Hit> hitsFromClusters(
-      cluListHandle, evt, fClusterModuleLabel);
-    std::vector<bool> hitUsed(hitPtrList.size(),
-                              false); // tag hits used in clusters
+    auto const& hitsFromClusters = *owners.clusters;
+    std::vector<bool> hitUsed; // tag hits used in clusters, if not indexed already
+    if (!fAccumulate) { hitUsed.resize(hitPtrList.size(), false); }
                                       // clang-format off
         for (auto const & [key, clusters_keys] : cluMap)
         {
@@ -157,21 +259,25 @@ namespace nnet {
 
       for (size_t c : clusters_keys) // c is the Ptr< recob::Cluster >::key()
       {
-        auto v = hitsFromClusters.at(c);
+        auto const& v = hitsFromClusters.at(c);
         if (v.empty())
           continue;
 
-        for (auto const& hit : v) {
-          if (hitUsed[hit.key()]) {
-            mf::LogWarning("EmTrack") << "hit already used in another cluster";
+        std::array<float, N> vout;
+        if (fAccumulate) { vout = owners.cluScores.output(c); }
+        else {
+          for (auto const& hit : v) {
+            if (hitUsed[hit.key()]) {
+              mf::LogWarning("EmTrack") << "hit already used in another cluster";
+            }
+            hitUsed[hit.key()] = true;
           }
-          hitUsed[hit.key()] = true;
-        }
 
-        auto vout = fMVAWriter.template getOutput<recob::Hit>(
-          v, [&](art::Ptr<recob::Hit> const& ptr) {
-            return (float)hitInFA[ptr.key()];
-          });
+          vout = fMVAWriter.template getOutput<recob::Hit>(
+            v, [&](art::Ptr<recob::Hit> const& ptr) {
+              return (float)hitInFA[ptr.key()];
+            });
+        }
 
         float pvalue = vout[0] / (vout[0] + vout[1]);
         mf::LogVerbatim("EmTrack")
@@ -214,7 +320,7 @@ namespace nnet {
       for (size_t h :
            hitMap.at({cryo, tpc, view})) // h is the Ptr< recob::Hit >::key()
       {
-        if (hitUsed[h])
+        if (fAccumulate ? (owners.cluScores.owners(h) > 0) : hitUsed[h])
           continue;
 
         auto vout = fMVAWriter.template getOutput<recob::Hit>(h);
@@ -267,50 +373,88 @@ namespace nnet {
     evt.put(std::move(clu2hit));
   }
 
-  /// make tracks
+  /// read hits of clusters and tracks, index them for the score accumulation
   template <size_t N>
-  void
-  EmTrack<N>::make_tracks(art::Event const& evt,
-                          std::vector<char> const& hitInFA)
+  typename EmTrack<N>::OwnerHits
+  EmTrack<N>::read_owners(art::Event const& evt, size_t nHits) const
   {
-    auto trkListHandle =
-      evt.getValidHandle<std::vector<recob::Track>>(fTrackModuleLabel);
-    art::FindManyP<recob::Hit> hitsFromTracks(
-      trkListHandle, evt, fTrackModuleLabel);
-    std::vector<std::vector<art::Ptr<recob::Hit>>> trkHitPtrList(
-      trkListHandle->size());
-    for (size_t t = 0; t < trkListHandle->size(); ++t) {
-      auto v = hitsFromTracks.at(t);
-      size_t nh[3] = {0, 0, 0};
-      for (auto const& hptr : v) {
-        ++nh[hptr->View()];
-      }
-      size_t best_view = 2; // collection
-      if ((nh[0] >= nh[1]) && (nh[0] > 2 * nh[2]))
-        best_view = 0; // ind1
-      if ((nh[1] >= nh[0]) && (nh[1] > 2 * nh[2]))
-        best_view = 1; // ind2
-
-      size_t k = 0;
-      while (!isViewSelected(best_view)) {
-        best_view = (best_view + 1) % 3;
-        if (++k > 3) {
-          throw cet::exception("EmTrack")
-            << "No views selected at all?" << std::endl;
+    OwnerHits owners;
+    if (fDoClusters) {
+      auto cluListHandle =
+        evt.getValidHandle<std::vector<recob::Cluster>>(fClusterModuleLabel);
+      owners.clusters.emplace(cluListHandle, evt, fClusterModuleLabel);
+      if (fAccumulate) {
+        auto const& hitsFromClusters = *owners.clusters;
+        owners.cluScores.index(hitsFromClusters.size(), nHits, [&](size_t c) -> auto const& {
+          return hitsFromClusters.at(c);
+        });
+        size_t nShared = 0;
+        for (size_t h = 0; h < nHits; ++h) {
+          if (owners.cluScores.owners(h) > 1) ++nShared;
+        }
+        if (nShared) {
+          mf::LogWarning("EmTrack") << nShared << " hits used in more than one cluster";
         }
       }
+    }
 
-      for (auto const& hptr : v) {
-        if (hptr->View() == best_view)
-          trkHitPtrList[t].emplace_back(hptr);
+    if (fDoTracks) {
+      auto trkListHandle =
+        evt.getValidHandle<std::vector<recob::Track>>(fTrackModuleLabel);
+      art::FindManyP<recob::Hit> hitsFromTracks(
+        trkListHandle, evt, fTrackModuleLabel);
+      auto& trkHitPtrList = owners.tracks;
+      trkHitPtrList.resize(trkListHandle->size());
+      for (size_t t = 0; t < trkListHandle->size(); ++t) {
+        auto const& v = hitsFromTracks.at(t);
+        size_t nh[3] = {0, 0, 0};
+        for (auto const& hptr : v) {
+          ++nh[hptr->View()];
+        }
+        size_t best_view = 2; // collection
+        if ((nh[0] >= nh[1]) && (nh[0] > 2 * nh[2]))
+          best_view = 0; // ind1
+        if ((nh[1] >= nh[0]) && (nh[1] > 2 * nh[2]))
+          best_view = 1; // ind2
+
+        size_t k = 0;
+        while (!isViewSelected(best_view)) {
+          best_view = (best_view + 1) % 3;
+          if (++k > 3) {
+            throw cet::exception("EmTrack")
+              << "No views selected at all?" << std::endl;
+          }
+        }
+
+        for (auto const& hptr : v) {
+          if (hptr->View() == best_view)
+            trkHitPtrList[t].emplace_back(hptr);
+        }
+      }
+      if (fAccumulate) {
+        owners.trkScores.index(trkHitPtrList.size(), nHits, [&](size_t t) -> auto const& {
+          return trkHitPtrList[t];
+        });
       }
     }
+    return owners;
+  }
 
+  /// make tracks
+  template <size_t N>
+  void
+  EmTrack<N>::make_tracks(std::vector<char> const& hitInFA, OwnerHits const& owners)
+  {
+    auto const& trkHitPtrList = owners.tracks;
     auto trkID = fMVAWriter.template initOutputs<recob::Track>(
-      fTrackModuleLabel, trkHitPtrList.size(), fPointIdAlgTool->outputLabels());
+      fTrackModuleLabel, trkHitPtrList.size(), fPointIdAlgTools.front()->outputLabels());
     for (size_t t = 0; t < trkHitPtrList.size();
          ++t) // t is the Ptr< recob::Track >::key()
     {
+      if (fAccumulate) {
+        fMVAWriter.setOutput(trkID, t, owners.trkScores.output(t));
+        continue;
+      }
       auto vout = fMVAWriter.template getOutput<recob::Hit>(
         trkHitPtrList[t], [&](art::Ptr<recob::Hit> const& ptr) {
           return (float)hitInFA[ptr.key()];
@@ -342,10 +486,11 @@ namespace nnet {
   std::vector<char>
   EmTrack<N>::classify_hits(art::Event const& evt,
                             EmTrack::cryo_tpc_view_keymap const& hitMap,
-                            std::vector<art::Ptr<recob::Hit>> const& hitPtrList)
+                            std::vector<art::Ptr<recob::Hit>> const& hitPtrList,
+                            OwnerHits& owners)
   {
     auto hitID = fMVAWriter.template initOutputs<recob::Hit>(
-      fHitModuleLabel, hitPtrList.size(), fPointIdAlgTool->outputLabels());
+      fHitModuleLabel, hitPtrList.size(), fPointIdAlgTools.front()->outputLabels());
 
     auto const clockData =
       art::ServiceHandle<detinfo::DetectorClocksService const>()->DataFor(evt);
@@ -357,57 +502,263 @@ namespace nnet {
     std::vector<char> hitInFA(hitPtrList.size(),
                               0); // tag hits in fid. area as 1, use 0 for hits
                                   // close to the projectrion edges
-    for (auto const& [key, hits] : hitMap) {
-      auto const& [cryo, tpc, view] = key;
-      if (!isViewSelected(view))
-        continue; // should not happen, hits were selected
 
-      fPointIdAlgTool->setWireDriftData(
-        clockData, detProp, *wireHandle, view, tpc, cryo);
+    plane_list planes;
+    for (auto const& entry : hitMap) {
+      if (isViewSelected(std::get<2>(entry.first))) { planes.push_back(&entry); }
+    }
+    std::atomic<size_t> nHits{0}, nPatches{0};
+
+    // fiducial area tag of a hit, used as its weight, is set before its output is ready
+    auto store = [&](size_t h, std::vector<float> const& out) {
+      fMVAWriter.setOutput(hitID, h, out);
+      if (fAccumulate) {
+        owners.cluScores.add(h, hitInFA[h], out);
+        owners.trkScores.add(h, hitInFA[h], out);
+      }
+    };
 
-      // (1) do all hits in this plane
-      // ------------------------------------------------
-      for (size_t idx = 0; idx < hits.size(); idx += fBatchSize) {
-        std::vector<std::pair<unsigned int, float>> points;
-        std::vector<size_t> keys;
-        for (size_t k = 0; k < fBatchSize; ++k) {
-          if (idx + k >= hits.size()) {
-            break;
-          } // careful about the tail
+    if (!fArena || (planes.size() < 2)) {
+      classify_planes(*fPointIdAlgTools.front(),
+                      clockData,
+                      detProp,
+                      *wireHandle,
+                      planes,
+                      hitPtrList,
+                      hitInFA,
+                      nHits,
+                      nPatches,
+                      store);
+    }
+    else {
+      // planes processed concurrently, each by the tool of the arena thread running it,
+      // which holds the view data; outputs are kept per plane and passed to the MVA writer
+      // at the end
+      std::vector<std::vector<std::pair<size_t, std::vector<float>>>> outputs(
+        planes.size());
+
+      fArena->execute([&]() {
+        tbb::parallel_for(size_t(0), planes.size(), [&](size_t p) {
+          // isolated: while waiting in nested loops of the tool (e.g. Keras Conv2D) this
+          // thread must not pick up another plane, which would reuse its tool
+          tbb::this_task_arena::isolate([&]() {
+            auto& tool = *fPointIdAlgTools[tbb::this_task_arena::current_thread_index()];
+
+            classify_planes(tool,
+                            clockData,
+                            detProp,
+                            *wireHandle,
+                            plane_list{planes[p]},
+                            hitPtrList,
+                            hitInFA,
+                            nHits,
+                            nPatches,
+                            [&](size_t h, std::vector<float> const& out) {
+                              outputs[p].emplace_back(h, out);
+                            });
+          });
+        });
+      });
 
-          size_t h = hits[idx + k]; // h is the Ptr< recob::Hit >::key()
-          const recob::Hit& hit = *(hitPtrList[h]);
-          points.emplace_back(hit.WireID().Wire, hit.PeakTime());
-          keys.push_back(h);
+      for (auto const& plane_out : outputs) {
+        for (auto const& [h, out] : plane_out) {
+          store(h, out);
         }
+      }
+    }
+
+    if (nHits) {
+      mf::LogVerbatim("EmTrack") << nPatches << " unique patches for " << nHits
+                                 << " hits";
+    }
+    fPerfHits->add(nHits);
+    fPerfPatches->add(nPatches);
+    return hitInFA;
+  }
+
+  template <size_t N>
+  template <typename Out>
+  void
+  EmTrack<N>::classify_planes(PointIdAlgTools::IPointIdAlg& tool,
+                              detinfo::DetectorClocksData const& clockData,
+                              detinfo::DetectorPropertiesData const& detProp,
+                              std::vector<recob::Wire> const& wires,
+                              plane_list const& planes,
+                              std::vector<art::Ptr<recob::Hit>> const& hitPtrList,
+                              std::vector<char>& hitInFA,
+                              std::atomic<size_t>& nHits,
+                              std::atomic<size_t>& nPatches,
+                              Out&& setOutput) const
+  {
+    // score map of a plane: node outputs are collected from all its batches, then hit
+    // outputs are interpolated
+    struct PlaneMap {
+      PointIdAlgTools::ScoreGrid grid;
+      std::vector<size_t> keys;
+      std::vector<std::vector<float>> nodeOutputs;
+      size_t pending = 0;
+    };
+
+    // batches submitted to the tool and not yet collected, oldest first;
+    // fiducial area is tagged at submission, with the view data used for patches
+    struct Submitted {
+      std::vector<std::vector<size_t>> keys; // hits of each patch, or...
+      std::shared_ptr<PlaneMap> map; // ...score map nodes starting from first
+      size_t first = 0;
+      size_t size = 0;
+      PerfTimer::Clock::time_point start; // submission, for the batch size tuner
+    };
+    std::deque<Submitted> inflight;
+    PerfTimer::Clock::time_point lastCollect; // batches wait in the queue until then
+
+    auto submit = [&](std::vector<std::pair<unsigned int, float>> const& points,
+                      Submitted&& batch) {
+      batch.size = points.size();
+      if (fTuner) { batch.start = PerfTimer::Clock::now(); }
+      tool.submitIdVectors(points);
+      inflight.push_back(std::move(batch));
+    };
 
-        auto batch_out = fPointIdAlgTool->predictIdVectors(points);
-        if (points.size() != batch_out.size()) {
+    auto collect = [&]() {
+      auto const& batch = inflight.front();
+      auto batch_out = tool.collectIdVectors();
+      if (fTuner) {
+        auto now = PerfTimer::Clock::now();
+        fTuner->record(batch.size, std::max(batch.start, lastCollect), now);
+        lastCollect = now;
+      }
+      if (batch.map) {
+        auto& map = *batch.map;
+        if (batch.first + batch_out.size() > map.nodeOutputs.size()) {
           throw cet::exception("EmTrack")
-            << "hits processing failed" << std::endl;
+            << "score map processing failed" << std::endl;
+        }
+        std::move(batch_out.begin(), batch_out.end(), map.nodeOutputs.begin() + batch.first);
+        if (--map.pending == 0) {
+          auto hits_out = map.grid.interpolate(map.nodeOutputs);
+          for (size_t k = 0; k < map.keys.size(); ++k) {
+            setOutput(map.keys[k], hits_out[k]);
+          }
         }
+        inflight.pop_front();
+        return;
+      }
+      if (batch.keys.size() != batch_out.size()) {
+        throw cet::exception("EmTrack")
+          << "hits processing failed" << std::endl;
+      }
+      for (size_t k = 0; k < batch.keys.size(); ++k) {
+        for (size_t h : batch.keys[k]) {
+          setOutput(h, batch_out[k]);
+        }
+      }
+      inflight.pop_front();
+    };
+
+    for (auto const* plane : planes) {
+      auto const& [key, hits] = *plane;
+      auto const& [cryo, tpc, view] = key;
+
+      // batch size is fixed within a plane, it may change between planes if auto-tuned
+      const size_t batchSize = fTuner ? fTuner->batchSize() : fBatchSize;
 
-        for (size_t k = 0; k < points.size(); ++k) {
-          size_t h = keys[k];
-          fMVAWriter.setOutput(hitID, h, batch_out[k]);
-          if (fPointIdAlgTool->isInsideFiducialRegion(points[k].first,
-                                                      points[k].second)) {
+      // patches of submitted batches were already read, view data can be replaced
+      PerfTimer viewTimer(fPerfViewSetup);
+      tool.setWireDriftData(clockData, detProp, wires, view, tpc, cryo);
+      viewTimer.stop();
+
+      if (fScoreMapStrideW) {
+        // (1) score map over the area covered by hits in this plane
+        // ------------------------------------------------
+        auto map = std::make_shared<PlaneMap>();
+        std::vector<std::pair<unsigned int, float>> points;
+        for (size_t h : hits) {
+          const recob::Hit& hit = *(hitPtrList[h]);
+          points.emplace_back(hit.WireID().Wire, hit.PeakTime());
+          map->keys.push_back(h);
+          if (tool.isInsideFiducialRegion(points.back().first,
+                                          points.back().second)) {
             hitInFA[h] = 1;
           }
         }
+        tool.makeScoreGrid(points, fScoreMapStrideW, fScoreMapStrideD, map->grid);
+
+        auto const& nodes = map->grid.nodes;
+        nHits += hits.size();
+        nPatches += nodes.size();
+        map->nodeOutputs.resize(nodes.size());
+        map->pending = (nodes.size() + batchSize - 1) / batchSize;
+        for (size_t idx = 0; idx < nodes.size(); idx += batchSize) {
+          std::vector<std::pair<unsigned int, float>> batch_nodes(
+            nodes.begin() + idx,
+            nodes.begin() + std::min(nodes.size(), idx + batchSize));
+
+          if (inflight.size() == fQueueDepth) { collect(); }
+          Submitted batch;
+          batch.map = map;
+          batch.first = idx;
+          submit(batch_nodes, std::move(batch));
+        }
+        mf::LogVerbatim("EmTrack") << "view " << view << ": " << hits.size()
+                                   << " hits from " << nodes.size()
+                                   << " score map nodes";
+        continue;
+      }
+
+      // (1) do all hits in this plane, once for each unique patch: results
+      // are shared by hits in the same (downsampled) wire/drift cell
+      // ------------------------------------------------
+      std::vector<std::pair<unsigned int, float>> points;
+      std::vector<std::vector<size_t>> patchHits;
+      std::unordered_map<uint64_t, size_t> patchIdx;
+      for (size_t h : hits) { // h is the Ptr< recob::Hit >::key()
+        const recob::Hit& hit = *(hitPtrList[h]);
+        const unsigned int wire = hit.WireID().Wire;
+        const float drift = hit.PeakTime();
+        if (tool.isInsideFiducialRegion(wire, drift)) {
+          hitInFA[h] = 1;
+        }
+
+        auto [it, added] =
+          patchIdx.emplace(tool.patchKey(wire, drift), points.size());
+        if (added) {
+          points.emplace_back(wire, drift);
+          patchHits.emplace_back();
+        }
+        patchHits[it->second].push_back(h);
+      }
+      nHits += hits.size();
+      nPatches += points.size();
+
+      for (size_t idx = 0; idx < points.size(); idx += batchSize) {
+        const size_t end = std::min(points.size(), idx + batchSize);
+        std::vector<std::pair<unsigned int, float>> batch_points(
+          points.begin() + idx, points.begin() + end);
+        Submitted batch;
+        batch.keys.assign(std::make_move_iterator(patchHits.begin() + idx),
+                          std::make_move_iterator(patchHits.begin() + end));
+
+        if (inflight.size() == fQueueDepth) { collect(); }
+        submit(batch_points, std::move(batch));
       } // hits done
         // ------------------------------------------------------------------
     }
-    return hitInFA;
+    while (!inflight.empty()) {
+      collect();
+    }
   }
+
   // make sure fMVAWriter is getting a variable string
   template <size_t N>
   EmTrack<N>::EmTrack(EmTrack::Config const& config,
                       std::string const& module_label,
                       art::ProducesCollector& collector)
     : fBatchSize(config.BatchSize())
-    , fPointIdAlgTool(art::make_tool<PointIdAlgTools::IPointIdAlg>(
-        config.PointIdAlg.get_PSet()))
+    , fQueueDepth(std::max<size_t>(1, config.QueueDepth()))
+    , fWarmUp(config.WarmUp())
+    , fAccumulate(config.AccumulateScores())
+    , fScoreMapStrideW(config.ScoreMapStrideW())
+    , fScoreMapStrideD(std::max<size_t>(1, config.ScoreMapStrideD()))
     , fMVAWriter(collector, "emtrkmichel")
     , fWireProducerLabel(config.WireLabel())
     , fHitModuleLabel(config.HitModuleLabel())
@@ -420,7 +771,37 @@ namespace nnet {
         module_label,
         "",
         art::ServiceHandle<art::TriggerNamesService const>()->getProcessName())
+    , fPerfReportFile(config.PerfReportFile())
+    , fPerf(PerfRegistry::stats(module_label))
+    , fPerfEvent(fPerf.stage("event"))
+    , fPerfViewSetup(fPerf.stage("view setup"))
+    , fPerfHits(fPerf.stage("hits per event", PerfStage::Unit::Count))
+    , fPerfPatches(fPerf.stage("patches per event", PerfStage::Unit::Count))
   {
+    int nThreads = config.NumThreads();
+    if (nThreads != 1) {
+      fArena = std::make_unique<tbb::task_arena>(
+        nThreads > 1 ? nThreads : tbb::task_arena::automatic);
+      nThreads = fArena->max_concurrency();
+    }
+    for (int i = 0; i < std::max(nThreads, 1); ++i) {
+      fPointIdAlgTools.push_back(art::make_tool<PointIdAlgTools::IPointIdAlg>(
+        config.PointIdAlg.get_PSet()));
+      fPointIdAlgTools.back()->setPerfStats(&fPerf);
+    }
+    if (fArena) {
+      mf::LogInfo("EmTrack") << "planes processed by " << nThreads
+                             << " threads, each with its PointIdAlg tool";
+    }
+    if (config.AutoTuneBatchSize()) {
+      size_t maxSize = config.MaxBatchSize();
+      if (size_t toolMax = fPointIdAlgTools.front()->maxBatchSize()) {
+        maxSize = maxSize ? std::min(maxSize, toolMax) : toolMax;
+      }
+      fTuner = std::make_unique<BatchSizeTuner>(
+        module_label, fBatchSize, 1, maxSize, config.MaxBatchLatencyMs(), fPerf);
+    }
+
     fMVAWriter.template produces_using<recob::Hit>();
 
     if (!fClusterModuleLabel.label().empty()) {
@@ -436,10 +817,24 @@ namespace nnet {
   }
   // ------------------------------------------------------
 
+  template <size_t N>
+  void
+  EmTrack<N>::beginJob()
+  {
+    if (!fWarmUp) return;
+    // every tool of the pool: per-tool buffers are set up too, shared models initialize once
+    for (auto& tool : fPointIdAlgTools) {
+      tool->warmUp(std::max<size_t>(1, fBatchSize));
+    }
+    mf::LogInfo("EmTrack") << "PointIdAlg tools warmed up";
+  }
+  // ------------------------------------------------------
+
   template <size_t N>
   void
   EmTrack<N>::produce(art::Event& evt)
   {
+    PerfTimer timer(fPerfEvent);
     mf::LogVerbatim("EmTrack")
       << "next event: " << evt.run() << " / " << evt.id().event();
     auto hitListHandle =
@@ -447,17 +842,30 @@ namespace nnet {
     std::vector<art::Ptr<recob::Hit>> hitPtrList;
     art::fill_ptr_vector(hitPtrList, hitListHandle);
     const EmTrack::cryo_tpc_view_keymap hitMap = create_hitmap(hitPtrList);
-    const std::vector<char> hitInFA = classify_hits(evt, hitMap, hitPtrList);
+    OwnerHits owners = read_owners(evt, hitPtrList.size());
+    const std::vector<char> hitInFA = classify_hits(evt, hitMap, hitPtrList, owners);
 
     if (fDoClusters)
-      make_clusters(evt, hitPtrList, hitInFA, hitMap);
+      make_clusters(evt, hitPtrList, hitInFA, hitMap, owners);
 
     if (fDoTracks)
-      make_tracks(evt, hitInFA);
+      make_tracks(hitInFA, owners);
     fMVAWriter.saveOutputs(evt);
   }
   // ------------------------------------------------------
 
+  template <size_t N>
+  void
+  EmTrack<N>::endJob()
+  {
+    if (fTuner) {
+      mf::LogInfo("EmTrack") << "batch size " << fTuner->batchSize()
+                             << (fTuner->converged() ? "" : " (auto-tuning not converged)");
+    }
+    fPerf.report(fPerfReportFile);
+  }
+  // ------------------------------------------------------
+
   template <size_t N>
   bool
   EmTrack<N>::isViewSelected(int view) const
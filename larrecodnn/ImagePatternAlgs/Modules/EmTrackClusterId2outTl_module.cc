@@ -35,7 +35,9 @@ namespace nnet {
     EmTrackClusterId2outTl& operator=(EmTrackClusterId2outTl&&) = delete;
 
   private:
+    void beginJob() override;
     void produce(art::Event& e) override;
+    void endJob() override;
     EmTrack<2> fEmTrack;
   };
   // ------------------------------------------------------
@@ -46,6 +48,13 @@ namespace nnet {
   {}
   // ------------------------------------------------------
 
+  void
+  EmTrackClusterId2outTl::beginJob()
+  {
+    fEmTrack.beginJob();
+  }
+  // ------------------------------------------------------
+
   void
   EmTrackClusterId2outTl::produce(art::Event& evt)
   {
@@ -53,6 +62,13 @@ namespace nnet {
   }
   // ------------------------------------------------------
 
+  void
+  EmTrackClusterId2outTl::endJob()
+  {
+    fEmTrack.endJob();
+  }
+  // ------------------------------------------------------
+
   DEFINE_ART_MODULE(EmTrackClusterId2outTl)
 
 }
@@ -35,7 +35,9 @@ namespace nnet {
     EmTrackClusterId3outTl& operator=(EmTrackClusterId3outTl&&) = delete;
 
   private:
+    void beginJob() override;
     void produce(art::Event& e) override;
+    void endJob() override;
     EmTrack<3> fEmTrack;
   };
   // ------------------------------------------------------
@@ -46,6 +48,13 @@ namespace nnet {
   {}
   // ------------------------------------------------------
 
+  void
+  EmTrackClusterId3outTl::beginJob()
+  {
+    fEmTrack.beginJob();
+  }
+  // ------------------------------------------------------
+
   void
   EmTrackClusterId3outTl::produce(art::Event& evt)
   {
@@ -53,6 +62,13 @@ namespace nnet {
   }
   // ------------------------------------------------------
 
+  void
+  EmTrackClusterId3outTl::endJob()
+  {
+    fEmTrack.endJob();
+  }
+  // ------------------------------------------------------
+
   DEFINE_ART_MODULE(EmTrackClusterId3outTl)
 
 }
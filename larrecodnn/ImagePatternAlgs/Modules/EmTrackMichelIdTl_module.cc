@@ -37,7 +37,9 @@ namespace nnet {
     EmTrackMichelIdTl& operator=(EmTrackMichelIdTl&&) = delete;
 
   private:
+    void beginJob() override;
     void produce(art::Event& e) override;
+    void endJob() override;
     EmTrack<4> fEmTrack;
   };
   // ------------------------------------------------------
@@ -48,6 +50,13 @@ namespace nnet {
   {}
   // ------------------------------------------------------
 
+  void
+  EmTrackMichelIdTl::beginJob()
+  {
+    fEmTrack.beginJob();
+  }
+  // ------------------------------------------------------
+
   void
   EmTrackMichelIdTl::produce(art::Event& evt)
   {
@@ -55,6 +64,13 @@ namespace nnet {
   }
   // ------------------------------------------------------
 
+  void
+  EmTrackMichelIdTl::endJob()
+  {
+    fEmTrack.endJob();
+  }
+  // ------------------------------------------------------
+
   DEFINE_ART_MODULE(EmTrackMichelIdTl)
 
 }
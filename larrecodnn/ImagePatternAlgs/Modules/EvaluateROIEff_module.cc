@@ -13,6 +13,7 @@
 //        is consecutive energy deposits based on tdc ticks.
 ////////////////////////////////////////////////////////////////////////
 
+#include "larrecodnn/ImagePatternAlgs/Modules/TruthIndex.h"
 #include "larevt/CalibrationDBI/Interface/ChannelStatusProvider.h"
 #include "larevt/CalibrationDBI/Interface/ChannelStatusService.h"
 #include "lardata/DetectorInfoServices/DetectorClocksService.h"
@@ -37,8 +38,15 @@
 #include "TEfficiency.h"
 #include "TH1D.h"
 
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task_arena.h"
+
+#include <algorithm>
 #include <cstdlib> // std::abs()
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace nnet {
@@ -64,11 +72,53 @@ private:
   void beginJob() override;
   void endJob() override;
   bool isSignalInROI(int starttick, int endtick, int maxtick, int roistart, int roiend);
+
+  // consecutive ticks with energy deposits in a SimChannel
+  struct Signal {
+    int starttick;
+    int endtick;
+    double energy;
+    double energy_max; // largest deposit of a tick
+    int max_tdctick;
+  };
+
+  // efficiency histogram entry of a signal, or of signals sharing a ROI
+  struct SignalFill {
+    size_t sim;    // index of the SimChannel
+    double energy; // h_energy (and h_energy_roi if in a ROI)
+    bool inROI;
+    double tickdiff;
+  };
+
+  // per-wire results, filled into histograms in the input order
+  struct WireResult {
+    std::vector<SignalFill> signals;
+    std::vector<double> roi_max; // max |adc| of each ROI
+    std::vector<char> roi_sig;   // 1 if the ROI contains a signal
+  };
+
+  std::vector<Signal> makeSignals(TruthIndex::Segment const& channel,
+                                  detinfo::DetectorClocksData const& clockData,
+                                  int maxTick) const;
+  void evaluateWire(recob::Wire const& wire,
+                    TruthIndex::Range<TruthIndex::Segment> sims,
+                    std::vector<std::vector<Signal>> const& signals,
+                    WireResult& result);
+
+  template <typename F>
+  void forEachChunk(size_t n, F&& f);
+
   // Declare member data here.
   art::InputTag fWireProducerLabel;
   art::InputTag
     fSimulationProducerLabel; // The name of the producer that tracked simulated particles through the detector
 
+  int fNumThreads;          // Threads for the channel loops, 1: serial, 0: TBB default
+  size_t fChannelChunkSize; // Channels per parallel task
+  std::unique_ptr<tbb::task_arena> fArena;
+
+  TruthIndex fTruth; // SimChannels of the event by channel
+
   TH1D* h_energy[3];
   TH1D* h_energy_roi[3];
 
@@ -91,9 +141,163 @@ nnet::EvaluateROIEff::EvaluateROIEff(fhicl::ParameterSet const& p)
   : EDAnalyzer{p}
   , fWireProducerLabel(p.get<art::InputTag>("WireProducerLabel", ""))
   , fSimulationProducerLabel(p.get<art::InputTag>("SimulationProducerLabel", "largeant"))
+  , fNumThreads(p.get<int>("NumThreads", 1))
+  , fChannelChunkSize(p.get<size_t>("ChannelChunkSize", 256))
 // More initializers here.
 {
   // Call appropriate consumes<>() for any products to be retrieved by this module.
+  if (fNumThreads != 1) {
+    fArena = std::make_unique<tbb::task_arena>(fNumThreads > 1 ? fNumThreads :
+                                                                 int(tbb::task_arena::automatic));
+  }
+  if (fChannelChunkSize == 0) { fChannelChunkSize = 1; }
+}
+
+template <typename F>
+void
+nnet::EvaluateROIEff::forEachChunk(size_t n, F&& f)
+{
+  if (!fArena) {
+    f(size_t(0), n);
+    return;
+  }
+  fArena->execute([&] {
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, fChannelChunkSize),
+                      [&](const tbb::blocked_range<size_t>& r) { f(r.begin(), r.end()); });
+  });
+}
+
+std::vector<nnet::EvaluateROIEff::Signal>
+nnet::EvaluateROIEff::makeSignals(TruthIndex::Segment const& channel,
+                                  detinfo::DetectorClocksData const& clockData,
+                                  int maxTick) const
+{
+  // time slice from simChannel is for individual tick
+  // group neighboring time slices into a "signal"
+  std::vector<Signal> signals;
+  int tdctick_previous = -999;
+
+  for (auto const& timeSlice : fTruth.slices(channel)) {
+    auto const tpctime = timeSlice.tdc;
+    auto const energyDeposits = fTruth.deposits(timeSlice);
+    int tdctick = static_cast<int>(clockData.TPCTDC2Tick(double(tpctime)));
+    if (tdctick < 0 || tdctick > maxTick) continue;
+
+    // for a time slice, there may exist more than one energy deposit.
+    double e_deposit = 0;
+    for (auto const& energyDeposit : energyDeposits) {
+      e_deposit += energyDeposit.energy;
+    }
+
+    if (tdctick_previous == -999 || tdctick - tdctick_previous != 1) {
+      signals.push_back({tdctick, tdctick, e_deposit, e_deposit, tdctick});
+    }
+    else {
+      Signal& sig = signals.back();
+      sig.endtick = tdctick;
+      sig.energy += e_deposit;
+      if (sig.energy_max < e_deposit) {
+        sig.energy_max = e_deposit;
+        sig.max_tdctick = tdctick;
+      }
+    }
+
+    tdctick_previous = tdctick;
+
+  } // loop over timeSlices timeSlice
+
+  return signals;
+}
+
+void
+nnet::EvaluateROIEff::evaluateWire(
+  recob::Wire const& wire,
+  TruthIndex::Range<TruthIndex::Segment> sims,
+  std::vector<std::vector<Signal>> const& signals,
+  WireResult& result)
+{
+  auto const& ranges = wire.SignalROI().get_ranges();
+  const size_t nroi = ranges.size();
+
+  // maximum pulse height and position of each ROI
+  std::vector<int> roiStart(nroi), roiEnd(nroi), roiMaxTick(nroi);
+  result.roi_max.resize(nroi);
+  result.roi_sig.assign(nroi, 0);
+  for (size_t r = 0; r < nroi; ++r) {
+    auto const& range = ranges[r];
+    auto const& adc = range.data();
+    roiStart[r] = range.begin_index();
+    roiEnd[r] = range.end_index();
+
+    double maxadc_sig = 0;
+    int maxadc_tick = -99;
+    double maxabs_adc = -99.;
+    for (size_t k = 0; k < adc.size(); ++k) {
+      if (adc[k] > maxadc_sig) {
+        maxadc_sig = adc[k];
+        maxadc_tick = roiStart[r] + k;
+      }
+      if (std::abs(adc[k]) > maxabs_adc) maxabs_adc = std::abs(adc[k]);
+    }
+    roiMaxTick[r] = maxadc_tick;
+    result.roi_max[r] = maxabs_adc;
+  }
+
+  // signals of a SimChannel and ROIs of a wire are both ordered in ticks, so each
+  // SimChannel is matched in one pass over its signals and the ROIs
+  for (auto const& sim : sims) {
+    auto const& sig = signals[sim.sim];
+    if (sig.empty()) continue;
+
+    // efficiency:
+    // a) if signal s is not in any ROI (including the case no ROI), fill h_energy
+    //    with its energy_max;
+    // b) if signal s is in a ROI, take the following signals that are also in this ROI,
+    //    then use the maximum of energy_max to fill h_energy and h_energy_roi.
+    size_t r = 0;
+    for (size_t s = 0; s < sig.size();) {
+      // .. ROIs ending before this signal can not contain any of the next signals
+      while (r < nroi && roiEnd[r] <= sig[s].max_tdctick) {
+        ++r;
+      }
+
+      // case a: signal is not in any ROI
+      if (r == nroi ||
+          !isSignalInROI(
+            sig[s].starttick, sig[s].endtick, sig[s].max_tdctick, roiStart[r], roiEnd[r])) {
+        result.signals.push_back({sim.sim, sig[s].energy_max, false, -99});
+        ++s;
+        continue;
+      }
+
+      // case b: signals in this ROI
+      double maxE_roi = -999.;
+      double maxE_roi_tick = -999.;
+      for (; s < sig.size() &&
+             isSignalInROI(
+               sig[s].starttick, sig[s].endtick, sig[s].max_tdctick, roiStart[r], roiEnd[r]);
+           ++s) {
+        if (maxE_roi < sig[s].energy_max) {
+          maxE_roi = sig[s].energy_max;
+          maxE_roi_tick = sig[s].max_tdctick;
+        }
+      }
+      result.signals.push_back({sim.sim, maxE_roi, true, maxE_roi_tick - roiMaxTick[r]});
+    }
+
+    // purity: check if signal/signals in each ROI
+    size_t s = 0;
+    for (size_t r = 0; r < nroi; ++r) {
+      while (s < sig.size() && sig[s].max_tdctick < roiStart[r]) {
+        ++s;
+      }
+      if (s < sig.size() &&
+          isSignalInROI(
+            sig[s].starttick, sig[s].endtick, sig[s].max_tdctick, roiStart[r], roiEnd[r])) {
+        result.roi_sig[r] = 1;
+      }
+    }
+  }
 }
 
 void
@@ -113,294 +317,95 @@ nnet::EvaluateROIEff::analyze(art::Event const& e)
   }
 
   auto simChannelHandle = e.getValidHandle<std::vector<sim::SimChannel>>(fSimulationProducerLabel);
+  auto const& simChannels = *simChannelHandle;
+  fTruth.update(e, fSimulationProducerLabel);
+
+  // .. wires sorted by channel number, in the input order within a channel
+  std::vector<std::pair<raw::ChannelID_t, size_t>> wireIdx(wires.size());
+  std::vector<char> wireBad(wires.size());
+  for (size_t i = 0; i < wires.size(); ++i) {
+    wireIdx[i] = {wires[i]->Channel(), i};
+    wireBad[i] = chStatus.IsBad(wires[i]->Channel());
+  }
+  std::sort(wireIdx.begin(), wireIdx.end());
+
+  auto channelWires = [&wireIdx](raw::ChannelID_t ch) {
+    auto first = std::lower_bound(wireIdx.begin(), wireIdx.end(), std::make_pair(ch, size_t(0)));
+    auto last = first;
+    while (last != wireIdx.end() && last->first == ch) {
+      ++last;
+    }
+    return std::make_pair(first, last);
+  };
+
+  // .. group the deposits of each SimChannel into signals
+  const int maxTick = int(detProp.ReadOutWindowSize()) - 1;
+  auto const sims = fTruth.segments();
+  std::vector<std::vector<Signal>> signals(simChannels.size());
+  forEachChunk(sims.size(), [&](size_t i0, size_t i1) {
+    for (size_t i = i0; i < i1; ++i) {
+      signals[sims.begin()[i].sim] = makeSignals(sims.begin()[i], clockData, maxTick);
+    }
+  });
+
+  // .. match signals to the ROIs of each wire
+  std::vector<WireResult> results(wires.size());
+  forEachChunk(wires.size(), [&](size_t i0, size_t i1) {
+    for (size_t i = i0; i < i1; ++i) {
+      if (wireBad[i]) continue;
+      evaluateWire(*wires[i], fTruth.segments(wires[i]->Channel()), signals, results[i]);
+    }
+  });
 
   // efficiency: according to each simulated energy deposit
   // ... Loop over simChannels
-  for (auto const& channel : (*simChannelHandle)) {
+  for (size_t isim = 0; isim < simChannels.size(); ++isim) {
 
     // .. get simChannel channel number
-    const raw::ChannelID_t ch1 = channel.Channel();
+    const raw::ChannelID_t ch1 = simChannels[isim].Channel();
     if (chStatus.IsBad(ch1)) continue;
 
     if (ch1 % 1000 == 0) mf::LogInfo("EvaluateROIEFF") << ch1;
     int view = geo->View(ch1);
-    auto const& timeSlices = channel.TDCIDEMap();
-
-    // time slice from simChannel is for individual tick
-    // group neighboring time slices into a "signal"
-    int tdctick_previous = -999;
-    double totalE = 0.;
-    double maxE = -999.;
-    int maxEtick = -999;
-    std::vector<int> signal_starttick;
-    std::vector<int> signal_endtick;
-    std::vector<double> signal_energydeposits;
-    std::vector<double> signal_energy_max;
-    std::vector<double> signal_max_tdctick;
-
-    for (auto const& timeSlice : timeSlices) {
-      auto const tpctime = timeSlice.first;
-      auto const& energyDeposits = timeSlice.second;
-      int tdctick = static_cast<int>(clockData.TPCTDC2Tick(double(tpctime)));
-      if (tdctick < 0 || tdctick > int(detProp.ReadOutWindowSize()) - 1) continue;
-
-      // for a time slice, there may exist more than one energy deposit.
-      double e_deposit = 0;
-      for (auto const& energyDeposit : energyDeposits) {
-        e_deposit += energyDeposit.energy;
-      }
 
-      if (tdctick_previous == -999) {
-        signal_starttick.push_back(tdctick);
-        totalE += e_deposit;
-        maxE = e_deposit;
-        maxEtick = tdctick;
-      }
-      else if (tdctick - tdctick_previous != 1) {
-        signal_starttick.push_back(tdctick);
-        signal_endtick.push_back(tdctick_previous);
-        signal_energydeposits.push_back(totalE);
-        signal_energy_max.push_back(maxE);
-        signal_max_tdctick.push_back(maxEtick);
-        totalE = e_deposit;
-        maxE = e_deposit;
-        maxEtick = tdctick;
-      }
-      else if (tdctick - tdctick_previous == 1) {
-        totalE += e_deposit;
-        if (maxE < e_deposit) {
-          maxE = e_deposit;
-          maxEtick = tdctick;
-        }
-      }
+    if (signals[isim].empty()) continue;
 
-      tdctick_previous = tdctick;
-
-    } // loop over timeSlices timeSlice
-
-    signal_endtick.push_back(tdctick_previous); // for last one
-    signal_energydeposits.push_back(totalE);    // for last one
-    signal_energy_max.push_back(maxE);          // for last one
-    signal_max_tdctick.push_back(maxEtick);     // for last one
-
-    if (signal_starttick.size() == 0 ||
-        (signal_endtick.size() == 1 && signal_endtick.back() == -999))
-      continue;
-
-    for (auto& wire : wires) {
-      if (wire->Channel() != ch1) continue;
-
-      const recob::Wire::RegionsOfInterest_t& signalROI = wire->SignalROI();
-
-      std::vector<float> vecADC =
-        wire->Signal(); // a zero-padded full length vector filled with RoI signal.
-
-      // loop over signals:
-      // a) if signal s is not in any ROI (including the case no ROI), fill h_energy 
-      //    with signal_energy_max[s];
-      // b) if signal s is in a ROI, check following signals that are also in this ROI,
-      //    then use the maximum of signal_energy_max to fill h_energy and h_energy_roi. 
-      //    After this, the loop will skip to the signal that is not in this ROI.
-      for (size_t s = 0; s < signal_starttick.size(); s++) {
-        // case a: signal is not in any ROI
-        bool IsSignalOutside = true;
-        for (const auto& range : signalROI.get_ranges()) {
-          //const auto& waveform = range.data();
-          raw::TDCtick_t roiFirstBinTick = range.begin_index();
-          raw::TDCtick_t roiLastBinTick = range.end_index();
-
-          if (isSignalInROI(signal_starttick[s],
-                            signal_endtick[s],
-                            signal_max_tdctick[s],
-                            roiFirstBinTick,
-                            roiLastBinTick)) {
-            IsSignalOutside = false;
-            break;
-          }
-        } // loop over range
-
-        if (IsSignalOutside) {
-          //cout << "This signal is not in any ROI: " << signal_starttick[s] << " -> " << signal_endtick[s] << endl;
-          h_energy[view]->Fill(signal_energy_max[s]);
-          h1_tickdiff_max[view]->Fill(-99);
-          continue;
-        }
-
-        // signal is in one ROI
-        for (const auto& range : signalROI.get_ranges()) {
-          //const auto& waveform = range.data();
-          raw::TDCtick_t roiFirstBinTick = range.begin_index();
-          raw::TDCtick_t roiLastBinTick = range.end_index();
-
-          if (isSignalInROI(signal_starttick[s],
-                            signal_endtick[s],
-                            signal_max_tdctick[s],
-                            roiFirstBinTick,
-                            roiLastBinTick)) {
-            // maximum pulse height and postion for this ROI
-            double maxadc_sig = 0;
-            int maxadc_tick = -99;
-            for (int k = roiFirstBinTick; k < roiLastBinTick; k++) {
-              if (vecADC[k] > maxadc_sig) {
-                maxadc_sig = vecADC[k];
-                maxadc_tick = k;
-              }
-            }
-
-            double maxE_roi = -999.;
-            double maxE_roi_tick = -999.;
-
-            if (maxE_roi < signal_energy_max[s]) {
-              maxE_roi = signal_energy_max[s];
-              maxE_roi_tick = signal_max_tdctick[s];
-            }
-
-            // check the following signals in the same ROI
-            for (size_t s2 = s + 1; s2 < signal_starttick.size(); s2++) {
-              if (isSignalInROI(signal_starttick[s2],
-                                signal_endtick[s2],
-                                signal_max_tdctick[s2],
-                                roiFirstBinTick,
-                                roiLastBinTick)) {
-                if (maxE_roi < signal_energy_max[s2]) {
-                  maxE_roi = signal_energy_max[s2];
-                  maxE_roi_tick = signal_max_tdctick[s2];
-                }
-                if (s2 == signal_starttick.size() - 1) { s = s2; }
-              }
-              else {
-                s = s2 - 1;
-                break;
-              }
-            } // loop over s2
-
-            // finish this ROI
-            h_energy[view]->Fill(maxE_roi);
-            h_energy_roi[view]->Fill(maxE_roi);
-            h1_tickdiff_max[view]->Fill(maxE_roi_tick - maxadc_tick);
-            break;
-          } // isSignalInROI
-        }   // loop over range
-
-      } // loop over signals s
-    }   // loop over wires wire
-  }     // loop simChannels
+    auto chWires = channelWires(ch1);
+    for (auto iw = chWires.first; iw != chWires.second; ++iw) {
+      for (auto const& fill : results[iw->second].signals) {
+        if (fill.sim != isim) continue;
+        h_energy[view]->Fill(fill.energy);
+        if (fill.inROI) { h_energy_roi[view]->Fill(fill.energy); }
+        h1_tickdiff_max[view]->Fill(fill.tickdiff);
+      }
+    } // loop over wires wire
+  }   // loop simChannels
 
   // purity: # signals in ROI / (#signals in ROI + #non-signals in ROI). Because we only consider the maximum signal in the ROI, this is quivalent to purity of ( number of ROIs with signal / number of ROIs)
   double roi_sig[3] = {0., 0., 0.};   // number of roi contains signal in an event
   double roi_total[3] = {0., 0., 0.}; // number of roi in an event
 
-  for (auto& wire : wires) {
-    const raw::ChannelID_t wirechannel = wire->Channel();
-    if (chStatus.IsBad(wirechannel)) continue;
-
-    int view = wire->View();
-
-    const recob::Wire::RegionsOfInterest_t& signalROI = wire->SignalROI();
+  for (size_t iw = 0; iw < wires.size(); ++iw) {
+    if (wireBad[iw]) continue;
 
-    if (signalROI.get_ranges().empty()) continue;
+    int view = wires[iw]->View();
 
-    std::vector<float> vecADC =
-      wire->Signal(); // a zero-padded full length vector filled with RoI signal.
+    auto const& result = results[iw];
+    const size_t nroi = result.roi_max.size();
+    if (!nroi) continue;
 
-    roi_total[view] += signalROI.get_ranges().size();
-    fCount_Roi_total[view] += signalROI.get_ranges().size();
+    roi_total[view] += nroi;
+    fCount_Roi_total[view] += nroi;
 
-    for (const auto& range : signalROI.get_ranges()) {
-      bool IsSigROI = false;
-
-      raw::TDCtick_t roiFirstBinTick = range.begin_index();
-      raw::TDCtick_t roiLastBinTick = range.end_index();
-
-      double maxadc_sig = -99.;
-      for (int k = roiFirstBinTick; k < roiLastBinTick; k++) {
-        if (std::abs(vecADC[k]) > maxadc_sig) maxadc_sig = std::abs(vecADC[k]);
-      }
-      h1_roi_max[view]->Fill(maxadc_sig);
-
-      // check simulation: ideally we could put this part outside loop over range to make the algorithm more efficient. However, as there are only one or two ROIs in a channel for most of cases, we keep this style to make the algorithm more readable. Also, signal information are kept here.
-      for (auto const& channel : (*simChannelHandle)) {
-        if (wirechannel != channel.Channel()) continue;
-
-        int tdctick_previous = -999;
-        double totalE = 0.;
-        double maxE = -999.;
-        int maxEtick = -999;
-        std::vector<int> signal_starttick;
-        std::vector<int> signal_endtick;
-        std::vector<double> signal_energydeposits;
-        std::vector<double> signal_energy_max;
-        std::vector<double> signal_max_tdctick;
-
-        auto const& timeSlices = channel.TDCIDEMap();
-
-        for (auto const& timeSlice : timeSlices) {
-          auto const tpctime = timeSlice.first;
-          auto const& energyDeposits = timeSlice.second;
-          int tdctick = static_cast<int>(clockData.TPCTDC2Tick(double(tpctime)));
-          if (tdctick < 0 || tdctick > int(detProp.ReadOutWindowSize()) - 1) continue;
-
-          double e_deposit = 0;
-          for (auto const& energyDeposit : energyDeposits) {
-            e_deposit += energyDeposit.energy;
-          }
-
-          if (tdctick_previous == -999) {
-            signal_starttick.push_back(tdctick);
-            totalE += e_deposit;
-            maxE = e_deposit;
-            maxEtick = tdctick;
-          }
-          else if (tdctick - tdctick_previous != 1) {
-            signal_starttick.push_back(tdctick);
-            signal_endtick.push_back(tdctick_previous);
-            signal_energydeposits.push_back(totalE);
-            signal_energy_max.push_back(maxE);
-            signal_max_tdctick.push_back(maxEtick);
-            totalE = e_deposit;
-            maxE = e_deposit;
-            maxEtick = tdctick;
-          }
-          else if (tdctick - tdctick_previous == 1) {
-            totalE += e_deposit;
-            if (maxE < e_deposit) {
-              maxE = e_deposit;
-              maxEtick = tdctick;
-            }
-          }
-
-          tdctick_previous = tdctick;
-
-        } // loop over timeSlices timeSlice
-
-        signal_endtick.push_back(tdctick_previous); // for last one
-        signal_energydeposits.push_back(totalE);    // for last one
-        signal_energy_max.push_back(maxE);          // for last one
-        signal_max_tdctick.push_back(maxEtick);     // for last one
-
-        if (signal_starttick.size() == 0 ||
-            (signal_endtick.size() == 1 && signal_endtick.back() == -999))
-          continue;
-
-        // check if signal/signals in this ROI
-        for (size_t s = 0; s < signal_starttick.size(); s++) {
-          if (isSignalInROI(signal_starttick[s],
-                            signal_endtick[s],
-                            signal_max_tdctick[s],
-                            roiFirstBinTick,
-                            roiLastBinTick)) {
-            IsSigROI = true;
-            break;
-          }
-        } // loop over s
-      }   // loop simChannels
+    for (size_t r = 0; r < nroi; ++r) {
+      h1_roi_max[view]->Fill(result.roi_max[r]);
 
       h_roi[view]->Fill(0); // total roi
-      if (IsSigROI) {
+      if (result.roi_sig[r]) {
         roi_sig[view] += 1.;
         fCount_Roi_sig[view] += 1;
         h_roi[view]->Fill(1); // sig roi
-        h1_roi_max_sim[view]->Fill(maxadc_sig);
+        h1_roi_max_sim[view]->Fill(result.roi_max[r]);
       }
     } // loop ranges of signalROI
   }   // loop wires
@@ -0,0 +1,392 @@
+////////////////////////////////////////////////////////////////////////////////
+// Class:       ParticleDecayIdTl
+// Module Type: producer
+// File:        ParticleDecayIdTl_module.cc
+// Authors:     dorota.stefan@cern.ch pplonski86@gmail.com robert.sulej@cern.ch
+//              tool interface ver
+// Hits of all tracks are classified once per event: grouped by cryo/tpc/view,
+// the view is prepared once per group and PointIdAlg tool is applied in batches.
+//
+// THIS IS STIIL DEVELOPMENT NOW - CODE MAKING VERTICES MAY STILL CHANGE STRATEGY
+//
+/////////////////////////////////////////////////////////////////////////////////
+
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/IPointIdAlg.h"
+#include "larrecodnn/ImagePatternAlgs/Modules/SpatialHash.h"
+#include "lardata/DetectorInfoServices/DetectorClocksService.h"
+#include "lardata/DetectorInfoServices/DetectorPropertiesService.h"
+#include "lardataobj/RecoBase/Hit.h"
+#include "lardataobj/RecoBase/SpacePoint.h"
+#include "lardataobj/RecoBase/Track.h"
+#include "lardataobj/RecoBase/Vertex.h"
+#include "lardataobj/RecoBase/Wire.h"
+
+#include "art/Framework/Core/EDProducer.h"
+#include "art/Framework/Core/ModuleMacros.h"
+#include "art/Framework/Principal/Event.h"
+#include "art/Framework/Principal/Handle.h"
+#include "art/Framework/Services/Registry/ServiceHandle.h"
+#include "art/Utilities/make_tool.h"
+#include "canvas/Persistency/Common/Assns.h"
+#include "canvas/Persistency/Common/FindManyP.h"
+#include "canvas/Persistency/Common/Ptr.h"
+#include "canvas/Utilities/InputTag.h"
+#include "messagefacility/MessageLogger/MessageLogger.h"
+#include "fhiclcpp/types/Atom.h"
+#include "fhiclcpp/types/Comment.h"
+#include "fhiclcpp/types/Name.h"
+#include "fhiclcpp/types/Table.h"
+#include "cetlib_except/exception.h"
+
+#include <TVector3.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace nnet {
+
+  class ParticleDecayIdTl : public art::EDProducer {
+  public:
+    struct Config {
+      using Name = fhicl::Name;
+      using Comment = fhicl::Comment;
+
+      fhicl::Table<PointIdAlgTools::IPointIdAlg::Config> PointIdAlg{Name("PointIdAlg")};
+
+      fhicl::Atom<size_t> BatchSize{Name("BatchSize"),
+                                    Comment("number of samples processed in one batch"),
+                                    256};
+
+      fhicl::Atom<art::InputTag> WireLabel{
+        Name("WireLabel"),
+        Comment("tag of deconvoluted ADC on wires (recob::Wire)")};
+
+      fhicl::Atom<art::InputTag> TrackModuleLabel{
+        Name("TrackModuleLabel"),
+        Comment("tag of tracks where decays points are to be found")};
+
+      fhicl::Atom<double> RoiThreshold{
+        Name("RoiThreshold"),
+        Comment("search for decay points where the net output > ROI threshold")};
+
+      fhicl::Atom<double> PointThreshold{
+        Name("PointThreshold"),
+        Comment("tag decay point if it is detected in at least two planes with net outputs product "
+                "> POINT threshold")};
+
+      fhicl::Atom<int> SkipView{Name("SkipView"),
+                                Comment("use all views to find decays if -1, or skip the view with "
+                                        "provided index and use only the two other views")};
+    };
+    using Parameters = art::EDProducer::Table<Config>;
+    explicit ParticleDecayIdTl(Parameters const& p);
+
+    ParticleDecayIdTl(ParticleDecayIdTl const&) = delete;
+    ParticleDecayIdTl(ParticleDecayIdTl&&) = delete;
+    ParticleDecayIdTl& operator=(ParticleDecayIdTl const&) = delete;
+    ParticleDecayIdTl& operator=(ParticleDecayIdTl&&) = delete;
+
+  private:
+    using key = std::tuple<unsigned int, unsigned int, unsigned int>; // cryo, tpc, view
+    using hit_scores = std::map<art::Ptr<recob::Hit>, float>;         // p(decay) of hits
+
+    void produce(art::Event& e) override;
+
+    void classifyHits(detinfo::DetectorClocksData const& clockData,
+                      detinfo::DetectorPropertiesData const& detProp,
+                      const std::vector<recob::Wire>& wires,
+                      const std::vector<art::Ptr<recob::Hit>>& hits,
+                      hit_scores& scores);
+
+    bool DetectDecay(const std::vector<art::Ptr<recob::Hit>>& hits,
+                     hit_scores const& scores,
+                     std::map<size_t, TVector3>& spoints,
+                     std::vector<std::pair<TVector3, double>>& result);
+
+    std::unique_ptr<PointIdAlgTools::IPointIdAlg> fPointIdAlgTool;
+    size_t fBatchSize;
+
+    art::InputTag fWireProducerLabel;
+    art::InputTag fTrackModuleLabel;
+
+    double fRoiThreshold, fPointThreshold;
+
+    int fSkipView;
+  };
+  // ------------------------------------------------------
+
+  ParticleDecayIdTl::ParticleDecayIdTl(ParticleDecayIdTl::Parameters const& config)
+    : EDProducer{config}
+    , fPointIdAlgTool(
+        art::make_tool<PointIdAlgTools::IPointIdAlg>(config().PointIdAlg.get_PSet()))
+    , fBatchSize(std::max<size_t>(1, config().BatchSize()))
+    , fWireProducerLabel(config().WireLabel())
+    , fTrackModuleLabel(config().TrackModuleLabel())
+    , fRoiThreshold(config().RoiThreshold())
+    , fPointThreshold(config().PointThreshold())
+    , fSkipView(config().SkipView())
+  {
+    produces<std::vector<recob::Vertex>>();
+    produces<art::Assns<recob::Vertex, recob::Track>>();
+  }
+  // ------------------------------------------------------
+
+  void
+  ParticleDecayIdTl::produce(art::Event& evt)
+  {
+    mf::LogVerbatim("ParticleDecayId") << "next event: " << evt.run() << " / " << evt.id().event();
+
+    auto vtxs = std::make_unique<std::vector<recob::Vertex>>();
+    auto vtx2trk = std::make_unique<art::Assns<recob::Vertex, recob::Track>>();
+
+    auto wireHandle = evt.getValidHandle<std::vector<recob::Wire>>(fWireProducerLabel);
+    auto trkListHandle = evt.getValidHandle<std::vector<recob::Track>>(fTrackModuleLabel);
+    auto spListHandle = evt.getValidHandle<std::vector<recob::SpacePoint>>(fTrackModuleLabel);
+
+    art::FindManyP<recob::Hit> hitsFromTracks(trkListHandle, evt, fTrackModuleLabel);
+    art::FindManyP<recob::SpacePoint> spFromTracks(trkListHandle, evt, fTrackModuleLabel);
+    art::FindManyP<recob::Hit> hitsFromSPoints(spListHandle, evt, fTrackModuleLabel);
+
+    auto const clockData = art::ServiceHandle<detinfo::DetectorClocksService const>()->DataFor(evt);
+    auto const detProp =
+      art::ServiceHandle<detinfo::DetectorPropertiesService const>()->DataFor(evt, clockData);
+
+    // nn outputs for hits of all tracks, each TPC/view prepared once
+    std::vector<art::Ptr<recob::Hit>> allHits;
+    for (size_t i = 0; i < hitsFromTracks.size(); ++i) {
+      auto const& hits = hitsFromTracks.at(i);
+      allHits.insert(allHits.end(), hits.begin(), hits.end());
+    }
+    hit_scores scores;
+    classifyHits(clockData, detProp, *wireHandle, allHits, scores);
+
+    std::vector<std::pair<TVector3, double>> decays;
+    for (size_t i = 0; i < hitsFromTracks.size(); ++i) {
+      auto hits = hitsFromTracks.at(i);
+      auto spoints = spFromTracks.at(i);
+      if (hits.empty()) continue;
+
+      std::map<size_t, TVector3> trkSpacePoints;
+      for (const auto& p : spoints) {
+        auto sp_hits = hitsFromSPoints.at(p.key());
+        for (const auto& h : sp_hits) {
+          trkSpacePoints[h.key()] = TVector3(p->XYZ()[0], p->XYZ()[1], p->XYZ()[2]);
+        }
+      }
+
+      DetectDecay(hits, scores, trkSpacePoints, decays);
+    }
+
+    double xyz[3];
+    for (const auto& p3d : decays) {
+
+      xyz[0] = p3d.first.X();
+      xyz[1] = p3d.first.Y();
+      xyz[2] = p3d.first.Z();
+      mf::LogVerbatim("ParticleDecayId") << "   detected: [" << xyz[0] << ", " << xyz[1] << ", "
+                                         << xyz[2] << "] p:" << p3d.second;
+
+      size_t vidx = vtxs->size();
+      vtxs->push_back(recob::Vertex(xyz, vidx));
+
+      // to do: assn to eg. appropriate track
+      // selected among set of connected tracks
+    }
+
+    evt.put(std::move(vtxs));
+    evt.put(std::move(vtx2trk));
+  }
+  // ------------------------------------------------------
+
+  void
+  ParticleDecayIdTl::classifyHits(detinfo::DetectorClocksData const& clockData,
+                                  detinfo::DetectorPropertiesData const& detProp,
+                                  const std::vector<recob::Wire>& wires,
+                                  const std::vector<art::Ptr<recob::Hit>>& hits,
+                                  hit_scores& scores)
+  {
+    std::map<key, std::vector<art::Ptr<recob::Hit>>> hitMap; // hits shared by tracks added once
+    for (auto const& h : hits) {
+      unsigned int view = h->WireID().Plane;
+      if ((fSkipView >= 0) && (view == (unsigned int)fSkipView)) continue;
+
+      if (scores.emplace(h, 0).second) {
+        hitMap[{h->WireID().Cryostat, h->WireID().TPC, view}].push_back(h);
+      }
+    }
+
+    auto& tool = *fPointIdAlgTool;
+    for (auto const& [k, group] : hitMap) {
+      auto const& [cryo, tpc, view] = k;
+      tool.setWireDriftData(clockData, detProp, wires, view, tpc, cryo);
+
+      // hits sharing the same patch are classified once
+      std::vector<std::pair<unsigned int, float>> points;
+      std::vector<std::vector<art::Ptr<recob::Hit>>> patchHits;
+      std::unordered_map<uint64_t, size_t> patchIdx;
+      for (auto const& h : group) {
+        unsigned int wire = h->WireID().Wire;
+        float drift = h->PeakTime();
+        auto [it, added] = patchIdx.emplace(tool.patchKey(wire, drift), points.size());
+        if (added) {
+          points.emplace_back(wire, drift);
+          patchHits.emplace_back();
+        }
+        patchHits[it->second].push_back(h);
+      }
+
+      // next batch is prepared while the previous one is processed by asynchronous back-ends
+      std::deque<std::pair<size_t, size_t>> inflight; // first patch and size of submitted batches
+      auto collect = [&]() {
+        auto [first, size] = inflight.front();
+        inflight.pop_front();
+        auto batch_out = tool.collectIdVectors();
+        if (batch_out.size() != size) {
+          throw cet::exception("ParticleDecayId") << "Problem with applying model to input.";
+        }
+        for (size_t i = 0; i < batch_out.size(); ++i) {
+          if (batch_out[i].empty()) {
+            throw cet::exception("ParticleDecayId") << "Problem with applying model to input.";
+          }
+          for (auto const& h : patchHits[first + i]) {
+            scores[h] = batch_out[i][0]; // p(decay)
+          }
+        }
+      };
+      for (size_t idx = 0; idx < points.size(); idx += fBatchSize) {
+        std::vector<std::pair<unsigned int, float>> batch_points(
+          points.begin() + idx, points.begin() + std::min(points.size(), idx + fBatchSize));
+
+        if (inflight.size() == 2) { collect(); }
+        tool.submitIdVectors(batch_points);
+        inflight.emplace_back(idx, batch_points.size());
+      }
+      while (!inflight.empty()) {
+        collect();
+      }
+    }
+  }
+  // ------------------------------------------------------
+
+  bool
+  ParticleDecayIdTl::DetectDecay(const std::vector<art::Ptr<recob::Hit>>& hits,
+                                 hit_scores const& scores,
+                                 std::map<size_t, TVector3>& spoints,
+                                 std::vector<std::pair<TVector3, double>>& result)
+  {
+    const size_t nviews = 3;
+
+    std::vector<art::Ptr<recob::Hit>> wire_drift[nviews];
+    std::vector<float> outputs[nviews];
+    for (size_t i = 0; i < hits.size(); ++i) // split classified hits between views
+    {
+      size_t v = hits[i]->WireID().Plane;
+      auto s = scores.find(hits[i]);
+      if ((v >= nviews) || (s == scores.end())) continue;
+
+      wire_drift[v].push_back(hits[i]);
+      outputs[v].push_back(s->second);
+    }
+
+    std::vector<std::pair<size_t, float>> candidates2d[nviews];
+    std::vector<std::pair<TVector3, float>> candidates3d[nviews];
+    for (size_t v = 0; v < nviews; ++v) {
+      size_t idx = 0;
+      while (idx < outputs[v].size()) {
+        if (outputs[v][idx] > fRoiThreshold) {
+          size_t ci = idx;
+          float max = outputs[v][idx];
+          ++idx;
+
+          while ((idx < outputs[v].size()) && (outputs[v][idx] > fRoiThreshold)) {
+            if (outputs[v][idx] > max) {
+              max = outputs[v][idx];
+              ci = idx;
+            }
+            ++idx;
+          }
+          candidates2d[v].emplace_back(ci, max);
+          candidates3d[v].emplace_back(spoints[wire_drift[v][ci].key()], max);
+        }
+        else
+          ++idx;
+      }
+    }
+
+    double min_dist =
+      2.0; // [cm], threshold for today to distinguish between two different candidates,
+           // if belo threshold, then use 3D point corresponding to higher cnn output
+
+    // candidates of each view are hashed in cells of min_dist size, so coincidences
+    // are found with radius queries instead of comparing all pairs of candidates
+    std::vector<SpatialHash> candidateHash(nviews, SpatialHash(min_dist));
+    std::vector<TVector3> candidatePoints[nviews];
+    for (size_t v = 0; v < nviews; ++v) {
+      for (auto const& c : candidates3d[v]) {
+        candidatePoints[v].push_back(c.first);
+      }
+      candidateHash[v].insert(candidatePoints[v]);
+    }
+
+    // need coincidence of high cnn out in two views, then look if there is another close candidate
+    // and again select by cnn output value, would like to have few strong candidates
+    bool found = false;
+    for (size_t v = 0; v < nviews - 1; ++v) {
+      std::vector<std::vector<std::vector<size_t>>> close(nviews); // [u][i] -> close in view u
+      for (size_t u = v + 1; u < nviews; ++u) {
+        close[u] = candidateHash[u].query(candidatePoints[v], min_dist);
+      }
+
+      for (size_t i = 0; i < candidates3d[v].size(); ++i) {
+        TVector3 c0(candidates3d[v][i].first);
+        float p0 = candidates3d[v][i].second;
+
+        for (size_t u = v + 1; u < nviews; ++u) {
+          for (size_t j : close[u][i]) {
+            TVector3 c1(candidates3d[u][j].first);
+            float p1 = candidates3d[u][j].second;
+
+            TVector3 c(c0);
+            if (p1 > p0) { c = c1; }
+            double p = p0 * p1;
+
+            if (p > fPointThreshold) {
+              double d, dmin = min_dist;
+              size_t kmin = 0;
+              for (size_t k = 0; k < result.size(); ++k) {
+                d = (result[k].first - c).Mag();
+                if (d < dmin) {
+                  dmin = d;
+                  kmin = k;
+                }
+              }
+              if (dmin < min_dist) {
+                if (result[kmin].second < p) // replace previously found point
+                {
+                  result[kmin].first = c;
+                  result[kmin].second = p;
+                  found = true;
+                }
+              }
+              else // nothing close in the list, add new point
+              {
+                result.emplace_back(c, p);
+                found = true;
+              }
+            } // if (p > fPointThreshold)
+          }   // loop over points in view u close to c0
+        }     // loop over views u
+      }       // loop over points in view v
+    }         // loop over views v
+    return found;
+  }
+
+  DEFINE_ART_MODULE(ParticleDecayIdTl)
+
+}
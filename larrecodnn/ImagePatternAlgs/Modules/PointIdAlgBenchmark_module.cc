@@ -0,0 +1,454 @@
+////////////////////////////////////////////////////////////////////////
+// Class:       PointIdAlgBenchmark
+// Module Type: analyzer
+// File:        PointIdAlgBenchmark_module.cc
+//
+// Inference throughput of any IPointIdAlg tool (Tf, Keras, Triton,
+// SonicTriton,...) configured in FHiCL: batches of synthetic patches,
+// or of patches recorded at hit positions in the input events, are
+// processed with each of the configured batch sizes and thread counts.
+// Results (patches/s, batch latency percentiles, time split, memory)
+// are written to a JSON file at the end of the job.
+//
+// Memory: rss_mb is the resident size (/proc/self/statm) at the end of
+// a configuration, rss_delta_mb its change during that configuration;
+// process_peak_rss_mb is the process high-water mark (getrusage), so it
+// is cumulative over all configurations run so far.
+//
+// Time split: buffering is cutting patches from the wire data (recorded
+// patches only), marshalling is copying patches into the input layout
+// passed to the tool, inference is the tool Run() call (including any
+// conversion and transfer done by the back-end).
+////////////////////////////////////////////////////////////////////////
+
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/IPointIdAlg.h"
+
+#include "lardata/DetectorInfoServices/DetectorClocksService.h"
+#include "lardata/DetectorInfoServices/DetectorPropertiesService.h"
+#include "lardataobj/RecoBase/Hit.h"
+#include "lardataobj/RecoBase/Wire.h"
+
+#include "art/Framework/Core/EDAnalyzer.h"
+#include "art/Framework/Core/ModuleMacros.h"
+#include "art/Framework/Principal/Event.h"
+#include "art/Framework/Services/Registry/ServiceHandle.h"
+#include "art/Utilities/make_tool.h"
+#include "canvas/Utilities/InputTag.h"
+#include "messagefacility/MessageLogger/MessageLogger.h"
+#include "fhiclcpp/types/Atom.h"
+#include "fhiclcpp/types/Comment.h"
+#include "fhiclcpp/types/Name.h"
+#include "fhiclcpp/types/Sequence.h"
+#include "fhiclcpp/types/Table.h"
+#include "cetlib_except/exception.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace nnet {
+
+  class PointIdAlgBenchmark : public art::EDAnalyzer {
+  public:
+    struct Config {
+      using Name = fhicl::Name;
+      using Comment = fhicl::Comment;
+
+      fhicl::Table<PointIdAlgTools::IPointIdAlg::Config> PointIdAlg{
+        Name("PointIdAlg"),
+        Comment("Tool to benchmark, tool_type selects the back-end")};
+
+      fhicl::Atom<art::InputTag> WireLabel{
+        Name("WireLabel"),
+        Comment("Wires to record patches from, empty: synthetic patches"),
+        ""};
+
+      fhicl::Atom<art::InputTag> HitModuleLabel{
+        Name("HitModuleLabel"),
+        Comment("Patches are recorded at positions of these hits"),
+        "linecluster"};
+
+      fhicl::Atom<unsigned int> PoolSize{
+        Name("PoolSize"),
+        Comment("Number of distinct patches (synthetic, or max recorded)"),
+        4096};
+
+      fhicl::Atom<unsigned int> NPatches{
+        Name("NPatches"),
+        Comment("Patches processed in each configuration"),
+        20000};
+
+      fhicl::Atom<unsigned int> WarmupBatches{
+        Name("WarmupBatches"),
+        Comment("Batches run by each tool before measuring"),
+        2};
+
+      fhicl::Sequence<unsigned int> BatchSizes{
+        Name("BatchSizes"),
+        Comment("Batch sizes to measure"),
+        std::vector<unsigned int>{1, 16, 64, 256, 1024}};
+
+      fhicl::Sequence<unsigned int> ThreadCounts{
+        Name("ThreadCounts"),
+        Comment("Numbers of concurrent threads, each with its own tool instance"),
+        std::vector<unsigned int>{1}};
+
+      fhicl::Atom<bool> NestedInput{
+        Name("NestedInput"),
+        Comment("Pass batches as nested vectors instead of the contiguous block"),
+        false};
+
+      fhicl::Atom<unsigned int> Seed{Name("Seed"), Comment("Seed of synthetic patches"), 12345};
+
+      fhicl::Atom<std::string> OutputFile{
+        Name("OutputFile"),
+        Comment("JSON file with the results"),
+        "pointidalg_benchmark.json"};
+    };
+    using Parameters = art::EDAnalyzer::Table<Config>;
+
+    explicit PointIdAlgBenchmark(Parameters const& config);
+
+    PointIdAlgBenchmark(PointIdAlgBenchmark const&) = delete;
+    PointIdAlgBenchmark(PointIdAlgBenchmark&&) = delete;
+    PointIdAlgBenchmark& operator=(PointIdAlgBenchmark const&) = delete;
+    PointIdAlgBenchmark& operator=(PointIdAlgBenchmark&&) = delete;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Result {
+      size_t batchSize, threads, patches;
+      double wall, marshal, infer;  // [s], marshal and infer summed over threads
+      double meanLatency, p50Latency, p99Latency; // [ms] per batch
+      double rssMB, rssDeltaMB; // current RSS after the run, and its change during the run
+      double processPeakRssMB;  // high-water mark of the process since start, cumulative
+    };
+
+    void analyze(art::Event const& e) override;
+    void endJob() override;
+
+    void makeSyntheticPool();
+    Result measure(size_t batchSize, size_t nThreads);
+    void writeJson(std::vector<Result> const& results) const;
+
+    static double
+    seconds(Clock::duration d)
+    {
+      return std::chrono::duration<double>(d).count();
+    }
+    static double currentRssMB();
+    static double processPeakRssMB();
+
+    std::vector<std::unique_ptr<PointIdAlgTools::IPointIdAlg>> fTools; // one per thread
+    std::string fToolType;
+    size_t fPatchSize;
+    size_t fPatchSizeW, fPatchSizeD;
+
+    PointIdAlgTools::PatchBatch fPool; // patches used in turn by all batches
+    size_t fNPool = 0;
+
+    // recorded patches
+    size_t fNEvents = 0;
+    double fViewSetupTime = 0, fBufferingTime = 0;
+
+    art::InputTag fWireLabel;
+    art::InputTag fHitModuleLabel;
+    size_t fPoolSize;
+    size_t fNPatches;
+    size_t fWarmupBatches;
+    std::vector<unsigned int> fBatchSizes;
+    std::vector<unsigned int> fThreadCounts;
+    bool fNestedInput;
+    unsigned int fSeed;
+    std::string fOutputFile;
+  };
+
+} // namespace nnet
+
+nnet::PointIdAlgBenchmark::PointIdAlgBenchmark(nnet::PointIdAlgBenchmark::Parameters const& config)
+  : art::EDAnalyzer(config)
+  , fPatchSizeW(config().PointIdAlg().PatchSizeW())
+  , fPatchSizeD(config().PointIdAlg().PatchSizeD())
+  , fWireLabel(config().WireLabel())
+  , fHitModuleLabel(config().HitModuleLabel())
+  , fPoolSize(std::max(1u, config().PoolSize()))
+  , fNPatches(config().NPatches())
+  , fWarmupBatches(config().WarmupBatches())
+  , fBatchSizes(config().BatchSizes())
+  , fThreadCounts(config().ThreadCounts())
+  , fNestedInput(config().NestedInput())
+  , fSeed(config().Seed())
+  , fOutputFile(config().OutputFile())
+{
+  fPatchSize = fPatchSizeW * fPatchSizeD;
+  if (!config().PointIdAlg().ToolType(fToolType)) { fToolType = "unknown"; }
+
+  unsigned int maxThreads = 1;
+  for (auto t : fThreadCounts) {
+    maxThreads = std::max(maxThreads, t);
+  }
+  for (unsigned int i = 0; i < maxThreads; ++i) {
+    fTools.push_back(
+      art::make_tool<PointIdAlgTools::IPointIdAlg>(config().PointIdAlg.get_PSet()));
+  }
+
+  fPool.resize(fPoolSize * fPatchSize);
+  if (fWireLabel.label().empty()) { makeSyntheticPool(); }
+}
+
+void
+nnet::PointIdAlgBenchmark::makeSyntheticPool()
+{
+  // noise around zero with sparse, exponentially distributed signal, roughly like deconvoluted ADC
+  std::mt19937 gen(fSeed);
+  std::normal_distribution<float> noise(0.F, 1.F);
+  std::exponential_distribution<float> signal(0.05F);
+  std::uniform_real_distribution<float> flat(0.F, 1.F);
+  for (auto& v : fPool) {
+    v = noise(gen) + ((flat(gen) < 0.05F) ? signal(gen) : 0.F);
+  }
+  fNPool = fPoolSize;
+}
+
+void
+nnet::PointIdAlgBenchmark::analyze(art::Event const& e)
+{
+  if (fWireLabel.label().empty() || (fNPool == fPoolSize)) { return; }
+
+  auto const clockData = art::ServiceHandle<detinfo::DetectorClocksService const>()->DataFor(e);
+  auto const detProp =
+    art::ServiceHandle<detinfo::DetectorPropertiesService const>()->DataFor(e, clockData);
+
+  auto const& wires = *e.getValidHandle<std::vector<recob::Wire>>(fWireLabel);
+  auto const& hits = *e.getValidHandle<std::vector<recob::Hit>>(fHitModuleLabel);
+
+  std::map<std::tuple<unsigned int, unsigned int, unsigned int>,
+           std::vector<std::pair<unsigned int, float>>>
+    points;
+  for (auto const& hit : hits) {
+    auto const& wid = hit.WireID();
+    points[std::make_tuple(wid.Cryostat, wid.TPC, wid.Plane)].emplace_back(wid.Wire, hit.PeakTime());
+  }
+
+  auto& tool = *fTools.front();
+  PointIdAlgTools::PatchBatch batch;
+  for (auto& [view, pts] : points) {
+    if (fNPool == fPoolSize) { break; }
+    auto [cryo, tpc, plane] = view;
+
+    auto t0 = Clock::now();
+    if (!tool.setWireDriftData(clockData, detProp, wires, plane, tpc, cryo)) { continue; }
+    auto t1 = Clock::now();
+    fViewSetupTime += seconds(t1 - t0);
+
+    pts.resize(std::min(pts.size(), fPoolSize - fNPool));
+    tool.bufferPatches(pts, batch);
+    fBufferingTime += seconds(Clock::now() - t1);
+
+    std::copy_n(batch.begin(), pts.size() * fPatchSize, fPool.begin() + fNPool * fPatchSize);
+    fNPool += pts.size();
+  }
+  ++fNEvents;
+}
+
+double
+nnet::PointIdAlgBenchmark::currentRssMB()
+{
+  std::ifstream statm("/proc/self/statm");
+  size_t total = 0, resident = 0;
+  if (!(statm >> total >> resident)) { return 0; }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024.0) / 1024.0;
+}
+
+double
+nnet::PointIdAlgBenchmark::processPeakRssMB()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0; // kB on Linux
+}
+
+nnet::PointIdAlgBenchmark::Result
+nnet::PointIdAlgBenchmark::measure(size_t batchSize, size_t nThreads)
+{
+  struct Worker {
+    PointIdAlgTools::PatchBatch batch;
+    std::vector<std::vector<std::vector<float>>> nested;
+    std::vector<double> latency; // [s]
+    double marshal = 0, infer = 0;
+    size_t patches = 0;
+    std::exception_ptr error;
+  };
+
+  // batch k takes pool patches from k * batchSize on, wrapping around
+  auto runBatch = [&](PointIdAlgTools::IPointIdAlg const& tool, Worker& w, size_t k) {
+    auto t0 = Clock::now();
+    size_t first = (k * batchSize) % fNPool;
+    for (size_t i = 0; i < batchSize; ++i) {
+      auto src = fPool.begin() + ((first + i) % fNPool) * fPatchSize;
+      if (fNestedInput) {
+        for (size_t iw = 0; iw < fPatchSizeW; ++iw) {
+          std::copy_n(src + iw * fPatchSizeD, fPatchSizeD, w.nested[i][iw].begin());
+        }
+      }
+      else {
+        std::copy_n(src, fPatchSize, w.batch.begin() + i * fPatchSize);
+      }
+    }
+    auto t1 = Clock::now();
+    auto out = fNestedInput ? tool.Run(w.nested, batchSize) : tool.Run(w.batch.data(), batchSize);
+    auto t2 = Clock::now();
+    if (out.size() != batchSize) {
+      throw cet::exception("PointIdAlgBenchmark")
+        << "tool returned " << out.size() << " outputs for " << batchSize << " inputs" << std::endl;
+    }
+    w.marshal += seconds(t1 - t0);
+    w.infer += seconds(t2 - t1);
+    w.latency.push_back(seconds(t2 - t0));
+    w.patches += batchSize;
+  };
+
+  const double rssBefore = currentRssMB();
+  std::vector<Worker> workers(nThreads);
+  for (size_t t = 0; t < nThreads; ++t) {
+    auto& w = workers[t];
+    if (fNestedInput) {
+      w.nested.assign(batchSize,
+                      std::vector<std::vector<float>>(fPatchSizeW, std::vector<float>(fPatchSizeD)));
+    }
+    else {
+      w.batch.resize(batchSize * fPatchSize);
+    }
+    for (size_t k = 0; k < fWarmupBatches; ++k) {
+      runBatch(*fTools[t], w, k);
+    }
+    w.latency.clear();
+    w.marshal = w.infer = 0;
+    w.patches = 0;
+  }
+
+  // batches are taken from a common counter, so faster threads do more of them
+  const size_t nBatches = std::max(nThreads, (fNPatches + batchSize - 1) / batchSize);
+  std::atomic<size_t> next{0};
+  auto work = [&](size_t t) {
+    try {
+      for (size_t k = next++; k < nBatches; k = next++) {
+        runBatch(*fTools[t], workers[t], k);
+      }
+    }
+    catch (...) {
+      workers[t].error = std::current_exception();
+    }
+  };
+
+  auto start = Clock::now();
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < nThreads; ++t) {
+    threads.emplace_back(work, t);
+  }
+  work(0);
+  for (auto& th : threads) {
+    th.join();
+  }
+  double wall = seconds(Clock::now() - start);
+
+  const double rssAfter = currentRssMB(); // worker buffers are still allocated
+  Result res{
+    batchSize, nThreads, 0, wall, 0, 0, 0, 0, 0, rssAfter, rssAfter - rssBefore, processPeakRssMB()};
+  std::vector<double> latency;
+  for (auto const& w : workers) {
+    if (w.error) { std::rethrow_exception(w.error); }
+    res.patches += w.patches;
+    res.marshal += w.marshal;
+    res.infer += w.infer;
+    latency.insert(latency.end(), w.latency.begin(), w.latency.end());
+  }
+  std::sort(latency.begin(), latency.end());
+  auto percentile = [&](double p) {
+    return 1e3 * latency[std::min(latency.size() - 1, (size_t)std::ceil(p * latency.size()) - 1)];
+  };
+  double sum = 0;
+  for (double l : latency) {
+    sum += l;
+  }
+  res.meanLatency = 1e3 * sum / latency.size();
+  res.p50Latency = percentile(0.50);
+  res.p99Latency = percentile(0.99);
+  return res;
+}
+
+void
+nnet::PointIdAlgBenchmark::endJob()
+{
+  if (!fNPool) {
+    throw cet::exception("PointIdAlgBenchmark") << "no patches recorded from " << fWireLabel.encode()
+                                                << " at " << fHitModuleLabel.encode() << std::endl;
+  }
+
+  std::vector<Result> results;
+  for (auto nThreads : fThreadCounts) {
+    for (auto batchSize : fBatchSizes) {
+      if (!nThreads || !batchSize) { continue; }
+      results.push_back(measure(batchSize, nThreads));
+      auto const& r = results.back();
+      mf::LogInfo("PointIdAlgBenchmark")
+        << fToolType << " batch " << r.batchSize << " x " << r.threads << " threads: "
+        << r.patches / r.wall << " patches/s, latency p50 " << r.p50Latency << " ms, p99 "
+        << r.p99Latency << " ms, marshalling " << 100 * r.marshal / (r.marshal + r.infer)
+        << "%, RSS " << r.rssMB << " MB (" << (r.rssDeltaMB < 0 ? "" : "+") << r.rssDeltaMB
+        << " MB), process peak RSS " << r.processPeakRssMB << " MB";
+    }
+  }
+  writeJson(results);
+}
+
+void
+nnet::PointIdAlgBenchmark::writeJson(std::vector<Result> const& results) const
+{
+  std::ofstream out(fOutputFile);
+  if (!out) {
+    throw cet::exception("PointIdAlgBenchmark") << "cannot write " << fOutputFile << std::endl;
+  }
+
+  out << "{\n";
+  out << "  \"tool\": \"" << fToolType << "\",\n";
+  out << "  \"patch\": [" << fPatchSizeW << ", " << fPatchSizeD << "],\n";
+  out << "  \"input\": \"" << (fWireLabel.label().empty() ? "synthetic" : "recorded") << "\",\n";
+  out << "  \"layout\": \"" << (fNestedInput ? "nested" : "contiguous") << "\",\n";
+  out << "  \"pool_patches\": " << fNPool << ",\n";
+  if (!fWireLabel.label().empty()) {
+    out << "  \"recorded\": {\"events\": " << fNEvents << ", \"view_setup_s\": " << fViewSetupTime
+        << ", \"buffering_s\": " << fBufferingTime
+        << ", \"buffering_us_per_patch\": " << 1e6 * fBufferingTime / fNPool << "},\n";
+  }
+  out << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    auto const& r = results[i];
+    out << (i ? "," : "") << "\n    {\"batch_size\": " << r.batchSize << ", \"threads\": " << r.threads
+        << ", \"patches\": " << r.patches << ", \"wall_s\": " << r.wall
+        << ", \"patches_per_s\": " << r.patches / r.wall << ",\n     \"latency_ms\": {\"mean\": "
+        << r.meanLatency << ", \"p50\": " << r.p50Latency << ", \"p99\": " << r.p99Latency << "},"
+        << "\n     \"time_s\": {\"marshalling\": " << r.marshal << ", \"inference\": " << r.infer
+        << "},\n     \"rss_mb\": " << r.rssMB << ", \"rss_delta_mb\": " << r.rssDeltaMB
+        << ", \"process_peak_rss_mb\": " << r.processPeakRssMB << "}";
+  }
+  out << "\n  ]\n}\n";
+
+  mf::LogInfo("PointIdAlgBenchmark") << "results written to " << fOutputFile;
+}
+
+DEFINE_ART_MODULE(nnet::PointIdAlgBenchmark)
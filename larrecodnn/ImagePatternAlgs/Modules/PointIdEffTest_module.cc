@@ -9,6 +9,7 @@
 // from cetpkgsupport v1_10_01.
 ////////////////////////////////////////////////////////////////////////
 
+#include "larrecodnn/ImagePatternAlgs/Modules/TruthIndex.h"
 #include "larreco/Calorimetry/CalorimetryAlg.h"
 #include "larsim/Simulation/LArG4Parameters.h"
 #include "lardata/ArtDataHelper/MVAReader.h"
@@ -100,9 +101,7 @@ namespace nnet {
 
     void cleanup();
 
-    void countTruthDep(const std::vector<sim::SimChannel>& channels,
-                       float& emLike,
-                       float& trackLike) const;
+    void countTruthDep(float& emLike, float& trackLike) const;
 
     void countPfpDep(detinfo::DetectorClocksData const& clockData,
                      detinfo::DetectorPropertiesData const& detProp,
@@ -115,9 +114,10 @@ namespace nnet {
     bool isMuonDecaying(const simb::MCParticle& particle,
                         const std::unordered_map<int, const simb::MCParticle*>& particleMap) const;
 
+    bool isMichel(int trackID);
+
     int testCNN(detinfo::DetectorClocksData const& clockData,
                 detinfo::DetectorPropertiesData const& detProp,
-                const std::vector<sim::SimChannel>& channels,
                 const std::vector<art::Ptr<recob::Hit>>& hits,
                 const std::array<float, MVA_LENGTH>& cnn_out,
                 const std::vector<anab::FeatureVector<MVA_LENGTH>>& hit_outs,
@@ -157,7 +157,8 @@ namespace nnet {
 
     unsigned int fView;
 
-    std::unordered_map<int, const simb::MCParticle*> fParticleMap;
+    TruthIndex fTruth;                            // SimChannels and MCParticles of the event
+    std::unordered_map<int, bool> fMichelTrackID; // Michel electron flag by track ID
 
     calo::CalorimetryAlg fCalorimetryAlg;
     art::InputTag fSimulationProducerLabel;
@@ -279,7 +280,7 @@ nnet::PointIdEffTest::endJob()
 void
 nnet::PointIdEffTest::cleanup()
 {
-  fParticleMap.clear();
+  fMichelTrackID.clear();
 
   fMcDepEM = 0;
   fMcDepTrack = 0;
@@ -322,15 +323,9 @@ nnet::PointIdEffTest::analyze(art::Event const& e)
 
   // access to MC information
 
-  // MC particles list
-  auto particleHandle = e.getValidHandle<std::vector<simb::MCParticle>>(fSimulationProducerLabel);
-  for (auto const& particle : *particleHandle) {
-    fParticleMap[particle.TrackId()] = &particle;
-  }
-
-  // SimChannels
-  auto simChannelHandle = e.getValidHandle<std::vector<sim::SimChannel>>(fSimulationProducerLabel);
-  countTruthDep(*simChannelHandle, fMcDepEM, fMcDepTrack);
+  // MC particles list and SimChannels
+  fTruth.update(e, fSimulationProducerLabel, fSimulationProducerLabel);
+  countTruthDep(fMcDepEM, fMcDepTrack);
 
   auto const clockData = art::ServiceHandle<detinfo::DetectorClocksService const>()->DataFor(e);
   auto const detProp =
@@ -375,7 +370,6 @@ nnet::PointIdEffTest::analyze(art::Event const& e)
 
       testCNN(clockData,
               detProp,
-              *simChannelHandle,
               hits,
               cnn_out,
               hitResults.outputs(),
@@ -437,44 +431,24 @@ nnet::PointIdEffTest::analyze(art::Event const& e)
 /******************************************/
 
 void
-nnet::PointIdEffTest::countTruthDep(const std::vector<sim::SimChannel>& channels,
-                                    float& emLike,
-                                    float& trackLike) const
+nnet::PointIdEffTest::countTruthDep(float& emLike, float& trackLike) const
 {
   emLike = 0;
   trackLike = 0;
-  for (auto const& channel : channels) {
-    // for every time slice in this channel:
-    auto const& timeSlices = channel.TDCIDEMap();
-    for (auto const& timeSlice : timeSlices) {
-      // loop over the energy deposits.
-      auto const& energyDeposits = timeSlice.second;
-      for (auto const& energyDeposit : energyDeposits) {
-        int trackID = energyDeposit.trackID;
+  for (auto const& energyDeposit : fTruth.deposits()) {
+    int trackID = energyDeposit.trackID;
 
-        double energy = energyDeposit.numElectrons * fElectronsToGeV * 1000;
+    double energy = energyDeposit.numElectrons * fElectronsToGeV * 1000;
 
-        if (trackID < 0) { emLike += energy; }
-        else if (trackID > 0) {
-          auto search = fParticleMap.find(trackID);
-          bool found = true;
-          if (search == fParticleMap.end()) {
-            mf::LogWarning("TrainingDataAlg") << "PARTICLE NOT FOUND";
-            found = false;
-          }
+    if (trackID < 0) { emLike += energy; }
+    else if (trackID > 0) {
+      if (!energyDeposit.particle) { mf::LogWarning("TrainingDataAlg") << "PARTICLE NOT FOUND"; }
 
-          int pdg = 0;
-          if (found) {
-            const simb::MCParticle& particle = *((*search).second);
-            if (!pdg) pdg = particle.PdgCode(); // not EM activity so read what PDG it is
-          }
-
-          if ((pdg == 11) || (pdg == -11) || (pdg == 22))
-            emLike += energy;
-          else
-            trackLike += energy;
-        }
-      }
+      int pdg = energyDeposit.pdg; // not EM activity so read what PDG it is
+      if ((pdg == 11) || (pdg == -11) || (pdg == 22))
+        emLike += energy;
+      else
+        trackLike += energy;
     }
   }
 }
@@ -544,10 +518,27 @@ nnet::PointIdEffTest::isMuonDecaying(
 }
 /******************************************/
 
+bool
+nnet::PointIdEffTest::isMichel(int trackID)
+{
+  auto search = fMichelTrackID.find(trackID);
+  if (search != fMichelTrackID.end()) return search->second;
+
+  bool michel = false;
+  auto const* particle = fTruth.particle(trackID);
+  if (particle && (particle->PdgCode() == 11)) // electron, check if it is Michel
+  {
+    auto const* mother = fTruth.particle(particle->Mother());
+    if (mother) { michel = isMuonDecaying(*mother, fTruth.particleMap()); }
+  }
+  fMichelTrackID[trackID] = michel;
+  return michel;
+}
+/******************************************/
+
 int
 nnet::PointIdEffTest::testCNN(detinfo::DetectorClocksData const& clockData,
                               detinfo::DetectorPropertiesData const& detProp,
-                              const std::vector<sim::SimChannel>& channels,
                               const std::vector<art::Ptr<recob::Hit>>& hits,
                               const std::array<float, MVA_LENGTH>& cnn_out,
                               const std::vector<anab::FeatureVector<MVA_LENGTH>>& hit_outs,
@@ -577,52 +568,35 @@ nnet::PointIdEffTest::testCNN(detinfo::DetectorClocksData const& clockData,
     if (fNoneIdx >= 0) { fOutNone = vout[fNoneIdx]; }
     if (fMichelLikeIdx >= 0) { p_michel = vout[fMichelLikeIdx]; }
 
-    for (auto const& channel : channels) {
-      if (channel.Channel() != hitChannelNumber) continue;
-
-      // for every time slice in this channel:
-      auto const& timeSlices = channel.TDCIDEMap();
-      for (auto const& timeSlice : timeSlices) {
-        int time = timeSlice.first;
-        if (std::abs(hit->TimeDistanceAsRMS(time)) < 1.0) {
-          // loop over the energy deposits.
-          auto const& energyDeposits = timeSlice.second;
-
-          for (auto const& energyDeposit : energyDeposits) {
-            int trackID = energyDeposit.trackID;
-
-            double energy = energyDeposit.numElectrons * fElectronsToGeV * 1000;
-            hitEn += energy;
-
-            if (trackID < 0) { hitEnSh += energy; } // EM activity
-            else if (trackID > 0) {
-              auto search = fParticleMap.find(trackID);
-              if (search != fParticleMap.end()) {
-                const simb::MCParticle& particle = *((*search).second);
-                int pdg = particle.PdgCode(); // not EM activity so read what PDG it is
-
-                if ((pdg == 11) || (pdg == -11) || (pdg == 22))
-                  hitEnSh += energy;
-                else
-                  hitEnTrk += energy;
-
-                if (pdg == 11) // electron, check if it is Michel
-                {
-                  auto msearch = fParticleMap.find(particle.Mother());
-                  if (msearch != fParticleMap.end()) {
-                    auto const& mother = *((*msearch).second);
-                    if (isMuonDecaying(mother, fParticleMap)) { hitEnMichel += energy; }
-                  }
-                }
-              }
-              else {
-                mf::LogWarning("TrainingDataAlg") << "PARTICLE NOT FOUND";
-              }
-            }
+    // ticks within RMS from the hit peak, range rounded outwards and checked exactly below
+    int tdc0 = std::floor(hit->PeakTime() - hit->RMS());
+    int tdc1 = std::ceil(hit->PeakTime() + hit->RMS()) + 1;
+    fTruth.forEachDeposit(
+      hitChannelNumber, tdc0, tdc1, [&](int time, TruthIndex::Deposit const& energyDeposit) {
+        if (std::abs(hit->TimeDistanceAsRMS(time)) >= 1.0) return;
+
+        int trackID = energyDeposit.trackID;
+
+        double energy = energyDeposit.numElectrons * fElectronsToGeV * 1000;
+        hitEn += energy;
+
+        if (trackID < 0) { hitEnSh += energy; } // EM activity
+        else if (trackID > 0) {
+          if (energyDeposit.particle) {
+            int pdg = energyDeposit.pdg; // not EM activity so read what PDG it is
+
+            if ((pdg == 11) || (pdg == -11) || (pdg == 22))
+              hitEnSh += energy;
+            else
+              hitEnTrk += energy;
+
+            if ((pdg == 11) && isMichel(trackID)) { hitEnMichel += energy; }
+          }
+          else {
+            mf::LogWarning("TrainingDataAlg") << "PARTICLE NOT FOUND";
           }
         }
-      }
-    }
+      });
     totEnSh += hitEnSh;
     totEnTrk += hitEnTrk;
     totEnMichel += hitEnMichel;
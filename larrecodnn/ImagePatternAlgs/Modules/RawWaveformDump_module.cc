@@ -50,15 +50,22 @@
 #include "nurandom/RandomUtils/NuRandomService.h"
 
 #include "CLHEP/Random/RandFlat.h"
-#include "c2numpy.h"
+#include "larrecodnn/ImagePatternAlgs/Modules/WaveformDumpOutput.h"
+
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task_arena.h"
 
 #include <algorithm>
 #include <chrono>
 #include <cstdlib>
 #include <map>
+#include <memory>
 #include <random>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -77,6 +84,23 @@ struct WireSigInfo {
   double edep;
 };
 
+// particle inventory info of a track, looked up once per event
+struct TrackTruth {
+  bool selected; // above the energy threshold and with an eve track
+  int pdgcode;
+  std::string genlab;
+  std::string procid;
+};
+
+// waveform selected for the output
+struct DumpRow {
+  raw::ChannelID_t channel;
+  size_t data;    // index of the digit / wire
+  int start_tick; // first tick saved
+  unsigned int ntrk;
+  std::vector<nnet::WaveformTrack> tracks;
+};
+
 namespace nnet {
   class RawWaveformDump;
 }
@@ -102,6 +126,8 @@ public:
 
 private:
   std::string fDumpWaveformsFileName;
+  std::string fOutputFormat; ///< "npy" or "root"
+  int fRootCompression;      ///< ROOT compression setting of the "root" output
 
   std::string fSimulationProducerLabel; ///< producer that tracked simulated part. through detector
   std::string fSimChannelLabel;         ///< module that made simchannels
@@ -126,7 +152,24 @@ private:
 
   CLHEP::RandFlat fRandFlat;
 
-  c2numpy_writer npywriter;
+  std::unique_ptr<WaveformDumpOutput> fOutput;
+
+  int fNumThreads;          ///< threads decoding waveforms, 1: serial, 0: TBB default
+  size_t fChannelChunkSize; ///< waveforms decoded at once, then written in order
+  std::unique_ptr<tbb::task_arena> fArena;
+
+  // .. channel-indexed lookups, sized from geometry and reused across events
+  std::vector<int> fChannelData; ///< index of the channel digit / wire, -1 if none
+  std::vector<char> fChannelSim; ///< 1 if the channel has a SimChannel
+
+  std::vector<std::vector<short>> fRowAdc;                     ///< waveforms of the chunk of rows
+  tbb::enumerable_thread_specific<std::vector<short>> fRawAdc; ///< per-thread decoding buffers
+
+  void writeRows(art::Event const& evt,
+                 std::vector<DumpRow> const& rows,
+                 std::vector<raw::RawDigit> const* digits,
+                 std::vector<art::Ptr<recob::Wire>> const& wirelist,
+                 unsigned int dataSize);
 };
 
 //-----------------------------------------------------------------------
@@ -173,12 +216,30 @@ public:
 // Create the random number generator
 namespace {
   std::string const instanceName = "RawWaveformDump";
+
+  // channel slot of a channel-indexed array, grown if the channel is beyond the geometry
+  template <typename T>
+  T&
+  channelSlot(std::vector<T>& slots, raw::ChannelID_t ch, T empty)
+  {
+    if (ch >= slots.size()) { slots.resize(ch + 1, empty); }
+    return slots[ch];
+  }
+
+  template <typename T>
+  T
+  channelValue(std::vector<T> const& slots, raw::ChannelID_t ch, T empty)
+  {
+    return ch < slots.size() ? slots[ch] : empty;
+  }
 }
 
 //-----------------------------------------------------------------------
 nnet::RawWaveformDump::RawWaveformDump(fhicl::ParameterSet const& p)
   : EDAnalyzer{p}
   , fDumpWaveformsFileName(p.get<std::string>("DumpWaveformsFileName", "dumpwaveforms"))
+  , fOutputFormat(p.get<std::string>("OutputFormat", "npy"))
+  , fRootCompression(p.get<int>("RootCompression", 505))
   , fSimulationProducerLabel(p.get<std::string>("SimulationProducerLabel", "larg4Main"))
   , fSimChannelLabel(p.get<std::string>("SimChannelLabel", "elecDrift"))
   , fDigitModuleLabel(p.get<std::string>("DigitModuleLabel", "simWire"))
@@ -199,6 +260,8 @@ nnet::RawWaveformDump::RawWaveformDump(fhicl::ParameterSet const& p)
   , fRandFlat{createEngine(art::ServiceHandle<rndm::NuRandomService>{}->declareEngine(
                            instanceName, p, "SeedForRawWaveformDump"),
                            "HepJamesRandom", instanceName)}
+  , fNumThreads(p.get<int>("NumThreads", 1))
+  , fChannelChunkSize(p.get<size_t>("ChannelChunkSize", 256))
 {
   if (std::getenv("CLUSTER") && std::getenv("PROCESS")) {
     fDumpWaveformsFileName += string(std::getenv("CLUSTER")) + "-" + string(std::getenv("PROCESS")) + "-";
@@ -213,6 +276,15 @@ nnet::RawWaveformDump::RawWaveformDump(fhicl::ParameterSet const& p)
     throw cet::exception("RawWaveformDump")
       << "Only one of DigitModuleLabel and WireProducerLabel should be set";
   }
+
+  if (fNumThreads != 1) {
+    fArena = std::make_unique<tbb::task_arena>(fNumThreads > 1 ? fNumThreads :
+                                                                 int(tbb::task_arena::automatic));
+  }
+  if (fChannelChunkSize == 0) { fChannelChunkSize = 1; }
+
+  fChannelData.assign(fgeom->Nchannels(), -1);
+  fChannelSim.assign(fgeom->Nchannels(), 0);
 }
 
 //-----------------------------------------------------------------------
@@ -221,62 +293,20 @@ nnet::RawWaveformDump::beginJob()
 {
   auto const detProp = art::ServiceHandle<detinfo::DetectorPropertiesService const>()->DataForJob();
 
-  c2numpy_init(&npywriter, fDumpWaveformsFileName, 50000);
-  c2numpy_addcolumn(&npywriter, "evt", C2NUMPY_UINT32);
-  c2numpy_addcolumn(&npywriter, "chan", C2NUMPY_UINT32);
-  c2numpy_addcolumn(&npywriter, "view", (c2numpy_type)((int)C2NUMPY_STRING + 1));
-  c2numpy_addcolumn(&npywriter, "ntrk", C2NUMPY_UINT16);
-
-  for (unsigned int i = 0; i < 5; i++) {
-    std::ostringstream name;
-
-    name.str("");
-    name << "tid" << i;
-    c2numpy_addcolumn(&npywriter, name.str().c_str(), C2NUMPY_INT32);
-
-    name.str("");
-    name << "pdg" << i;
-    c2numpy_addcolumn(&npywriter, name.str().c_str(), C2NUMPY_INT32);
-
-    name.str("");
-    name << "gen" << i;
-    c2numpy_addcolumn(&npywriter, name.str().c_str(), (c2numpy_type)((int)C2NUMPY_STRING + 6));
-
-    name.str("");
-    name << "pid" << i;
-    c2numpy_addcolumn(&npywriter, name.str().c_str(), (c2numpy_type)((int)C2NUMPY_STRING + 7));
-
-    name.str("");
-    name << "edp" << i;
-    c2numpy_addcolumn(&npywriter, name.str().c_str(), C2NUMPY_FLOAT32);
-
-    name.str("");
-    name << "nel" << i;
-    c2numpy_addcolumn(&npywriter, name.str().c_str(), C2NUMPY_UINT32);
-
-    name.str("");
-    name << "sti" << i;
-    c2numpy_addcolumn(&npywriter, name.str().c_str(), C2NUMPY_UINT16);
-
-    name.str("");
-    name << "stf" << i;
-    c2numpy_addcolumn(&npywriter, name.str().c_str(), C2NUMPY_UINT16);
-  }
-
-  for (unsigned int i = 0;
-       i < (fUseFullWaveform ? detProp.ReadOutWindowSize() : fShortWaveformSize);
-       i++) {
-    std::ostringstream name;
-    name << "tck_" << i;
-    c2numpy_addcolumn(&npywriter, name.str().c_str(), C2NUMPY_INT16);
-  }
+  fOutput = std::make_unique<WaveformDumpOutput>(
+    fOutputFormat,
+    fDumpWaveformsFileName,
+    "",
+    false,
+    fUseFullWaveform ? detProp.ReadOutWindowSize() : fShortWaveformSize,
+    fRootCompression);
 }
 
 //-----------------------------------------------------------------------
 void
 nnet::RawWaveformDump::endJob()
 {
-  c2numpy_close(&npywriter);
+  fOutput->close();
 }
 
 //-----------------------------------------------------------------------
@@ -327,25 +357,22 @@ nnet::RawWaveformDump::analyze(art::Event const& evt)
     return;
   }
 
-  // ... Build a map from channel number -> rawdigitVec
-  std::map<raw::ChannelID_t, art::Ptr<raw::RawDigit>> rawdigitMap;
-  raw::ChannelID_t chnum = raw::InvalidChannelID; // channel number
-  if (rawdigitlist.size()) {
-    for (size_t rdIter = 0; rdIter < digitVecHandle->size(); ++rdIter) {
-      art::Ptr<raw::RawDigit> digitVec(digitVecHandle, rdIter);
-      chnum = digitVec->Channel();
-      if (chnum == raw::InvalidChannelID) continue;
-      rawdigitMap[chnum] = digitVec;
+  // ... Index the digits or wires by channel number
+  std::vector<raw::RawDigit> const* digits =
+    rawdigitlist.empty() ? nullptr : digitVecHandle.product();
+  std::fill(fChannelData.begin(), fChannelData.end(), -1);
+  if (digits) {
+    for (size_t rdIter = 0; rdIter < digits->size(); ++rdIter) {
+      raw::ChannelID_t ch = (*digits)[rdIter].Channel();
+      if (ch == raw::InvalidChannelID) continue;
+      channelSlot(fChannelData, ch, -1) = rdIter;
     }
   }
-  // ... Build a map from channel number -> wire
-  std::map<raw::ChannelID_t, art::Ptr<recob::Wire>> wireMap;
-  if (wirelist.size()) {
+  else {
     for (size_t ich = 0; ich < wirelist.size(); ++ich) {
-      art::Ptr<recob::Wire> wire = wirelist[ich];
-      chnum = wire->Channel();
-      if (chnum == raw::InvalidChannelID) continue;
-      wireMap[chnum] = wire;
+      raw::ChannelID_t ch = wirelist[ich]->Channel();
+      if (ch == raw::InvalidChannelID) continue;
+      channelSlot(fChannelData, ch, -1) = ich;
     }
   }
 
@@ -380,15 +407,31 @@ nnet::RawWaveformDump::analyze(art::Event const& evt)
     }
   }
 
-  std::string dummystr6 = "none  ";
-  std::string dummystr7 = "none   ";
+  std::vector<DumpRow> rows;
 
   if (fSaveSignal) {
-    // .. create a channel number to trackid-wire signal info map
-    std::map<raw::ChannelID_t, std::map<int, WireSigInfo>> Ch2TrkWSInfoMap;
+    // .. particle inventory lookups are the same for all deposits of a track
+    std::unordered_map<int, TrackTruth> trackTruth;
+    auto truthOf = [&](int trkid) -> TrackTruth const& {
+      auto it = trackTruth.find(trkid);
+      if (it != trackTruth.end()) return it->second;
+
+      TrackTruth truth{false, 0, "", ""};
+      simb::MCParticle const& particle = PIS->TrackIdToMotherParticle(trkid);
+      // .. ignore energy depositions if incident particle energy below some threshold
+      if (particle.E() >= fMinParticleEnergyGeV) {
+        int eve_id = PIS->TrackIdToEveTrackId(trkid);
+        if (eve_id) { truth = {true, particle.PdgCode(), gf->get_gen(eve_id), particle.Process()}; }
+      }
+      return trackTruth.emplace(trkid, std::move(truth)).first->second;
+    };
+
+    // .. selected channels and their track ID to wire signal info, sorted by track ID
+    std::vector<raw::ChannelID_t> sigChannels;
+    std::vector<std::vector<std::pair<int, WireSigInfo>>> sigInfos;
 
-    // .. create a track ID to vector of channel numbers (in w/c this track deposited energy) map
-    std::map<int, std::vector<raw::ChannelID_t>> Trk2ChVecMap;
+    // .. (track ID, index of selected channel) for tracks which deposited energy in the channel
+    std::vector<std::pair<int, size_t>> trkChannels;
 
     // ... Loop over simChannels
     for (auto const& channel : (*simChannelHandle)) {
@@ -400,8 +443,8 @@ nnet::RawWaveformDump::analyze(art::Event const& evt)
 
       bool selectThisChannel = false;
 
-      // .. create a track ID to wire signal info map
-      std::map<int, WireSigInfo> Trk2WSInfoMap;
+      // .. create a track ID to wire signal info list
+      std::vector<std::pair<int, WireSigInfo>> Trk2WSInfo;
 
       // ... Loop over all ticks with ionization energy deposited
       auto const& timeSlices = channel.TDCIDEMap();
@@ -417,36 +460,37 @@ nnet::RawWaveformDump::analyze(art::Event const& evt)
 
           if (!energyDeposit.trackID) continue;
           int trkid = energyDeposit.trackID;
-          simb::MCParticle particle = PIS->TrackIdToMotherParticle(trkid);
-          //std::cout << energyDeposit.trackID << " " << trkid << " " << particle.TrackId() << std::endl;
-
-          // .. ignore this energy deposition if incident particle energy below some threshold
-          if (particle.E() < fMinParticleEnergyGeV) continue;
+          TrackTruth const& truth = truthOf(trkid);
+          if (!truth.selected) continue;
 
-          int eve_id = PIS->TrackIdToEveTrackId(trkid);
-          if (!eve_id) continue;
-          std::string genlab = gf->get_gen(eve_id);
-
-          if (Trk2WSInfoMap.find(trkid) == Trk2WSInfoMap.end()) {
+          auto itrk = std::find_if(Trk2WSInfo.begin(), Trk2WSInfo.end(), [trkid](auto const& t) {
+            return t.first == trkid;
+          });
+          if (itrk == Trk2WSInfo.end()) {
             WireSigInfo wsinf;
-            wsinf.pdgcode = particle.PdgCode();
-            wsinf.genlab = genlab;
-            wsinf.procid = particle.Process();
+            wsinf.pdgcode = truth.pdgcode;
+            wsinf.genlab = truth.genlab;
+            wsinf.procid = truth.procid;
             wsinf.tdcmin = dataSize - 1;
             wsinf.tdcmax = 0;
             wsinf.edep = 0.;
             wsinf.numel = 0;
-            Trk2WSInfoMap.insert(std::pair<int, WireSigInfo>(trkid, wsinf));
+            Trk2WSInfo.emplace_back(trkid, wsinf);
+            itrk = Trk2WSInfo.end() - 1;
           }
-          if (tdctick < Trk2WSInfoMap.at(trkid).tdcmin) Trk2WSInfoMap.at(trkid).tdcmin = tdctick;
-          if (tdctick > Trk2WSInfoMap.at(trkid).tdcmax) Trk2WSInfoMap.at(trkid).tdcmax = tdctick;
-          Trk2WSInfoMap.at(trkid).edep += energyDeposit.energy;
-          Trk2WSInfoMap.at(trkid).numel += energyDeposit.numElectrons;
+          WireSigInfo& wsinf = itrk->second;
+          if (tdctick < wsinf.tdcmin) wsinf.tdcmin = tdctick;
+          if (tdctick > wsinf.tdcmax) wsinf.tdcmax = tdctick;
+          wsinf.edep += energyDeposit.energy;
+          wsinf.numel += energyDeposit.numElectrons;
         }
       }
 
-      if (!Trk2WSInfoMap.empty()) {
-        for (std::pair<int, WireSigInfo> itmap : Trk2WSInfoMap) {
+      if (!Trk2WSInfo.empty()) {
+        std::sort(Trk2WSInfo.begin(), Trk2WSInfo.end(), [](auto const& a, auto const& b) {
+          return a.first < b.first;
+        });
+        for (auto const& itmap : Trk2WSInfo) {
           if (fSelectGenLabel != "ANY") {
             if (itmap.second.genlab != fSelectGenLabel) continue;
           }
@@ -456,239 +500,159 @@ nnet::RawWaveformDump::analyze(art::Event const& evt)
           if (fSelectPDGCode != 0) {
             if (itmap.second.pdgcode != fSelectPDGCode) continue;
           }
-          itmap.second.genlab.resize(6, ' ');
-          itmap.second.procid.resize(7, ' ');
           if (itmap.second.numel >= fMinNumberOfElectrons &&
               itmap.second.edep >= fMinEnergyDepositedMeV) {
             if (fMaxNumberOfElectrons >= 0 && itmap.second.numel >= fMaxNumberOfElectrons) {
               continue;
             }
             else {
-              int trkid = itmap.first;
-              if (Trk2ChVecMap.find(trkid) == Trk2ChVecMap.end()) {
-                std::vector<raw::ChannelID_t> chvec;
-                Trk2ChVecMap.insert(std::pair<int, std::vector<raw::ChannelID_t>>(trkid, chvec));
-              }
-              Trk2ChVecMap.at(trkid).push_back(ch1);
+              trkChannels.emplace_back(itmap.first, sigChannels.size());
               selectThisChannel = true;
             }
           }
-        } // loop over Trk2WSinfoMap
+        } // loop over Trk2WSinfo
         if (selectThisChannel) {
-          Ch2TrkWSInfoMap.insert(
-            std::pair<raw::ChannelID_t, std::map<int, WireSigInfo>>(ch1, Trk2WSInfoMap));
+          sigChannels.push_back(ch1);
+          sigInfos.push_back(std::move(Trk2WSInfo));
         }
-      } // if Trk2WSInfoMap not empty
+      } // if Trk2WSInfo not empty
 
     } // loop over SimChannels
 
-    std::set<raw::ChannelID_t> selected_channels;
+    // .. group channels of each track, in the order of track IDs and then of SimChannels
+    std::stable_sort(trkChannels.begin(), trkChannels.end(), [](auto const& a, auto const& b) {
+      return a.first < b.first;
+    });
 
-    // ... Now write out the signal waveforms for each track
-    if (!Trk2ChVecMap.empty()) {
-      for (auto const& ittrk : Trk2ChVecMap) {
-   	int i = fRandFlat.fireInt(ittrk.second.size()); // randomly select one channel with a signal from this particle
-        chnum = ittrk.second[i];
+    std::vector<char> selected_channels(sigChannels.size(), 0);
 
-        if (not selected_channels.insert(chnum).second) {
-          continue;
-        }
+    // ... Now select the signal waveforms for each track
+    for (size_t g = 0; g < trkChannels.size();) {
+      size_t gend = g + 1;
+      while (gend < trkChannels.size() && trkChannels[gend].first == trkChannels[g].first) {
+        ++gend;
+      }
+      int i = fRandFlat.fireInt(gend - g); // randomly select one channel with a signal from this particle
+      const size_t isig = trkChannels[g + i].second;
+      g = gend;
 
-        std::map<raw::ChannelID_t, std::map<int, WireSigInfo>>::iterator itchn;
-        itchn = Ch2TrkWSInfoMap.find(chnum);
-        if (itchn != Ch2TrkWSInfoMap.end()) {
+      if (selected_channels[isig]) continue;
+      selected_channels[isig] = 1;
 
-          std::vector<short> adcvec(dataSize); // vector to hold zero-padded full waveform
+      const raw::ChannelID_t chnum = sigChannels[isig];
+      const int data = channelValue(fChannelData, chnum, -1);
+      if (data < 0) continue;
 
-          if (rawdigitlist.size()) {
-            auto search = rawdigitMap.find(chnum);
-            if (search == rawdigitMap.end()) continue;
-            art::Ptr<raw::RawDigit> rawdig = (*search).second;
-            std::vector<short> rawadc(dataSize); // vector to hold uncompressed adc values later
-            raw::Uncompress(rawdig->ADCs(), rawadc, rawdig->GetPedestal(), rawdig->Compression());
-            for (size_t j = 0; j < rawadc.size(); ++j) {
-              adcvec[j] = rawadc[j] - rawdig->GetPedestal();
-            }
-          }
-          else if (wirelist.size()) {
-            auto search = wireMap.find(chnum);
-            if (search == wireMap.end()) continue;
-            art::Ptr<recob::Wire> wire = (*search).second;
-            const auto& signal = wire->Signal();
-            for (size_t j = 0; j < adcvec.size(); ++j) {
-              adcvec[j] = signal[j];
-            }
-          }
+      auto const& sigs = sigInfos[isig];
 
-          // .. write out info for each peak
-          // a full waveform has at least one peak; the output will save up to 5 peaks (if there is
-          // only 1 peak, will fill the other 4 with 0);
-          // for fShortWaveformSize: only use the first peak's start_tick
-
-          if (fUseFullWaveform) {
-
-            c2numpy_uint32(&npywriter, evt.id().event());
-            c2numpy_uint32(&npywriter, chnum);
-            c2numpy_string(&npywriter, geo::PlaneGeo::ViewName(fgeom->View(chnum)).c_str());
-            c2numpy_uint16(&npywriter,itchn->second.size()); // size of Trk2WSInfoMap, or #peaks
-            unsigned int icnt = 0;
-            for (auto const& it : itchn->second) {
-              c2numpy_int32(&npywriter, it.first);                  // trackid
-              c2numpy_int32(&npywriter, it.second.pdgcode);         // pdgcode
-              c2numpy_string(&npywriter, it.second.genlab.c_str()); // genlab
-              c2numpy_string(&npywriter, it.second.procid.c_str()); // procid
-              c2numpy_float32(&npywriter, it.second.edep);          // edepo
-              c2numpy_uint32(&npywriter, it.second.numel);          // numelec
-
-              c2numpy_uint16(&npywriter, it.second.tdcmin); // stck1
-              c2numpy_uint16(&npywriter, it.second.tdcmax); // stc2
-
-              icnt++;
-              if (icnt == 5) break;
-    	    }
-
-            // .. pad with 0's if number of peaks less than 5
-            for (unsigned int i = icnt; i < 5; ++i) {
-              c2numpy_int32(&npywriter, 0);
-              c2numpy_int32(&npywriter, 0);
-              c2numpy_string(&npywriter, dummystr6.c_str());
-              c2numpy_string(&npywriter, dummystr7.c_str());
-              c2numpy_float32(&npywriter, 0.);
-              c2numpy_uint32(&npywriter, 0);
-              c2numpy_uint16(&npywriter, 0);
-              c2numpy_uint16(&npywriter, 0);
-            }
+      // .. write out info for each peak
+      // a full waveform has at least one peak; the output will save up to 5 peaks (if there is
+      // only 1 peak, will fill the other 4 with 0);
+      // for fShortWaveformSize: only use the first peak's start_tick
 
-            for (unsigned int itck = 0; itck < dataSize; ++itck) {
-              c2numpy_int16(&npywriter, adcvec[itck]);
-            }
+      if (fUseFullWaveform) {
 
-          } else {
-
-    	    // .. first loop to find largest signal
-    	    double EDep = 0.;
-    	    unsigned int TDCMin, TDCMax;
-    	    bool foundmaxsig = false;
-    	    for (auto & it : itchn->second) {
-    	      if (it.second.edep > EDep && it.second.numel > 0){ 
-    		EDep = it.second.edep;
-    		TDCMin = it.second.tdcmin;
-    		TDCMax = it.second.tdcmax;
-    		foundmaxsig = true;
-    	      }
-    	    }
-    	    if (foundmaxsig) {
-    	      int sigtdc1, sigtdc2, sighwid, sigfwid, sigtdcm;
-    	      if (fPlaneToDump!=fCollectionPlaneLabel){
-    		sigtdc1 = TDCMin - 14/2;
-    		sigtdc2 = TDCMax + 3*14/2;
-    	      } else {
-    		sigtdc1 = TDCMin - 32/2;
-    		sigtdc2 = TDCMax + 32/2;
-    	      }
-    	      sigfwid=sigtdc2 - sigtdc1;
-    	      sighwid=sigfwid/2;
-    	      sigtdcm=sigtdc1+sighwid;
-
-              int start_tick = -1;
-              int end_tick = -1;
-    	      // .. set window edges to contain the largest signal
-    	      if (sigfwid < (int)fShortWaveformSize) {
-    		// --> case 1: signal range fits within window
-    		int dt = fShortWaveformSize - sigfwid;
-    		start_tick = sigtdc1 - dt * fRandFlat.fire(0,1);
-    	      }
-    	      else {
-    		// --> case 2: signal range larger than window
-    		int mrgn = fShortWaveformSize/20;
-    		int dt = fShortWaveformSize - 2*mrgn;
-    		start_tick = sigtdcm - mrgn - dt * fRandFlat.fire(0,1);
-    	      }
-    	      if (start_tick < 0) start_tick = 0;
-    	      end_tick = start_tick + fShortWaveformSize - 1;
-    	      if (end_tick > int (dataSize - 1)) {
-    		end_tick = dataSize - 1;
-    		start_tick = end_tick - fShortWaveformSize + 1;
-    	      }
-
-              c2numpy_uint32(&npywriter, evt.id().event());
-              c2numpy_uint32(&npywriter, chnum);
-              c2numpy_string(&npywriter, geo::PlaneGeo::ViewName(fgeom->View(chnum)).c_str());
-
-    	      // .. second loop to select only signals that are within the window
-
-    	      int it_trk[5],it_pdg[5],it_nel[5];
-    	      unsigned int stck_1[5],stck_2[5];
-    	      std::string it_glb[5], it_prc[5];
-    	      double it_edp[5];
-
-    	      unsigned int icnt = 0;
-
-    	      for (auto & it : itchn->second) {
-    		if (( it.second.tdcmin >= (unsigned int)start_tick && it.second.tdcmin <  (unsigned int)end_tick) ||
-    		    ( it.second.tdcmax >  (unsigned int)start_tick && it.second.tdcmax <= (unsigned int)end_tick)) {
-
-    		  it_trk[icnt] = it.first;	 
-    		  it_pdg[icnt] = it.second.pdgcode;	  
-    		  it_glb[icnt] = it.second.genlab;	    
-    		  it_prc[icnt] = it.second.procid;	    
-    		  it_edp[icnt] = it.second.edep;    
-    		  it_nel[icnt] = it.second.numel;   
-
-    		  unsigned int mintdc = it.second.tdcmin;
-    		  unsigned int maxtdc = it.second.tdcmax;
-    		  if (mintdc < (unsigned int)start_tick)mintdc = start_tick; 
-    		  if (maxtdc > (unsigned int)end_tick)maxtdc = end_tick; 
-
-    		  stck_1[icnt] = mintdc - start_tick;	    
-    		  stck_2[icnt] = maxtdc - start_tick;	    
-
-    		  icnt++;
-    		  if (icnt == 5) break;
-    		}
-    	      }
-
-    	      c2numpy_uint16(&npywriter, icnt); // number of peaks
-
-    	      for (unsigned int i = 0; i < icnt; ++i) {
-    		  c2numpy_int32(&npywriter,  it_trk[i]);	 // trackid
-    		  c2numpy_int32(&npywriter,  it_pdg[i]);	 // pdgcode
-    		  c2numpy_string(&npywriter, it_glb[i].c_str()); // genlab
-    		  c2numpy_string(&npywriter, it_prc[i].c_str()); // procid
-    		  c2numpy_float32(&npywriter,it_edp[i]);	 // edepo
-    		  c2numpy_uint32(&npywriter, it_nel[i]);	 // numelec
-    		  c2numpy_uint16(&npywriter, stck_1[i]); // stck1
-    		  c2numpy_uint16(&npywriter, stck_2[i]); // stck2
-    	      }
-
-              // .. pad with 0's if number of peaks less than 5
-              for (unsigned int i = icnt; i < 5; ++i) {
-                c2numpy_int32(&npywriter, 0);
-                c2numpy_int32(&npywriter, 0);
-                c2numpy_string(&npywriter, dummystr6.c_str());
-                c2numpy_string(&npywriter, dummystr7.c_str());
-                c2numpy_float32(&npywriter, 0.);
-                c2numpy_uint32(&npywriter, 0);
-                c2numpy_uint16(&npywriter, 0);
-                c2numpy_uint16(&npywriter, 0);
-              }
-
-    	      for (unsigned int itck = start_tick; itck < (start_tick + fShortWaveformSize); ++itck) {
-    		c2numpy_int16(&npywriter, adcvec[itck]);
-    	      }
-
-            } // foundmaxsig
+        DumpRow row{chnum, (size_t)data, 0, (unsigned int)sigs.size(), {}}; // #peaks
+        for (auto const& it : sigs) {
+          if (row.tracks.size() == fOutput->maxTracks()) break;
+          row.tracks.push_back({it.first,
+                                it.second.pdgcode,
+                                it.second.genlab,
+                                it.second.procid,
+                                (float)it.second.edep,
+                                (unsigned int)it.second.numel,
+                                (unsigned short)it.second.tdcmin,
+                                (unsigned short)it.second.tdcmax});
+        }
+        rows.push_back(std::move(row));
+
+      } else {
+
+        // .. first loop to find largest signal
+        double EDep = 0.;
+        unsigned int TDCMin, TDCMax;
+        bool foundmaxsig = false;
+        for (auto const& it : sigs) {
+          if (it.second.edep > EDep && it.second.numel > 0) {
+            EDep = it.second.edep;
+            TDCMin = it.second.tdcmin;
+            TDCMax = it.second.tdcmax;
+            foundmaxsig = true;
           }
         }
+        if (foundmaxsig) {
+          int sigtdc1, sigtdc2, sighwid, sigfwid, sigtdcm;
+          if (fPlaneToDump != fCollectionPlaneLabel) {
+            sigtdc1 = TDCMin - 14 / 2;
+            sigtdc2 = TDCMax + 3 * 14 / 2;
+          }
+          else {
+            sigtdc1 = TDCMin - 32 / 2;
+            sigtdc2 = TDCMax + 32 / 2;
+          }
+          sigfwid = sigtdc2 - sigtdc1;
+          sighwid = sigfwid / 2;
+          sigtdcm = sigtdc1 + sighwid;
+
+          int start_tick = -1;
+          int end_tick = -1;
+          // .. set window edges to contain the largest signal
+          if (sigfwid < (int)fShortWaveformSize) {
+            // --> case 1: signal range fits within window
+            int dt = fShortWaveformSize - sigfwid;
+            start_tick = sigtdc1 - dt * fRandFlat.fire(0, 1);
+          }
+          else {
+            // --> case 2: signal range larger than window
+            int mrgn = fShortWaveformSize / 20;
+            int dt = fShortWaveformSize - 2 * mrgn;
+            start_tick = sigtdcm - mrgn - dt * fRandFlat.fire(0, 1);
+          }
+          if (start_tick < 0) start_tick = 0;
+          end_tick = start_tick + fShortWaveformSize - 1;
+          if (end_tick > int(dataSize - 1)) {
+            end_tick = dataSize - 1;
+            start_tick = end_tick - fShortWaveformSize + 1;
+          }
+
+          // .. second loop to select only signals that are within the window
+          DumpRow row{chnum, (size_t)data, start_tick, 0, {}};
+          for (auto const& it : sigs) {
+            if ((it.second.tdcmin >= (unsigned int)start_tick &&
+                 it.second.tdcmin < (unsigned int)end_tick) ||
+                (it.second.tdcmax > (unsigned int)start_tick &&
+                 it.second.tdcmax <= (unsigned int)end_tick)) {
+
+              unsigned int mintdc = it.second.tdcmin;
+              unsigned int maxtdc = it.second.tdcmax;
+              if (mintdc < (unsigned int)start_tick) mintdc = start_tick;
+              if (maxtdc > (unsigned int)end_tick) maxtdc = end_tick;
+
+              row.tracks.push_back({it.first,
+                                    it.second.pdgcode,
+                                    it.second.genlab,
+                                    it.second.procid,
+                                    (float)it.second.edep,
+                                    (unsigned int)it.second.numel,
+                                    (unsigned short)(mintdc - start_tick),
+                                    (unsigned short)(maxtdc - start_tick)});
+              if (row.tracks.size() == fOutput->maxTracks()) break;
+            }
+          }
+          row.ntrk = row.tracks.size(); // number of peaks
+          rows.push_back(std::move(row));
+
+        } // foundmaxsig
       }
     }
   }
   else {
     //save noise
     int noisechancount = 0;
-    std::map<raw::ChannelID_t, bool> signalMap;
+    std::fill(fChannelSim.begin(), fChannelSim.end(), 0);
     for (auto const& channel : (*simChannelHandle)) {
-      signalMap[channel.Channel()] = true;
+      if (channel.Channel() == raw::InvalidChannelID) continue;
+      channelSlot(fChannelSim, channel.Channel(), (char)0) = 1;
     }
     // .. create a vector for shuffling the wire channel indices
     auto seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
@@ -697,70 +661,92 @@ nnet::RawWaveformDump::analyze(art::Event const& evt)
     for (size_t i=0; i<nchan; ++i) randigitmap.push_back(i);
     std::shuffle ( randigitmap.begin(), randigitmap.end(), std::mt19937(seed) );
 
-    for (size_t rdIter = 0; rdIter < (rawdigitlist.empty() ? wirelist.size() : rawdigitlist.size());
-         ++rdIter) {
+    for (size_t rdIter = 0; rdIter < nchan; ++rdIter) {
 
       if (noisechancount==fMaxNoiseChannelsPerEvent)break;
 
-      std::vector<short> adcvec(dataSize); // vector to wire adc values
-      if (rawdigitlist.size()) {
-        size_t ranIdx=randigitmap[rdIter];
-        art::Ptr<raw::RawDigit> digitVec(digitVecHandle, ranIdx);
-        if (signalMap[digitVec->Channel()]) continue;
-
-        std::vector<short> rawadc(dataSize); // vector to hold uncompressed adc values later
-        if (geo::PlaneGeo::ViewName(fgeom->View(digitVec->Channel())) != fPlaneToDump[0]) continue;
-        raw::Uncompress(digitVec->ADCs(), rawadc, digitVec->GetPedestal(), digitVec->Compression());
-        for (size_t j = 0; j < rawadc.size(); ++j) {
-          adcvec[j] = rawadc[j] - digitVec->GetPedestal();
-        }
-        c2numpy_uint32(&npywriter, evt.id().event());
-        c2numpy_uint32(&npywriter, digitVec->Channel());
-        c2numpy_string(&npywriter,
-                       geo::PlaneGeo::ViewName(fgeom->View(digitVec->Channel())).c_str());
+      size_t ranIdx=randigitmap[rdIter];
+      raw::ChannelID_t chnum = raw::InvalidChannelID;
+      if (digits) {
+        chnum = (*digits)[ranIdx].Channel();
+        if (channelValue(fChannelSim, chnum, (char)0)) continue;
+        if (geo::PlaneGeo::ViewName(fgeom->View(chnum)) != fPlaneToDump[0]) continue;
       }
-      else if (wirelist.size()) {
-        size_t ranIdx=randigitmap[rdIter];
-        art::Ptr<recob::Wire> wire = wirelist[ranIdx];
-        if (signalMap[wire->Channel()]) continue;
-        if (channelStatus.IsBad(wire->Channel())) continue;
-        if (geo::PlaneGeo::ViewName(fgeom->View(wire->Channel())) != fPlaneToDump[0]) continue;
-        const auto& signal = wire->Signal();
-        for (size_t j = 0; j < adcvec.size(); ++j) {
-          adcvec[j] = signal[j];
-        }
-        c2numpy_uint32(&npywriter, evt.id().event());
-        c2numpy_uint32(&npywriter, wire->Channel());
-        c2numpy_string(&npywriter, geo::PlaneGeo::ViewName(fgeom->View(wire->Channel())).c_str());
+      else {
+        chnum = wirelist[ranIdx]->Channel();
+        if (channelValue(fChannelSim, chnum, (char)0)) continue;
+        if (channelStatus.IsBad(chnum)) continue;
+        if (geo::PlaneGeo::ViewName(fgeom->View(chnum)) != fPlaneToDump[0]) continue;
       }
 
-      c2numpy_uint16(&npywriter, 0); //number of peaks
-      for (unsigned int i = 0; i < 5; ++i) {
-        c2numpy_int32(&npywriter, 0);
-        c2numpy_int32(&npywriter, 0);
-        c2numpy_string(&npywriter, dummystr6.c_str());
-        c2numpy_string(&npywriter, dummystr7.c_str());
-        c2numpy_float32(&npywriter, 0.);
-        c2numpy_uint32(&npywriter, 0);
-        c2numpy_uint16(&npywriter, 0);
-        c2numpy_uint16(&npywriter, 0);
+      int start_tick = 0;
+      if (!fUseFullWaveform) {
+        start_tick = int((dataSize - fShortWaveformSize) * fRandFlat.fire(0, 1));
       }
+      rows.push_back({chnum, ranIdx, start_tick, 0, {}}); // no peaks
 
-      if (fUseFullWaveform) {
-        for (unsigned int itck = 0; itck < dataSize; ++itck) {
-          c2numpy_int16(&npywriter, adcvec[itck]);
+      ++noisechancount;
+    }
+    std::cout << "Total number of noise channels " << noisechancount << std::endl;
+  }
+
+  writeRows(evt, rows, digits, wirelist, dataSize);
+}
+
+//-----------------------------------------------------------------------
+void
+nnet::RawWaveformDump::writeRows(art::Event const& evt,
+                                 std::vector<DumpRow> const& rows,
+                                 std::vector<raw::RawDigit> const* digits,
+                                 std::vector<art::Ptr<recob::Wire>> const& wirelist,
+                                 unsigned int dataSize)
+{
+  // .. waveforms of a chunk of rows are decoded in parallel, then written in the row order
+  for (size_t begin = 0; begin < rows.size(); begin += fChannelChunkSize) {
+    const size_t end = std::min(rows.size(), begin + fChannelChunkSize);
+    if (fRowAdc.size() < end - begin) fRowAdc.resize(end - begin);
+
+    auto decode = [&](size_t r0, size_t r1, std::vector<short>& rawadc) {
+      for (size_t r = r0; r < r1; ++r) {
+        auto& adcvec = fRowAdc[r - begin]; // vector to hold zero-padded full waveform
+        adcvec.assign(dataSize, 0);
+        if (digits) {
+          raw::RawDigit const& rawdig = (*digits)[rows[r].data];
+          rawadc.assign(dataSize, 0); // vector to hold uncompressed adc values
+          raw::Uncompress(rawdig.ADCs(), rawadc, rawdig.GetPedestal(), rawdig.Compression());
+          for (size_t j = 0; j < rawadc.size(); ++j) {
+            adcvec[j] = rawadc[j] - rawdig.GetPedestal();
+          }
         }
-      }
-      else {
-        int start_tick = int((dataSize - fShortWaveformSize) * fRandFlat.fire(0, 1));
-        for (unsigned int itck = start_tick; itck < (start_tick + fShortWaveformSize); ++itck) {
-          c2numpy_int16(&npywriter, adcvec[itck]);
+        else {
+          const auto& signal = wirelist[rows[r].data]->Signal();
+          for (size_t j = 0; j < adcvec.size(); ++j) {
+            adcvec[j] = signal[j];
+          }
         }
       }
+    };
+
+    if (!fArena) { decode(begin, end, fRawAdc.local()); }
+    else {
+      fArena->execute([&] {
+        tbb::parallel_for(tbb::blocked_range<size_t>(begin, end),
+                          [&](const tbb::blocked_range<size_t>& r) {
+                            decode(r.begin(), r.end(), fRawAdc.local());
+                          });
+      });
+    }
 
-      ++noisechancount;
+    for (size_t r = begin; r < end; ++r) {
+      auto const& row = rows[r];
+      fOutput->write(evt.id().event(),
+                     row.channel,
+                     geo::PlaneGeo::ViewName(fgeom->View(row.channel)),
+                     row.ntrk,
+                     row.tracks,
+                     fRowAdc[r - begin].data() + row.start_tick);
     }
-    std::cout << "Total number of noise channels " << noisechancount << std::endl;
   }
 }
+
 DEFINE_ART_MODULE(nnet::RawWaveformDump)
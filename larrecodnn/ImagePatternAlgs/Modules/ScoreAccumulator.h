@@ -0,0 +1,122 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Class:       ScoreAccumulator
+// File:        ScoreAccumulator.h
+//
+//      Outputs of clusters or tracks (owners) accumulated from the outputs of their hits as
+//      soon as hits are classified. The hit -> owners index is built once per event, in CSR
+//      layout (owners of hit h are entries [offsets[h], offsets[h+1]) of the list), then each
+//      hit output is added to all its owners. Result is the same as from
+//      MVAWriter::getOutput(hits, weight): weighted mean of the clamped log-probabilities,
+//      exponentiated and normalized, or 1/N for each output if the total weight is 0.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef ScoreAccumulator_H
+#define ScoreAccumulator_H
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace nnet {
+
+  template <size_t N>
+  class ScoreAccumulator {
+  public:
+    // nOwners owners, hitsOf(i) gives hits of owner i (items with key() of the hit);
+    // nHits: size of the hit collection
+    template <typename F>
+    void
+    index(size_t nOwners, size_t nHits, F&& hitsOf)
+    {
+      fOffsets.assign(nHits + 1, 0);
+      for (size_t i = 0; i < nOwners; ++i) {
+        for (auto const& hit : hitsOf(i)) {
+          ++fOffsets[hit.key() + 1];
+        }
+      }
+      for (size_t h = 0; h < nHits; ++h) {
+        fOffsets[h + 1] += fOffsets[h];
+      }
+
+      fOwners.resize(fOffsets.back());
+      std::vector<size_t> fill(fOffsets.begin(), fOffsets.end() - 1);
+      for (size_t i = 0; i < nOwners; ++i) {
+        for (auto const& hit : hitsOf(i)) {
+          fOwners[fill[hit.key()]++] = i;
+        }
+      }
+
+      fSums.assign(nOwners, {});
+      fWeights.assign(nOwners, 0.0);
+    }
+
+    // number of owners of the hit
+    size_t
+    owners(size_t h) const
+    {
+      return (h + 1 < fOffsets.size()) ? fOffsets[h + 1] - fOffsets[h] : 0;
+    }
+
+    // add output of the hit with weight w to all its owners
+    template <typename V>
+    void
+    add(size_t h, float w, V const& out)
+    {
+      if ((w == 0) || (h + 1 >= fOffsets.size()) || (fOffsets[h] == fOffsets[h + 1])) return;
+
+      const float pmin = 1.0e-6, pmax = 1.0 - pmin;
+      const float log_pmin = std::log(pmin), log_pmax = std::log(pmax);
+
+      std::array<double, N> v;
+      for (size_t k = 0; k < N; ++k) {
+        if (out[k] < pmin)
+          v[k] = log_pmin;
+        else if (out[k] > pmax)
+          v[k] = log_pmax;
+        else
+          v[k] = std::log(out[k]);
+      }
+
+      for (size_t j = fOffsets[h]; j < fOffsets[h + 1]; ++j) {
+        auto& sum = fSums[fOwners[j]];
+        for (size_t k = 0; k < N; ++k) {
+          sum[k] += w * v[k];
+        }
+        fWeights[fOwners[j]] += w;
+      }
+    }
+
+    // accumulated output of owner i
+    std::array<float, N>
+    output(size_t i) const
+    {
+      std::array<float, N> result;
+      if (fWeights[i] > 0.0) {
+        std::array<double, N> p;
+        double totp = 0.0;
+        for (size_t k = 0; k < N; ++k) {
+          p[k] = std::exp(fSums[i][k] / fWeights[i]);
+          totp += p[k];
+        }
+        for (size_t k = 0; k < N; ++k) {
+          result[k] = p[k] / totp;
+        }
+      }
+      else {
+        result.fill(1.0 / N);
+      }
+      return result;
+    }
+
+  private:
+    std::vector<size_t> fOffsets; // CSR row offsets, by hit key
+    std::vector<size_t> fOwners;  // owners of hits, concatenated
+    std::vector<std::array<double, N>> fSums;
+    std::vector<double> fWeights;
+  };
+
+}
+
+#endif
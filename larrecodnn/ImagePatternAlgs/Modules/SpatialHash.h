@@ -0,0 +1,121 @@
+#ifndef SPATIALHASH_H
+#define SPATIALHASH_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Class:       SpatialHash
+// File:        SpatialHash.h
+//
+//      Uniform grid of 3D points for fixed radius queries. Points are stored in
+//      cubic cells, a query visits only cells overlapping with the query sphere,
+//      so with the cell size equal to the radius it is 27 cells around the point.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <TVector3.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace nnet {
+
+  class SpatialHash {
+  public:
+    explicit SpatialHash(double cellSize) : fCellSize(cellSize > 0 ? cellSize : 1.0) {}
+
+    void
+    clear()
+    {
+      fPoints.clear();
+      fCells.clear();
+    }
+
+    size_t
+    size() const
+    {
+      return fPoints.size();
+    }
+
+    TVector3 const&
+    point(size_t idx) const
+    {
+      return fPoints[idx];
+    }
+
+    // add point, returns its index (points are indexed in the insertion order)
+    size_t
+    insert(TVector3 const& p)
+    {
+      fCells[cellKey(cell(p.X()), cell(p.Y()), cell(p.Z()))].push_back(fPoints.size());
+      fPoints.push_back(p);
+      return fPoints.size() - 1;
+    }
+
+    void
+    insert(std::vector<TVector3> const& points)
+    {
+      fPoints.reserve(fPoints.size() + points.size());
+      for (auto const& p : points) {
+        insert(p);
+      }
+    }
+
+    // indices of points closer than radius to p, in ascending order (insertion order)
+    void
+    query(TVector3 const& p, double radius, std::vector<size_t>& result) const
+    {
+      result.clear();
+      const int64_t x0 = cell(p.X() - radius), x1 = cell(p.X() + radius);
+      const int64_t y0 = cell(p.Y() - radius), y1 = cell(p.Y() + radius);
+      const int64_t z0 = cell(p.Z() - radius), z1 = cell(p.Z() + radius);
+      for (int64_t x = x0; x <= x1; ++x) {
+        for (int64_t y = y0; y <= y1; ++y) {
+          for (int64_t z = z0; z <= z1; ++z) {
+            auto c = fCells.find(cellKey(x, y, z));
+            if (c == fCells.end()) continue;
+            for (size_t idx : c->second) {
+              if ((fPoints[idx] - p).Mag() < radius) { result.push_back(idx); }
+            }
+          }
+        }
+      }
+      std::sort(result.begin(), result.end());
+    }
+
+    // bulk version: neighbours of each of the points
+    std::vector<std::vector<size_t>>
+    query(std::vector<TVector3> const& points, double radius) const
+    {
+      std::vector<std::vector<size_t>> result(points.size());
+      for (size_t i = 0; i < points.size(); ++i) {
+        query(points[i], radius, result[i]);
+      }
+      return result;
+    }
+
+  private:
+    int64_t
+    cell(double x) const
+    {
+      return (int64_t)std::floor(x / fCellSize);
+    }
+
+    // 21 bits per coordinate; cells wrapping around the range share the key, what
+    // only adds candidates rejected by the distance check
+    static uint64_t
+    cellKey(int64_t x, int64_t y, int64_t z)
+    {
+      const uint64_t mask = (1ULL << 21) - 1;
+      return (((uint64_t)x & mask) << 42) | (((uint64_t)y & mask) << 21) | ((uint64_t)z & mask);
+    }
+
+    double fCellSize;
+    std::vector<TVector3> fPoints;
+    std::unordered_map<uint64_t, std::vector<size_t>> fCells;
+  };
+
+}
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef TRUTHINDEX_H
+#define TRUTHINDEX_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Class:       TruthIndex
+// File:        TruthIndex.h
+//
+//      Per-event index of the simulated energy deposits: SimChannels grouped by
+//      channel number, their time slices in TDC order and each deposit with its
+//      MCParticle (and PDG code) already looked up. Built once per event, then
+//      queried by channel and tick range instead of scanning all SimChannels.
+//      Deposits are visited in the SimChannel order, as when looping over the
+//      SimChannel collection.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "art/Framework/Principal/Event.h"
+#include "art/Framework/Principal/Handle.h"
+#include "canvas/Utilities/InputTag.h"
+#include "larcoreobj/SimpleTypesAndConstants/RawTypes.h"
+#include "lardataobj/Simulation/SimChannel.h"
+#include "nusimdata/SimulationBase/MCParticle.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace nnet {
+
+  class TruthIndex {
+  public:
+    struct Deposit {
+      int trackID;
+      int pdg; // PDG code of the particle, 0 if not found or for EM activity (trackID < 0)
+      float numElectrons;
+      float energy;
+      simb::MCParticle const* particle; // nullptr if not found
+    };
+
+    // deposits of one TDC tick
+    struct Slice {
+      int tdc;
+      size_t begin, end;
+    };
+
+    // time slices of one SimChannel
+    struct Segment {
+      raw::ChannelID_t channel;
+      size_t sim; // index in the SimChannel collection
+      size_t begin, end;
+    };
+
+    template <typename T>
+    struct Range {
+      T const* b;
+      T const* e;
+      T const* begin() const { return b; }
+      T const* end() const { return e; }
+      size_t size() const { return e - b; }
+      bool empty() const { return b == e; }
+    };
+
+    // build for the event, to be called once per event: products of the previous event
+    // may be gone, so nothing is reused; with an empty particleTag deposits are not
+    // matched to particles
+    void
+    update(art::Event const& event,
+           art::InputTag const& simChannelTag,
+           art::InputTag const& particleTag = {})
+    {
+      auto simChannelHandle = event.getValidHandle<std::vector<sim::SimChannel>>(simChannelTag);
+      std::vector<simb::MCParticle> const* particles = nullptr;
+      if (!particleTag.label().empty()) {
+        particles = event.getValidHandle<std::vector<simb::MCParticle>>(particleTag).product();
+      }
+      build(*simChannelHandle, particles);
+    }
+
+    void
+    build(std::vector<sim::SimChannel> const& channels,
+          std::vector<simb::MCParticle> const* particles)
+    {
+      fParticleMap.clear();
+      if (particles) {
+        for (auto const& particle : *particles) {
+          fParticleMap[particle.TrackId()] = &particle;
+        }
+      }
+
+      fDeposits.clear();
+      fSlices.clear();
+      fSegments.clear();
+      fSegments.reserve(channels.size());
+      for (size_t i = 0; i < channels.size(); ++i) {
+        auto const& timeSlices = channels[i].TDCIDEMap();
+        fSegments.push_back({channels[i].Channel(), i, fSlices.size(), 0});
+        for (auto const& timeSlice : timeSlices) {
+          fSlices.push_back({int(timeSlice.first), fDeposits.size(), 0});
+          for (auto const& energyDeposit : timeSlice.second) {
+            simb::MCParticle const* particle =
+              (energyDeposit.trackID > 0) ? this->particle(energyDeposit.trackID) : nullptr;
+            fDeposits.push_back({energyDeposit.trackID,
+                                 particle ? particle->PdgCode() : 0,
+                                 energyDeposit.numElectrons,
+                                 energyDeposit.energy,
+                                 particle});
+          }
+          fSlices.back().end = fDeposits.size();
+        }
+        fSegments.back().end = fSlices.size();
+      }
+
+      // .. by channel, SimChannels of the same channel kept in the input order
+      std::stable_sort(fSegments.begin(), fSegments.end(), [](auto const& a, auto const& b) {
+        return a.channel < b.channel;
+      });
+    }
+
+    // SimChannels of all channels, ordered by channel number
+    Range<Segment>
+    segments() const
+    {
+      return {fSegments.data(), fSegments.data() + fSegments.size()};
+    }
+
+    // SimChannels of the channel (usually one or none)
+    Range<Segment>
+    segments(raw::ChannelID_t channel) const
+    {
+      auto first = std::lower_bound(
+        fSegments.begin(), fSegments.end(), channel, [](Segment const& s, raw::ChannelID_t ch) {
+          return s.channel < ch;
+        });
+      auto last = first;
+      while ((last != fSegments.end()) && (last->channel == channel)) {
+        ++last;
+      }
+      return {fSegments.data() + (first - fSegments.begin()),
+              fSegments.data() + (last - fSegments.begin())};
+    }
+
+    Range<Slice>
+    slices(Segment const& segment) const
+    {
+      return {fSlices.data() + segment.begin, fSlices.data() + segment.end};
+    }
+
+    // time slices of the SimChannel with tdc0 <= tdc < tdc1
+    Range<Slice>
+    slices(Segment const& segment, int tdc0, int tdc1) const
+    {
+      auto const all = slices(segment);
+      auto first = std::lower_bound(
+        all.begin(), all.end(), tdc0, [](Slice const& s, int t) { return s.tdc < t; });
+      auto last = std::lower_bound(
+        first, all.end(), tdc1, [](Slice const& s, int t) { return s.tdc < t; });
+      return {first, last};
+    }
+
+    // all deposits, in the SimChannel collection order
+    Range<Deposit>
+    deposits() const
+    {
+      return {fDeposits.data(), fDeposits.data() + fDeposits.size()};
+    }
+
+    Range<Deposit>
+    deposits(Slice const& slice) const
+    {
+      return {fDeposits.data() + slice.begin, fDeposits.data() + slice.end};
+    }
+
+    // f(int tdc, Deposit const&) for deposits in the channel with tdc0 <= tdc < tdc1
+    template <typename F>
+    void
+    forEachDeposit(raw::ChannelID_t channel, int tdc0, int tdc1, F&& f) const
+    {
+      for (auto const& segment : segments(channel)) {
+        for (auto const& slice : slices(segment, tdc0, tdc1)) {
+          for (auto const& deposit : deposits(slice)) {
+            f(slice.tdc, deposit);
+          }
+        }
+      }
+    }
+
+    simb::MCParticle const*
+    particle(int trackID) const
+    {
+      auto search = fParticleMap.find(trackID);
+      return (search != fParticleMap.end()) ? search->second : nullptr;
+    }
+
+    std::unordered_map<int, const simb::MCParticle*> const&
+    particleMap() const
+    {
+      return fParticleMap;
+    }
+
+  private:
+    std::unordered_map<int, const simb::MCParticle*> fParticleMap;
+    std::vector<Deposit> fDeposits;
+    std::vector<Slice> fSlices;
+    std::vector<Segment> fSegments;
+  };
+
+}
+
+#endif
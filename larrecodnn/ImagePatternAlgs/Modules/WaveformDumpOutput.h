@@ -0,0 +1,319 @@
+#ifndef WAVEFORMDUMPOUTPUT_H
+#define WAVEFORMDUMPOUTPUT_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Class:       WaveformDumpOutput
+// File:        WaveformDumpOutput.h
+//
+//      Rows of the waveform dumps (RawWaveformDump, RawWaveformClnSigDump):
+//      - "npy":  c2numpy record arrays, 5 fixed track slots with padded strings,
+//                clean signal waveforms in a separate file;
+//      - "root": TTree with variable length track lists and waveforms, compressed
+//                in clusters of rows (compression = 100 * algorithm + level: 505 is
+//                zstd level 5, 404 is lz4 level 4), clean signal in the same tree.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "larrecodnn/ImagePatternAlgs/Modules/c2numpy.h"
+
+#include "messagefacility/MessageLogger/MessageLogger.h"
+#include "cetlib_except/exception.h"
+
+#include "TFile.h"
+#include "TTree.h"
+
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace nnet {
+
+  // signal of one particle in the dumped waveform
+  struct WaveformTrack {
+    int trackid;
+    int pdgcode;
+    std::string genlab;
+    std::string procid;
+    float edep;
+    unsigned int numel;
+    unsigned short stck1; // first and last tick of the signal
+    unsigned short stck2;
+    int pktdc = 0; // peak tick and ADC, saved only with peak info
+    int pkadc = 0;
+  };
+
+  class WaveformDumpOutput {
+  public:
+    static constexpr size_t kNpyTracks = 5;
+    static constexpr int32_t kNpyRowsPerFile = 50000;
+
+    WaveformDumpOutput(std::string const& format,
+                       std::string const& fileName,
+                       std::string const& cleanFileName, // no clean signal output if empty
+                       bool peakInfo,
+                       size_t nTicks,
+                       int compression)
+      : fPeakInfo(peakInfo), fClean(!cleanFileName.empty()), fNTicks(nTicks)
+    {
+      if (format == "npy") { initNpy(fileName, cleanFileName); }
+      else if (format == "root") {
+        initTree(fileName, compression);
+      }
+      else {
+        throw cet::exception("WaveformDumpOutput") << "Unknown output format: " << format;
+      }
+    }
+    // files are normally closed by an explicit close() at the end of job; here the job may be
+    // unwinding from another exception, so a write failure is only logged
+    ~WaveformDumpOutput()
+    {
+      try {
+        close();
+      }
+      catch (cet::exception const& e) {
+        mf::LogError("WaveformDumpOutput") << e.what();
+      }
+    }
+
+    WaveformDumpOutput(WaveformDumpOutput const&) = delete;
+    WaveformDumpOutput& operator=(WaveformDumpOutput const&) = delete;
+
+    // tracks beyond this number are not saved
+    size_t
+    maxTracks() const
+    {
+      return fTree ? std::numeric_limits<size_t>::max() : kNpyTracks;
+    }
+
+    // ntrk: number of tracks recorded in the row, tracks: signals to save; adc (and clean
+    // signal if enabled) of the size set at construction
+    void
+    write(unsigned int evt,
+          unsigned int chan,
+          std::string const& view,
+          unsigned int ntrk,
+          std::vector<WaveformTrack> const& tracks,
+          short const* adc,
+          short const* clean = nullptr)
+    {
+      if (fTree) { fillTree(evt, chan, view, ntrk, tracks, adc, clean); }
+      else {
+        writeNpy(evt, chan, view, ntrk, tracks, adc, clean);
+      }
+    }
+
+    void
+    close()
+    {
+      if (fFile) {
+        fFile->cd();
+        fTree->Write();
+        fFile->Close();
+        fFile.reset();
+        fTree = nullptr;
+      }
+      if (fNpyOpen) {
+        int status = c2numpy_close(&fNpy);
+        if (fClean) { status |= c2numpy_close(&fNpyClean); }
+        fNpyOpen = false;
+        if (status != 0) {
+          throw cet::exception("WaveformDumpOutput") << "Failed to write numpy files.";
+        }
+      }
+    }
+
+  private:
+    void
+    initNpy(std::string const& fileName, std::string const& cleanFileName)
+    {
+      c2numpy_init(&fNpy, fileName, kNpyRowsPerFile);
+      c2numpy_addcolumn(&fNpy, "evt", C2NUMPY_UINT32);
+      c2numpy_addcolumn(&fNpy, "chan", C2NUMPY_UINT32);
+      c2numpy_addcolumn(&fNpy, "view", (c2numpy_type)((int)C2NUMPY_STRING + 1));
+      c2numpy_addcolumn(&fNpy, "ntrk", C2NUMPY_UINT16);
+
+      for (unsigned int i = 0; i < kNpyTracks; i++) {
+        std::string idx = std::to_string(i);
+        c2numpy_addcolumn(&fNpy, "tid" + idx, C2NUMPY_INT32);
+        c2numpy_addcolumn(&fNpy, "pdg" + idx, C2NUMPY_INT32);
+        c2numpy_addcolumn(&fNpy, "gen" + idx, (c2numpy_type)((int)C2NUMPY_STRING + 6));
+        c2numpy_addcolumn(&fNpy, "pid" + idx, (c2numpy_type)((int)C2NUMPY_STRING + 7));
+        c2numpy_addcolumn(&fNpy, "edp" + idx, C2NUMPY_FLOAT32);
+        c2numpy_addcolumn(&fNpy, "nel" + idx, C2NUMPY_UINT32);
+        c2numpy_addcolumn(&fNpy, "sti" + idx, C2NUMPY_UINT16);
+        c2numpy_addcolumn(&fNpy, "stf" + idx, C2NUMPY_UINT16);
+        if (fPeakInfo) {
+          c2numpy_addcolumn(&fNpy, "stp" + idx, C2NUMPY_INT32);
+          c2numpy_addcolumn(&fNpy, "adc" + idx, C2NUMPY_INT32);
+        }
+      }
+
+      for (size_t i = 0; i < fNTicks; i++) {
+        c2numpy_addcolumn(&fNpy, "tck_" + std::to_string(i), C2NUMPY_INT16);
+      }
+
+      // ... this is for storing the clean signal (no noise) waveform
+      if (fClean) {
+        c2numpy_init(&fNpyClean, cleanFileName, kNpyRowsPerFile);
+        for (size_t i = 0; i < fNTicks; i++) {
+          c2numpy_addcolumn(&fNpyClean, "tck_" + std::to_string(i), C2NUMPY_INT16);
+        }
+      }
+      fNpyOpen = true;
+    }
+
+    void
+    writeNpy(unsigned int evt,
+             unsigned int chan,
+             std::string const& view,
+             unsigned int ntrk,
+             std::vector<WaveformTrack> const& tracks,
+             short const* adc,
+             short const* clean)
+    {
+      c2numpy_uint32(&fNpy, evt);
+      c2numpy_uint32(&fNpy, chan);
+      c2numpy_string(&fNpy, view.c_str());
+      c2numpy_uint16(&fNpy, ntrk);
+
+      for (size_t i = 0; i < kNpyTracks; ++i) {
+        if (i < tracks.size()) {
+          auto const& t = tracks[i];
+          std::string genlab(t.genlab), procid(t.procid);
+          genlab.resize(6, ' ');
+          procid.resize(7, ' ');
+          c2numpy_int32(&fNpy, t.trackid);
+          c2numpy_int32(&fNpy, t.pdgcode);
+          c2numpy_string(&fNpy, genlab.c_str());
+          c2numpy_string(&fNpy, procid.c_str());
+          c2numpy_float32(&fNpy, t.edep);
+          c2numpy_uint32(&fNpy, t.numel);
+          c2numpy_uint16(&fNpy, t.stck1);
+          c2numpy_uint16(&fNpy, t.stck2);
+          if (fPeakInfo) {
+            c2numpy_int32(&fNpy, t.pktdc);
+            c2numpy_int32(&fNpy, t.pkadc);
+          }
+        }
+        else { // .. pad with 0's if number of peaks less than 5
+          c2numpy_int32(&fNpy, 0);
+          c2numpy_int32(&fNpy, 0);
+          c2numpy_string(&fNpy, "none  ");
+          c2numpy_string(&fNpy, "none   ");
+          c2numpy_float32(&fNpy, 0.);
+          c2numpy_uint32(&fNpy, 0);
+          c2numpy_uint16(&fNpy, 0);
+          c2numpy_uint16(&fNpy, 0);
+          if (fPeakInfo) {
+            c2numpy_int32(&fNpy, 0);
+            c2numpy_int32(&fNpy, 0);
+          }
+        }
+      }
+
+      c2numpy_int16_array(&fNpy, adc, fNTicks);
+      if (fClean && clean) { c2numpy_int16_array(&fNpyClean, clean, fNTicks); }
+    }
+
+    void
+    initTree(std::string const& fileName, int compression)
+    {
+      fFile.reset(TFile::Open((fileName + ".root").c_str(), "RECREATE", "", compression));
+      if (!fFile || fFile->IsZombie()) {
+        throw cet::exception("WaveformDumpOutput") << "Cannot create " << fileName << ".root";
+      }
+
+      fTree = new TTree("waveforms", "waveform dump"); // owned by fFile
+      fTree->SetAutoFlush(-16 * 1024 * 1024);          // compressed in ~16 MB clusters of rows
+      fTree->Branch("evt", &fEvt);
+      fTree->Branch("chan", &fChan);
+      fTree->Branch("view", &fView);
+      fTree->Branch("ntrk", &fNtrk);
+      fTree->Branch("tid", &fTid);
+      fTree->Branch("pdg", &fPdg);
+      fTree->Branch("gen", &fGen);
+      fTree->Branch("pid", &fPid);
+      fTree->Branch("edp", &fEdp);
+      fTree->Branch("nel", &fNel);
+      fTree->Branch("sti", &fSti);
+      fTree->Branch("stf", &fStf);
+      if (fPeakInfo) {
+        fTree->Branch("stp", &fStp);
+        fTree->Branch("adc", &fAdcPeak);
+      }
+      fTree->Branch("tck", &fTicks);
+      if (fClean) { fTree->Branch("clean", &fCleanTicks); }
+    }
+
+    void
+    fillTree(unsigned int evt,
+             unsigned int chan,
+             std::string const& view,
+             unsigned int ntrk,
+             std::vector<WaveformTrack> const& tracks,
+             short const* adc,
+             short const* clean)
+    {
+      fEvt = evt;
+      fChan = chan;
+      fView = view;
+      fNtrk = ntrk;
+
+      fTid.clear();
+      fPdg.clear();
+      fGen.clear();
+      fPid.clear();
+      fEdp.clear();
+      fNel.clear();
+      fSti.clear();
+      fStf.clear();
+      fStp.clear();
+      fAdcPeak.clear();
+      for (auto const& t : tracks) {
+        fTid.push_back(t.trackid);
+        fPdg.push_back(t.pdgcode);
+        fGen.push_back(t.genlab);
+        fPid.push_back(t.procid);
+        fEdp.push_back(t.edep);
+        fNel.push_back(t.numel);
+        fSti.push_back(t.stck1);
+        fStf.push_back(t.stck2);
+        fStp.push_back(t.pktdc);
+        fAdcPeak.push_back(t.pkadc);
+      }
+
+      fTicks.assign(adc, adc + fNTicks);
+      if (clean) { fCleanTicks.assign(clean, clean + fNTicks); }
+      else {
+        fCleanTicks.clear();
+      }
+
+      fTree->Fill();
+    }
+
+    const bool fPeakInfo;
+    const bool fClean;
+    const size_t fNTicks;
+
+    c2numpy_writer fNpy;
+    c2numpy_writer fNpyClean;
+    bool fNpyOpen = false;
+
+    std::unique_ptr<TFile> fFile;
+    TTree* fTree = nullptr;
+    unsigned int fEvt, fChan, fNtrk;
+    std::string fView;
+    std::vector<int> fTid, fPdg;
+    std::vector<std::string> fGen, fPid;
+    std::vector<float> fEdp;
+    std::vector<unsigned int> fNel;
+    std::vector<unsigned short> fSti, fStf;
+    std::vector<int> fStp, fAdcPeak;
+    std::vector<short> fTicks, fCleanTicks;
+  };
+
+}
+
+#endif
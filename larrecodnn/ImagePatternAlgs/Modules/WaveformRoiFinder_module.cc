@@ -13,14 +13,16 @@
 // Based on the Analyzer module written by Mike Wang.
 ////////////////////////////////////////////////////////////////////////
 
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/BatchSizeTuner.h"
 #include "larrecodnn/ImagePatternAlgs/ToolInterfaces/IWaveformRecog.h"
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/PerfStats.h"
 #include "larcore/Geometry/Geometry.h"
 #include "larcore/CoreUtils/ServiceUtil.h"
 #include "lardataobj/RawData/RawDigit.h"
 #include "lardataobj/RawData/raw.h"
 #include "lardataobj/RecoBase/Wire.h"
 
-#include "art/Framework/Core/EDProducer.h"
+#include "art/Framework/Core/SharedProducer.h"
 #include "art/Framework/Core/ModuleMacros.h"
 #include "art/Framework/Principal/Event.h"
 #include "art/Framework/Principal/Handle.h"
@@ -33,7 +35,15 @@
 #include "fhiclcpp/ParameterSet.h"
 #include "cetlib_except/exception.h"
 
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task_arena.h"
+
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <string>
 #include <utility> // std::move()
 #include <vector>
 
@@ -41,9 +51,9 @@ namespace nnet {
   class WaveformRoiFinder;
 }
 
-class nnet::WaveformRoiFinder : public art::EDProducer {
+class nnet::WaveformRoiFinder : public art::SharedProducer {
 public:
-  explicit WaveformRoiFinder(fhicl::ParameterSet const& p);
+  WaveformRoiFinder(fhicl::ParameterSet const& p, art::ProcessingFrame const&);
   // The compiler-generated destructor is fine for non-base
   // classes without bare pointers or other resource use.
 
@@ -54,9 +64,57 @@ public:
   WaveformRoiFinder& operator=(WaveformRoiFinder&&) = delete;
 
   // Required functions.
-  void produce(art::Event& e) override;
+  void beginJob(art::ProcessingFrame const&) override;
+  void produce(art::Event& e, art::ProcessingFrame const&) override;
+  void endJob(art::ProcessingFrame const&) override;
 
 private:
+  // Channels waiting for batched inference, per view; waveforms are decoded directly
+  // into the signal buffers, which are kept for reuse after the batch is flushed
+  struct PendingChannels {
+    std::vector<size_t> channels;
+    std::vector<std::vector<float>> signals;
+    std::vector<std::vector<float>> spare;
+
+    std::vector<float>&
+    add(size_t ich)
+    {
+      channels.push_back(ich);
+      if (spare.empty()) { signals.emplace_back(); }
+      else {
+        signals.push_back(std::move(spare.back()));
+        spare.pop_back();
+      }
+      return signals.back();
+    }
+    void
+    clear()
+    {
+      channels.clear();
+      for (auto& s : signals) {
+        spare.push_back(std::move(s));
+      }
+      signals.clear();
+    }
+  };
+
+  // Per-thread work buffers, reused by all channel chunks processed by the thread
+  struct Scratch {
+    std::vector<float> inputsignal;
+    std::vector<short> rawadc;
+    std::vector<bool> inroi;
+    std::vector<std::vector<bool>> inrois;
+    std::vector<PendingChannels> pending;
+    wavrec_tool::IWaveformRecog::Scratch recog;
+  };
+
+  // Output of one event: wire slots indexed by the input channel, filled by any thread
+  struct ChannelResults {
+    std::vector<recob::Wire> wires;
+    std::vector<char> hasROI; // not vector<bool>: slots are written concurrently
+    std::atomic<size_t> windows{0}; // scan windows of all channels
+  };
+
   art::InputTag fRawProducerLabel;
   art::InputTag fWireProducerLabel;
 
@@ -64,12 +122,62 @@ private:
 
   int fNPlanes;
   unsigned int fWaveformSize; // Full waveform size
+  size_t fInferenceBatchSize; // Windows per network call, 0: one call per channel
+  int fNumThreads;            // Threads for the channel loop, 1: serial, 0: TBB default
+  size_t fChannelChunkSize;   // Channels per parallel task
+  bool fWarmUp;               // Dummy inference at begin of job
+
+  std::unique_ptr<tbb::task_arena> fArena;
+
+  std::string fPerfReportFile;
+  nnet::PerfStats& fPerf; // stats of this module and its tools
+  nnet::PerfStage* fPerfEvent;
+  nnet::PerfStage* fPerfChannels;
+  nnet::PerfStage* fPerfWindows;
+  std::unique_ptr<nnet::BatchSizeTuner> fTuner; // InferenceBatchSize auto-tuned, if enabled
+
+  // Run all processing steps on channels [begin, end), results go to the channel slots
+  void processChannels(size_t begin,
+                       size_t end,
+                       const std::vector<art::Ptr<raw::RawDigit>>& rawlist,
+                       const std::vector<art::Ptr<recob::Wire>>& wirelist,
+                       Scratch& scratch,
+                       ChannelResults& results) const;
+
+  // Pedestal-subtracted waveform of the raw digit in signal, fWaveformSize ticks; uncompressed
+  // ADCs are read in place, compressed ones are first decoded to rawadc
+  void decodeRaw(const raw::RawDigit& digit,
+                 std::vector<short>& rawadc,
+                 std::vector<float>& signal) const;
+
+  // Build ROIs from the mask and store the wire in the channel slot
+  void makeWire(size_t ich,
+                const std::vector<art::Ptr<raw::RawDigit>>& rawlist,
+                const std::vector<art::Ptr<recob::Wire>>& wirelist,
+                const std::vector<float>& inputsignal,
+                const std::vector<bool>& inroi,
+                ChannelResults& results) const;
+
+  // Build ROIs from the mask, returns false if there is no ROI in the waveform
+  bool makeROIs(const std::vector<float>& inputsignal,
+                const std::vector<bool>& inroi,
+                recob::Wire::RegionsOfInterest_t& rois) const;
 };
 
-nnet::WaveformRoiFinder::WaveformRoiFinder(fhicl::ParameterSet const& p)
-  : EDProducer{p}
+nnet::WaveformRoiFinder::WaveformRoiFinder(fhicl::ParameterSet const& p,
+                                           art::ProcessingFrame const&)
+  : SharedProducer{p}
   , fRawProducerLabel(p.get<art::InputTag>("RawProducerLabel", ""))
   , fWireProducerLabel(p.get<art::InputTag>("WireProducerLabel", ""))
+  , fInferenceBatchSize(p.get<size_t>("InferenceBatchSize", 0))
+  , fNumThreads(p.get<int>("NumThreads", 1))
+  , fChannelChunkSize(p.get<size_t>("ChannelChunkSize", 256))
+  , fWarmUp(p.get<bool>("WarmUp", false))
+  , fPerfReportFile(p.get<std::string>("PerfReportFile", ""))
+  , fPerf(nnet::PerfRegistry::stats(p.get<std::string>("module_label")))
+  , fPerfEvent(fPerf.stage("event"))
+  , fPerfChannels(fPerf.stage("channels per event", nnet::PerfStage::Unit::Count))
+  , fPerfWindows(fPerf.stage("windows per event", nnet::PerfStage::Unit::Count))
 {
   // use either raw waveform or recob waveform
   if (fRawProducerLabel.empty() && fWireProducerLabel.empty()) {
@@ -91,14 +199,50 @@ nnet::WaveformRoiFinder::WaveformRoiFinder(fhicl::ParameterSet const& p)
   fWaveformSize = tool_psets[0].get<unsigned int>("WaveformSize");
   for (auto const& pset : tool_psets) {
     fWaveformRecogToolVec.push_back(art::make_tool<wavrec_tool::IWaveformRecog>(pset));
+    fWaveformRecogToolVec.back()->setPerfStats(&fPerf);
+  }
+
+  if (fNumThreads != 1) {
+    fArena = std::make_unique<tbb::task_arena>(fNumThreads > 1 ? fNumThreads :
+                                                                 tbb::task_arena::automatic);
+  }
+  if (fChannelChunkSize == 0) { fChannelChunkSize = 1; }
+
+  if (p.get<bool>("AutoTuneBatchSize", false)) {
+    if (fInferenceBatchSize == 0) {
+      throw cet::exception("WaveformRoiFinder")
+        << "AutoTuneBatchSize needs InferenceBatchSize > 0 as the initial batch size";
+    }
+    fTuner = std::make_unique<nnet::BatchSizeTuner>(p.get<std::string>("module_label"),
+                                                    fInferenceBatchSize,
+                                                    fWaveformRecogToolVec[0]->numWindows(),
+                                                    p.get<size_t>("MaxBatchSize", 65536),
+                                                    p.get<double>("MaxBatchLatencyMs", 0.),
+                                                    fPerf);
   }
 
   produces<std::vector<recob::Wire>>();
+
+  // tools are const and thread-safe, several events can be processed at once
+  async<art::InEvent>();
 }
 
 void
-nnet::WaveformRoiFinder::produce(art::Event& e)
+nnet::WaveformRoiFinder::beginJob(art::ProcessingFrame const&)
 {
+  if (!fWarmUp) { return; }
+  for (auto& tool : fWaveformRecogToolVec) {
+    size_t nwindows = fInferenceBatchSize ? fInferenceBatchSize : tool->numWindows();
+    tool->warmUp(nwindows);
+  }
+  mf::LogInfo("WaveformRoiFinder") << "WaveformRecog tools warmed up";
+}
+
+void
+nnet::WaveformRoiFinder::produce(art::Event& e, art::ProcessingFrame const&)
+{
+  nnet::PerfTimer timer(fPerfEvent);
+
   art::Handle<std::vector<raw::RawDigit>> rawListHandle;
   std::vector<art::Ptr<raw::RawDigit>> rawlist;
   if (e.getByLabel(fRawProducerLabel, rawListHandle)) art::fill_ptr_vector(rawlist, rawListHandle);
@@ -110,84 +254,213 @@ nnet::WaveformRoiFinder::produce(art::Event& e)
 
   std::unique_ptr<std::vector<recob::Wire>> outwires(new std::vector<recob::Wire>);
 
+  const size_t nchannels = rawlist.empty() ? wirelist.size() : rawlist.size();
+
+  // ... output wires are kept in the input channel order, whatever thread or batch made them
+  ChannelResults results;
+  results.wires.resize(nchannels);
+  results.hasROI.assign(nchannels, 0);
+
+  if (!fArena) {
+    Scratch scratch;
+    processChannels(0, nchannels, rawlist, wirelist, scratch, results);
+  }
+  else {
+    tbb::enumerable_thread_specific<Scratch> scratches;
+    fArena->execute([&] {
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, nchannels, fChannelChunkSize),
+                        [&](const tbb::blocked_range<size_t>& r) {
+                          processChannels(
+                            r.begin(), r.end(), rawlist, wirelist, scratches.local(), results);
+                        });
+    });
+  }
+
+  size_t nout = std::count(results.hasROI.begin(), results.hasROI.end(), 1);
+  outwires->reserve(nout);
+  for (size_t ich = 0; ich < nchannels; ++ich) {
+    if (results.hasROI[ich]) { outwires->push_back(std::move(results.wires[ich])); }
+  }
+
+  fPerfChannels->add(nchannels);
+  fPerfWindows->add(results.windows);
+
+  e.put(std::move(outwires));
+}
+
+void
+nnet::WaveformRoiFinder::endJob(art::ProcessingFrame const&)
+{
+  for (size_t view = 0; view < fWaveformRecogToolVec.size(); ++view) {
+    auto const& tool = *fWaveformRecogToolVec[view];
+    size_t nscanned = tool.numScannedWindows(), nskipped = tool.numSkippedWindows();
+    mf::LogInfo("WaveformRoiFinder")
+      << "View " << view << ": " << nskipped << " of " << nscanned
+      << " windows skipped by the pre-filter ("
+      << (nscanned ? 100.0 * nskipped / nscanned : 0.0) << "%).";
+  }
+  if (fTuner) {
+    mf::LogInfo("WaveformRoiFinder")
+      << "inference batch size " << fTuner->batchSize() << " windows"
+      << (fTuner->converged() ? "" : " (auto-tuning not converged)");
+  }
+  fPerf.report(fPerfReportFile);
+}
+
+void
+nnet::WaveformRoiFinder::processChannels(size_t begin,
+                                         size_t end,
+                                         const std::vector<art::Ptr<raw::RawDigit>>& rawlist,
+                                         const std::vector<art::Ptr<recob::Wire>>& wirelist,
+                                         Scratch& scratch,
+                                         ChannelResults& results) const
+{
   auto const* geo = lar::providerFrom<geo::Geometry>();
 
+  auto& pending = scratch.pending;
+  pending.resize(fWaveformRecogToolVec.size());
+
+  // batch size may be changed by the tuner from other threads, one value is used per flush
+  auto batchSize = [&]() { return fTuner ? fTuner->batchSize() : fInferenceBatchSize; };
+
+  auto flush = [&](size_t view) {
+    auto& pv = pending[view];
+    if (pv.channels.empty()) { return; }
+    auto& inrois = scratch.inrois;
+    auto const& tool = *fWaveformRecogToolVec[view];
+    auto start = nnet::BatchSizeTuner::Clock::now();
+    tool.findROIs(pv.signals, batchSize(), inrois, scratch.recog);
+    if (fTuner) {
+      fTuner->record(pv.channels.size() * tool.numWindows(),
+                     start,
+                     nnet::BatchSizeTuner::Clock::now());
+    }
+    for (size_t i = 0; i < pv.channels.size(); ++i) {
+      makeWire(pv.channels[i], rawlist, wirelist, pv.signals[i], inrois[i], results);
+    }
+    pv.clear();
+  };
+
+  auto& inputsignal = scratch.inputsignal;
+  auto& rawadc = scratch.rawadc;
+  size_t nwindows = 0;
+
   //##############################
   //### Looping over the wires ###
   //##############################
-  for (unsigned int ich = 0; ich < (rawlist.empty() ? wirelist.size() : rawlist.size()); ++ich) {
+  for (size_t ich = begin; ich < end; ++ich) {
 
-    std::vector<float> inputsignal(fWaveformSize);
+    int view = !wirelist.empty() ? (int)wirelist[ich]->View() :
+                                   (int)geo->View(rawlist[ich]->Channel());
 
-    int view = -1;
+    // ... waveform goes straight to the batch if the inference is batched
+    const bool batched = (fInferenceBatchSize > 0);
+    auto& signal = batched ? pending[view].add(ich) : inputsignal;
 
     if (!wirelist.empty()) {
-      const auto& wire = wirelist[ich];
-      const auto& signal = wire->Signal();
-
-      view = wire->View();
-
-      for (size_t itck = 0; itck < inputsignal.size(); ++itck) {
-        inputsignal[itck] = signal[itck];
-      }
+      const auto& wsignal = wirelist[ich]->Signal();
+      signal.assign(fWaveformSize, 0.);
+      std::copy_n(wsignal.begin(), std::min<size_t>(wsignal.size(), fWaveformSize), signal.begin());
     }
     else if (!rawlist.empty()) {
-      const auto& digitVec = rawlist[ich];
-
-      view = geo->View(rawlist[ich]->Channel());
+      decodeRaw(*rawlist[ich], rawadc, signal);
+    }
 
-      std::vector<short> rawadc(fWaveformSize);
-      raw::Uncompress(digitVec->ADCs(), rawadc, digitVec->GetPedestal(), digitVec->Compression());
-      for (size_t itck = 0; itck < rawadc.size(); ++itck) {
-        inputsignal[itck] = rawadc[itck] - digitVec->GetPedestal();
-      }
+    nwindows += fWaveformRecogToolVec[view]->numWindows();
+    if (!batched) {
+      // ... use waveform recognition CNN to perform inference on each window
+      fWaveformRecogToolVec[view]->findROI(inputsignal, scratch.inroi, scratch.recog);
+      makeWire(ich, rawlist, wirelist, inputsignal, scratch.inroi, results);
+    }
+    else if (pending[view].channels.size() * fWaveformRecogToolVec[view]->numWindows() >=
+             batchSize()) {
+      // ... windows of the view are collected until the batch is full
+      flush(view);
     }
+  }
+  for (size_t view = 0; view < pending.size(); ++view) {
+    flush(view);
+  }
+  results.windows += nwindows;
+}
+
+void
+nnet::WaveformRoiFinder::decodeRaw(const raw::RawDigit& digit,
+                                   std::vector<short>& rawadc,
+                                   std::vector<float>& signal) const
+{
+  const auto& adcs = digit.ADCs();
+  const short* adc = adcs.data();
+  size_t n = std::min<size_t>(adcs.size(), fWaveformSize);
+  if (digit.Compression() != raw::kNone) {
+    rawadc.resize(std::max<size_t>(fWaveformSize, digit.Samples()));
+    raw::Uncompress(adcs, rawadc, digit.GetPedestal(), digit.Compression());
+    adc = rawadc.data();
+    n = fWaveformSize;
+  }
 
-    // ... use waveform recognition CNN to perform inference on each window
-    std::vector<bool> inroi(fWaveformSize, false);
-    inroi = fWaveformRecogToolVec[view]->findROI(inputsignal);
+  signal.resize(fWaveformSize);
+  wavrec_tool::subtractPedestal(adc, digit.GetPedestal(), signal.data(), n);
+  std::fill(signal.begin() + n, signal.end(), 0.F);
+}
 
-    std::vector<float> sigs;
-    int lastsignaltick = -1;
-    int roistart = -1;
-    bool hasROI = false;
+void
+nnet::WaveformRoiFinder::makeWire(size_t ich,
+                                  const std::vector<art::Ptr<raw::RawDigit>>& rawlist,
+                                  const std::vector<art::Ptr<recob::Wire>>& wirelist,
+                                  const std::vector<float>& inputsignal,
+                                  const std::vector<bool>& inroi,
+                                  ChannelResults& results) const
+{
+  recob::Wire::RegionsOfInterest_t rois(fWaveformSize);
+  if (!makeROIs(inputsignal, inroi, rois)) { return; }
 
-    recob::Wire::RegionsOfInterest_t rois(fWaveformSize);
+  if (!wirelist.empty()) {
+    results.wires[ich] = recob::Wire(rois, wirelist[ich]->Channel(), wirelist[ich]->View());
+  }
+  else {
+    auto const* geo = lar::providerFrom<geo::Geometry>();
+    results.wires[ich] =
+      recob::Wire(rois, rawlist[ich]->Channel(), geo->View(rawlist[ich]->Channel()));
+  }
+  results.hasROI[ich] = 1;
+}
 
-    for (size_t i = 0; i < fWaveformSize; ++i) {
-      if (inroi[i]) {
-        hasROI = true;
-        if (sigs.empty()) {
+bool
+nnet::WaveformRoiFinder::makeROIs(const std::vector<float>& inputsignal,
+                                   const std::vector<bool>& inroi,
+                                   recob::Wire::RegionsOfInterest_t& rois) const
+{
+  std::vector<float> sigs;
+  int lastsignaltick = -1;
+  int roistart = -1;
+  bool hasROI = false;
+
+  for (size_t i = 0; i < fWaveformSize; ++i) {
+    if (inroi[i]) {
+      hasROI = true;
+      if (sigs.empty()) {
+        sigs.push_back(inputsignal[i]);
+        lastsignaltick = i;
+        roistart = i;
+      }
+      else {
+        if (int(i) != lastsignaltick + 1) {
+          rois.add_range(roistart, std::move(sigs));
+          sigs.clear();
           sigs.push_back(inputsignal[i]);
           lastsignaltick = i;
           roistart = i;
         }
         else {
-          if (int(i) != lastsignaltick + 1) {
-            rois.add_range(roistart, std::move(sigs));
-            sigs.clear();
-            sigs.push_back(inputsignal[i]);
-            lastsignaltick = i;
-            roistart = i;
-          }
-          else {
-            sigs.push_back(inputsignal[i]);
-            lastsignaltick = i;
-          }
+          sigs.push_back(inputsignal[i]);
+          lastsignaltick = i;
         }
       }
     }
-    if (!sigs.empty()) { rois.add_range(roistart, std::move(sigs)); }
-    if (!wirelist.empty() && hasROI ) {
-      outwires->emplace_back(recob::Wire(rois, wirelist[ich]->Channel(), wirelist[ich]->View()));
-    }
-    else if (!rawlist.empty() && hasROI ) {
-      outwires->emplace_back(
-        recob::Wire(rois, rawlist[ich]->Channel(), geo->View(rawlist[ich]->Channel())));
-    }
   }
-
-  e.put(std::move(outwires));
+  if (!sigs.empty()) { rois.add_range(roistart, std::move(sigs)); }
+  return hasROI;
 }
 
 DEFINE_ART_MODULE(nnet::WaveformRoiFinder)
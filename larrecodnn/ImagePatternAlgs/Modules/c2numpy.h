@@ -17,10 +17,15 @@
 
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 const char* C2NUMPY_VERSION = "1.2";
@@ -51,9 +56,28 @@ typedef enum {
     C2NUMPY_END          = 255   // ensure that c2numpy_type is at least a byte
 } c2numpy_type;
 
-// a Numpy writer object
+// Rows are serialized into an in-memory block, full blocks are written by a background
+// thread which also opens the rotating files and rewrites the header of the last one.
+const size_t C2NUMPY_BLOCK_SIZE = 16 * 1024 * 1024;   // flush rows when the block is this large
+const size_t C2NUMPY_MAX_QUEUED = 4;                  // blocks waiting for the thread, at most
+
+// (internal) work for the flushing thread, executed in order
 typedef struct {
-    FILE *file;                   // output file handle
+    enum { OPEN, DATA, CLOSE } action;
+    std::string fileName;         // OPEN: file to create
+    std::vector<char> data;       // OPEN: header, DATA: serialized rows
+    int32_t numRows;              // CLOSE: rows written to the file...
+    int64_t sizeSeekPosition;     // CLOSE: ...to be put here in the header, if fewer than promised
+    int64_t sizeSeekSize;
+} c2numpy_block;
+
+struct c2numpy_writer_struct;
+int c2numpy_close(struct c2numpy_writer_struct *writer);
+
+// a Numpy writer object
+typedef struct c2numpy_writer_struct {
+    FILE *file;                   // output file handle (used by the flushing thread)
+    bool fileOpen;                // a file is being written (rows go to the current file)
     std::string outputFilePrefix;       // output file name, not including the rotating number and .npy
     int64_t sizeSeekPosition;     // (internal) keep track of number of rows to modify before closing
     int64_t sizeSeekSize;         // (internal)
@@ -66,6 +90,18 @@ typedef struct {
     int32_t currentColumn;        // current column number
     int32_t currentRowInFile;     // current row number in the current file
     int32_t currentFileNumber;    // current file number
+
+    std::vector<char> buffer;     // (internal) rows not yet passed to the flushing thread
+    std::deque<c2numpy_block> queue;  // (internal) blocks waiting for the flushing thread
+    std::mutex mutex;             // (internal) protects queue, stop and status
+    std::condition_variable cv;   // (internal) queue has work / has space
+    std::thread flusher;          // (internal) flushing thread, started with the first file
+    bool stop;                    // (internal) thread finishes when queue is empty
+    int status;                   // (internal) non-zero if the thread failed to write
+
+    ~c2numpy_writer_struct() {    // rows not closed yet are written, the thread is joined
+        if (flusher.joinable()) c2numpy_close(this);
+    }
 } c2numpy_writer;
 
 const char *c2numpy_descr(c2numpy_type type) {
@@ -139,8 +175,99 @@ const char *c2numpy_descr(c2numpy_type type) {
     return NULL;
 }
 
+// (internal) body of the flushing thread
+void c2numpy_flush_loop(c2numpy_writer *writer) {
+    while (true) {
+        c2numpy_block block;
+        {
+            std::unique_lock<std::mutex> lock(writer->mutex);
+            writer->cv.wait(lock, [writer] { return writer->stop || !writer->queue.empty(); });
+            if (writer->queue.empty()) return;
+            block = std::move(writer->queue.front());
+            writer->queue.pop_front();
+        }
+        writer->cv.notify_all();
+
+        int status = 0;
+        if (block.action == c2numpy_block::OPEN) {
+            writer->file = fopen(block.fileName.c_str(), "wb");
+            if (writer->file == NULL) status = -1;
+        }
+        if (writer->file == NULL) {
+            status = -1;
+        }
+        else if (!block.data.empty()) {
+            if (fwrite(block.data.data(), 1, block.data.size(), writer->file) != block.data.size())
+                status = -1;
+        }
+        if (block.action == c2numpy_block::CLOSE && writer->file != NULL) {
+            // we wrote fewer rows than we promised
+            if (block.sizeSeekSize > 0) {
+                // so go back to the part of the header where that was written
+                fseek(writer->file, block.sizeSeekPosition, SEEK_SET);
+                // overwrite it with spaces
+                int i;
+                for (i = 0;  i < block.sizeSeekSize;  ++i)
+                    fputc(' ', writer->file);
+                // now go back and write it again (it MUST be fewer or an equal number of digits)
+                fseek(writer->file, block.sizeSeekPosition, SEEK_SET);
+                fprintf(writer->file, "%d", block.numRows);
+            }
+            // now close it
+            if (fclose(writer->file) != 0) status = -1;
+            writer->file = NULL;
+        }
+
+        if (status != 0) {
+            std::lock_guard<std::mutex> lock(writer->mutex);
+            writer->status = status;
+        }
+    }
+}
+
+// (internal) pass a block to the flushing thread, waits if too many are queued already
+void c2numpy_push(c2numpy_writer *writer, c2numpy_block&& block) {
+    {
+        std::unique_lock<std::mutex> lock(writer->mutex);
+        writer->cv.wait(lock, [writer] { return writer->queue.size() < C2NUMPY_MAX_QUEUED; });
+        writer->queue.push_back(std::move(block));
+    }
+    writer->cv.notify_all();
+}
+
+// (internal) pass rows buffered so far to the flushing thread
+void c2numpy_flush(c2numpy_writer *writer) {
+    if (writer->buffer.empty()) return;
+
+    c2numpy_block block;
+    block.action = c2numpy_block::DATA;
+    block.data.swap(writer->buffer);
+    c2numpy_push(writer, std::move(block));
+    writer->buffer.reserve(C2NUMPY_BLOCK_SIZE);
+}
+
+// (internal) buffered rows and the end of the current file for the flushing thread
+void c2numpy_flush_close(c2numpy_writer *writer) {
+    c2numpy_flush(writer);
+
+    c2numpy_block block;
+    block.action = c2numpy_block::CLOSE;
+    block.numRows = writer->currentRowInFile;
+    block.sizeSeekPosition = writer->sizeSeekPosition;
+    block.sizeSeekSize = (writer->currentRowInFile < writer->numRowsPerFile) ? writer->sizeSeekSize : 0;
+    c2numpy_push(writer, std::move(block));
+    writer->fileOpen = false;
+}
+
+// (internal) append bytes of the current column to the current row
+void c2numpy_append(c2numpy_writer *writer, const void *data, size_t size) {
+    const char *bytes = (const char *)data;
+    writer->buffer.insert(writer->buffer.end(), bytes, bytes + size);
+}
+
 int c2numpy_init(c2numpy_writer *writer, const std::string outputFilePrefix, int32_t numRowsPerFile) {
     writer->file = NULL;
+    writer->fileOpen = false;
     writer->outputFilePrefix = outputFilePrefix;
     writer->sizeSeekPosition = 0;
     writer->sizeSeekSize = 0;
@@ -152,6 +279,12 @@ int c2numpy_init(c2numpy_writer *writer, const std::string outputFilePrefix, int
     writer->currentRowInFile = 0;
     writer->currentFileNumber = 0;
 
+    writer->buffer.clear();
+    writer->buffer.reserve(C2NUMPY_BLOCK_SIZE);
+    writer->queue.clear();
+    writer->stop = false;
+    writer->status = 0;
+
     return 0;
 }
 
@@ -168,7 +301,6 @@ int c2numpy_open(c2numpy_writer *writer) {
     fileNameStream << writer->currentFileNumber;
     fileNameStream << ".npy";
     std::string fileName = fileNameStream.str();
-    writer->file = fopen(fileName.c_str(), "wb");
 
     std::stringstream headerStream;
     headerStream << "{'descr': [";
@@ -200,26 +332,36 @@ int c2numpy_open(c2numpy_writer *writer) {
       if (headerSize > 65535) version = 2;
     }
 
-    fwrite("\x93NUMPY", 1, 6, writer->file);
+    c2numpy_block block;
+    block.action = c2numpy_block::OPEN;
+    block.fileName = fileName;
+
+    block.data.insert(block.data.end(), "\x93NUMPY", "\x93NUMPY" + 6);
+    const char *sizeBytes = (const char *)&headerSize;
     if (version == 1) {
-      fwrite("\x01\x00", 1, 2, writer->file);
-      fwrite(&headerSize, 1, 2, writer->file);
+      block.data.insert(block.data.end(), "\x01\x00", "\x01\x00" + 2);
+      block.data.insert(block.data.end(), sizeBytes, sizeBytes + 2);
       writer->sizeSeekPosition += 6 + 2 + 2;
     }
     else {
-      fwrite("\x02\x00", 1, 2, writer->file);
-      fwrite(&headerSize, 1, 4, writer->file);
+      block.data.insert(block.data.end(), "\x02\x00", "\x02\x00" + 2);
+      block.data.insert(block.data.end(), sizeBytes, sizeBytes + 4);
       writer->sizeSeekPosition += 6 + 2 + 4;
     }
 
     std::string header = headerStream.str();
-    fwrite(header.c_str(), 1, header.size(), writer->file);
+    block.data.insert(block.data.end(), header.begin(), header.end());
+
+    if (!writer->flusher.joinable())
+      writer->flusher = std::thread(c2numpy_flush_loop, writer);
+    c2numpy_push(writer, std::move(block));
+    writer->fileOpen = true;
 
     return 0;
 }
 
 #define C2NUMPY_CHECK_ITEM {                                                    \
-    if (writer->file == NULL) {                                                 \
+    if (!writer->fileOpen) {                                                    \
         int status = c2numpy_open(writer);                                      \
         if (status != 0)                                                        \
             return status;                                                      \
@@ -230,11 +372,13 @@ int c2numpy_open(c2numpy_writer *writer) {
     if (writer->currentColumn == 0) {                                           \
         writer->currentRowInFile += 1;                                          \
         if (writer->currentRowInFile == writer->numRowsPerFile) {               \
-            fclose(writer->file);                                               \
-            writer->file = NULL;                                                \
+            c2numpy_flush_close(writer);                                        \
             writer->currentRowInFile = 0;                                       \
             writer->currentFileNumber += 1;                                     \
         }                                                                       \
+        else if (writer->buffer.size() >= C2NUMPY_BLOCK_SIZE) {                 \
+            c2numpy_flush(writer);                                              \
+        }                                                                       \
     }                                                                           \
     return 0;                                                                   \
 }
@@ -242,7 +386,7 @@ int c2numpy_open(c2numpy_writer *writer) {
 int c2numpy_bool(c2numpy_writer *writer, int8_t data) {   // "bool" is just a byte
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_BOOL) return -1;
-    fwrite(&data, sizeof(int8_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(int8_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -250,7 +394,7 @@ int c2numpy_bool(c2numpy_writer *writer, int8_t data) {   // "bool" is just a by
 int c2numpy_int(c2numpy_writer *writer, int64_t data) {   // Numpy's default int is 64-bit
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT) return -1;
-    fwrite(&data, sizeof(int64_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(int64_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -258,7 +402,7 @@ int c2numpy_int(c2numpy_writer *writer, int64_t data) {   // Numpy's default int
 int c2numpy_intc(c2numpy_writer *writer, int data) {      // the built-in C int
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INTC) return -1;
-    fwrite(&data, sizeof(int), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(int));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -266,7 +410,7 @@ int c2numpy_intc(c2numpy_writer *writer, int data) {      // the built-in C int
 int c2numpy_intp(c2numpy_writer *writer, size_t data) {   // intp is Numpy's way of saying size_t
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INTP) return -1;
-    fwrite(&data, sizeof(size_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(size_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -274,7 +418,7 @@ int c2numpy_intp(c2numpy_writer *writer, size_t data) {   // intp is Numpy's way
 int c2numpy_int8(c2numpy_writer *writer, int8_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT8) return -1;
-    fwrite(&data, sizeof(int8_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(int8_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -282,7 +426,7 @@ int c2numpy_int8(c2numpy_writer *writer, int8_t data) {
 int c2numpy_int16(c2numpy_writer *writer, int16_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT16) return -1;
-    fwrite(&data, sizeof(int16_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(int16_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -290,7 +434,7 @@ int c2numpy_int16(c2numpy_writer *writer, int16_t data) {
 int c2numpy_int32(c2numpy_writer *writer, int32_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT32) return -1;
-    fwrite(&data, sizeof(int32_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(int32_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -298,7 +442,7 @@ int c2numpy_int32(c2numpy_writer *writer, int32_t data) {
 int c2numpy_int64(c2numpy_writer *writer, int64_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_INT64) return -1;
-    fwrite(&data, sizeof(int64_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(int64_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -306,7 +450,7 @@ int c2numpy_int64(c2numpy_writer *writer, int64_t data) {
 int c2numpy_uint8(c2numpy_writer *writer, uint8_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_UINT8) return -1;
-    fwrite(&data, sizeof(uint8_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(uint8_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -314,7 +458,7 @@ int c2numpy_uint8(c2numpy_writer *writer, uint8_t data) {
 int c2numpy_uint16(c2numpy_writer *writer, uint16_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_UINT16) return -1;
-    fwrite(&data, sizeof(uint16_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(uint16_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -322,7 +466,7 @@ int c2numpy_uint16(c2numpy_writer *writer, uint16_t data) {
 int c2numpy_uint32(c2numpy_writer *writer, uint32_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_UINT32) return -1;
-    fwrite(&data, sizeof(uint32_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(uint32_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -330,7 +474,7 @@ int c2numpy_uint32(c2numpy_writer *writer, uint32_t data) {
 int c2numpy_uint64(c2numpy_writer *writer, uint64_t data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_UINT64) return -1;
-    fwrite(&data, sizeof(uint64_t), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(uint64_t));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -338,7 +482,7 @@ int c2numpy_uint64(c2numpy_writer *writer, uint64_t data) {
 int c2numpy_float(c2numpy_writer *writer, double data) {   // Numpy's "float" is a double
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_FLOAT) return -1;
-    fwrite(&data, sizeof(double), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(double));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -354,7 +498,7 @@ int c2numpy_float(c2numpy_writer *writer, double data) {   // Numpy's "float" is
 int c2numpy_float32(c2numpy_writer *writer, float data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_FLOAT32) return -1;
-    fwrite(&data, sizeof(float), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(float));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -362,7 +506,7 @@ int c2numpy_float32(c2numpy_writer *writer, float data) {
 int c2numpy_float64(c2numpy_writer *writer, double data) {
     C2NUMPY_CHECK_ITEM
     if (writer->columnTypes[writer->currentColumn] != C2NUMPY_FLOAT64) return -1;
-    fwrite(&data, sizeof(double), 1, writer->file);
+    c2numpy_append(writer, &data, sizeof(double));
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
     C2NUMPY_INCREMENT_ITEM
 }
@@ -396,7 +540,7 @@ int c2numpy_string(c2numpy_writer *writer, const char *data) {
 
     int stringlength = writer->columnTypes[writer->currentColumn] - C2NUMPY_STRING;
     if (0 < stringlength  &&  stringlength < 155)
-        fwrite(data, 1, stringlength, writer->file);
+        c2numpy_append(writer, data, stringlength);
     else
         return -1;
     writer->currentColumn = (writer->currentColumn + 1) % writer->numColumns;
@@ -404,25 +548,33 @@ int c2numpy_string(c2numpy_writer *writer, const char *data) {
     C2NUMPY_INCREMENT_ITEM
 }
 
+// n consecutive INT16 columns in one go, e.g. a whole waveform; the columns
+// must fit in the current row
+int c2numpy_int16_array(c2numpy_writer *writer, const int16_t *data, size_t n) {
+    C2NUMPY_CHECK_ITEM
+    if (writer->currentColumn + n > (size_t)writer->numColumns) return -1;
+    for (size_t i = 0;  i < n;  ++i)
+        if (writer->columnTypes[writer->currentColumn + i] != C2NUMPY_INT16) return -1;
+    c2numpy_append(writer, data, n * sizeof(int16_t));
+    writer->currentColumn = (writer->currentColumn + n) % writer->numColumns;
+    C2NUMPY_INCREMENT_ITEM
+}
+
 int c2numpy_close(c2numpy_writer *writer) {
-    if (writer->file != NULL) {
-        // we wrote fewer rows than we promised
-        if (writer->currentRowInFile < writer->numRowsPerFile) {
-            // so go back to the part of the header where that was written
-            fseek(writer->file, writer->sizeSeekPosition, SEEK_SET);
-            // overwrite it with spaces
-            int i;
-            for (i = 0;  i < writer->sizeSeekSize;  ++i)
-                fputc(' ', writer->file);
-            // now go back and write it again (it MUST be fewer or an equal number of digits)
-            fseek(writer->file, writer->sizeSeekPosition, SEEK_SET);
-            fprintf(writer->file, "%d", writer->currentRowInFile);
+    if (writer->fileOpen)
+        c2numpy_flush_close(writer);
+
+    // wait for all blocks to be written
+    if (writer->flusher.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(writer->mutex);
+            writer->stop = true;
         }
-        // now close it
-        fclose(writer->file);
+        writer->cv.notify_all();
+        writer->flusher.join();
     }
 
-    return 0;
+    return writer->status;
 }
 
 #endif // C2NUMPY
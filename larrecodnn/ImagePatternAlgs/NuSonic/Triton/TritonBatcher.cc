@@ -0,0 +1,186 @@
+#include "larrecodnn/ImagePatternAlgs/NuSonic/Triton/TritonBatcher.h"
+
+#include "messagefacility/MessageLogger/MessageLogger.h"
+#include "fhiclcpp/ParameterSet.h"
+#include "cetlib_except/exception.h"
+
+#include <algorithm>
+#include <exception>
+#include <tuple>
+
+namespace lartriton {
+
+std::shared_ptr<TritonBatcher> TritonBatcher::instance(const fhicl::ParameterSet& clientParams, unsigned maxDelayUs) {
+  using Key = std::tuple<std::string, std::vector<std::string>, std::string, std::string>;
+  static std::mutex registryMutex;
+  static std::map<Key, std::weak_ptr<TritonBatcher>> registry;
+
+  Key key(clientParams.get<std::string>("serverURL"),
+          clientParams.get<std::vector<std::string>>("serverURLs", {}),
+          clientParams.get<std::string>("modelName"),
+          clientParams.get<std::string>("modelVersion"));
+
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto batcher = registry[key].lock();
+  if (!batcher) {
+    batcher = std::make_shared<TritonBatcher>(clientParams, maxDelayUs);
+    registry[key] = batcher;
+  }
+  return batcher;
+}
+
+TritonBatcher::TritonBatcher(const fhicl::ParameterSet& clientParams, unsigned maxDelayUs)
+    : client_(std::make_unique<TritonClient>(clientParams)),
+      maxDelay_(maxDelayUs),
+      queuedSamples_(0),
+      stop_(false),
+      nBatches_(0),
+      nSamples_(0) {
+  if (client_->input().size() != 1)
+    throw cet::exception("TritonBatcher") << "only models with a single input are supported";
+
+  const auto& input = client_->input().begin()->second;
+  if (input.variableDims())
+    throw cet::exception("TritonBatcher") << "input " << input.dname() << " has variable dimensions";
+
+  sampleSize_ = input.sizeDims();
+  inputDatatype_ = input.dname();
+  maxBatchSize_ = client_->maxBatchSize();
+  for (const auto& [name, output] : client_->output()) {
+    outputSizes_[name] = output.sizeDims();
+  }
+  staging_.resize(maxBatchSize_ * sampleSize_);
+
+  worker_ = std::thread(&TritonBatcher::run, this);
+}
+
+TritonBatcher::~TritonBatcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  worker_.join();
+
+  if (nBatches_)
+    MF_LOG_INFO("TritonBatcher") << nSamples_ << " samples sent in " << nBatches_ << " batches, mean batch fill "
+                                 << 100.0 * nSamples_ / (nBatches_ * maxBatchSize_) << "%";
+}
+
+TritonBatcher::Ticket TritonBatcher::submit(const float* data, size_t samples) {
+  Ticket ticket;
+  auto now = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t first = 0; first < samples; first += maxBatchSize_) {
+      size_t n = std::min<size_t>(maxBatchSize_, samples - first);
+      Request req;
+      req.data.assign(data + first * sampleSize_, data + (first + n) * sampleSize_);
+      req.samples = n;
+      req.queued = now;
+      ticket.push_back(req.result.get_future());
+      queue_.push_back(std::move(req));
+      queuedSamples_ += n;
+    }
+  }
+  cond_.notify_all();
+  return ticket;
+}
+
+TritonBatcher::Result TritonBatcher::collect(Ticket& ticket) {
+  Result out;
+  for (auto& part : ticket) {
+    auto res = part.get();
+    for (auto& [name, values] : res.data) {
+      auto& dst = out.data[name];
+      dst.insert(dst.end(), values.begin(), values.end());
+      out.sizeDims[name] = res.sizeDims[name];
+    }
+    out.samples += res.samples;
+  }
+  ticket.clear();
+  return out;
+}
+
+void TritonBatcher::run() {
+  std::vector<Request> batch;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      //wait for a full batch, or for the oldest request to reach max delay
+      while (true) {
+        if (queue_.empty()) {
+          if (stop_)
+            return;
+          cond_.wait(lock);
+          continue;
+        }
+        if (stop_ || queuedSamples_ >= maxBatchSize_)
+          break;
+        auto deadline = queue_.front().queued + maxDelay_;
+        if (cond_.wait_until(lock, deadline) == std::cv_status::timeout)
+          break;
+      }
+
+      //whole requests, in arrival order, up to the max batch size
+      size_t nb = 0;
+      while (!queue_.empty() && nb + queue_.front().samples <= maxBatchSize_) {
+        nb += queue_.front().samples;
+        batch.push_back(std::move(queue_.front()));
+        queue_.pop_front();
+      }
+      queuedSamples_ -= nb;
+    }
+    sendBatch(batch);
+    batch.clear();
+  }
+}
+
+void TritonBatcher::sendBatch(std::vector<Request>& batch) {
+  size_t nb = 0;
+  for (const auto& req : batch) {
+    std::copy(req.data.begin(), req.data.end(), staging_.begin() + nb * sampleSize_);
+    nb += req.samples;
+  }
+
+  try {
+    client_->setBatchSize(nb);
+    client_->input().begin()->second.toServer(staging_.data(), nb);
+    client_->dispatch();
+
+    //split outputs back to requests
+    size_t first = 0;
+    std::vector<Result> results(batch.size());
+    for (const auto& [name, output] : client_->output()) {
+      const auto values = output.fromServer<float>();
+      const int64_t ndims = output.sizeDims();
+      first = 0;
+      for (size_t r = 0; r < batch.size(); ++r) {
+        auto& dst = results[r].data[name];
+        dst.reserve(batch[r].samples * ndims);
+        for (size_t i = 0; i < batch[r].samples; ++i) {
+          dst.insert(dst.end(), values[first + i].begin(), values[first + i].end());
+        }
+        results[r].sizeDims[name] = ndims;
+        first += batch[r].samples;
+      }
+    }
+    client_->reset();
+
+    for (size_t r = 0; r < batch.size(); ++r) {
+      results[r].samples = batch[r].samples;
+      batch[r].result.set_value(std::move(results[r]));
+    }
+    ++nBatches_;
+    nSamples_ += nb;
+  }
+  catch (...) {
+    //callers get the failure when collecting
+    client_->reset();
+    for (auto& req : batch) {
+      req.result.set_exception(std::current_exception());
+    }
+  }
+}
+
+}
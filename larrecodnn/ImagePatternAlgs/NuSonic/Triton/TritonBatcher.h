@@ -0,0 +1,88 @@
+#ifndef NuSonic_Triton_TritonBatcher
+#define NuSonic_Triton_TritonBatcher
+
+#include "larrecodnn/ImagePatternAlgs/NuSonic/Triton/TritonClient.h"
+
+namespace fhicl { class ParameterSet; }
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace lartriton {
+
+//process-wide client-side batching: requests of all callers using the same server/model/version
+//are merged into server batches of up to the model max batch size; a batch is sent when it is
+//full or when its oldest request waited for the configured max delay
+class TritonBatcher {
+public:
+  //outputs of one request, per output name: [samples, sizeDims] values
+  struct Result {
+    size_t samples = 0;
+    std::map<std::string, std::vector<float>> data;
+    std::map<std::string, int64_t> sizeDims;
+  };
+  //request is split into parts fitting in the server batch, all are collected together
+  using Ticket = std::vector<std::future<Result>>;
+
+  //shared instance for the server/model/version of the client parameters (as for TritonClient);
+  //the configuration of the first caller is used to create it
+  static std::shared_ptr<TritonBatcher> instance(const fhicl::ParameterSet& clientParams, unsigned maxDelayUs);
+
+  TritonBatcher(const fhicl::ParameterSet& clientParams, unsigned maxDelayUs);
+  ~TritonBatcher();
+
+  TritonBatcher(const TritonBatcher&) = delete;
+  TritonBatcher& operator=(const TritonBatcher&) = delete;
+
+  //queue contiguous [samples, sampleSize()] input, data is copied before the call returns
+  Ticket submit(const float* data, size_t samples);
+  //block until all parts of the request are done
+  Result collect(Ticket& ticket);
+
+  size_t sampleSize() const { return sampleSize_; }
+  unsigned maxBatchSize() const { return maxBatchSize_; }
+  //datatype of the model input, FP16/BF16 inputs are converted from float by the client
+  const std::string& inputDatatype() const { return inputDatatype_; }
+  //output names and their sizeDims
+  const std::map<std::string, int64_t>& outputSizes() const { return outputSizes_; }
+
+private:
+  struct Request {
+    std::vector<float> data;
+    size_t samples;
+    std::promise<Result> result;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  void run();
+  void sendBatch(std::vector<Request>& batch);
+
+  std::unique_ptr<TritonClient> client_;
+  size_t sampleSize_;
+  unsigned maxBatchSize_;
+  std::string inputDatatype_;
+  std::map<std::string, int64_t> outputSizes_;
+  std::chrono::microseconds maxDelay_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Request> queue_;
+  size_t queuedSamples_;
+  bool stop_;
+
+  std::vector<float> staging_;
+  size_t nBatches_, nSamples_;
+
+  std::thread worker_;
+};
+
+}
+#endif
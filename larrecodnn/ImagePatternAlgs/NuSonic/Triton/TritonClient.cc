@@ -7,6 +7,7 @@
 
 #include "grpc_client.h"
 
+#include <algorithm>
 #include <string>
 #include <cmath>
 #include <chrono>
@@ -14,6 +15,12 @@
 #include <sstream>
 #include <utility>
 #include <tuple>
+#include <atomic>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+
+#include <unistd.h>
 
 namespace ni = nvidia::inferenceserver;
 namespace nic = ni::client;
@@ -25,26 +32,56 @@ namespace lartriton {
 
 TritonClient::TritonClient(const fhicl::ParameterSet& params)
     : allowedTries_(params.get<unsigned>("allowedTries", 0)),
-      serverURL_(params.get<std::string>("serverURL")),
       verbose_(params.get<bool>("verbose")),
+      shmSlots_(0),
+      shmSlot_(0),
+      current_(0),
+      statsInterval_(std::max(1u, params.get<unsigned>("statsInterval", 20))),
+      retryDelay_(params.get<unsigned>("retryDelay", 30)),
+      hedgeMs_(params.get<double>("hedgeMs", 0)),
       options_(params.get<std::string>("modelName")) {
-  //get appropriate server for this model
+  //servers for this model: the list if given, otherwise the single one
+  auto urls = params.get<std::vector<std::string>>("serverURLs", {});
+  if (urls.empty())
+    urls.push_back(params.get<std::string>("serverURL"));
   if (verbose_)
-    MF_LOG_INFO("TritonClient") << "Using server: " << serverURL_;
+    MF_LOG_INFO("TritonClient") << "Using servers: " << triton_utils::printColl(urls);
+
+  const auto routing = params.get<std::string>("routing", "latency");
+  if (routing != "latency" && routing != "queue")
+    throw cet::exception("TritonClient") << "unknown routing " << routing << ", use latency or queue";
+  queueRouting_ = (routing == "queue");
 
-  //connect to the server
+  //connect to the servers
   //TODO: add SSL options
-  triton_utils::throwIfError(nic::InferenceServerGrpcClient::Create(&client_, serverURL_, false),
-                             "TritonClient(): unable to create inference context");
+  servers_.resize(urls.size());
+  for (unsigned i = 0; i < urls.size(); ++i) {
+    servers_[i].url = urls[i];
+    triton_utils::throwIfError(nic::InferenceServerGrpcClient::Create(&servers_[i].client, urls[i], false),
+                               "TritonClient(): unable to create inference context for " + urls[i]);
+  }
 
   //set options
   options_.model_version_ = params.get<std::string>("modelVersion");
   //convert seconds to microseconds
   options_.client_timeout_ = params.get<unsigned>("timeout") * 1e6;
 
+  //model is read from the first healthy server, the same model is expected on all of them
+  for (unsigned i = 0; i < servers_.size(); ++i) {
+    if (!checkHealth(i)) {
+      recordFailure(i);
+      continue;
+    }
+    current_ = i;
+    break;
+  }
+  if (!servers_[current_].healthy)
+    throw cet::exception("TritonClient") << "TritonClient(): no server ready for model " << options_.model_name_;
+  auto& client = servers_[current_].client;
+
   //config needed for batch size
   inference::ModelConfigResponse modelConfigResponse;
-  triton_utils::throwIfError(client_->ModelConfig(&modelConfigResponse, options_.model_name_, options_.model_version_),
+  triton_utils::throwIfError(client->ModelConfig(&modelConfigResponse, options_.model_name_, options_.model_version_),
                              "TritonClient(): unable to get model config");
   inference::ModelConfig modelConfig(modelConfigResponse.config());
 
@@ -58,7 +95,7 @@ TritonClient::TritonClient(const fhicl::ParameterSet& params)
 
   //get model info
   inference::ModelMetadataResponse modelMetadata;
-  triton_utils::throwIfError(client_->ModelMetadata(&modelMetadata, options_.model_name_, options_.model_version_),
+  triton_utils::throwIfError(client->ModelMetadata(&modelMetadata, options_.model_name_, options_.model_version_),
                              "TritonClient(): unable to get model metadata");
 
   //get input and output (which know their sizes)
@@ -130,6 +167,10 @@ TritonClient::TritonClient(const fhicl::ParameterSet& params)
   //propagate batch size to inputs and outputs
   setBatchSize(1);
 
+  //"system" or "cuda" shared memory instead of sending data in requests, if server is local;
+  //one slot per request that may be in flight
+  setupSharedMemory(params.get<std::string>("sharedMemory", "none"), params.get<unsigned>("sharedMemorySlots", 2));
+
   //print model info
   if (verbose_) {
     std::ostringstream model_msg;
@@ -140,6 +181,86 @@ TritonClient::TritonClient(const fhicl::ParameterSet& params)
   }
 }
 
+TritonClient::~TritonClient() {
+  //server may still write outputs of requests in flight; their results were not collected
+  for (auto& request : inflight_) {
+    std::unique_ptr<nic::InferResult> results(request.result.get());
+  }
+  releaseSharedMemory();
+}
+
+bool TritonClient::serverIsLocal() const {
+  const auto& url = servers_.front().url;
+  std::string host = url.substr(0, url.rfind(':'));
+  if (host == "localhost" || host == "127.0.0.1" || host == "[::1]" || host == "::1")
+    return true;
+  char hostname[256] = {0};
+  return (gethostname(hostname, sizeof(hostname) - 1) == 0) && (host == hostname);
+}
+
+void TritonClient::setupSharedMemory(const std::string& mode, unsigned nslots) {
+  if (mode == "none" || mode.empty())
+    return;
+  if (mode != "system" && mode != "cuda")
+    throw cet::exception("TritonClient") << "unknown shared memory mode " << mode;
+  if (servers_.size() > 1) {
+    MF_LOG_INFO("TritonClient") << "Several servers in use, shared memory not used";
+    return;
+  }
+  if (!serverIsLocal()) {
+    MF_LOG_INFO("TritonClient") << "Server " << servers_.front().url << " is remote, shared memory not used";
+    return;
+  }
+
+  //region names must be unique on the server
+  static std::atomic<unsigned> clientCount{0};
+  std::string prefix = "lartriton_" + std::to_string(getpid()) + "_" + std::to_string(clientCount++) + "_";
+
+  bool cuda = (mode == "cuda");
+  bool success = true;
+  unsigned idx = 0;
+  for (auto& element : input_) {
+    success = success && element.second.setupSharedMemory(servers_.front().client.get(), prefix + "in" + std::to_string(idx++),
+                                                          maxBatchSize_, nslots, cuda);
+  }
+  idx = 0;
+  for (auto& element : output_) {
+    success = success && element.second.setupSharedMemory(servers_.front().client.get(), prefix + "out" + std::to_string(idx++),
+                                                          maxBatchSize_, nslots, cuda);
+  }
+  if (!success) {
+    MF_LOG_WARNING("TritonClient") << "Shared memory setup failed, falling back to gRPC transport";
+    releaseSharedMemory();
+    return;
+  }
+  shmSlots_ = std::max(1u, nslots);
+  if (verbose_)
+    MF_LOG_INFO("TritonClient") << "Using " << mode << " shared memory, " << shmSlots_ << " slots";
+}
+
+void TritonClient::releaseSharedMemory() {
+  for (auto& element : input_) {
+    element.second.releaseSharedMemory(servers_.front().client.get());
+  }
+  for (auto& element : output_) {
+    element.second.releaseSharedMemory(servers_.front().client.get());
+  }
+  shmSlots_ = 0;
+}
+
+void TritonClient::setSharedMemorySlot(unsigned slot, bool inputs, bool outputs) {
+  if (!shmSlots_)
+    return;
+  if (inputs)
+    for (auto& element : input_) {
+      element.second.setSharedMemorySlot(slot);
+    }
+  if (outputs)
+    for (auto& element : output_) {
+      element.second.setSharedMemorySlot(slot);
+    }
+}
+
 bool TritonClient::setBatchSize(unsigned bsize) {
   if (bsize > maxBatchSize_) {
     MF_LOG_WARNING("TritonClient") << "Requested batch size " << bsize << " exceeds server-specified max batch size "
@@ -158,10 +279,14 @@ bool TritonClient::setBatchSize(unsigned bsize) {
 }
 
 void TritonClient::reset() {
-  for (auto& element : input_) {
+  resetInputs();
+  for (auto& element : output_) {
     element.second.reset();
   }
-  for (auto& element : output_) {
+}
+
+void TritonClient::resetInputs() {
+  for (auto& element : input_) {
     element.second.reset();
   }
 }
@@ -196,15 +321,29 @@ void TritonClient::evaluate() {
     return;
   }
 
+  //best server at the moment, the one which just failed is down already
+  current_ = pickServer();
+
   // Get the status of the server prior to the request being made.
   const auto& start_status = getServerSideStatus();
 
+  //outputs go to the slot of the inputs
+  setSharedMemorySlot(shmSlot_, false, true);
+
   //blocking call
   auto t1 = std::chrono::steady_clock::now();
   nic::InferResult* results;
-  bool status = triton_utils::warnIfError(client_->Infer(&results, options_, inputsTriton_, outputsTriton_),
-  					  "evaluate(): unable to run and/or get result");
+  bool status;
+  if (hedgeMs_ > 0 && !shmSlots_ && servers_.size() > 1)
+    status = inferHedged(&results); //records latency, current_ is the server which answered
+  else {
+    status = triton_utils::warnIfError(servers_[current_].client->Infer(&results, options_, inputsTriton_, outputsTriton_),
+                                       "evaluate(): unable to run and/or get result from " + servers_[current_].url);
+    if (status)
+      recordLatency(current_, std::chrono::steady_clock::now() - t1);
+  }
   if (!status) {
+    recordFailure(current_);
     finish(false);
     return;
   }
@@ -229,12 +368,98 @@ void TritonClient::evaluate() {
   finish(status);
 }
 
+void TritonClient::dispatchAsync() {
+  //shared memory slot of this request must not be used by another one in flight
+  if (!canDispatch()) {
+    throw cet::exception("TritonClient") << "dispatchAsync(): " << inflight_.size()
+                                         << " requests in flight, shared memory has only " << shmSlots_ << " slots";
+  }
+
+  auto promise = std::make_shared<std::promise<nic::InferResult*>>();
+  auto done = std::make_shared<std::chrono::steady_clock::time_point>();
+  inflight_.push_back({promise->get_future(), batchSize_, shmSlot_, 0, {}, done});
+
+  //in case there is nothing to process
+  if (batchSize_ == 0) {
+    promise->set_value(nullptr);
+    return;
+  }
+
+  setSharedMemorySlot(shmSlot_, false, true);
+
+  //only the launch can be retried, the request is serialized once it is sent;
+  //a server which fails to take it is skipped and the next best one is tried
+  bool status = false;
+  for (tries_ = 0; !status && tries_ < maxTries(); ++tries_) {
+    auto& request = inflight_.back();
+    request.server = pickServer();
+    request.sent = std::chrono::steady_clock::now();
+    status = triton_utils::warnIfError(
+        servers_[request.server].client->AsyncInfer(
+            [promise, done](nic::InferResult* results) {
+              *done = std::chrono::steady_clock::now();
+              promise->set_value(results);
+            },
+            options_, inputsTriton_, outputsTriton_),
+        "dispatchAsync(): unable to launch async run on " + servers_[request.server].url);
+    if (!status)
+      recordFailure(request.server);
+  }
+  if (!status) {
+    inflight_.pop_back();
+    throw cet::exception("TritonClient") << "async call failed after max " << tries_ << " tries" << std::endl;
+  }
+
+  resetInputs();
+
+  //next request is prepared in the next slot
+  if (shmSlots_) {
+    shmSlot_ = (shmSlot_ + 1) % shmSlots_;
+    setSharedMemorySlot(shmSlot_, true, false);
+  }
+}
+
+void TritonClient::wait() {
+  if (inflight_.empty()) {
+    throw cet::exception("TritonClient") << "wait(): no request in flight" << std::endl;
+  }
+
+  auto t1 = std::chrono::steady_clock::now();
+  auto request = std::move(inflight_.front());
+  inflight_.pop_front();
+  nic::InferResult* results = request.result.get();
+  auto t2 = std::chrono::steady_clock::now();
+  MF_LOG_DEBUG("TritonClient") << "Async wait time: "
+                               << std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+
+  //outputs describe the batch of the request being collected
+  for (auto& element : output_) {
+    element.second.setBatchSize(request.batchSize);
+  }
+  setSharedMemorySlot(request.shmSlot, false, true);
+  if (!results)
+    return;
+
+  std::shared_ptr<nic::InferResult> results_ptr(results);
+  bool status = triton_utils::warnIfError(results_ptr->RequestStatus(),
+                                          "wait(): async request failed on " + servers_[request.server].url);
+  if (status) {
+    recordLatency(request.server, *request.done - request.sent);
+    status = getResults(results_ptr);
+  }
+  else
+    recordFailure(request.server);
+  if (!status) {
+    throw cet::exception("TritonClient") << "async call failed" << std::endl;
+  }
+}
+
 void TritonClient::finish(bool success) {
   //retries are only allowed if no exception was raised
   if (!success) {
     ++tries_;
-    //if max retries has not been exceeded, call evaluate again
-    if (tries_ < allowedTries_) {
+    //if max retries has not been exceeded, call evaluate again (on the next best server)
+    if (tries_ < maxTries()) {
       evaluate();
       //avoid calling doneWaiting() twice
       return;
@@ -303,15 +528,194 @@ TritonClient::ServerSideStats TritonClient::summarizeServerStats(const inference
 }
 
 inference::ModelStatistics TritonClient::getServerSideStatus() const {
-  if (verbose_) {
-    inference::ModelStatisticsResponse resp;
-    bool success = triton_utils::warnIfError(
-        client_->ModelInferenceStatistics(&resp, options_.model_name_, options_.model_version_),
-        "getServerSideStatus(): unable to get model statistics");
-    if (success)
-      return *(resp.model_stats().begin());
-  }
-  return inference::ModelStatistics{};
+  inference::ModelStatistics stats;
+  if (verbose_)
+    getServerStats(current_, stats);
+  return stats;
+}
+
+bool TritonClient::getServerStats(unsigned idx, inference::ModelStatistics& stats) const {
+  inference::ModelStatisticsResponse resp;
+  bool success = triton_utils::warnIfError(
+      servers_[idx].client->ModelInferenceStatistics(&resp, options_.model_name_, options_.model_version_),
+      "getServerSideStatus(): unable to get model statistics from " + servers_[idx].url);
+  if (success && resp.model_stats_size() > 0) {
+    stats = *(resp.model_stats().begin());
+    return true;
+  }
+  return false;
+}
+
+unsigned TritonClient::maxTries() const {
+  //every server gets a chance before giving up
+  return std::max<unsigned>({1u, allowedTries_, (unsigned)servers_.size()});
+}
+
+bool TritonClient::checkHealth(unsigned idx) const {
+  auto& client = servers_[idx].client;
+  bool live = false, ready = false;
+  return triton_utils::warnIfError(client->IsServerLive(&live), "checkHealth(): " + servers_[idx].url + " not reachable") &&
+         live &&
+         triton_utils::warnIfError(client->IsModelReady(&ready, options_.model_name_, options_.model_version_),
+                                   "checkHealth(): unable to get model status from " + servers_[idx].url) &&
+         ready;
+}
+
+double TritonClient::score(unsigned idx) const {
+  //servers without requests yet come first, so that all of them get measured
+  const auto& server = servers_[idx];
+  return queueRouting_ ? server.queueUs : server.latencyUs;
+}
+
+unsigned TritonClient::pickServer(int exclude) {
+  if (servers_.size() == 1)
+    return 0;
+
+  auto now = std::chrono::steady_clock::now();
+  int best = -1;
+  for (unsigned i = 0; i < servers_.size(); ++i) {
+    auto& server = servers_[i];
+    if ((int)i == exclude)
+      continue;
+    if (!server.healthy) {
+      if (now < server.retryAfter)
+        continue;
+      //down long enough: back in the list if it passes the health check
+      if (!checkHealth(i)) {
+        server.retryAfter = now + std::chrono::seconds(retryDelay_);
+        continue;
+      }
+      server.healthy = true;
+      MF_LOG_INFO("TritonClient") << "Server " << server.url << " is back";
+    }
+    if (queueRouting_ && server.requests >= server.statsRequests + statsInterval_)
+      refreshQueueTime(i);
+    if (best < 0 || score(i) < score(best))
+      best = i;
+  }
+  if (best >= 0)
+    return best;
+
+  //nothing else available: the excluded one, or the one back the soonest
+  if (exclude >= 0)
+    return exclude;
+  best = 0;
+  for (unsigned i = 1; i < servers_.size(); ++i) {
+    if (servers_[i].retryAfter < servers_[best].retryAfter)
+      best = i;
+  }
+  return best;
+}
+
+void TritonClient::recordLatency(unsigned idx, std::chrono::steady_clock::duration latency) {
+  constexpr double alpha = 0.2; //weight of the last request in the moving average
+  auto& server = servers_[idx];
+  double us = std::chrono::duration<double, std::micro>(latency).count();
+  server.latencyUs = server.requests ? (1 - alpha) * server.latencyUs + alpha * us : us;
+  ++server.requests;
+}
+
+void TritonClient::recordFailure(unsigned idx) {
+  auto& server = servers_[idx];
+  ++server.failures;
+  if (servers_.size() == 1)
+    return;
+  server.healthy = false;
+  server.retryAfter = std::chrono::steady_clock::now() + std::chrono::seconds(retryDelay_);
+  MF_LOG_WARNING("TritonClient") << "Server " << server.url << " failed, not used for " << retryDelay_ << " s";
+}
+
+void TritonClient::refreshQueueTime(unsigned idx) {
+  constexpr double alpha = 0.5;
+  auto& server = servers_[idx];
+  server.statsRequests = server.requests;
+
+  inference::ModelStatistics stats;
+  if (!getServerStats(idx, stats))
+    return;
+  //queue time of requests from all clients of the server since the last reading
+  const auto& diff = summarizeServerStats(server.lastStats, stats);
+  if (diff.success_count_ > 0) {
+    double us = 1e-3 * diff.queue_time_ns_ / diff.success_count_;
+    server.queueUs = (server.lastStats.inference_count() > 0) ? (1 - alpha) * server.queueUs + alpha * us : us;
+  }
+  server.lastStats = stats;
+}
+
+bool TritonClient::inferHedged(nic::InferResult** results) {
+  //shared by the callbacks, which may come after this call returned
+  struct Hedge {
+    std::mutex mutex;
+    std::condition_variable cv;
+    nic::InferResult* result = nullptr;
+    int winner = -1;
+    unsigned pending = 0;
+  };
+  auto hedge = std::make_shared<Hedge>();
+
+  auto launch = [&](unsigned idx) {
+    {
+      std::lock_guard<std::mutex> lock(hedge->mutex);
+      ++hedge->pending;
+    }
+    bool status = triton_utils::warnIfError(
+        servers_[idx].client->AsyncInfer(
+            [hedge, idx](nic::InferResult* result) {
+              std::lock_guard<std::mutex> lock(hedge->mutex);
+              --hedge->pending;
+              if (hedge->winner < 0 && result && result->RequestStatus().IsOk()) {
+                hedge->winner = idx;
+                hedge->result = result;
+              }
+              else
+                delete result; //failed, or the other server was faster
+              hedge->cv.notify_all();
+            },
+            options_, inputsTriton_, outputsTriton_),
+        "inferHedged(): unable to launch run on " + servers_[idx].url);
+    if (!status) {
+      std::lock_guard<std::mutex> lock(hedge->mutex);
+      --hedge->pending;
+    }
+    return status;
+  };
+  auto finished = [&]() { return hedge->winner >= 0 || hedge->pending == 0; };
+
+  const unsigned first = current_;
+  int second = -1;
+  auto t1 = std::chrono::steady_clock::now();
+  if (!launch(first))
+    return false;
+
+  std::unique_lock<std::mutex> lock(hedge->mutex);
+  if (!hedge->cv.wait_for(lock, std::chrono::duration<double, std::milli>(hedgeMs_), finished)) {
+    //slow answer: same request to the next best server, the first one to answer wins
+    lock.unlock();
+    unsigned other = pickServer(first);
+    if (other != first && launch(other)) {
+      second = other;
+      MF_LOG_DEBUG("TritonClient") << "Request to " << servers_[first].url << " hedged on " << servers_[other].url;
+    }
+    lock.lock();
+    hedge->cv.wait(lock, finished);
+  }
+  auto latency = std::chrono::steady_clock::now() - t1;
+
+  if (hedge->winner < 0) {
+    if (second >= 0)
+      recordFailure(second);
+    return false; //first server is marked as failed by the caller
+  }
+
+  current_ = hedge->winner;
+  *results = hedge->result;
+  recordLatency(current_, latency);
+  //the slower server is known to take at least that long
+  if (second >= 0) {
+    unsigned loser = (current_ == first) ? second : first;
+    recordLatency(loser, latency);
+  }
+  return true;
 }
 
 }
@@ -5,6 +5,9 @@
 
 namespace fhicl { class ParameterSet; }
 
+#include <chrono>
+#include <deque>
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
@@ -15,6 +18,13 @@ namespace lartriton {
 
 class TritonClient {
 public:
+  //constructor parameters: "serverURL", or "serverURLs" to spread requests over several servers;
+  //each request goes to the healthy server with the lowest "routing" score: "latency" (mean
+  //request latency seen by this client) or "queue" (mean server-side queue time, from the model
+  //statistics read every "statsInterval" requests); a failed server is skipped for "retryDelay"
+  //seconds and then health-checked again; failed requests are retried on the next best server,
+  //at least once on each; sync requests not answered after "hedgeMs" are also sent to the next
+  //best server and the first result is used (0: no hedging, shared memory transport: no hedging)
   struct ServerSideStats {
     uint64_t inference_count_;
     uint64_t execution_count_;
@@ -28,11 +38,13 @@ public:
 
   //constructor
   TritonClient(const fhicl::ParameterSet& params);
+  ~TritonClient();
 
   //accessors
   TritonInputMap& input() { return input_; }
   const TritonOutputMap& output() const { return output_; }
   unsigned batchSize() const { return batchSize_; }
+  unsigned maxBatchSize() const { return maxBatchSize_; }
   bool verbose() const { return verbose_; }
   bool setBatchSize(unsigned bsize);
 
@@ -42,8 +54,20 @@ public:
     evaluate();
   }
 
+  //asynchronous operation: send the request and return, inputs are released as soon as the
+  //request is serialized so the next one can be prepared while this one is processed;
+  //several requests may be in flight, wait() makes results of the oldest one available
+  //in output(); failed async requests are not retried
+  void dispatchAsync();
+  void wait();
+  size_t inFlight() const { return inflight_.size(); }
+  //false if all shared memory slots are used by requests in flight: inputs of the next request
+  //must not be written to the region before one of them is collected
+  bool canDispatch() const { return !shmSlots_ || inflight_.size() < shmSlots_; }
+
   //helper
   void reset();
+  void resetInputs();
 
 protected:
   //helper
@@ -58,24 +82,71 @@ protected:
                                        const inference::ModelStatistics& end_status) const;
 
   inference::ModelStatistics getServerSideStatus() const;
+  bool getServerStats(unsigned idx, inference::ModelStatistics& stats) const;
+
+  //routing over the server list
+  unsigned pickServer(int exclude = -1);
+  bool checkHealth(unsigned idx) const;
+  void recordLatency(unsigned idx, std::chrono::steady_clock::duration latency);
+  void recordFailure(unsigned idx);
+  void refreshQueueTime(unsigned idx);
+  double score(unsigned idx) const;
+  unsigned maxTries() const;
+  //sync call, also sent to the next best server if not answered within hedgeMs_
+  bool inferHedged(nvidia::inferenceserver::client::InferResult** results);
+
+  //shared memory transport for servers on the same node
+  bool serverIsLocal() const;
+  void setupSharedMemory(const std::string& mode, unsigned nslots);
+  void releaseSharedMemory();
+  void setSharedMemorySlot(unsigned slot, bool inputs, bool outputs);
 
   //members
   TritonInputMap input_;
   TritonOutputMap output_;
   unsigned allowedTries_, tries_;
-  std::string serverURL_;
   unsigned maxBatchSize_;
   unsigned batchSize_;
   bool noBatch_;
   bool verbose_;
+  unsigned shmSlots_; //0 if shared memory is not used
+  unsigned shmSlot_;  //slot of the next request
 
   //IO pointers for triton
   std::vector<nvidia::inferenceserver::client::InferInput*> inputsTriton_;
   std::vector<const nvidia::inferenceserver::client::InferRequestedOutput*> outputsTriton_;
 
-  std::unique_ptr<nvidia::inferenceserver::client::InferenceServerGrpcClient> client_;
+  //server endpoints and their state used for routing
+  struct Server {
+    std::string url;
+    std::unique_ptr<nvidia::inferenceserver::client::InferenceServerGrpcClient> client;
+    bool healthy = true;
+    std::chrono::steady_clock::time_point retryAfter; //down until then after a failure
+    double latencyUs = 0; //moving average of request latency seen by this client
+    double queueUs = 0;   //moving average of server-side queue time per request
+    unsigned requests = 0, failures = 0;
+    unsigned statsRequests = 0; //requests when the statistics were read last time
+    inference::ModelStatistics lastStats;
+  };
+  std::vector<Server> servers_;
+  unsigned current_; //server of the current request
+  bool queueRouting_;
+  unsigned statsInterval_;
+  unsigned retryDelay_; //[s]
+  double hedgeMs_;
   //stores timeout, model name and version
   nvidia::inferenceserver::client::InferOptions options_;
+
+  //requests sent with dispatchAsync, oldest first
+  struct InFlight {
+    std::future<nvidia::inferenceserver::client::InferResult*> result;
+    unsigned batchSize;
+    unsigned shmSlot;
+    unsigned server;
+    std::chrono::steady_clock::time_point sent;
+    std::shared_ptr<std::chrono::steady_clock::time_point> done; //set when the result arrives
+  };
+  std::deque<InFlight> inflight_;
 };
 
 }
@@ -6,6 +6,14 @@
 #include <cstring>
 #include <sstream>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef TRITON_ENABLE_GPU
+#include <cuda_runtime_api.h>
+#endif
+
 namespace ni = nvidia::inferenceserver;
 namespace nic = ni::client;
 
@@ -34,7 +42,9 @@ TritonData<IO>::TritonData(const std::string& name, const TritonData<IO>::Tensor
       productDims_(variableDims_ ? -1 : dimProduct(shape_)),
       dname_(model_info.datatype()),
       dtype_(ni::ProtocolStringToDataType(dname_)),
-      byteSize_(ni::GetDataTypeByteSize(dtype_)) {
+      byteSize_(ni::GetDataTypeByteSize(dtype_)),
+      conversion_(dname_ == "FP16" ? Conversion::FP16 : (dname_ == "BF16" ? Conversion::BF16 : Conversion::None)),
+      shmSlot_(0) {
   //create input or output object
   IO* iotmp;
   createObject(&iotmp);
@@ -51,6 +61,171 @@ void TritonOutputData::createObject(nic::InferRequestedOutput** ioptr) const {
   nic::InferRequestedOutput::Create(ioptr, name_);
 }
 
+//shared memory region: POSIX system shm mapped in this process, or CUDA device memory
+//exported with an IPC handle (then transfers to/from host are done with cudaMemcpy)
+template <typename IO>
+struct TritonData<IO>::SharedMemory {
+  std::string name;
+  std::string key;
+  size_t slotBytes = 0;
+  unsigned nslots = 0;
+  bool cuda = false;
+  bool registered = false;
+  uint8_t* addr = nullptr;        //system shm mapping, or device pointer
+  std::vector<uint8_t> host;      //host copy of cuda outputs
+
+  size_t bytes() const { return slotBytes * nslots; }
+
+  ~SharedMemory() {
+    if (!addr)
+      return;
+    if (cuda) {
+#ifdef TRITON_ENABLE_GPU
+      cudaFree(addr);
+#endif
+    } else {
+      munmap(addr, bytes());
+      shm_unlink(key.c_str());
+    }
+  }
+};
+
+template <typename IO>
+bool TritonData<IO>::setupSharedMemory(nic::InferenceServerGrpcClient* client,
+                                       const std::string& regionName,
+                                       unsigned maxBatchSize,
+                                       unsigned nslots,
+                                       bool cuda) {
+  if (variableDims_) {
+    MF_LOG_INFO("TritonData") << name_ << ": variable dimensions, shared memory not used";
+    return false;
+  }
+
+  auto shm = std::make_shared<SharedMemory>();
+  shm->name = regionName;
+  shm->slotBytes = productDims_ * byteSize_ * maxBatchSize;
+  shm->nslots = std::max(1u, nslots);
+  shm->cuda = cuda;
+
+  if (cuda) {
+#ifdef TRITON_ENABLE_GPU
+    void* dptr = nullptr;
+    cudaIpcMemHandle_t handle;
+    if ((cudaMalloc(&dptr, shm->bytes()) != cudaSuccess)) {
+      MF_LOG_WARNING("TritonData") << name_ << ": cudaMalloc failed";
+      return false;
+    }
+    shm->addr = static_cast<uint8_t*>(dptr);
+    if (cudaIpcGetMemHandle(&handle, dptr) != cudaSuccess) {
+      MF_LOG_WARNING("TritonData") << name_ << ": cudaIpcGetMemHandle failed";
+      return false;
+    }
+    if (!triton_utils::warnIfError(client->RegisterCudaSharedMemory(shm->name, handle, 0, shm->bytes()),
+                                   name_ + " setupSharedMemory(): unable to register cuda region"))
+      return false;
+#else
+    MF_LOG_WARNING("TritonData") << name_ << ": built without CUDA support";
+    return false;
+#endif
+  } else {
+    //POSIX shm key is the region name with a leading slash
+    shm->key = "/" + regionName;
+    int fd = shm_open(shm->key.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+      MF_LOG_WARNING("TritonData") << name_ << ": shm_open failed for " << shm->key;
+      return false;
+    }
+    bool ok = (ftruncate(fd, shm->bytes()) == 0);
+    void* ptr = ok ? mmap(nullptr, shm->bytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (ptr == MAP_FAILED) {
+      shm_unlink(shm->key.c_str());
+      MF_LOG_WARNING("TritonData") << name_ << ": unable to map " << shm->key;
+      return false;
+    }
+    shm->addr = static_cast<uint8_t*>(ptr);
+    if (!triton_utils::warnIfError(client->RegisterSystemSharedMemory(shm->name, shm->key, shm->bytes()),
+                                   name_ + " setupSharedMemory(): unable to register system region"))
+      return false;
+  }
+  shm->registered = true;
+
+  shm_ = std::move(shm);
+  setSharedMemorySlot(0);
+  return true;
+}
+
+template <typename IO>
+void TritonData<IO>::releaseSharedMemory(nic::InferenceServerGrpcClient* client) {
+  if (!shm_)
+    return;
+  if (shm_->registered) {
+    if (shm_->cuda) {
+#ifdef TRITON_ENABLE_GPU
+      triton_utils::warnIfError(client->UnregisterCudaSharedMemory(shm_->name),
+                                name_ + " releaseSharedMemory(): unable to unregister region");
+#endif
+    } else {
+      triton_utils::warnIfError(client->UnregisterSystemSharedMemory(shm_->name),
+                                name_ + " releaseSharedMemory(): unable to unregister region");
+    }
+  }
+  unsetSharedMemory();
+  shm_.reset();
+}
+
+template <>
+void TritonInputData::unsetSharedMemory() {
+  data_->Reset();
+}
+
+template <>
+void TritonOutputData::unsetSharedMemory() {
+  //otherwise later requests would ask the server to write into the unregistered region
+  triton_utils::warnIfError(data_->UnsetSharedMemory(), name_ + " releaseSharedMemory(): unable to unset region");
+}
+
+template <>
+void TritonInputData::setSharedMemorySlot(unsigned slot) {
+  if (shm_)
+    shmSlot_ = slot % shm_->nslots;
+}
+
+template <>
+void TritonOutputData::setSharedMemorySlot(unsigned slot) {
+  if (!shm_)
+    return;
+  shmSlot_ = slot % shm_->nslots;
+  //server writes outputs of the request into this slot
+  triton_utils::throwIfError(data_->SetSharedMemory(shm_->name, shm_->slotBytes, shmSlot_ * shm_->slotBytes),
+                             name_ + " output(): unable to set shared memory");
+}
+
+template <>
+template <typename DT>
+DT* TritonInputData::sharedMemoryBuffer() const {
+  if (!shm_ || shm_->cuda || byteSize_ != sizeof(DT))
+    return nullptr;
+  return reinterpret_cast<DT*>(shm_->addr + shmSlot_ * shm_->slotBytes);
+}
+
+//reduced precision conversions
+template <typename IO>
+void TritonData<IO>::toReduced(const float* in, uint16_t* out, size_t n) const {
+  if (conversion_ == Conversion::FP16)
+    triton_utils::floatToHalf(in, out, n);
+  else
+    triton_utils::floatToBFloat16(in, out, n);
+}
+
+template <typename IO>
+void TritonData<IO>::fromReduced(const uint16_t* in, float* out, size_t n) const {
+  if (conversion_ == Conversion::FP16)
+    triton_utils::halfToFloat(in, out, n);
+  else
+    triton_utils::bfloat16ToFloat(in, out, n);
+}
+
 //setters
 template <typename IO>
 bool TritonData<IO>::setShape(const TritonData<IO>::ShapeType& newShape, bool canThrow) {
@@ -117,11 +292,41 @@ void TritonInputData::toServer(std::shared_ptr<TritonInput<DT>> ptr) {
   //shape must be specified for variable dims or if batch size changes
   data_->SetShape(fullShape_);
 
-  if (byteSize_ != sizeof(DT))
+  if (byteSize_ != sizeof(DT) && !converts<DT>())
     throw cet::exception("TritonDataError") << name_ << " input(): inconsistent byte size " << sizeof(DT)
                                             << " (should be " << byteSize_ << " for " << dname_ << ")";
 
   int64_t nInput = sizeShape();
+  if (converts<DT>()) {
+    //entries are converted into the current slot of the region, or into the local buffer
+    bool toShm = shm_ && !shm_->cuda;
+    if (!toShm)
+      reduced_.resize(nInput * batchSize_);
+    uint16_t* dst = toShm ? reinterpret_cast<uint16_t*>(shm_->addr + shmSlot_ * shm_->slotBytes) : reduced_.data();
+    for (unsigned i0 = 0; i0 < batchSize_; ++i0) {
+      toReduced(reinterpret_cast<const float*>(data_in[i0].data()), dst + i0 * nInput, nInput);
+    }
+    if (toShm)
+      triton_utils::throwIfError(
+          data_->SetSharedMemory(shm_->name, nInput * byteSize_ * batchSize_, shmSlot_ * shm_->slotBytes),
+          name_ + " input(): unable to set shared memory");
+    else
+      triton_utils::throwIfError(
+          data_->AppendRaw(reinterpret_cast<const uint8_t*>(dst), nInput * byteSize_ * batchSize_),
+          name_ + " input(): unable to set data");
+    return;
+  }
+  if (shm_ && !shm_->cuda) {
+    //entries are gathered into the current slot of the region
+    uint8_t* dst = shm_->addr + shmSlot_ * shm_->slotBytes;
+    for (unsigned i0 = 0; i0 < batchSize_; ++i0) {
+      std::memcpy(dst + i0 * nInput * byteSize_, data_in[i0].data(), nInput * byteSize_);
+    }
+    triton_utils::throwIfError(
+        data_->SetSharedMemory(shm_->name, nInput * byteSize_ * batchSize_, shmSlot_ * shm_->slotBytes),
+        name_ + " input(): unable to set shared memory");
+    return;
+  }
   for (unsigned i0 = 0; i0 < batchSize_; ++i0) {
     const DT* arr = data_in[i0].data();
     triton_utils::throwIfError(data_->AppendRaw(reinterpret_cast<const uint8_t*>(arr), nInput * byteSize_),
@@ -132,6 +337,60 @@ void TritonInputData::toServer(std::shared_ptr<TritonInput<DT>> ptr) {
   holder_ = std::move(ptr);
 }
 
+template <>
+template <typename DT>
+void TritonInputData::toServer(const DT* data, unsigned bsize) {
+  //check batch size
+  if (bsize != batchSize_) {
+    throw cet::exception("TritonDataError") << name_ << " input(): input block has " << bsize
+                                            << " entries but specified batch size is " << batchSize_;
+  }
+
+  //shape must be specified for variable dims or if batch size changes
+  data_->SetShape(fullShape_);
+
+  if (byteSize_ != sizeof(DT) && !converts<DT>())
+    throw cet::exception("TritonDataError") << name_ << " input(): inconsistent byte size " << sizeof(DT)
+                                            << " (should be " << byteSize_ << " for " << dname_ << ")";
+
+  int64_t nInput = sizeShape();
+  size_t nbytes = nInput * byteSize_ * batchSize_;
+  holder_.reset();
+
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+  if (converts<DT>()) {
+    //converted straight into the current slot of a system region, otherwise into the local buffer
+    uint16_t* reduced = nullptr;
+    if (shm_ && !shm_->cuda)
+      reduced = reinterpret_cast<uint16_t*>(shm_->addr + shmSlot_ * shm_->slotBytes);
+    else {
+      reduced_.resize(nInput * batchSize_);
+      reduced = reduced_.data();
+    }
+    toReduced(reinterpret_cast<const float*>(data), reduced, nInput * batchSize_);
+    src = reinterpret_cast<const uint8_t*>(reduced);
+  }
+
+  if (shm_) {
+    //data goes to the current slot of the region, no copy if it was written there already
+    uint8_t* dst = shm_->addr + shmSlot_ * shm_->slotBytes;
+    if (shm_->cuda) {
+#ifdef TRITON_ENABLE_GPU
+      if (cudaMemcpy(dst, src, nbytes, cudaMemcpyHostToDevice) != cudaSuccess)
+        throw cet::exception("TritonDataError") << name_ << " input(): cudaMemcpy failed";
+#endif
+    } else if (src != dst) {
+      std::memcpy(dst, src, nbytes);
+    }
+    triton_utils::throwIfError(data_->SetSharedMemory(shm_->name, nbytes, shmSlot_ * shm_->slotBytes),
+                               name_ + " input(): unable to set shared memory");
+    return;
+  }
+
+  //whole batch in a single call, memory is not copied until the request is sent
+  triton_utils::throwIfError(data_->AppendRaw(src, nbytes), name_ + " input(): unable to set data");
+}
+
 template <>
 template <typename DT>
 TritonOutput<DT> TritonOutputData::fromServer() const {
@@ -139,7 +398,7 @@ TritonOutput<DT> TritonOutputData::fromServer() const {
     throw cet::exception("TritonDataError") << name_ << " output(): missing result";
   }
 
-  if (byteSize_ != sizeof(DT)) {
+  if (byteSize_ != sizeof(DT) && !converts<DT>()) {
     throw cet::exception("TritonDataError") << name_ << " output(): inconsistent byte size " << sizeof(DT)
                                             << " (should be " << byteSize_ << " for " << dname_ << ")";
   }
@@ -149,12 +408,32 @@ TritonOutput<DT> TritonOutputData::fromServer() const {
   const uint8_t* r0;
   size_t contentByteSize;
   size_t expectedContentByteSize = nOutput * byteSize_ * batchSize_;
-  triton_utils::throwIfError(result_->RawData(name_, &r0, &contentByteSize), "output(): unable to get raw");
+  if (shm_) {
+    //outputs were written by the server to the slot of the request
+    r0 = shm_->addr + shmSlot_ * shm_->slotBytes;
+    contentByteSize = expectedContentByteSize;
+    if (shm_->cuda) {
+#ifdef TRITON_ENABLE_GPU
+      shm_->host.resize(contentByteSize);
+      if (cudaMemcpy(shm_->host.data(), r0, contentByteSize, cudaMemcpyDeviceToHost) != cudaSuccess)
+        throw cet::exception("TritonDataError") << name_ << " output(): cudaMemcpy failed";
+      r0 = shm_->host.data();
+#endif
+    }
+  } else {
+    triton_utils::throwIfError(result_->RawData(name_, &r0, &contentByteSize), "output(): unable to get raw");
+  }
   if (contentByteSize != expectedContentByteSize) {
     throw cet::exception("TritonDataError") << name_ << " output(): unexpected content byte size " << contentByteSize
                                             << " (expected " << expectedContentByteSize << ")";
   }
 
+  if (converts<DT>()) {
+    converted_.resize(nOutput * batchSize_);
+    fromReduced(reinterpret_cast<const uint16_t*>(r0), converted_.data(), converted_.size());
+    r0 = reinterpret_cast<const uint8_t*>(converted_.data());
+  }
+
   const DT* r1 = reinterpret_cast<const DT*>(r0);
   dataOut.reserve(batchSize_);
   for (unsigned i0 = 0; i0 < batchSize_; ++i0) {
@@ -182,6 +461,10 @@ template class TritonData<nic::InferRequestedOutput>;
 
 template void TritonInputData::toServer(std::shared_ptr<TritonInput<float>> data_in);
 template void TritonInputData::toServer(std::shared_ptr<TritonInput<int64_t>> data_in);
+template void TritonInputData::toServer(const float* data, unsigned bsize);
+template void TritonInputData::toServer(const int64_t* data, unsigned bsize);
+template float* TritonInputData::sharedMemoryBuffer() const;
+template int64_t* TritonInputData::sharedMemoryBuffer() const;
 
 template TritonOutput<float> TritonOutputData::fromServer() const;
 
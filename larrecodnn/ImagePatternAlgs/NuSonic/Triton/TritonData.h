@@ -5,9 +5,11 @@
 
 #include <algorithm>
 #include <any>
+#include <cstdint>
 #include <memory>
 #include <numeric>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
@@ -43,14 +45,27 @@ public:
   //io accessors
   template <typename DT>
   void toServer(std::shared_ptr<TritonInput<DT>> ptr);
+  //contiguous [bsize, ...] block, caller keeps it alive until the request is done
+  template <typename DT>
+  void toServer(const DT* data, unsigned bsize);
   template <typename DT>
   TritonOutput<DT> fromServer() const;
 
+  //shared memory transport (set up by the client for local servers)
+  bool sharedMemory() const { return bool(shm_); }
+  //input: memory where the batch of the next request can be written directly, then passed
+  //to toServer(const DT*, unsigned) without a copy; nullptr if not available
+  template <typename DT>
+  DT* sharedMemoryBuffer() const;
+
   //const accessors
   const ShapeView& shape() const { return shape_; }
   int64_t byteSize() const { return byteSize_; }
   const std::string& dname() const { return dname_; }
   unsigned batchSize() const { return batchSize_; }
+  //FP16/BF16 tensors are exchanged as float: inputs are converted when set, outputs up-converted
+  //when read (the float view stays valid until the next fromServer() or reset)
+  bool reducedPrecision() const { return conversion_ != Conversion::None; }
 
   //utilities
   bool variableDims() const { return variableDims_; }
@@ -68,6 +83,14 @@ private:
   void reset();
   void setResult(std::shared_ptr<Result> result) { result_ = result; }
   IO* data() { return data_.get(); }
+  bool setupSharedMemory(nvidia::inferenceserver::client::InferenceServerGrpcClient* client,
+                         const std::string& regionName,
+                         unsigned maxBatchSize,
+                         unsigned nslots,
+                         bool cuda);
+  void releaseSharedMemory(nvidia::inferenceserver::client::InferenceServerGrpcClient* client);
+  void setSharedMemorySlot(unsigned slot);
+  void unsetSharedMemory(); //drop references of the tensor to the region
 
   //helpers
   bool anyNeg(const ShapeView& vec) const {
@@ -78,6 +101,14 @@ private:
   }
   void createObject(IO** ioptr) const;
 
+  enum class Conversion { None, FP16, BF16 };
+  template <typename DT>
+  bool converts() const {
+    return std::is_same_v<DT, float> && conversion_ != Conversion::None;
+  }
+  void toReduced(const float* in, uint16_t* out, size_t n) const;
+  void fromReduced(const uint16_t* in, float* out, size_t n) const;
+
   //members
   std::string name_;
   std::shared_ptr<IO> data_;
@@ -91,8 +122,16 @@ private:
   std::string dname_;
   inference::DataType dtype_;
   int64_t byteSize_;
+  Conversion conversion_;
+  std::vector<uint16_t> reduced_;          //converted input, kept until the request is sent
+  mutable std::vector<float> converted_;  //output read back as float
   std::any holder_;
   std::shared_ptr<Result> result_;
+
+  //registered region, nslots blocks of max batch size used in turn by in-flight requests
+  struct SharedMemory;
+  std::shared_ptr<SharedMemory> shm_;
+  unsigned shmSlot_;
 };
 
 using TritonInputData = TritonData<nvidia::inferenceserver::client::InferInput>;
@@ -105,6 +144,14 @@ void TritonInputData::reset();
 template <>
 void TritonOutputData::reset();
 template <>
+void TritonInputData::setSharedMemorySlot(unsigned slot);
+template <>
+void TritonOutputData::setSharedMemorySlot(unsigned slot);
+template <>
+void TritonInputData::unsetSharedMemory();
+template <>
+void TritonOutputData::unsetSharedMemory();
+template <>
 void TritonInputData::createObject(nvidia::inferenceserver::client::InferInput** ioptr) const;
 template <>
 void TritonOutputData::createObject(nvidia::inferenceserver::client::InferRequestedOutput** ioptr) const;
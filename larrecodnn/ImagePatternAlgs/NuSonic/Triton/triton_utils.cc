@@ -4,11 +4,76 @@
 #include "cetlib_except/exception.h"
 
 #include <algorithm>
+#include <cstring>
 #include <experimental/iterator>
 #include <iostream>
 #include <sstream>
 #include <string>
 
+#if defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+  uint16_t toHalf(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t ax = x & 0x7fffffff;
+    if (ax >= 0x7f800000) //inf or nan
+      return sign | (ax > 0x7f800000 ? 0x7e00 : 0x7c00);
+    if (ax >= 0x477ff000) //rounds to above the largest half
+      return sign | 0x7c00;
+    if (ax < 0x38800000) {
+      //half subnormal: adding 0.5 leaves the value rounded to units of 2^-24 in the mantissa
+      float a;
+      std::memcpy(&a, &ax, sizeof(a));
+      a += 0.5f;
+      std::memcpy(&ax, &a, sizeof(ax));
+      return sign | (ax - 0x3f000000);
+    }
+    //rebias the exponent and round the mantissa to nearest even
+    ax += 0xc8000fff + ((ax >> 13) & 1);
+    return sign | (ax >> 13);
+  }
+
+  float fromHalf(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t em = h & 0x7fff;
+    uint32_t x;
+    if (em >= 0x7c00)
+      x = 0x7f800000 | ((em & 0x3ff) << 13);
+    else if (em >= 0x0400)
+      x = (em << 13) + 0x38000000;
+    else {
+      float f = em * 5.9604644775390625e-8f; //subnormal, units of 2^-24
+      std::memcpy(&x, &f, sizeof(x));
+    }
+    x |= sign;
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+  }
+
+  uint16_t toBFloat16(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) //keep nan quiet
+      return (x >> 16) | 0x40;
+    x += 0x7fff + ((x >> 16) & 1);
+    return x >> 16;
+  }
+
+  float fromBFloat16(uint16_t h) {
+    uint32_t x = uint32_t(h) << 16;
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+  }
+
+}  // namespace
+
 namespace triton_utils {
 
   template <typename C>
@@ -34,6 +99,60 @@ namespace triton_utils {
     return err.IsOk();
   }
 
+  void floatToHalf(const float* in, uint16_t* out, size_t n) {
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= n; i += 8)
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                       _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+    for (; i < n; ++i)
+      out[i] = toHalf(in[i]);
+  }
+
+  void halfToFloat(const uint16_t* in, float* out, size_t n) {
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= n; i += 8)
+      _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+#endif
+    for (; i < n; ++i)
+      out[i] = fromHalf(in[i]);
+  }
+
+  void floatToBFloat16(const float* in, uint16_t* out, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i one = _mm256_set1_epi32(1), bias = _mm256_set1_epi32(0x7fff);
+    const __m256i absMask = _mm256_set1_epi32(0x7fffffff), inf = _mm256_set1_epi32(0x7f800000);
+    const __m256i quiet = _mm256_set1_epi32(0x40);
+    for (; i + 8 <= n; i += 8) {
+      __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+      __m256i hi = _mm256_srli_epi32(x, 16);
+      __m256i r = _mm256_srli_epi32(_mm256_add_epi32(x, _mm256_add_epi32(bias, _mm256_and_si256(hi, one))), 16);
+      __m256i nan = _mm256_cmpgt_epi32(_mm256_and_si256(x, absMask), inf);
+      r = _mm256_blendv_epi8(r, _mm256_or_si256(hi, quiet), nan);
+      //values fit in 16 bits, pack within lanes and take the low quadwords of both lanes
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0xd8);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(packed));
+    }
+#endif
+    for (; i < n; ++i)
+      out[i] = toBFloat16(in[i]);
+  }
+
+  void bfloat16ToFloat(const uint16_t* in, float* out, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+      __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_slli_epi32(x, 16));
+    }
+#endif
+    for (; i < n; ++i)
+      out[i] = fromBFloat16(in[i]);
+  }
+
 }  // namespace triton_utils
 
 template std::string triton_utils::printColl(const triton_span::Span<std::vector<int64_t>::const_iterator>& coll,
@@ -1,6 +1,8 @@
 #ifndef NuSonic_Triton_triton_utils
 #define NuSonic_Triton_triton_utils
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <string_view>
 
@@ -19,6 +21,12 @@ namespace triton_utils {
   //helper to turn triton error into warning
   bool warnIfError(const Error& err, std::string_view msg);
 
+  //float <-> IEEE half / bfloat16 (round to nearest even), vectorized where the target allows
+  void floatToHalf(const float* in, uint16_t* out, size_t n);
+  void halfToFloat(const uint16_t* in, float* out, size_t n);
+  void floatToBFloat16(const float* in, uint16_t* out, size_t n);
+  void bfloat16ToFloat(const uint16_t* in, float* out, size_t n);
+
 }  // namespace triton_utils
 
 #endif
@@ -0,0 +1,383 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Class:       Session
+//
+// Interface to run ONNX models with ONNX Runtime, the in-process counterpart of tf::Graph.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "ort_session.h"
+
+#include "onnxruntime_cxx_api.h"
+#if __has_include("dnnl_provider_factory.h")
+#include "dnnl_provider_factory.h"
+#define ORT_SESSION_HAS_DNNL 1
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+namespace
+{
+    Ort::Env & ortEnv()
+    {
+        static Ort::Env env(ORT_LOGGING_LEVEL_WARNING, "larrecodnn");
+        return env;
+    }
+
+    std::string lower(std::string s)
+    {
+        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+        return s;
+    }
+
+    // add provider to the session options, return false if not available in this build or node
+    bool appendProvider(Ort::SessionOptions & options, const std::string & name, int deviceId, void* stream)
+    {
+        try
+        {
+            if (name == "tensorrt")
+            {
+                OrtTensorRTProviderOptions trt{};
+                trt.device_id = deviceId;
+                trt.has_user_compute_stream = (stream != nullptr);
+                trt.user_compute_stream = stream;
+                options.AppendExecutionProvider_TensorRT(trt);
+            }
+            else if (name == "cuda")
+            {
+                OrtCUDAProviderOptions cuda{};
+                cuda.device_id = deviceId;
+                cuda.has_user_compute_stream = (stream != nullptr);
+                cuda.user_compute_stream = stream;
+                options.AppendExecutionProvider_CUDA(cuda);
+            }
+            else if (name == "dnnl")
+            {
+#ifdef ORT_SESSION_HAS_DNNL
+                Ort::ThrowOnError(OrtSessionOptionsAppendExecutionProvider_Dnnl(options, 1));
+#else
+                std::cout << "ort::Session: DNNL provider not in this ONNX Runtime build." << std::endl;
+                return false;
+#endif
+            }
+            else if (name != "cpu")
+            {
+                std::cout << "ort::Session: unknown execution provider " << name << std::endl;
+                return false;
+            }
+        }
+        catch (const Ort::Exception & e)
+        {
+            std::cout << "ort::Session: " << name << " provider not available: " << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    GraphOptimizationLevel optimizationLevel(const std::string & level)
+    {
+        auto l = lower(level);
+        if (l == "none") { return GraphOptimizationLevel::ORT_DISABLE_ALL; }
+        if (l == "basic") { return GraphOptimizationLevel::ORT_ENABLE_BASIC; }
+        if (l == "extended") { return GraphOptimizationLevel::ORT_ENABLE_EXTENDED; }
+        if (l != "all") { std::cout << "ort::Session: unknown optimization level " << level << ", using all." << std::endl; }
+        return GraphOptimizationLevel::ORT_ENABLE_ALL;
+    }
+
+    // dimensions of a model input or output, incl. batch, -1 for free ones
+    std::vector<long long int> modelShape(const Ort::TypeInfo & info)
+    {
+        auto shape = info.GetTensorTypeAndShapeInfo().GetShape();
+        return std::vector<long long int>(shape.begin(), shape.end());
+    }
+
+    // elements per sample, -1 if not fixed in the model
+    long long int sampleSize(const std::vector<long long int> & shape)
+    {
+        long long int n = 1;
+        for (size_t d = 1; d < shape.size(); ++d)
+        {
+            if (shape[d] <= 0) { return -1; }
+            n *= shape[d];
+        }
+        return n;
+    }
+    // shape of the input tensor: model dimensions if fixed (e.g. NCHW of a PyTorch export, same
+    // memory layout for a single channel), otherwise the caller's sample shape
+    bool inputShape(const std::vector<long long int> & model, long long int samples,
+                    const std::vector<long long int> & sampleShape, std::vector<int64_t> & shape)
+    {
+        long long int n = 1;
+        for (auto d : sampleShape) { n *= d; }
+
+        if ((sampleSize(model) > 0) && (model[0] <= 0 || model[0] == samples))
+        {
+            if (sampleSize(model) != n)
+            {
+                std::cout << "ort::Session: input size does not match the model." << std::endl;
+                return false;
+            }
+            shape.assign(model.begin(), model.end());
+        }
+        else { shape.assign(sampleShape.begin(), sampleShape.end()); shape.insert(shape.begin(), 0); }
+        shape[0] = samples;
+        return true;
+    }
+}
+
+// -------------------------------------------------------------------
+struct ort::Session::Impl
+{
+    std::unique_ptr<Ort::Session> session;
+    Ort::MemoryInfo memInfo = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+    std::unique_ptr<Ort::MemoryInfo> devInfo; // CUDA memory of the configured device
+};
+// -------------------------------------------------------------------
+
+std::shared_ptr<ort::Session> ort::Session::acquire(const char* model_file_name, const std::vector<std::string> & outputs,
+                                                    const SessionConfig & cfg)
+{
+    using Key = std::tuple<std::string, std::vector<std::string>, std::vector<std::string>, int, void*, int, int, std::string>;
+    static std::mutex poolMutex;
+    static std::map< Key, std::weak_ptr<Session> > pool;
+
+    // key on the resolved path, so the same file reached via links or relative paths is loaded once
+    char resolved[PATH_MAX];
+    std::string path = realpath(model_file_name, resolved) ? resolved : model_file_name;
+
+    Key key(path, outputs, cfg.providers, cfg.deviceId, cfg.cudaStream, cfg.interOpThreads, cfg.intraOpThreads, cfg.optimization);
+
+    std::lock_guard<std::mutex> lock(poolMutex);
+    auto shared = pool[key].lock();
+    if (!shared)
+    {
+        shared = create(model_file_name, outputs, cfg);
+        if (shared) { pool[key] = shared; }
+    }
+    else { std::cout << "ort::Session using already loaded " << model_file_name << std::endl; }
+    return shared;
+}
+
+// -------------------------------------------------------------------
+ort::Session::Session(const char* model_file_name, const std::vector<std::string> & outputs, bool & success,
+                      const SessionConfig & cfg)
+    : fImpl(std::make_unique<Impl>())
+{
+    success = false; // until all is done correctly
+
+    try
+    {
+        fImpl->devInfo = std::make_unique<Ort::MemoryInfo>("Cuda", OrtDeviceAllocator, cfg.deviceId, OrtMemTypeDefault);
+
+        Ort::SessionOptions options;
+        options.SetInterOpNumThreads(cfg.interOpThreads);
+        options.SetIntraOpNumThreads(cfg.intraOpThreads);
+        options.SetGraphOptimizationLevel(optimizationLevel(cfg.optimization));
+
+        for (const auto & p : cfg.providers)
+        {
+            auto name = lower(p);
+            if (name == "cpu") { break; } // default provider, nothing after it would be used
+            if (appendProvider(options, name, cfg.deviceId, cfg.cudaStream)) { fProviders.push_back(p); }
+        }
+        fProviders.push_back("CPU"); // always there, runs what other providers do not support
+
+        fImpl->session = std::make_unique<Ort::Session>(ortEnv(), model_file_name, options);
+        auto & session = *fImpl->session;
+
+        Ort::AllocatorWithDefaultOptions allocator;
+        auto nodeName = [&](bool input, size_t i) {
+#if ORT_API_VERSION >= 13
+            auto name = input ? session.GetInputNameAllocated(i, allocator) : session.GetOutputNameAllocated(i, allocator);
+            return std::string(name.get());
+#else
+            char* name = input ? session.GetInputName(i, allocator) : session.GetOutputName(i, allocator);
+            std::string result(name);
+            allocator.Free(name);
+            return result;
+#endif
+        };
+
+        if (session.GetInputCount() != 1)
+        {
+            std::cout << "ort::Session: model with a single input expected." << std::endl;
+            return;
+        }
+        fInputName = nodeName(true, 0);
+        fInputShape = modelShape(session.GetInputTypeInfo(0));
+
+        // all outputs if no specific name provided, or those with names containing provided strings
+        for (size_t o = 0; o < session.GetOutputCount(); ++o)
+        {
+            auto name = nodeName(false, o);
+            bool found = outputs.empty();
+            for (const auto & s : outputs)
+            {
+                if (name.find(s) != std::string::npos) { found = true; break; }
+            }
+            if (found)
+            {
+                fOutputNames.push_back(name);
+                fOutputShapes.push_back(modelShape(session.GetOutputTypeInfo(o)));
+            }
+        }
+        if (fOutputNames.empty())
+        {
+            std::cout << "Output nodes not found in the model." << std::endl;
+            return;
+        }
+    }
+    catch (const Ort::Exception & e)
+    {
+        std::cout << e.what() << std::endl;
+        return;
+    }
+
+    std::cout << "ort::Session loaded " << model_file_name << ", providers:";
+    for (const auto & p : fProviders) { std::cout << " " << p; }
+    std::cout << std::endl;
+
+    success = true; // ok, model loaded from the file
+}
+
+ort::Session::~Session() = default;
+// -------------------------------------------------------------------
+
+size_t ort::Session::run(const float * x, long long int samples, const std::vector<long long int> & sampleShape,
+                         std::vector<float> & out) const
+{
+    if ((samples <= 0) || !x) { out.clear(); return 0; }
+
+    std::vector<int64_t> shape;
+    if (!inputShape(fInputShape, samples, sampleShape, shape)) { out.clear(); return 0; }
+    long long int n = 1;
+    for (auto d : sampleShape) { n *= d; }
+
+    try
+    {
+        auto & session = *fImpl->session;
+        Ort::IoBinding binding(session);
+
+        auto input = Ort::Value::CreateTensor<float>(fImpl->memInfo, const_cast<float*>(x), samples * n,
+                                                     shape.data(), shape.size());
+        binding.BindInput(fInputName.c_str(), input);
+
+        if ((fOutputNames.size() == 1) && (sampleSize(fOutputShapes.front()) > 0))
+        {
+            // results go straight to the caller buffer
+            size_t nouts = sampleSize(fOutputShapes.front());
+            out.resize(samples * nouts);
+            std::vector<int64_t> oshape(fOutputShapes.front().begin(), fOutputShapes.front().end());
+            oshape[0] = samples;
+            auto output = Ort::Value::CreateTensor<float>(fImpl->memInfo, out.data(), out.size(),
+                                                          oshape.data(), oshape.size());
+            binding.BindOutput(fOutputNames.front().c_str(), output);
+            session.Run(Ort::RunOptions{nullptr}, binding);
+            return nouts;
+        }
+
+        for (const auto & name : fOutputNames)
+        {
+            binding.BindOutput(name.c_str(), fImpl->memInfo);
+        }
+        session.Run(Ort::RunOptions{nullptr}, binding);
+        auto outputs = binding.GetOutputValues();
+
+        size_t nouts = 0;
+        std::vector<size_t> sizes;
+        for (auto & o : outputs)
+        {
+            auto oshape = o.GetTensorTypeAndShapeInfo().GetShape();
+            if (oshape.empty() || (oshape[0] != samples))
+            {
+                throw std::string("ONNX outputs size inconsistent.");
+            }
+            sizes.push_back(o.GetTensorTypeAndShapeInfo().GetElementCount() / samples);
+            nouts += sizes.back();
+        }
+
+        out.resize(samples * nouts);
+
+        size_t idx0 = 0;
+        for (size_t o = 0; o < outputs.size(); ++o)
+        {
+            const float * src = outputs[o].GetTensorMutableData<float>();
+
+            size_t m = sizes[o];
+            for (long long int s = 0; s < samples; ++s) {
+                std::copy_n(src + s * m, m, out.begin() + s * nouts + idx0);
+            }
+            idx0 += m;
+        }
+        return nouts;
+    }
+    catch (const Ort::Exception & e)
+    {
+        std::cout << e.what() << std::endl;
+        out.clear();
+        return 0;
+    }
+}
+// -------------------------------------------------------------------
+
+std::vector<size_t> ort::Session::outputSizes() const
+{
+    std::vector<size_t> sizes;
+    for (const auto & shape : fOutputShapes) { sizes.push_back(std::max(sampleSize(shape), 0LL)); }
+    return sizes;
+}
+// -------------------------------------------------------------------
+
+bool ort::Session::runOnDevice(const float * x, long long int samples, const std::vector<long long int> & sampleShape,
+                               float * out) const
+{
+    if ((samples <= 0) || !x || !out) { return false; }
+
+    std::vector<int64_t> shape;
+    if (!inputShape(fInputShape, samples, sampleShape, shape)) { return false; }
+
+    long long int n = 1;
+    for (auto d : sampleShape) { n *= d; }
+
+    try
+    {
+        auto & session = *fImpl->session;
+        Ort::IoBinding binding(session);
+
+        auto input = Ort::Value::CreateTensor<float>(*fImpl->devInfo, const_cast<float*>(x), samples * n,
+                                                     shape.data(), shape.size());
+        binding.BindInput(fInputName.c_str(), input);
+
+        // each output bound to its block of the device buffer
+        std::vector<Ort::Value> outputs;
+        for (size_t o = 0; o < fOutputNames.size(); ++o)
+        {
+            long long int m = sampleSize(fOutputShapes[o]);
+            if (m <= 0)
+            {
+                std::cout << "ort::Session: output size not fixed in the model." << std::endl;
+                return false;
+            }
+            std::vector<int64_t> oshape(fOutputShapes[o].begin(), fOutputShapes[o].end());
+            oshape[0] = samples;
+            outputs.push_back(Ort::Value::CreateTensor<float>(*fImpl->devInfo, out, samples * m,
+                                                              oshape.data(), oshape.size()));
+            binding.BindOutput(fOutputNames[o].c_str(), outputs.back());
+            out += samples * m;
+        }
+        session.Run(Ort::RunOptions{nullptr}, binding);
+        return true;
+    }
+    catch (const Ort::Exception & e)
+    {
+        std::cout << e.what() << std::endl;
+        return false;
+    }
+}
+// -------------------------------------------------------------------
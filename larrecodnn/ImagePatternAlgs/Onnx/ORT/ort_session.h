@@ -0,0 +1,90 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//// Class:       Session
+////
+//// Interface to run ONNX models with ONNX Runtime, the in-process counterpart of tf::Graph.
+//// Execution providers are tried in the configured order (e.g. TensorRT, CUDA, DNNL), the ones
+//// not available in the ONNX Runtime build or on the node are skipped, CPU is always the last
+//// resort. Inputs and outputs are bound to the caller memory, no tensor copies on the host.
+////
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OrtSession_h
+#define OrtSession_h
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ort
+{
+
+/// Session options. Default protects batch farms as for TF: single core, CPU only.
+/// Use 0 threads to let ONNX Runtime take all cores.
+struct SessionConfig
+{
+    std::vector<std::string> providers = { "CPU" }; // TensorRT, CUDA, DNNL, CPU; in order of preference
+    int deviceId = 0;                               // GPU used by CUDA and TensorRT providers
+    void* cudaStream = nullptr;                     // cudaStream_t the GPU providers compute on, null: their own
+    int interOpThreads = 1;
+    int intraOpThreads = 1;
+    std::string optimization = "all";               // graph optimization: none, basic, extended, all
+};
+
+class Session
+{
+public:
+    static std::unique_ptr<Session> create(const char* model_file_name, const std::vector<std::string> & outputs = {},
+                                           const SessionConfig & cfg = SessionConfig())
+    {
+        bool success;
+        std::unique_ptr<Session> ptr(new Session(model_file_name, outputs, success, cfg));
+        if (success) { return ptr; }
+        else { return nullptr; }
+    }
+
+    /// Process-wide pool: tools using the same model file (resolved path), outputs and session config share
+    /// one session. Session is released when its last user is gone.
+    static std::shared_ptr<Session> acquire(const char* model_file_name, const std::vector<std::string> & outputs = {},
+                                            const SessionConfig & cfg = SessionConfig());
+
+    ~Session();
+
+    // run on contiguous input x, laid out as [samples, sampleShape...]; x is bound to the model
+    // input as is (no copy) and results are written to out as [samples, outputs] (out is only
+    // resized, so its memory can be reused between calls and, with a single model output of
+    // fixed size, is bound directly as the output buffer); return number of outputs per sample,
+    // 0 if failed; safe to call from many threads
+    size_t run(const float * x, long long int samples, const std::vector<long long int> & sampleShape,
+               std::vector<float> & out) const;
+
+    // x and out in CUDA memory of the configured device, input laid out as above; outputs are
+    // written one after the other, as [samples, outputSizes()[o]] blocks; work is queued on the
+    // configured stream and is complete on return; false if failed or output sizes not fixed
+    bool runOnDevice(const float * x, long long int samples, const std::vector<long long int> & sampleShape,
+                     float * out) const;
+
+    // values per sample of each model output, 0 if not fixed in the model
+    std::vector<size_t> outputSizes() const;
+
+    // execution providers actually used, in order of preference
+    const std::vector<std::string> & providers() const { return fProviders; }
+
+private:
+    /// Not-throwing constructor.
+    Session(const char* model_file_name, const std::vector<std::string> & outputs, bool & success,
+            const SessionConfig & cfg);
+
+    struct Impl; // ONNX Runtime objects, kept out of this header
+    std::unique_ptr<Impl> fImpl;
+
+    std::vector<std::string> fProviders;
+    std::string fInputName;
+    std::vector<long long int> fInputShape;  // model input shape, -1 for free dimensions
+    std::vector<std::string> fOutputNames;
+    std::vector< std::vector<long long int> > fOutputShapes; // same for outputs
+};
+
+} // namespace ort
+
+#endif
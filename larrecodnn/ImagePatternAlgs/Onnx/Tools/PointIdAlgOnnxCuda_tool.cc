@@ -0,0 +1,419 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Class:       PointIdAlgOnnxCuda_tool (in-process GPU inference in PointIdAlg)
+//
+//              ONNX models run with the CUDA or TensorRT execution provider of ONNX Runtime, for
+//              GPU nodes running a single reco job: no server and no network round trip.
+//              Batches go through CudaStreams lanes, each with its own stream, session and
+//              page-locked host buffers; patches of a batch are gathered straight into the pinned
+//              input of a free lane, then its H2D copy, inference and D2H copy run on the lane
+//              stream from a worker thread. Consecutive submitted batches use different lanes, so
+//              copies and compute of one batch overlap with the next one.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "art/Utilities/ToolMacros.h"
+
+#include "larrecodnn/ImagePatternAlgs/Onnx/ORT/ort_session.h"
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/IPointIdAlg.h"
+
+#include <cuda_runtime_api.h>
+
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace PointIdAlgTools {
+
+  class PointIdAlgOnnxCuda : public IPointIdAlg {
+  public:
+    explicit PointIdAlgOnnxCuda(fhicl::Table<Config> const& table);
+    ~PointIdAlgOnnxCuda() override;
+
+    std::vector<float> Run(std::vector<std::vector<float>> const& inp2d) const override;
+    std::vector<std::vector<float>> Run(std::vector<std::vector<std::vector<float>>> const& inps,
+                                        int samples = -1) const override;
+    std::vector<std::vector<float>> Run(float const* inps, size_t samples) const override;
+
+    void submitIdVectors(const std::vector<std::pair<unsigned int, float>>& points) override;
+    std::vector<std::vector<float>> collectIdVectors() override;
+
+  protected:
+    std::string findFile(const char* fileName) const;
+
+  private:
+    struct Lane {
+      cudaStream_t stream = nullptr;
+      std::shared_ptr<ort::Session> session; // computes on the lane stream
+      float* hostIn = nullptr;               // pinned
+      float* hostOut = nullptr;              // pinned
+      float* devIn = nullptr;
+      float* devOut = nullptr;
+      size_t capacity = 0; // samples
+      size_t samples = 0;  // in the current batch
+      std::future<bool> done; // valid while a batch is in flight
+    };
+
+    // batch submitted and not collected: in flight on a lane, or results already read
+    struct Pending {
+      Lane* lane;
+      std::vector<std::vector<float>> result;
+    };
+
+    // next lane in turn, results of its batch still in flight are read out first
+    Lane& acquireLane() const;
+    void reserve(Lane& lane, size_t samples) const;
+    void start(Lane& lane, size_t samples) const;
+    std::vector<std::vector<float>> finish(Lane& lane) const;
+    std::vector<std::vector<float>> runLane(Lane& lane, size_t samples) const;
+
+    void checkCuda(cudaError_t status, char const* what) const;
+
+    std::vector<std::string> fNNetOutputPattern;
+    std::string fNNetModelFilePath;
+    int fDeviceId;
+
+    std::vector<size_t> fOutputSizes; // values per sample of each output
+    size_t fNOutputValues;            // total values per sample
+
+    std::vector<std::unique_ptr<Lane>> fLanes;
+    mutable size_t fNextLane = 0;
+    mutable std::deque<Pending> fPending;
+  };
+
+  // ------------------------------------------------------
+  PointIdAlgOnnxCuda::PointIdAlgOnnxCuda(fhicl::Table<Config> const& table)
+    : img::DataProviderAlg(table())
+  {
+    // ... Get common config vars
+    fNNetOutputs = table().NNetOutputs();
+    fPatchSizeW = table().PatchSizeW();
+    fPatchSizeD = table().PatchSizeD();
+    fCurrentWireIdx = 99999;
+    fCurrentScaledDrift = 99999;
+
+    // ... Get "optional" config vars specific to onnx interface
+    std::string s_cfgvr;
+    if (table().NNetModelFile(s_cfgvr)) { fNNetModelFilePath = s_cfgvr; }
+    else {
+      fNNetModelFilePath = "mycnn.onnx";
+    }
+    std::vector<std::string> vs_cfgvr;
+    if (table().NNetOutputPattern(vs_cfgvr)) { fNNetOutputPattern = vs_cfgvr; }
+    else {
+      fNNetOutputPattern = {"cnn_output", "_netout"};
+    }
+
+    if ((fNNetModelFilePath.length() <= 5) ||
+        (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 5, 5, ".onnx") != 0)) {
+      throw art::Exception(art::errors::Configuration)
+        << "PointIdAlgOnnxCuda: ONNX model file expected, got " << fNNetModelFilePath;
+    }
+    const std::string modelFile = findFile(fNNetModelFilePath.c_str());
+
+    // ... only GPU providers from the list, CUDA if none given
+    auto lower = [](std::string s) {
+      std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+      return s;
+    };
+    ort::SessionConfig cfg;
+    cfg.providers.clear();
+    for (auto const& p : table().OnnxProviders()) {
+      if ((lower(p) == "tensorrt") || (lower(p) == "cuda")) { cfg.providers.push_back(p); }
+    }
+    if (cfg.providers.empty()) { cfg.providers.push_back("CUDA"); }
+    fDeviceId = cfg.deviceId = table().OnnxDeviceId();
+    cfg.interOpThreads = table().OnnxInterOpThreads();
+    cfg.intraOpThreads = table().OnnxIntraOpThreads();
+    cfg.optimization = table().OnnxOptimization();
+
+    checkCuda(cudaSetDevice(fDeviceId), "cudaSetDevice");
+
+    const size_t nlanes = std::max(1u, table().CudaStreams());
+    for (size_t i = 0; i < nlanes; ++i) {
+      auto lane = std::make_unique<Lane>();
+      checkCuda(cudaStreamCreateWithFlags(&lane->stream, cudaStreamNonBlocking), "cudaStreamCreate");
+      cfg.cudaStream = lane->stream;
+      lane->session = ort::Session::acquire(modelFile.c_str(), fNNetOutputPattern, cfg);
+      if (!lane->session) { throw art::Exception(art::errors::Unknown) << "ONNX model failed."; }
+
+      auto provider = lower(lane->session->providers().front());
+      if ((provider != "tensorrt") && (provider != "cuda")) {
+        throw art::Exception(art::errors::Unknown)
+          << "PointIdAlgOnnxCuda: no GPU execution provider available.";
+      }
+      fLanes.push_back(std::move(lane));
+    }
+
+    fOutputSizes = fLanes.front()->session->outputSizes();
+    fNOutputValues = 0;
+    for (auto n : fOutputSizes) {
+      if (n == 0) {
+        throw art::Exception(art::errors::Unknown)
+          << "PointIdAlgOnnxCuda: model outputs must have a fixed size per sample.";
+      }
+      fNOutputValues += n;
+    }
+
+    mf::LogInfo("PointIdAlgOnnxCuda")
+      << "ONNX model loaded, provider: " << fLanes.front()->session->providers().front() << ", "
+      << nlanes << " CUDA streams on device " << fDeviceId;
+
+    resizePatch();
+  }
+
+  // ------------------------------------------------------
+  PointIdAlgOnnxCuda::~PointIdAlgOnnxCuda()
+  {
+    for (auto& lane : fLanes) {
+      if (lane->done.valid()) { lane->done.wait(); }
+      lane->session.reset();
+      cudaFreeHost(lane->hostIn);
+      cudaFreeHost(lane->hostOut);
+      cudaFree(lane->devIn);
+      cudaFree(lane->devOut);
+      cudaStreamDestroy(lane->stream);
+    }
+  }
+
+  // ------------------------------------------------------
+  std::string
+  PointIdAlgOnnxCuda::findFile(const char* fileName) const
+  {
+    std::string fname_out;
+    cet::search_path sp("FW_SEARCH_PATH");
+    if (!sp.find_file(fileName, fname_out)) {
+      struct stat buffer;
+      if (stat(fileName, &buffer) == 0) { fname_out = fileName; }
+      else {
+        throw art::Exception(art::errors::NotFound) << "Could not find the model file " << fileName;
+      }
+    }
+    return fname_out;
+  }
+
+  // ------------------------------------------------------
+  void
+  PointIdAlgOnnxCuda::checkCuda(cudaError_t status, char const* what) const
+  {
+    if (status != cudaSuccess) {
+      throw cet::exception("PointIdAlgOnnxCuda")
+        << what << " failed: " << cudaGetErrorString(status) << std::endl;
+    }
+  }
+
+  // ------------------------------------------------------
+  PointIdAlgOnnxCuda::Lane&
+  PointIdAlgOnnxCuda::acquireLane() const
+  {
+    Lane& lane = *fLanes[fNextLane];
+    fNextLane = (fNextLane + 1) % fLanes.size();
+
+    if (lane.done.valid()) {
+      // lanes are taken in turn, so the oldest batch in flight is on this one
+      for (auto& p : fPending) {
+        if (p.lane == &lane) {
+          p.result = finish(lane);
+          p.lane = nullptr;
+          break;
+        }
+      }
+    }
+    return lane;
+  }
+
+  // ------------------------------------------------------
+  void
+  PointIdAlgOnnxCuda::reserve(Lane& lane, size_t samples) const
+  {
+    if (samples <= lane.capacity) { return; }
+
+    cudaFreeHost(lane.hostIn);
+    cudaFreeHost(lane.hostOut);
+    cudaFree(lane.devIn);
+    cudaFree(lane.devOut);
+    lane.capacity = 0;
+
+    const size_t nin = samples * fPatchSizeW * fPatchSizeD, nout = samples * fNOutputValues;
+    checkCuda(cudaSetDevice(fDeviceId), "cudaSetDevice");
+    checkCuda(cudaHostAlloc((void**)&lane.hostIn, nin * sizeof(float), cudaHostAllocDefault),
+              "cudaHostAlloc");
+    checkCuda(cudaHostAlloc((void**)&lane.hostOut, nout * sizeof(float), cudaHostAllocDefault),
+              "cudaHostAlloc");
+    checkCuda(cudaMalloc((void**)&lane.devIn, nin * sizeof(float)), "cudaMalloc");
+    checkCuda(cudaMalloc((void**)&lane.devOut, nout * sizeof(float)), "cudaMalloc");
+    lane.capacity = samples;
+  }
+
+  // ------------------------------------------------------
+  void
+  PointIdAlgOnnxCuda::start(Lane& lane, size_t samples) const
+  {
+    lane.samples = samples;
+    lane.done = std::async(std::launch::async, [this, &lane]() {
+      const long long int rows = fPatchSizeW, cols = fPatchSizeD;
+      const size_t nin = lane.samples * rows * cols, nout = lane.samples * fNOutputValues;
+      return (cudaSetDevice(fDeviceId) == cudaSuccess) &&
+             (cudaMemcpyAsync(lane.devIn,
+                              lane.hostIn,
+                              nin * sizeof(float),
+                              cudaMemcpyHostToDevice,
+                              lane.stream) == cudaSuccess) &&
+             lane.session->runOnDevice(lane.devIn, lane.samples, {rows, cols, 1}, lane.devOut) &&
+             (cudaMemcpyAsync(lane.hostOut,
+                              lane.devOut,
+                              nout * sizeof(float),
+                              cudaMemcpyDeviceToHost,
+                              lane.stream) == cudaSuccess) &&
+             (cudaStreamSynchronize(lane.stream) == cudaSuccess);
+    });
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgOnnxCuda::finish(Lane& lane) const
+  {
+    nnet::PerfTimer timer(fPerfInference); // time still waited for the result
+    if (!lane.done.get()) {
+      throw cet::exception("PointIdAlgOnnxCuda") << "GPU inference failed" << std::endl;
+    }
+
+    // ~~~~ outputs are [samples, n] blocks one after the other, concatenated per sample
+    timer.next(fPerfOutput);
+    const size_t samples = lane.samples;
+    std::vector<std::vector<float>> out(samples, std::vector<float>(fNOutputValues));
+    float const* src = lane.hostOut;
+    size_t offset = 0;
+    for (auto n : fOutputSizes) {
+      for (size_t s = 0; s < samples; ++s, src += n) {
+        std::copy_n(src, n, out[s].begin() + offset);
+      }
+      offset += n;
+    }
+    return out;
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgOnnxCuda::runLane(Lane& lane, size_t samples) const
+  {
+    start(lane, samples);
+    return finish(lane);
+  }
+
+  // ------------------------------------------------------
+  std::vector<float>
+  PointIdAlgOnnxCuda::Run(std::vector<std::vector<float>> const& inp2d) const
+  {
+    const size_t rows = inp2d.size(), cols = inp2d.front().size();
+    if ((rows != fPatchSizeW) || (cols != fPatchSizeD)) {
+      throw cet::exception("PointIdAlgOnnxCuda") << "Input size does not match the patch size" << std::endl;
+    }
+
+    Lane& lane = acquireLane();
+    reserve(lane, 1);
+
+    nnet::PerfTimer timer(fPerfInput);
+    for (size_t r = 0; r < rows; ++r) {
+      std::copy_n(inp2d[r].begin(), cols, lane.hostIn + r * cols);
+    }
+    timer.stop();
+
+    auto out = runLane(lane, 1);
+    return out.front();
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgOnnxCuda::Run(std::vector<std::vector<std::vector<float>>> const& inps, int samples) const
+  {
+    if ((samples == 0) || inps.empty() || inps.front().empty() || inps.front().front().empty()) {
+      return std::vector<std::vector<float>>();
+    }
+
+    if ((samples == -1) || (samples > (long long int)inps.size())) { samples = inps.size(); }
+
+    const size_t rows = inps.front().size(), cols = inps.front().front().size();
+    if ((rows != fPatchSizeW) || (cols != fPatchSizeD)) {
+      throw cet::exception("PointIdAlgOnnxCuda") << "Input size does not match the patch size" << std::endl;
+    }
+
+    Lane& lane = acquireLane();
+    reserve(lane, samples);
+
+    nnet::PerfTimer timer(fPerfInput);
+    float* dst = lane.hostIn;
+    for (int s = 0; s < samples; ++s) {
+      const auto& sample = inps[s];
+      for (size_t r = 0; r < rows; ++r) {
+        dst = std::copy_n(sample[r].begin(), cols, dst);
+      }
+    }
+    timer.stop();
+
+    return runLane(lane, samples);
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgOnnxCuda::Run(float const* inps, size_t samples) const
+  {
+    if ((samples == 0) || !inps) { return std::vector<std::vector<float>>(); }
+
+    // ~~~~ DMA needs page-locked memory, single block copy to the pinned input
+    Lane& lane = acquireLane();
+    reserve(lane, samples);
+
+    nnet::PerfTimer timer(fPerfInput);
+    std::copy_n(inps, samples * fPatchSizeW * fPatchSizeD, lane.hostIn);
+    timer.stop();
+
+    return runLane(lane, samples);
+  }
+
+  // ------------------------------------------------------
+  void
+  PointIdAlgOnnxCuda::submitIdVectors(const std::vector<std::pair<unsigned int, float>>& points)
+  {
+    if (points.empty()) {
+      fPending.push_back({nullptr, {}});
+      return;
+    }
+
+    Lane& lane = acquireLane();
+    reserve(lane, points.size());
+
+    // ~~~~ patches written straight into the pinned input of the lane
+    nnet::PerfTimer timer(fPerfPatches);
+    const size_t patchSize = fPatchSizeW * fPatchSizeD;
+    for (size_t i = 0; i < points.size(); ++i) {
+      if (!bufferPatch(points[i].first, points[i].second, lane.hostIn + i * patchSize)) {
+        throw cet::exception("PointIdAlgOnnxCuda") << "Patch buffering failed" << std::endl;
+      }
+    }
+    timer.stop();
+
+    start(lane, points.size());
+    fPending.push_back({&lane, {}});
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgOnnxCuda::collectIdVectors()
+  {
+    if (fPending.empty()) {
+      throw cet::exception("PointIdAlgOnnxCuda") << "No submitted batch to collect" << std::endl;
+    }
+
+    auto p = std::move(fPending.front());
+    fPending.pop_front();
+    if (p.lane) { return finish(*p.lane); }
+    return std::move(p.result);
+  }
+
+}
+DEFINE_ART_CLASS_TOOL(PointIdAlgTools::PointIdAlgOnnxCuda)
@@ -0,0 +1,184 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Class:       PointIdAlgOnnx_tool (ONNX Runtime model interface in PointIdAlg)
+//
+//              Same models as PointIdAlgTf, exported to ONNX; the patch buffer filled with
+//              bufferPatches() is bound directly as the model input.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "art/Utilities/ToolMacros.h"
+
+#include "larrecodnn/ImagePatternAlgs/Onnx/ORT/ort_session.h"
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/IPointIdAlg.h"
+
+#include <sys/stat.h>
+
+namespace PointIdAlgTools {
+
+  class PointIdAlgOnnx : public IPointIdAlg {
+  public:
+    explicit PointIdAlgOnnx(fhicl::Table<Config> const& table);
+
+    std::vector<float> Run(std::vector<std::vector<float>> const& inp2d) const override;
+    std::vector<std::vector<float>> Run(std::vector<std::vector<std::vector<float>>> const& inps,
+                                        int samples = -1) const override;
+    std::vector<std::vector<float>> Run(float const* inps, size_t samples) const override;
+
+  protected:
+    std::string findFile(const char* fileName) const;
+
+  private:
+    // run on contiguous [samples, rows, cols] input, outputs split per sample
+    std::vector<std::vector<float>> infer(float const* inps,
+                                          long long int samples,
+                                          long long int rows,
+                                          long long int cols) const;
+
+    std::shared_ptr<ort::Session> g; // ONNX Runtime session, shared by tools using the same model
+    std::vector<std::string> fNNetOutputPattern;
+    std::string fNNetModelFilePath;
+  };
+
+  // ------------------------------------------------------
+  PointIdAlgOnnx::PointIdAlgOnnx(fhicl::Table<Config> const& table)
+    : img::DataProviderAlg(table())
+  {
+    // ... Get common config vars
+    fNNetOutputs = table().NNetOutputs();
+    fPatchSizeW = table().PatchSizeW();
+    fPatchSizeD = table().PatchSizeD();
+    fCurrentWireIdx = 99999;
+    fCurrentScaledDrift = 99999;
+
+    // ... Get "optional" config vars specific to onnx interface
+    std::string s_cfgvr;
+    if (table().NNetModelFile(s_cfgvr)) { fNNetModelFilePath = s_cfgvr; }
+    else {
+      fNNetModelFilePath = "mycnn.onnx";
+    }
+    std::vector<std::string> vs_cfgvr;
+    if (table().NNetOutputPattern(vs_cfgvr)) { fNNetOutputPattern = vs_cfgvr; }
+    else {
+      fNNetOutputPattern = {"cnn_output", "_netout"};
+    }
+
+    if ((fNNetModelFilePath.length() > 5) &&
+        (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 5, 5, ".onnx") == 0)) {
+      ort::SessionConfig cfg;
+      cfg.providers = table().OnnxProviders();
+      cfg.deviceId = table().OnnxDeviceId();
+      cfg.interOpThreads = table().OnnxInterOpThreads();
+      cfg.intraOpThreads = table().OnnxIntraOpThreads();
+      cfg.optimization = table().OnnxOptimization();
+      g = ort::Session::acquire(
+        findFile(fNNetModelFilePath.c_str()).c_str(), fNNetOutputPattern, cfg);
+      if (!g) { throw art::Exception(art::errors::Unknown) << "ONNX model failed."; }
+      mf::LogInfo("PointIdAlgOnnx") << "ONNX model loaded, provider: " << g->providers().front();
+    }
+    else {
+      mf::LogError("PointIdAlgOnnx") << "File name extension not supported.";
+    }
+
+    resizePatch();
+  }
+
+  // ------------------------------------------------------
+  std::string
+  PointIdAlgOnnx::findFile(const char* fileName) const
+  {
+    std::string fname_out;
+    cet::search_path sp("FW_SEARCH_PATH");
+    if (!sp.find_file(fileName, fname_out)) {
+      struct stat buffer;
+      if (stat(fileName, &buffer) == 0) { fname_out = fileName; }
+      else {
+        throw art::Exception(art::errors::NotFound) << "Could not find the model file " << fileName;
+      }
+    }
+    return fname_out;
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgOnnx::infer(float const* inps,
+                        long long int samples,
+                        long long int rows,
+                        long long int cols) const
+  {
+    thread_local std::vector<float> flat; // session writes the outputs here, reused between calls
+
+    nnet::PerfTimer timer(fPerfInference);
+    size_t nouts = g->run(inps, samples, {rows, cols, 1}, flat);
+
+    timer.next(fPerfOutput);
+    std::vector<std::vector<float>> result;
+    if (nouts == 0) { return result; }
+
+    result.resize(samples);
+    for (long long int s = 0; s < samples; ++s) {
+      result[s].assign(flat.begin() + s * nouts, flat.begin() + (s + 1) * nouts);
+    }
+    return result;
+  }
+
+  // ------------------------------------------------------
+  std::vector<float>
+  PointIdAlgOnnx::Run(std::vector<std::vector<float>> const& inp2d) const
+  {
+    thread_local std::vector<float> staging;
+
+    nnet::PerfTimer timer(fPerfInput);
+    long long int rows = inp2d.size(), cols = inp2d.front().size();
+
+    staging.resize(rows * cols);
+    for (long long int r = 0; r < rows; ++r) {
+      std::copy_n(inp2d[r].begin(), cols, staging.begin() + r * cols);
+    }
+    timer.stop();
+
+    auto out = infer(staging.data(), 1, rows, cols);
+    if (!out.empty())
+      return out.front();
+    else
+      return std::vector<float>();
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgOnnx::Run(std::vector<std::vector<std::vector<float>>> const& inps, int samples) const
+  {
+    if ((samples == 0) || inps.empty() || inps.front().empty() || inps.front().front().empty()) {
+      return std::vector<std::vector<float>>();
+    }
+
+    if ((samples == -1) || (samples > (long long int)inps.size())) { samples = inps.size(); }
+
+    thread_local std::vector<float> staging;
+
+    nnet::PerfTimer timer(fPerfInput);
+    long long int rows = inps.front().size(), cols = inps.front().front().size();
+
+    staging.resize(samples * rows * cols);
+    float* dst = staging.data();
+    for (long long int s = 0; s < samples; ++s) {
+      const auto& sample = inps[s];
+      for (long long int r = 0; r < rows; ++r) {
+        dst = std::copy_n(sample[r].begin(), cols, dst);
+      }
+    }
+    timer.stop();
+
+    return infer(staging.data(), samples, rows, cols);
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgOnnx::Run(float const* inps, size_t samples) const
+  {
+    if ((samples == 0) || !inps) { return std::vector<std::vector<float>>(); }
+
+    // input memory has the tensor layout already, bound to the session as is
+    return infer(inps, samples, fPatchSizeW, fPatchSizeD);
+  }
+
+}
+DEFINE_ART_CLASS_TOOL(PointIdAlgTools::PointIdAlgOnnx)
@@ -0,0 +1,100 @@
+#include "art/Utilities/ToolMacros.h"
+#include "larrecodnn/ImagePatternAlgs/Onnx/ORT/ort_session.h"
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/IWaveformRecog.h"
+#include "messagefacility/MessageLogger/MessageLogger.h"
+
+namespace wavrec_tool {
+
+  class WaveformRecogOnnx : public IWaveformRecog {
+  public:
+    explicit WaveformRecogOnnx(const fhicl::ParameterSet& pset);
+
+    std::vector<std::vector<float>> predictWaveformType(
+      const std::vector<std::vector<float>>&) const override;
+    size_t predictWaveformWindows(const float* const* windows,
+                                  size_t nwindows,
+                                  std::vector<float>& out) const override;
+
+  private:
+    std::shared_ptr<ort::Session> g; // ONNX Runtime session, shared by tools using the same model
+    std::string fNNetModelFilePath;
+    std::vector<std::string> fNNetOutputPattern;
+  };
+
+  // ------------------------------------------------------
+  WaveformRecogOnnx::WaveformRecogOnnx(const fhicl::ParameterSet& pset)
+  {
+    fNNetModelFilePath = pset.get<std::string>("NNetModelFile", "mymodel.onnx");
+    fNNetOutputPattern = pset.get<std::vector<std::string>>("NNetOutputPattern", {});
+    ort::SessionConfig cfg;
+    cfg.providers = pset.get<std::vector<std::string>>("OnnxProviders", {"CPU"});
+    cfg.deviceId = pset.get<int>("OnnxDeviceId", 0);
+    cfg.interOpThreads = pset.get<int>("OnnxInterOpThreads", 1);
+    cfg.intraOpThreads = pset.get<int>("OnnxIntraOpThreads", 1);
+    cfg.optimization = pset.get<std::string>("OnnxOptimization", "all");
+    if ((fNNetModelFilePath.length() > 5) &&
+        (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 5, 5, ".onnx") == 0)) {
+      g = ort::Session::acquire(findFile(fNNetModelFilePath.c_str()).c_str(), fNNetOutputPattern, cfg);
+      if (!g) { throw art::Exception(art::errors::Unknown) << "ONNX model failed."; }
+      mf::LogInfo("WaveformRecogOnnx") << "ONNX model loaded, provider: " << g->providers().front();
+    }
+    else {
+      mf::LogError("WaveformRecogOnnx") << "File name extension not supported.";
+    }
+
+    setupWaveRecRoiParams(pset);
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  WaveformRecogOnnx::predictWaveformType(const std::vector<std::vector<float>>& waveforms) const
+  {
+    if (waveforms.empty() || waveforms.front().empty()) {
+      return std::vector<std::vector<float>>();
+    }
+
+    long long int samples = waveforms.size(), numtcks = waveforms.front().size();
+
+    std::vector<float> x(samples * numtcks), flat;
+    for (long long int s = 0; s < samples; ++s) {
+      std::copy_n(waveforms[s].begin(), numtcks, x.begin() + s * numtcks);
+    }
+
+    size_t nouts = g->run(x.data(), samples, {numtcks, 1}, flat);
+    std::vector<std::vector<float>> result;
+    if (nouts == 0) { return result; }
+
+    result.resize(samples);
+    for (long long int s = 0; s < samples; ++s) {
+      result[s].assign(flat.begin() + s * nouts, flat.begin() + (s + 1) * nouts);
+    }
+    return result;
+  }
+
+  // ------------------------------------------------------
+  size_t
+  WaveformRecogOnnx::predictWaveformWindows(const float* const* windows,
+                                            size_t nwindows,
+                                            std::vector<float>& out) const
+  {
+    out.clear();
+    if (nwindows == 0) { return 0; }
+
+    // windows overlap in the caller's waveform buffer, so they are packed once into a
+    // per-thread input block; outputs are bound directly to out
+    thread_local std::vector<float> staging;
+
+    long long int samples = nwindows, numtcks = windowSize();
+
+    nnet::PerfTimer timer(fPerfInput);
+    staging.resize(samples * numtcks);
+    for (long long int s = 0; s < samples; ++s) {
+      std::copy_n(windows[s], numtcks, staging.begin() + s * numtcks);
+    }
+
+    timer.next(fPerfInference);
+    return g->run(staging.data(), samples, {numtcks, 1}, out);
+  }
+
+}
+DEFINE_ART_CLASS_TOOL(wavrec_tool::WaveformRecogOnnx)
@@ -8,6 +8,7 @@
 //
 /////////////////////////////////////////////////////////////////////////////////
 
+#include "larrecodnn/ImagePatternAlgs/Modules/SpatialHash.h"
 #include "larrecodnn/ImagePatternAlgs/Tensorflow/PointIdAlg/PointIdAlg.h"
 #include "lardata/DetectorInfoServices/DetectorClocksService.h"
 #include "lardata/DetectorInfoServices/DetectorPropertiesService.h"
@@ -29,6 +30,7 @@
 #include "canvas/Persistency/Common/FindManyP.h"
 #include "canvas/Persistency/Common/Ptr.h"
 #include "canvas/Utilities/InputTag.h"
+#include "cetlib_except/exception.h"
 #include "fhiclcpp/types/Atom.h"
 #include "fhiclcpp/types/Comment.h"
 #include "fhiclcpp/types/Name.h"
@@ -36,9 +38,11 @@
 
 #include <TVector3.h>
 
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -52,6 +56,10 @@ namespace nnet {
 
       fhicl::Table<nnet::PointIdAlg::Config> PointIdAlg{Name("PointIdAlg")};
 
+      fhicl::Atom<size_t> BatchSize{Name("BatchSize"),
+                                    Comment("number of samples processed in one batch"),
+                                    256};
+
       fhicl::Atom<art::InputTag> WireLabel{
         Name("WireLabel"),
         Comment("tag of deconvoluted ADC on wires (recob::Wire)")};
@@ -82,16 +90,24 @@ namespace nnet {
     ParticleDecayId& operator=(ParticleDecayId&&) = delete;
 
   private:
+    using key = std::tuple<unsigned int, unsigned int, unsigned int>; // cryo, tpc, view
+    using hit_scores = std::map<art::Ptr<recob::Hit>, float>;         // p(decay) of hits
+
     void produce(art::Event& e) override;
 
-    bool DetectDecay(detinfo::DetectorClocksData const& clockData,
-                     detinfo::DetectorPropertiesData const& detProp,
-                     const std::vector<recob::Wire>& wires,
-                     const std::vector<art::Ptr<recob::Hit>>& hits,
+    void classifyHits(detinfo::DetectorClocksData const& clockData,
+                      detinfo::DetectorPropertiesData const& detProp,
+                      const std::vector<recob::Wire>& wires,
+                      const std::vector<art::Ptr<recob::Hit>>& hits,
+                      hit_scores& scores);
+
+    bool DetectDecay(const std::vector<art::Ptr<recob::Hit>>& hits,
+                     hit_scores const& scores,
                      std::map<size_t, TVector3>& spoints,
                      std::vector<std::pair<TVector3, double>>& result);
 
     PointIdAlg fPointIdAlg;
+    size_t fBatchSize;
 
     art::InputTag fWireProducerLabel;
     art::InputTag fTrackModuleLabel;
@@ -105,6 +121,7 @@ namespace nnet {
   ParticleDecayId::ParticleDecayId(ParticleDecayId::Parameters const& config)
     : EDProducer{config}
     , fPointIdAlg(config().PointIdAlg())
+    , fBatchSize(std::max<size_t>(1, config().BatchSize()))
     , fWireProducerLabel(config().WireLabel())
     , fTrackModuleLabel(config().TrackModuleLabel())
     , fRoiThreshold(config().RoiThreshold())
@@ -136,6 +153,15 @@ namespace nnet {
     auto const detProp =
       art::ServiceHandle<detinfo::DetectorPropertiesService const>()->DataFor(evt, clockData);
 
+    // nn outputs for hits of all tracks, each TPC/view prepared once
+    std::vector<art::Ptr<recob::Hit>> allHits;
+    for (size_t i = 0; i < hitsFromTracks.size(); ++i) {
+      auto const& hits = hitsFromTracks.at(i);
+      allHits.insert(allHits.end(), hits.begin(), hits.end());
+    }
+    hit_scores scores;
+    classifyHits(clockData, detProp, *wireHandle, allHits, scores);
+
     std::vector<std::pair<TVector3, double>> decays;
     for (size_t i = 0; i < hitsFromTracks.size(); ++i) {
       auto hits = hitsFromTracks.at(i);
@@ -150,7 +176,7 @@ namespace nnet {
         }
       }
 
-      DetectDecay(clockData, detProp, *wireHandle, hits, trkSpacePoints, decays);
+      DetectDecay(hits, scores, trkSpacePoints, decays);
     }
 
     double xyz[3];
@@ -177,36 +203,64 @@ namespace nnet {
   }
   // ------------------------------------------------------
 
+  void
+  ParticleDecayId::classifyHits(detinfo::DetectorClocksData const& clockData,
+                                detinfo::DetectorPropertiesData const& detProp,
+                                const std::vector<recob::Wire>& wires,
+                                const std::vector<art::Ptr<recob::Hit>>& hits,
+                                hit_scores& scores)
+  {
+    std::map<key, std::vector<art::Ptr<recob::Hit>>> hitMap; // hits shared by tracks added once
+    for (auto const& h : hits) {
+      unsigned int view = h->WireID().Plane;
+      if ((fSkipView >= 0) && (view == (unsigned int)fSkipView)) continue;
+
+      if (scores.emplace(h, 0).second) {
+        hitMap[{h->WireID().Cryostat, h->WireID().TPC, view}].push_back(h);
+      }
+    }
+
+    for (auto const& [k, group] : hitMap) {
+      auto const& [cryo, tpc, view] = k;
+      fPointIdAlg.setWireDriftData(clockData, detProp, wires, view, tpc, cryo);
+
+      for (size_t idx = 0; idx < group.size(); idx += fBatchSize) {
+        const size_t end = std::min(group.size(), idx + fBatchSize);
+        std::vector<std::pair<unsigned int, float>> points;
+        for (size_t i = idx; i < end; ++i) {
+          points.emplace_back(group[i]->WireID().Wire, group[i]->PeakTime());
+        }
+
+        auto batch_out = fPointIdAlg.predictIdVectors(points);
+        if (batch_out.size() != points.size()) {
+          throw cet::exception("ParticleDecayId") << "Problem with applying model to input.";
+        }
+        for (size_t i = idx; i < end; ++i) {
+          scores[group[i]] = batch_out[i - idx][0]; // p(decay)
+        }
+      }
+    }
+  }
+  // ------------------------------------------------------
+
   bool
-  ParticleDecayId::DetectDecay(detinfo::DetectorClocksData const& clockData,
-                               detinfo::DetectorPropertiesData const& detProp,
-                               const std::vector<recob::Wire>& wires,
-                               const std::vector<art::Ptr<recob::Hit>>& hits,
+  ParticleDecayId::DetectDecay(const std::vector<art::Ptr<recob::Hit>>& hits,
+                               hit_scores const& scores,
                                std::map<size_t, TVector3>& spoints,
                                std::vector<std::pair<TVector3, double>>& result)
   {
     const size_t nviews = 3;
 
     std::vector<art::Ptr<recob::Hit>> wire_drift[nviews];
-    for (size_t i = 0; i < hits.size(); ++i) // split hits between views
-    {
-      wire_drift[hits[i]->View()].push_back(hits[i]);
-    }
-
     std::vector<float> outputs[nviews];
-    for (size_t v = 0; v < nviews;
-         ++v) // calculate nn outputs for each view (hopefully not changing cryo/tpc many times)
+    for (size_t i = 0; i < hits.size(); ++i) // split classified hits between views
     {
-      outputs[v].resize(wire_drift[v].size(), 0);
-      for (size_t i = 0; i < wire_drift[v].size(); ++i) {
-        int tpc = wire_drift[v][i]->WireID().TPC;
-        int cryo = wire_drift[v][i]->WireID().Cryostat;
-
-        fPointIdAlg.setWireDriftData(clockData, detProp, wires, v, tpc, cryo);
+      size_t v = hits[i]->WireID().Plane;
+      auto s = scores.find(hits[i]);
+      if ((v >= nviews) || (s == scores.end())) continue;
 
-        outputs[v][i] = fPointIdAlg.predictIdVector(wire_drift[v][i]->WireID().Wire,
-                                                    wire_drift[v][i]->PeakTime())[0]; // p(decay)
-      }
+      wire_drift[v].push_back(hits[i]);
+      outputs[v].push_back(s->second);
     }
 
     std::vector<std::pair<size_t, float>> candidates2d[nviews];
@@ -238,53 +292,67 @@ namespace nnet {
       2.0; // [cm], threshold for today to distinguish between two different candidates,
            // if belo threshold, then use 3D point corresponding to higher cnn output
 
+    // candidates of each view are hashed in cells of min_dist size, so coincidences
+    // are found with radius queries instead of comparing all pairs of candidates
+    std::vector<SpatialHash> candidateHash(nviews, SpatialHash(min_dist));
+    std::vector<TVector3> candidatePoints[nviews];
+    for (size_t v = 0; v < nviews; ++v) {
+      for (auto const& c : candidates3d[v]) {
+        candidatePoints[v].push_back(c.first);
+      }
+      candidateHash[v].insert(candidatePoints[v]);
+    }
+
     // need coincidence of high cnn out in two views, then look if there is another close candidate
     // and again select by cnn output value, would like to have few strong candidates
     bool found = false;
     for (size_t v = 0; v < nviews - 1; ++v) {
+      std::vector<std::vector<std::vector<size_t>>> close(nviews); // [u][i] -> close in view u
+      for (size_t u = v + 1; u < nviews; ++u) {
+        close[u] = candidateHash[u].query(candidatePoints[v], min_dist);
+      }
+
       for (size_t i = 0; i < candidates3d[v].size(); ++i) {
         TVector3 c0(candidates3d[v][i].first);
         float p0 = candidates3d[v][i].second;
 
         for (size_t u = v + 1; u < nviews; ++u) {
-          for (size_t j = 0; j < candidates3d[v].size(); ++j) {
-            TVector3 c1(candidates3d[v][j].first);
-            float p1 = candidates3d[v][j].second;
-
-            if ((c0 - c1).Mag() < min_dist) {
-              TVector3 c(c0);
-              if (p1 > p0) { c = c1; }
-              double p = p0 * p1;
-
-              if (p > fPointThreshold) {
-                double d, dmin = min_dist;
-                size_t kmin = 0;
-                for (size_t k = 0; k < result.size(); ++k) {
-                  d = (result[k].first - c).Mag();
-                  if (d < dmin) {
-                    dmin = d;
-                    kmin = k;
-                  }
-                }
-                if (dmin < min_dist) {
-                  if (result[kmin].second < p) // replace previously found point
-                  {
-                    result[kmin].first = c;
-                    result[kmin].second = p;
-                    found = true;
-                  }
+          for (size_t j : close[u][i]) {
+            TVector3 c1(candidates3d[u][j].first);
+            float p1 = candidates3d[u][j].second;
+
+            TVector3 c(c0);
+            if (p1 > p0) { c = c1; }
+            double p = p0 * p1;
+
+            if (p > fPointThreshold) {
+              double d, dmin = min_dist;
+              size_t kmin = 0;
+              for (size_t k = 0; k < result.size(); ++k) {
+                d = (result[k].first - c).Mag();
+                if (d < dmin) {
+                  dmin = d;
+                  kmin = k;
                 }
-                else // nothing close in the list, add new point
+              }
+              if (dmin < min_dist) {
+                if (result[kmin].second < p) // replace previously found point
                 {
-                  result.emplace_back(c, p);
+                  result[kmin].first = c;
+                  result[kmin].second = p;
                   found = true;
                 }
-              } // if (p > fPointThreshold)
-            }   // coincidence: points from views u and v are close
-          }     // loop over points in view u
-        }       // loop over views u
-      }         // loop over points in view v
-    }           // loop over views v
+              }
+              else // nothing close in the list, add new point
+              {
+                result.emplace_back(c, p);
+                found = true;
+              }
+            } // if (p > fPointThreshold)
+          }   // loop over points in view u close to c0
+        }     // loop over views u
+      }       // loop over points in view v
+    }         // loop over views v
     return found;
   }
 
@@ -37,8 +37,11 @@
 
 #include "TH2F.h" // ADC and deposit maps
 #include "TH2I.h" // PDG+vertex info map
+#include "TBranch.h"
+#include "TTree.h"
 
 // C++ Includes
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <iostream>
@@ -77,6 +80,17 @@ namespace nnet {
         Name("DumpToRoot"),
         Comment("Dump to ROOT histogram file (replaces the text files)")};
 
+      fhicl::Atom<bool> DumpToTree{
+        Name("DumpToTree"),
+        Comment("Dump to compressed ROOT tree, deposit and PDG maps stored as sparse lists "
+                "(replaces the histograms and text files)"),
+        false};
+
+      fhicl::Atom<int> TreeCompression{
+        Name("TreeCompression"),
+        Comment("Compression of the tree branches: 100 * algorithm + level, 505 is zstd level 5"),
+        505};
+
       fhicl::Atom<bool> DumpToNumpy{
         Name("DumpToNumpy"),
         Comment("Dump to Numpy file (replaces the text files)")};
@@ -132,6 +146,8 @@ namespace nnet {
     std::string fOutTextFilePath;
     std::string fOutNumpyFileName;
     bool fDumpToRoot;
+    bool fDumpToTree;
+    int fTreeCompression;
     bool fDumpToNumpy;
 
     std::vector<int> fSelectedTPC;
@@ -157,6 +173,14 @@ namespace nnet {
 
     c2numpy_writer npywriter;
 
+    TTree* fTree = nullptr; ///< one entry per tpc/view of each event, owned by TFileService
+    unsigned int fTpc, fView, fW0, fW1, fD0, fD1;
+    std::vector<float> fRaw;           ///< dense ADC map, index (w - w0) * (d1 - d0) + (d - d0)
+    std::vector<unsigned int> fDepIdx; ///< indices of non-zero pixels of the deposit map
+    std::vector<float> fDepVal;
+    std::vector<unsigned int> fPdgIdx; ///< indices of non-zero pixels of the PDG map
+    std::vector<int> fPdgVal;
+
     CLHEP::HepRandomEngine& fEngine; ///< art-managed random-number engine
 
     int WeightedFit(int n,
@@ -174,6 +198,8 @@ namespace nnet {
     , fOutTextFilePath(config().OutTextFilePath())
     , fOutNumpyFileName(config().OutNumpyFileName())
     , fDumpToRoot(config().DumpToRoot())
+    , fDumpToTree(config().DumpToTree())
+    , fTreeCompression(config().TreeCompression())
     , fDumpToNumpy(config().DumpToNumpy())
     , fSelectedTPC(config().SelectedTPC())
     , fSelectedPlane(config().SelectedView())
@@ -221,6 +247,29 @@ namespace nnet {
     for (int i = 0; i<fPatch_size_w*fPatch_size_d; ++i){
       c2numpy_addcolumn(&npywriter, Form("x%d",i), C2NUMPY_FLOAT32);
     }
+    if (fDumpToTree) {
+      art::ServiceHandle<art::TFileService const> tfs;
+      fTree = tfs->make<TTree>("pointid", "PointIdAlg training data");
+      fTree->Branch("run", &fRun);
+      fTree->Branch("subrun", &fSubRun);
+      fTree->Branch("evt", &fEvent);
+      fTree->Branch("tpc", &fTpc);
+      fTree->Branch("view", &fView);
+      fTree->Branch("w0", &fW0);
+      fTree->Branch("w1", &fW1);
+      fTree->Branch("d0", &fD0);
+      fTree->Branch("d1", &fD1);
+      fTree->Branch("raw", &fRaw);
+      fTree->Branch("dep_idx", &fDepIdx);
+      fTree->Branch("dep_val", &fDepVal);
+      fTree->Branch("pdg_idx", &fPdgIdx);
+      fTree->Branch("pdg_val", &fPdgVal);
+      for (auto* b : *fTree->GetListOfBranches()) {
+        static_cast<TBranch*>(b)->SetCompressionSettings(fTreeCompression);
+      }
+      fTree->SetAutoFlush(-16 * 1024 * 1024); // compressed in ~16 MB clusters of entries
+    }
+
     nEm = 0;
     nTrk = 0;
     nMichel = 0;
@@ -272,6 +321,8 @@ namespace nnet {
 
     CLHEP::RandFlat flat(fEngine);
 
+    if (saveSim) { fTrainingDataAlg.indexTruth(event); }
+
     for (size_t i = 0; i < fSelectedTPC.size(); ++i)
       for (size_t v = 0; v < fSelectedPlane.size(); ++v) {
         fTrainingDataAlg.setEventData(
@@ -336,6 +387,42 @@ namespace nnet {
           writeAndDelete(pdgHist);
 
         }
+        else if (fDumpToTree) {
+          fTpc = fSelectedTPC[i];
+          fView = fSelectedPlane[v];
+          fW0 = w0;
+          fW1 = w1;
+          fD0 = d0;
+          fD1 = d1;
+
+          const size_t nd = d1 - d0;
+          fRaw.resize((w1 - w0) * nd);
+          fDepIdx.clear();
+          fDepVal.clear();
+          fPdgIdx.clear();
+          fPdgVal.clear();
+          for (size_t w = w0; w < w1; ++w) {
+            const size_t row = (w - w0) * nd;
+            auto const& raw = fTrainingDataAlg.wireData(w);
+            std::copy(raw.begin() + d0, raw.begin() + d1, fRaw.begin() + row);
+
+            if (saveSim) {
+              auto const& edep = fTrainingDataAlg.wireEdep(w);
+              auto const& pdg = fTrainingDataAlg.wirePdg(w);
+              for (size_t d = d0; d < d1; ++d) {
+                if (edep[d] != 0) {
+                  fDepIdx.push_back(row + d - d0);
+                  fDepVal.push_back(edep[d]);
+                }
+                if (pdg[d] != 0) {
+                  fPdgIdx.push_back(row + d - d0);
+                  fPdgVal.push_back(pdg[d]);
+                }
+              }
+            }
+          }
+          fTree->Fill();
+        }
         else if (fDumpToNumpy){
           for (size_t w = w0; w < w1; ++w) {
             int w_start = w - fPatch_size_w/2;
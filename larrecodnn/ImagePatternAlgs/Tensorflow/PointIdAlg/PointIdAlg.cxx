@@ -36,6 +36,8 @@
 
 #include "TMath.h"
 
+#include "tbb/parallel_for.h"
+
 #include <algorithm>
 #include <cmath>
 #include <map>
@@ -108,8 +110,8 @@ nnet::KerasModelInterface::Run(std::vector<std::vector<float>> const& inp2d)
 
 nnet::TfModelInterface::TfModelInterface(const char* modelFileName)
 {
-  g = tf::Graph::create(nnet::ModelInterface::findFile(modelFileName).c_str(),
-                        {"cnn_output", "_netout"});
+  g = tf::Graph::acquire(nnet::ModelInterface::findFile(modelFileName).c_str(),
+                         {"cnn_output", "_netout"});
   if (!g) { throw art::Exception(art::errors::Unknown) << "TF model failed."; }
 
   mf::LogInfo("TfModelInterface") << "TF model loaded.";
@@ -126,15 +128,12 @@ nnet::TfModelInterface::Run(std::vector<std::vector<std::vector<float>>> const&
 
   long long int rows = inps.front().size(), cols = inps.front().front().size();
 
-  tensorflow::Tensor _x(tensorflow::DT_FLOAT, tensorflow::TensorShape({samples, rows, cols, 1}));
-  auto input_map = _x.tensor<float, 4>();
+  auto _x = g->inputTensor(samples, {rows, cols, 1});
+  float* dst = _x.flat<float>().data();
   for (long long int s = 0; s < samples; ++s) {
     const auto& sample = inps[s];
     for (long long int r = 0; r < rows; ++r) {
-      const auto& row = sample[r];
-      for (long long int c = 0; c < cols; ++c) {
-        input_map(s, r, c, 0) = row[c];
-      }
+      dst = std::copy_n(sample[r].begin(), cols, dst);
     }
   }
 
@@ -147,13 +146,10 @@ nnet::TfModelInterface::Run(std::vector<std::vector<float>> const& inp2d)
 {
   long long int rows = inp2d.size(), cols = inp2d.front().size();
 
-  tensorflow::Tensor _x(tensorflow::DT_FLOAT, tensorflow::TensorShape({1, rows, cols, 1}));
-  auto input_map = _x.tensor<float, 4>();
+  auto _x = g->inputTensor(1, {rows, cols, 1});
+  float* dst = _x.flat<float>().data();
   for (long long int r = 0; r < rows; ++r) {
-    const auto& row = inp2d[r];
-    for (long long int c = 0; c < cols; ++c) {
-      input_map(0, r, c, 0) = row[c];
-    }
+    std::copy_n(inp2d[r].begin(), cols, dst + r * cols);
   }
 
   auto out = g->run(_x);
@@ -180,8 +176,10 @@ nnet::PointIdAlg::PointIdAlg(const Config& config)
 
   deleteNNet();
 
-  if ((fNNetModelFilePath.length() > 5) &&
-      (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 5, 5, ".nnet") == 0)) {
+  if (((fNNetModelFilePath.length() > 5) &&
+       (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 5, 5, ".nnet") == 0)) ||
+      ((fNNetModelFilePath.length() > 6) &&
+       (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 6, 6, ".nnetb") == 0))) {
     fNNet = new nnet::KerasModelInterface(fNNetModelFilePath.c_str());
   }
   else if ((fNNetModelFilePath.length() > 3) &&
@@ -358,6 +356,7 @@ nnet::TrainingDataAlg::TrainingDataAlg(const Config& config)
   , fSimulationProducerLabel(config.SimulationLabel())
   , fSimChannelProducerLabel(config.SimChannelLabel())
   , fSaveVtxFlags(config.SaveVtxFlags())
+  , fDataFromGeometry(config.DataFromGeometry())
   , fAdcDelay(config.AdcDelayTicks())
   , fEventsPerBin(100, 0)
 {
@@ -759,6 +758,15 @@ nnet::TrainingDataAlg::setDataEventData(const art::Event& event,
 
   art::FindManyP<recob::Track> ass_trk_hits(HitHandle, event, fTrackModuleLabel);
 
+  if (fDataFromGeometry) {
+    std::vector<recob::Track const*> hitTracks(Hitlist.size(), nullptr);
+    for (size_t iHit = 0; iHit < Hitlist.size(); ++iHit) {
+      if (!ass_trk_hits.at(iHit).empty()) { hitTracks[iHit] = ass_trk_hits.at(iHit)[0].get(); }
+    }
+    std::vector<recob::Hit> const noHits;
+    return setDataTrackLabels(*wireHandle, HitHandle.isValid() ? *HitHandle : noHits, hitTracks);
+  }
+
   // Loop over wires (sorry about hard coded value) to fill in 1) pdg and 2) charge depo
   for (size_t widx = 0; widx < 240; ++widx) {
 
@@ -872,6 +880,105 @@ nnet::TrainingDataAlg::setDataEventData(const art::Event& event,
 
   return true;
 }
+// ------------------------------------------------------
+
+bool
+nnet::TrainingDataAlg::setDataTrackLabels(std::vector<recob::Wire> const& wires,
+                                          std::vector<recob::Hit> const& hits,
+                                          std::vector<recob::Track const*> const& hitTracks)
+{
+  // wire index in the view of each channel of the view
+  std::unordered_map<raw::ChannelID_t, size_t> channelToWire;
+  for (size_t widx = 0; widx < fAlgView.fNWires; ++widx) {
+    if (fAlgView.fWireChannels[widx] != raw::InvalidChannelID) {
+      channelToWire[fAlgView.fWireChannels[widx]] = widx;
+    }
+  }
+
+  // hits of tracks in this view, grouped by track and by wire (in the hit list order)
+  std::vector<int> hitWire(hits.size(), -1);
+  std::unordered_map<int, std::vector<size_t>> trackHits;
+  std::vector<std::vector<size_t>> wireHits(fAlgView.fNWires);
+  for (size_t iHit = 0; iHit < hits.size(); ++iHit) {
+    auto w = channelToWire.find(hits[iHit].Channel());
+    if ((w == channelToWire.end()) || !hitTracks[iHit]) { continue; }
+
+    hitWire[iHit] = w->second;
+    trackHits[hitTracks[iHit]->ID()].push_back(iHit);
+    // cutting on length to not just get a bunch of shower stubs
+    if (hitTracks[iHit]->Length() >= 5) { wireHits[w->second].push_back(iHit); }
+  }
+
+  // angle of each track projection, normalized to [0, 1], from its endpoints: the hit farthest
+  // from the first one, then the hit farthest from that
+  auto dist2 = [&](size_t a, size_t b) {
+    double dw = hitWire[a] - hitWire[b];
+    double dt = hits[a].PeakTime() - hits[b].PeakTime();
+    return dw * dw + dt * dt;
+  };
+  auto farthest = [&](std::vector<size_t> const& trk, size_t from) {
+    size_t far = from;
+    double farDist = 0;
+    for (size_t j : trk) {
+      double d = dist2(from, j);
+      if (d > farDist) {
+        farDist = d;
+        far = j;
+      }
+    }
+    return far;
+  };
+  std::unordered_map<int, float> trackAngle;
+  for (auto const& [id, trk] : trackHits) {
+    size_t end0 = farthest(trk, trk.front());
+    size_t end1 = farthest(trk, end0);
+
+    double del_wire = hitWire[end1] - hitWire[end0];
+    double del_time = hits[end1].PeakTime() - hits[end0].PeakTime();
+    double hypo = sqrt(del_wire * del_wire + del_time * del_time);
+    if (hypo == 0) { continue; } // single hit or all hits in the same place
+
+    trackAngle[id] = TMath::ACos(TMath::Abs(del_wire / hypo)) * 2 / TMath::Pi();
+  }
+
+  std::unordered_map<raw::ChannelID_t, recob::Wire const*> channelWires;
+  for (auto const& wire : wires) {
+    channelWires[wire.Channel()] = &wire;
+  }
+
+  for (size_t widx = 0; widx < fAlgView.fNWires; ++widx) {
+    std::vector<float> labels_deposit(fAlgView.fNDrifts, 0); // full-drift-length buffers
+    std::vector<int> labels_pdg(fAlgView.fNDrifts, 0);
+
+    auto w = channelWires.find(fAlgView.fWireChannels[widx]);
+    if (w != channelWires.end()) {
+      auto const signal = w->second->Signal();
+      std::copy_n(
+        signal.begin(), std::min(signal.size(), labels_deposit.size()), labels_deposit.begin());
+    }
+
+    for (size_t iHit : wireHits[widx]) {
+      auto angle = trackAngle.find(hitTracks[iHit]->ID());
+      if (angle == trackAngle.end()) { continue; }
+
+      // fEventsPerBin keeps the number of hits per angle to get an isometric sample
+      int binner = int(angle->second * fEventsPerBin.size());
+      if (binner >= (int)fEventsPerBin.size()) { binner = fEventsPerBin.size() - 1; }
+      if (fEventsPerBin[binner] > 5000) { continue; }
+
+      size_t tick = hits[iHit].PeakTime();
+      if (tick >= labels_pdg.size()) { continue; }
+
+      fEventsPerBin[binner]++;
+      labels_pdg[tick] = 211; // Same as pion for now
+    }
+
+    setWireEdepsAndLabels(labels_deposit, labels_pdg, widx);
+  }
+
+  return true;
+}
+// ------------------------------------------------------
 
 bool
 nnet::TrainingDataAlg::setEventData(const art::Event& event,
@@ -897,34 +1004,30 @@ nnet::TrainingDataAlg::setEventData(const art::Event& event,
   art::ServiceHandle<sim::LArG4Parameters const> larParameters;
   double electronsToGeV = 1. / larParameters->GeVToElectrons();
 
-  auto particleHandle =
-    event.getValidHandle<std::vector<simb::MCParticle>>(fSimulationProducerLabel);
-
-  auto simChannelHandle =
-    event.getValidHandle<std::vector<sim::SimChannel>>(fSimChannelProducerLabel);
-
-  std::unordered_map<int, const simb::MCParticle*> particleMap;
-  for (auto const& particle : *particleHandle) {
-    particleMap[particle.TrackId()] = &particle;
-  }
+  auto const& particleMap = fParticleMap; // from indexTruth(event)
 
   std::unordered_map<size_t, std::unordered_map<int, int>> wireToDriftToVtxFlags;
   if (fSaveVtxFlags) collectVtxFlags(wireToDriftToVtxFlags, clockData, detProp, particleMap, plane);
 
-  fEdepTot = 0;
-
-  std::map<int, int> trackToPDG;
-  for (size_t widx = 0; widx < fAlgView.fNWires; ++widx) {
+  // wires are independent: each reads only SimChannels of its channel and writes its own labels
+  std::vector<double> wireEdepTot(fAlgView.fNWires, 0);
+  tbb::parallel_for(size_t(0), size_t(fAlgView.fNWires), [&](size_t widx) {
     auto wireChannelNumber = fAlgView.fWireChannels[widx];
-    if (wireChannelNumber == raw::InvalidChannelID) continue;
+    if (wireChannelNumber == raw::InvalidChannelID) return;
 
     std::vector<float> labels_deposit(fAlgView.fNDrifts, 0); // full-drift-length buffers,
     std::vector<int> labels_pdg(labels_deposit.size(), 0);   // both of the same size,
     int labels_size = labels_deposit.size();                 // cached as int for comparisons below
 
+    std::map<int, int> trackToPDG;
     std::map<int, std::map<int, double>> timeToTrackToCharge;
-    for (auto const& channel : *simChannelHandle) {
-      if (channel.Channel() != wireChannelNumber) continue;
+    auto ich = std::lower_bound(
+      fSimChannelIndex.begin(),
+      fSimChannelIndex.end(),
+      wireChannelNumber,
+      [](sim::SimChannel const* c, raw::ChannelID_t ch) { return c->Channel() < ch; });
+    for (; (ich != fSimChannelIndex.end()) && ((*ich)->Channel() == wireChannelNumber); ++ich) {
+      auto const& channel = **ich;
 
       auto const& timeSlices = channel.TDCIDEMap();
       for (auto const& timeSlice : timeSlices) {
@@ -996,7 +1099,7 @@ nnet::TrainingDataAlg::setEventData(const art::Event& event,
 
           double energy = energyDeposit.numElectrons * electronsToGeV;
           timeToTrackToCharge[time][energyDeposit.trackID] += energy;
-          fEdepTot += energy;
+          wireEdepTot[widx] += energy;
 
         } // loop over energy deposits
       }   // loop over time slices
@@ -1023,17 +1126,52 @@ nnet::TrainingDataAlg::setEventData(const art::Event& event,
       }
     }
 
-    for (auto const& drift_flags : wireToDriftToVtxFlags[widx]) {
-      int drift = drift_flags.first, flags = drift_flags.second;
-      if ((drift >= 0) && (drift < labels_size)) { labels_pdg[drift] |= flags; }
+    auto vtxFlags = wireToDriftToVtxFlags.find(widx);
+    if (vtxFlags != wireToDriftToVtxFlags.end()) {
+      for (auto const& drift_flags : vtxFlags->second) {
+        int drift = drift_flags.first, flags = drift_flags.second;
+        if ((drift >= 0) && (drift < labels_size)) { labels_pdg[drift] |= flags; }
+      }
     }
     setWireEdepsAndLabels(labels_deposit, labels_pdg, widx);
-  } // for each Wire
+  }); // for each Wire
+
+  fEdepTot = 0;
+  for (double e : wireEdepTot) {
+    fEdepTot += e;
+  }
 
   return true;
 }
 // ------------------------------------------------------
 
+void
+nnet::TrainingDataAlg::indexTruth(const art::Event& event)
+{
+  auto particleHandle =
+    event.getValidHandle<std::vector<simb::MCParticle>>(fSimulationProducerLabel);
+
+  auto simChannelHandle =
+    event.getValidHandle<std::vector<sim::SimChannel>>(fSimChannelProducerLabel);
+
+  fParticleMap.clear();
+  for (auto const& particle : *particleHandle) {
+    fParticleMap[particle.TrackId()] = &particle;
+  }
+
+  fSimChannelIndex.clear();
+  fSimChannelIndex.reserve(simChannelHandle->size());
+  for (auto const& channel : *simChannelHandle) {
+    fSimChannelIndex.push_back(&channel);
+  }
+  std::stable_sort(fSimChannelIndex.begin(),
+                   fSimChannelIndex.end(),
+                   [](sim::SimChannel const* a, sim::SimChannel const* b) {
+                     return a->Channel() < b->Channel();
+                   });
+}
+// ------------------------------------------------------
+
 bool
 nnet::TrainingDataAlg::findCrop(float max_e_cut,
                                 unsigned int& w0,
@@ -29,6 +29,12 @@ namespace detinfo {
 // Framework includes
 namespace art { class Event; }
 namespace fhicl { class ParameterSet; }
+namespace recob {
+  class Hit;
+  class Track;
+  class Wire;
+}
+namespace sim { class SimChannel; }
 #include "canvas/Utilities/InputTag.h"
 #include "fhiclcpp/types/Atom.h"
 #include "fhiclcpp/types/Comment.h"
@@ -87,7 +93,7 @@ public:
   std::vector<float> Run(std::vector<std::vector<float>> const& inp2d) override;
 
 private:
-  std::unique_ptr<tf::Graph> g; // network graph
+  std::shared_ptr<tf::Graph> g; // network graph, shared by all users of the same model
 };
 // ------------------------------------------------------
 
@@ -255,6 +261,12 @@ public:
     fhicl::Atom<unsigned int> AdcDelayTicks{
       Name("AdcDelayTicks"),
       Comment("ADC pulse peak delay in ticks (non-zero for not deconvoluted waveforms).")};
+
+    fhicl::Atom<bool> DataFromGeometry{
+      Name("DataFromGeometry"),
+      Comment("Real data labels on wires of the selected view, track endpoints found once per "
+              "track; false: LArIAT collection view with hard coded channels."),
+      false};
   };
 
   TrainingDataAlg(const fhicl::ParameterSet& pset)
@@ -273,6 +285,10 @@ public:
     return fSaveSimInfo;
   }
 
+  // truth lookup of the event, shared by all planes and TPCs; call once per event,
+  // before setEventData, if simulation info is saved
+  void indexTruth(const art::Event& event);
+
   bool setEventData(
     const art::Event& event, // collect & downscale ADC's, charge deposits, pdg labels
     detinfo::DetectorClocksData const& clockData,
@@ -335,6 +351,12 @@ private:
                              std::vector<int> const& pdgs,
                              size_t wireIdx);
 
+  // real data labels in the current view: hits of tracks (hitTracks: first associated track of
+  // each hit, or nullptr) are binned in the angle of their track projection
+  bool setDataTrackLabels(std::vector<recob::Wire> const& wires,
+                          std::vector<recob::Hit> const& hits,
+                          std::vector<recob::Track const*> const& hitTracks);
+
   void collectVtxFlags(
     std::unordered_map<size_t, std::unordered_map<int, int>>& wireToDriftToVtxFlags,
     detinfo::DetectorClocksData const& clockData,
@@ -356,6 +378,9 @@ private:
   bool isMuonDecaying(const simb::MCParticle& particle,
                       const std::unordered_map<int, const simb::MCParticle*>& particleMap) const;
 
+  std::unordered_map<int, const simb::MCParticle*> fParticleMap;
+  std::vector<sim::SimChannel const*> fSimChannelIndex; // ordered by channel
+
   double fEdepTot; // [GeV]
   std::vector<std::vector<float>> fWireDriftEdep;
   std::vector<std::vector<int>> fWireDriftPdg;
@@ -367,6 +392,7 @@ private:
   art::InputTag fSimChannelProducerLabel;
   bool fSaveVtxFlags;
   bool fSaveSimInfo;
+  bool fDataFromGeometry;
 
   unsigned int fAdcDelay;
 
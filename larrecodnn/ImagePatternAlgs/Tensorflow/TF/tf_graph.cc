@@ -16,24 +16,84 @@
 
 #include "tensorflow/core/public/session_options.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <tuple>
+
+// -------------------------------------------------------------------
+struct tf::Graph::ThreadCache
+{
+    std::map< std::vector<long long int>, std::unique_ptr<tensorflow::Tensor> > inputs; // by sample shape
+    std::vector< tensorflow::Tensor > outputs; // tensors replaced by each Run, only the vector storage is reused
+};
+
+tf::Graph::ThreadCache & tf::Graph::threadCache()
+{
+    std::lock_guard<std::mutex> lock(fCacheMutex);
+    auto & cache = fCaches[std::this_thread::get_id()];
+    if (!cache) { cache = std::make_unique<ThreadCache>(); }
+    return *cache;
+}
+// -------------------------------------------------------------------
+
+std::shared_ptr<tf::Graph> tf::Graph::acquire(const char* graph_file_name, const std::vector<std::string> & outputs, bool use_bundle,
+                                              const SessionConfig & cfg)
+{
+    using Key = std::tuple<std::string, std::vector<std::string>, bool, int, int, bool>;
+    static std::mutex poolMutex;
+    static std::map< Key, std::weak_ptr<Graph> > pool;
+
+    // key on the resolved path, so the same file reached via links or relative paths is loaded once
+    char resolved[PATH_MAX];
+    std::string path = realpath(graph_file_name, resolved) ? resolved : graph_file_name;
+
+    Key key(path, outputs, use_bundle, cfg.interOpThreads, cfg.intraOpThreads, cfg.usePerSessionThreads);
+
+    std::lock_guard<std::mutex> lock(poolMutex);
+    auto shared = pool[key].lock();
+    if (!shared)
+    {
+        shared = create(graph_file_name, outputs, use_bundle, cfg);
+        if (shared)
+        {
+            // drop entries of graphs released in the meantime
+            for (auto it = pool.begin(); it != pool.end(); )
+            {
+                if (it->second.expired()) { it = pool.erase(it); }
+                else { ++it; }
+            }
+            pool[key] = shared;
+        }
+    }
+    else { std::cout << "tf::Graph using already loaded " << graph_file_name << std::endl; }
+    return shared;
+}
+
 // -------------------------------------------------------------------
-tf::Graph::Graph(const char* graph_file_name, const std::vector<std::string> & outputs, bool & success, bool use_bundle)
+tf::Graph::Graph(const char* graph_file_name, const std::vector<std::string> & outputs, bool & success, bool use_bundle,
+                 const SessionConfig & cfg)
+    : fSession(nullptr), fBundle(nullptr)
 {
     fUseBundle = use_bundle;
     success = false; // until all is done correctly
 
-    // Force tf to only use a single core so it doesn't eat batch farms
+    // Thread policy from the configuration, by default single core so it doesn't eat batch farms
     tensorflow::SessionOptions options;
     tensorflow::ConfigProto &config = options.config;
-    config.set_inter_op_parallelism_threads(1);
-    config.set_intra_op_parallelism_threads(1);
-    config.set_use_per_session_threads(false);
+    config.set_inter_op_parallelism_threads(cfg.interOpThreads);
+    config.set_intra_op_parallelism_threads(cfg.intraOpThreads);
+    config.set_use_per_session_threads(cfg.usePerSessionThreads);
 
-    auto status = tensorflow::NewSession(options, &fSession);
-    if (!status.ok())
+    tensorflow::Status status;
+    if (!fUseBundle) // SavedModel comes with its own session
     {
-        std::cout << status.ToString() << std::endl;
-        return;
+        status = tensorflow::NewSession(options, &fSession);
+        if (!status.ok())
+        {
+            std::cout << status.ToString() << std::endl;
+            return;
+        }
     }
 
     tensorflow::GraphDef graph_def;
@@ -41,7 +101,7 @@ tf::Graph::Graph(const char* graph_file_name, const std::vector<std::string> & o
     {
       std::cout<<"LoadSavedModel"<<std::endl;
       fBundle = new tensorflow::SavedModelBundle();
-      status = tensorflow::LoadSavedModel(tensorflow::SessionOptions(), tensorflow::RunOptions(), graph_file_name, {tensorflow::kSavedModelTagServe}, fBundle);
+      status = tensorflow::LoadSavedModel(options, tensorflow::RunOptions(), graph_file_name, {tensorflow::kSavedModelTagServe}, fBundle);
       graph_def = fBundle->meta_graph_def.graph_def();
       std::cout<<"Loaded with Status: "<<status.ToString()<<std::endl;
     }
@@ -114,11 +174,14 @@ tf::Graph::Graph(const char* graph_file_name, const std::vector<std::string> & o
         return;
     }
 
-    status = fSession->Create(graph_def);
-    if (!status.ok())
+    if (!fUseBundle)
     {
-        std::cout << status.ToString() << std::endl;
-        return;
+        status = fSession->Create(graph_def);
+        if (!status.ok())
+        {
+            std::cout << status.ToString() << std::endl;
+            return;
+        }
     }
 
     success = true; // ok, graph loaded from the file
@@ -126,8 +189,11 @@ tf::Graph::Graph(const char* graph_file_name, const std::vector<std::string> & o
 
 tf::Graph::~Graph()
 {
-    fSession->Close().IgnoreError();
-    delete fSession;
+    if (fSession)
+    {
+        fSession->Close().IgnoreError();
+        delete fSession;
+    }
     if( fUseBundle) 
     {
       delete fBundle;
@@ -141,18 +207,14 @@ std::vector<float> tf::Graph::run(const std::vector< std::vector<float> > & x)
 
     long long int rows = x.size(), cols = x.front().size();
 
-    tensorflow::Tensor _x(tensorflow::DT_FLOAT, tensorflow::TensorShape({ 1, rows, cols, 1 }));
-    auto input_map = _x.tensor<float, 4>();
-
+    auto _x = inputTensor(1, { rows, cols, 1 });
+    float * dst = _x.flat<float>().data();
     for (long long int r = 0; r < rows; ++r) {
-        const auto & row = x[r];
-        for (long long int c = 0; c < cols; ++c) {
-            input_map(0, r, c, 0) = row[c];
-        }
+        std::copy_n(x[r].begin(), cols, dst + r * cols);
     }
 
-    auto result = run(_x);
-    if (!result.empty()) { return result.front(); }
+    std::vector<float> result;
+    if (run(_x, result) > 0) { return result; }
     else { return std::vector<float>(); }
 }
 // -------------------------------------------------------------------
@@ -171,17 +233,14 @@ std::vector< std::vector<float> > tf::Graph::run(
               cols = x.front().front().size(),
               depth = x.front().front().front().size();
 
-    tensorflow::Tensor _x(tensorflow::DT_FLOAT, tensorflow::TensorShape({ samples, rows, cols, depth }));
-    auto input_map = _x.tensor<float, 4>();
+    auto _x = inputTensor(samples, { rows, cols, depth });
+    float * dst = _x.flat<float>().data();
     for (long long int s = 0; s < samples; ++s) {
         const auto & sample = x[s];
         for (long long int r = 0; r < rows; ++r) {
             const auto & row = sample[r];
             for (long long int c = 0; c < cols; ++c) {
-                const auto & col = row[c];
-                for (long long int d = 0; d < depth; ++d) {
-                    input_map(s, r, c, d) = col[d];
-                }
+                dst = std::copy_n(row[c].begin(), depth, dst);
             }
         }
     }
@@ -190,22 +249,55 @@ std::vector< std::vector<float> > tf::Graph::run(
 }
 // -------------------------------------------------------------------
 
+tensorflow::Tensor tf::Graph::inputTensor(long long int samples, const std::vector<long long int> & sampleShape)
+{
+    auto & pooled = threadCache().inputs[sampleShape];
+    if (!pooled || (pooled->dim_size(0) < samples))
+    {
+        tensorflow::TensorShape shape({ samples });
+        for (auto d : sampleShape) { shape.AddDim(d); }
+        pooled = std::make_unique<tensorflow::Tensor>(tensorflow::DT_FLOAT, shape);
+    }
+    if (pooled->dim_size(0) == samples) { return *pooled; }
+    else { return pooled->Slice(0, samples); } // shares the pooled buffer
+}
+// -------------------------------------------------------------------
+
 std::vector< std::vector< float > > tf::Graph::run(const tensorflow::Tensor & x)
+{
+    std::vector< float > flat;
+    size_t nouts = run(x, flat);
+    if (nouts == 0) { return std::vector< std::vector< float > >(); }
+
+    size_t samples = flat.size() / nouts;
+    std::vector< std::vector< float > > result(samples);
+    for (size_t s = 0; s < samples; ++s) {
+        result[s].assign(flat.begin() + s * nouts, flat.begin() + (s + 1) * nouts);
+    }
+    return result;
+}
+// -------------------------------------------------------------------
+
+size_t tf::Graph::run(const float * x, long long int samples, const std::vector<long long int> & sampleShape,
+                      std::vector<float> & out)
+{
+    if ((samples <= 0) || !x) { out.clear(); return 0; }
+
+    auto _x = inputTensor(samples, sampleShape);
+    std::copy_n(x, _x.NumElements(), _x.flat<float>().data());
+
+    return run(_x, out);
+}
+// -------------------------------------------------------------------
+
+size_t tf::Graph::run(const tensorflow::Tensor & x, std::vector<float> & out)
 {
     std::vector< std::pair<std::string, tensorflow::Tensor> > inputs = {
         { fInputName, x }
-        //{ "conv1d_input", x }
     };
 
-    //std::cout << x.DebugString() << std::endl;
-    //std::cout << "run session" << std::endl;
-    //std::cout << "fInputName " << fInputName << std::endl;
-
-    std::vector<tensorflow::Tensor> outputs;
-    std::vector<std::string> outputNames;
-    auto status = (fUseBundle)? fBundle->GetSession()->Run(inputs, fOutputNames, outputNames, &outputs) : fSession->Run(inputs, fOutputNames, outputNames, &outputs);
-
-    //std::cout << "out size " << outputs.size() << std::endl;
+    auto & outputs = threadCache().outputs;
+    auto status = (fUseBundle)? fBundle->GetSession()->Run(inputs, fOutputNames, {}, &outputs) : fSession->Run(inputs, fOutputNames, {}, &outputs);
 
     if (status.ok())
     {
@@ -219,31 +311,27 @@ std::vector< std::vector< float > > tf::Graph::run(const tensorflow::Tensor & x)
             }
             nouts += outputs[o].dim_size(1);
         }
-        //std::cout << "samples " << samples << " nouts " << nouts << std::endl;
 
-        std::vector< std::vector< float > > result;
-        result.resize(samples, std::vector< float >(nouts));
+        out.resize(samples * nouts);
 
         size_t idx0 = 0;
         for (size_t o = 0; o < outputs.size(); ++o)
         {
-            auto output_map = outputs[o].tensor<float, 2>();
+            const float * src = outputs[o].flat<float>().data();
 
             size_t n = outputs[o].dim_size(1);
             for (size_t s = 0; s < samples; ++s) {
-                std::vector< float > & vs = result[s];
-                for (size_t i = 0; i < n; ++i) {
-                    vs[idx0 + i] = output_map(s, i);
-                }
+                std::copy_n(src + s * n, n, out.begin() + s * nouts + idx0);
             }
             idx0 += n;
         }
-        return result;
+        return nouts;
     }
     else
     {
         std::cout << status.ToString() << std::endl;
-        return std::vector< std::vector< float > >();
+        out.clear();
+        return 0;
     }
 }
 // -------------------------------------------------------------------
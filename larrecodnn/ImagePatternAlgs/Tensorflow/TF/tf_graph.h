@@ -11,7 +11,10 @@
 #ifndef Graph_h
 #define Graph_h
 
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string>
 
@@ -25,17 +28,33 @@ namespace tensorflow
 namespace tf
 {
 
+/// Threading policy of TF sessions, applied to both frozen graph and SavedModel loading.
+/// Default protects batch farms: single core per job. Use 0 to let TF take all cores.
+/// With per-session threads off TF shares process-wide pools, sized by the first session.
+struct SessionConfig
+{
+    int interOpThreads = 1;
+    int intraOpThreads = 1;
+    bool usePerSessionThreads = false;
+};
+
 class Graph
 {
 public:
-    static std::unique_ptr<Graph> create(const char* graph_file_name, const std::vector<std::string> & outputs = {}, bool use_bundle=false)
+    static std::unique_ptr<Graph> create(const char* graph_file_name, const std::vector<std::string> & outputs = {}, bool use_bundle=false,
+                                         const SessionConfig & cfg = SessionConfig())
     {
         bool success;
-        std::unique_ptr<Graph> ptr(new Graph(graph_file_name, outputs,  success, use_bundle));
+        std::unique_ptr<Graph> ptr(new Graph(graph_file_name, outputs,  success, use_bundle, cfg));
         if (success) { return ptr; }
         else { return nullptr; }
     }
 
+    /// Process-wide pool: tools using the same model file (resolved path), outputs and session config share
+    /// one loaded graph and session. Graph is released when its last user is gone.
+    static std::shared_ptr<Graph> acquire(const char* graph_file_name, const std::vector<std::string> & outputs = {}, bool use_bundle=false,
+                                          const SessionConfig & cfg = SessionConfig());
+
     ~Graph();
 
     std::vector<float> run(const std::vector< std::vector<float> > & x);
@@ -47,15 +66,36 @@ public:
 	long long int samples = -1);
     std::vector< std::vector< float > > run(const tensorflow::Tensor & x);
 
+    // input tensor [samples, sampleShape...] taken from the per-Graph pool: memory is allocated
+    // only if a larger batch of this shape is requested than ever before, otherwise a view
+    // on the pooled tensor is returned; content is valid until the next call with this shape
+    // from the same thread (pools are kept per calling thread, the graph may be shared)
+    tensorflow::Tensor inputTensor(long long int samples, const std::vector<long long int> & sampleShape);
+
+    // run on x and write results to out as [samples, outputs] (out is only resized, so its
+    // memory can be reused between calls); return number of outputs per sample, 0 if failed
+    size_t run(const tensorflow::Tensor & x, std::vector<float> & out);
+
+    // copy contiguous input x, laid out as [samples, sampleShape...], to a pooled tensor and run
+    size_t run(const float * x, long long int samples, const std::vector<long long int> & sampleShape,
+               std::vector<float> & out);
+
 private:
     /// Not-throwing constructor.
-    Graph(const char* graph_file_name, const std::vector<std::string> & outputs, bool & success, bool use_bundle = false);
+    Graph(const char* graph_file_name, const std::vector<std::string> & outputs, bool & success, bool use_bundle = false,
+          const SessionConfig & cfg = SessionConfig());
+
+    struct ThreadCache; // pooled input tensors and output tensors of one calling thread
+    ThreadCache & threadCache();
 
     tensorflow::Session* fSession;
     bool fUseBundle;
     tensorflow::SavedModelBundle* fBundle;
     std::string fInputName;
     std::vector< std::string > fOutputNames;
+
+    std::mutex fCacheMutex;
+    std::map< std::thread::id, std::unique_ptr<ThreadCache> > fCaches;
 };
 
 } // namespace tf
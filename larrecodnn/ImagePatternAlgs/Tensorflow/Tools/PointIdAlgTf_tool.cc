@@ -24,12 +24,13 @@ namespace PointIdAlgTools {
     std::vector<float> Run(std::vector<std::vector<float>> const& inp2d) const override;
     std::vector<std::vector<float>> Run(std::vector<std::vector<std::vector<float>>> const& inps,
                                         int samples = -1) const override;
+    std::vector<std::vector<float>> Run(float const* inps, size_t samples) const override;
 
   protected:
     std::string findFile(const char* fileName) const;
 
   private:
-    std::unique_ptr<tf::Graph> g; // network graph
+    std::shared_ptr<tf::Graph> g; // network graph, shared by tools using the same model
     std::vector<std::string> fNNetOutputPattern;
     std::string fNNetModelFilePath;
   };
@@ -58,7 +59,11 @@ namespace PointIdAlgTools {
 
     if ((fNNetModelFilePath.length() > 3) &&
         (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 3, 3, ".pb") == 0)) {
-      g = tf::Graph::create(findFile(fNNetModelFilePath.c_str()).c_str(), fNNetOutputPattern);
+      tf::SessionConfig cfg;
+      cfg.interOpThreads = table().TfInterOpThreads();
+      cfg.intraOpThreads = table().TfIntraOpThreads();
+      g = tf::Graph::acquire(
+        findFile(fNNetModelFilePath.c_str()).c_str(), fNNetOutputPattern, false, cfg);
       if (!g) { throw art::Exception(art::errors::Unknown) << "TF model failed."; }
       mf::LogInfo("PointIdAlgTf") << "TF model loaded.";
     }
@@ -89,17 +94,16 @@ namespace PointIdAlgTools {
   std::vector<float>
   PointIdAlgTf::Run(std::vector<std::vector<float>> const& inp2d) const
   {
+    nnet::PerfTimer timer(fPerfInput);
     long long int rows = inp2d.size(), cols = inp2d.front().size();
 
-    tensorflow::Tensor _x(tensorflow::DT_FLOAT, tensorflow::TensorShape({1, rows, cols, 1}));
-    auto input_map = _x.tensor<float, 4>();
+    auto _x = g->inputTensor(1, {rows, cols, 1}); // pooled tensor, no allocation
+    float* dst = _x.flat<float>().data();
     for (long long int r = 0; r < rows; ++r) {
-      const auto& row = inp2d[r];
-      for (long long int c = 0; c < cols; ++c) {
-        input_map(0, r, c, 0) = row[c];
-      }
+      std::copy_n(inp2d[r].begin(), cols, dst + r * cols);
     }
 
+    timer.next(fPerfInference); // incl. output copy done by the graph
     auto out = g->run(_x);
     if (!out.empty())
       return out.front();
@@ -118,19 +122,35 @@ namespace PointIdAlgTools {
 
     if ((samples == -1) || (samples > (long long int)inps.size())) { samples = inps.size(); }
 
+    nnet::PerfTimer timer(fPerfInput);
     long long int rows = inps.front().size(), cols = inps.front().front().size();
 
-    tensorflow::Tensor _x(tensorflow::DT_FLOAT, tensorflow::TensorShape({samples, rows, cols, 1}));
-    auto input_map = _x.tensor<float, 4>();
+    auto _x = g->inputTensor(samples, {rows, cols, 1});
+    float* dst = _x.flat<float>().data();
     for (long long int s = 0; s < samples; ++s) {
       const auto& sample = inps[s];
       for (long long int r = 0; r < rows; ++r) {
-        const auto& row = sample[r];
-        for (long long int c = 0; c < cols; ++c) {
-          input_map(s, r, c, 0) = row[c];
-        }
+        dst = std::copy_n(sample[r].begin(), cols, dst);
       }
     }
+    timer.next(fPerfInference);
+    return g->run(_x);
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgTf::Run(float const* inps, size_t samples) const
+  {
+    if ((samples == 0) || !inps) { return std::vector<std::vector<float>>(); }
+
+    long long int rows = fPatchSizeW, cols = fPatchSizeD;
+
+    // input memory has the tensor layout already, single block copy to the pooled tensor
+    nnet::PerfTimer timer(fPerfInput);
+    auto _x = g->inputTensor(samples, {rows, cols, 1});
+    std::copy_n(inps, samples * rows * cols, _x.flat<float>().data());
+
+    timer.next(fPerfInference);
     return g->run(_x);
   }
 
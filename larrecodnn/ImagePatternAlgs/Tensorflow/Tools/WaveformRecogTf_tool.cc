@@ -14,9 +14,12 @@ namespace wavrec_tool {
 
     std::vector<std::vector<float>> predictWaveformType(
       const std::vector<std::vector<float>>&) const override;
+    size_t predictWaveformWindows(const float* const* windows,
+                                  size_t nwindows,
+                                  std::vector<float>& out) const override;
 
   private:
-    std::unique_ptr<tf::Graph> g; // network graph
+    std::shared_ptr<tf::Graph> g; // network graph, shared by tools using the same model
     std::string fNNetModelFilePath;
     std::vector<std::string> fNNetOutputPattern;
     bool fUseBundle;
@@ -29,14 +32,17 @@ namespace wavrec_tool {
     fUseBundle = pset.get<bool>("UseSavedModelBundle", false);
     fNNetOutputPattern =
       pset.get<std::vector<std::string>>("NNetOutputPattern", {"cnn_output", "dense_3"});
+    tf::SessionConfig cfg;
+    cfg.interOpThreads = pset.get<int>("TfInterOpThreads", 1);
+    cfg.intraOpThreads = pset.get<int>("TfIntraOpThreads", 1);
     if ((fNNetModelFilePath.length() > 3) &&
         (fNNetModelFilePath.compare(fNNetModelFilePath.length() - 3, 3, ".pb") == 0) && !fUseBundle) {
-      g = tf::Graph::create(findFile(fNNetModelFilePath.c_str()).c_str(), fNNetOutputPattern, fUseBundle);
+      g = tf::Graph::acquire(findFile(fNNetModelFilePath.c_str()).c_str(), fNNetOutputPattern, fUseBundle, cfg);
       if (!g) { throw art::Exception(art::errors::Unknown) << "TF model failed."; }
       mf::LogInfo("WaveformRecogTf") << "TF model loaded.";
     }
     else if((fNNetModelFilePath.length() > 3) && fUseBundle ) {
-      g = tf::Graph::create(findFile(fNNetModelFilePath.c_str()).c_str(), fNNetOutputPattern, fUseBundle);
+      g = tf::Graph::acquire(findFile(fNNetModelFilePath.c_str()).c_str(), fNNetOutputPattern, fUseBundle, cfg);
       if (!g) { throw art::Exception(art::errors::Unknown) << "TF model failed."; }
       mf::LogInfo("WaveformRecogTf") << "TF model loaded.";
     }
@@ -58,17 +64,36 @@ namespace wavrec_tool {
     long long int samples = waveforms.size(), numtcks = waveforms.front().size();
 
     //std::cout<<"Samples: "<<samples<<", Ticks: "<<numtcks<<std::endl;
-    tensorflow::Tensor _x(tensorflow::DT_FLOAT, tensorflow::TensorShape({samples, numtcks, 1}));
-    auto input_map = _x.tensor<float, 3>();
+    auto _x = g->inputTensor(samples, {numtcks, 1}); // pooled tensor, no allocation
+    float* dst = _x.flat<float>().data();
     for (long long int s = 0; s < samples; ++s) {
-      const auto& wvfrm = waveforms[s];
-      for (long long int t = 0; t < numtcks; ++t) {
-        input_map(s, t, 0) = wvfrm[t];
-      }
+      std::copy_n(waveforms[s].begin(), numtcks, dst + s * numtcks);
     }
 
     return g->run(_x);
   }
 
+  // ------------------------------------------------------
+  size_t
+  WaveformRecogTf::predictWaveformWindows(const float* const* windows,
+                                          size_t nwindows,
+                                          std::vector<float>& out) const
+  {
+    out.clear();
+    if (nwindows == 0) { return 0; }
+
+    long long int samples = nwindows, numtcks = windowSize();
+
+    nnet::PerfTimer timer(fPerfInput);
+    auto _x = g->inputTensor(samples, {numtcks, 1}); // pooled tensor, no allocation
+    float* dst = _x.flat<float>().data();
+    for (long long int s = 0; s < samples; ++s) {
+      std::copy_n(windows[s], numtcks, dst + s * numtcks);
+    }
+
+    timer.next(fPerfInference); // incl. output copy done by the graph
+    return g->run(_x, out);
+  }
+
 }
 DEFINE_ART_CLASS_TOOL(wavrec_tool::WaveformRecogTf)
@@ -0,0 +1,185 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Class:       BatchSizeTuner
+// File:        BatchSizeTuner.h
+//
+//      Run-time choice of the inference batch size. Each processed batch is recorded in the
+//      "batch latency" and "batch samples" stages of the module PerfStats. Full batches of the
+//      current size make tuning steps; after a number of them the throughput (samples per
+//      second of the wall time with any batch in progress, so overlapping batches are not
+//      counted twice) and the mean latency of the current size are computed and the next
+//      size is chosen (latency of asynchronous batches is given by the caller without the
+//      time spent queued behind earlier batches):
+//        - the size is doubled while the throughput improves and the latency is below the ceiling,
+//          up to the max size (e.g. max batch size of the inference server),
+//        - if the latency goes above the ceiling the size is halved, down to the min size,
+//        - otherwise the size with the best throughput is kept.
+//      After convergence the latency is still checked and the size halved if it gets above the
+//      ceiling, e.g. if the server gets busier.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef BatchSizeTuner_H
+#define BatchSizeTuner_H
+
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/PerfStats.h"
+
+#include "messagefacility/MessageLogger/MessageLogger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace nnet {
+
+  class BatchSizeTuner {
+  public:
+    using Clock = PerfTimer::Clock;
+
+    // maxLatencyMs = 0: no latency ceiling; maxSize = 0: no limit
+    BatchSizeTuner(std::string const& name,
+                   size_t initial,
+                   size_t minSize,
+                   size_t maxSize,
+                   double maxLatencyMs,
+                   PerfStats& perf,
+                   unsigned batchesPerStep = 8)
+      : fName(name)
+      , fMin(std::max<size_t>(1, minSize))
+      , fMax(maxSize ? std::max(maxSize, fMin) : ~size_t(0))
+      , fMaxLatency(maxLatencyMs * 1.e6)
+      , fBatchesPerStep(std::max(1u, batchesPerStep))
+      , fLatency(perf.stage("batch latency"))
+      , fSamples(perf.stage("batch samples", PerfStage::Unit::Count))
+      , fCurrent(std::clamp(initial, fMin, fMax))
+    {
+      startStep();
+    }
+
+    BatchSizeTuner(BatchSizeTuner const&) = delete;
+    BatchSizeTuner& operator=(BatchSizeTuner const&) = delete;
+
+    size_t
+    batchSize() const
+    {
+      return fCurrent.load(std::memory_order_relaxed);
+    }
+
+    bool
+    converged() const
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      return fConverged;
+    }
+
+    // batch of n samples was processed from start to end; safe from any thread
+    void
+    record(size_t n, Clock::time_point start, Clock::time_point end)
+    {
+      const uint64_t ns = nanoseconds(start, end);
+      fLatency->add(ns);
+      fSamples->add(n);
+
+      std::lock_guard<std::mutex> lock(fMutex);
+      // wall time since the last recorded end (parts of the batch overlapping earlier
+      // batches are not added again)
+      const uint64_t wall = nanoseconds(std::max(start, fLastEnd), end);
+      fLastEnd = std::max(fLastEnd, end);
+      if (n < batchSize()) { return; } // tail of a plane or event, or of a previous size
+
+      ++fCalls;
+      fNs += ns;
+      fWallNs += wall;
+      fStepSamples += n;
+      if (fCalls < fBatchesPerStep) { return; }
+
+      const double latency = double(fNs) / fCalls;
+      const double throughput = fWallNs ? 1.e9 * fStepSamples / fWallNs : 0;
+      const bool tooSlow = (fMaxLatency > 0) && (latency > fMaxLatency);
+      const size_t current = batchSize();
+
+      if (fConverged) {
+        if (tooSlow && (current > fMin)) { setSize(std::max(fMin, current / 2), "latency"); }
+      }
+      else if (tooSlow) {
+        if (fBestSize) { settle(fBestSize); } // larger sizes were too slow
+        else if (current > fMin) {
+          fDescending = true;
+          fCurrent = std::max(fMin, current / 2);
+        }
+        else {
+          settle(fMin);
+        }
+      }
+      else if (fDescending) {
+        settle(current); // first size below the ceiling
+      }
+      else if (throughput > fBestThroughput * (1 + fMinGain)) {
+        fBestThroughput = throughput;
+        fBestSize = current;
+        if (current >= fMax) { settle(current); }
+        else {
+          fCurrent = (current > fMax / 2) ? fMax : 2 * current;
+        }
+      }
+      else {
+        settle(fBestSize);
+      }
+      startStep();
+    }
+
+  private:
+    static uint64_t
+    nanoseconds(Clock::time_point start, Clock::time_point end)
+    {
+      return (end > start) ?
+               std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() :
+               0;
+    }
+
+    void
+    startStep()
+    {
+      fCalls = 0;
+      fNs = fWallNs = fStepSamples = 0;
+    }
+
+    void
+    settle(size_t size)
+    {
+      fConverged = true;
+      setSize(size, "best throughput");
+    }
+
+    void
+    setSize(size_t size, char const* reason)
+    {
+      fCurrent = size;
+      mf::LogInfo("BatchSizeTuner") << fName << ": batch size " << size << " (" << reason << ")";
+    }
+
+    const std::string fName;
+    const size_t fMin, fMax;
+    const double fMaxLatency; // [ns]
+    const unsigned fBatchesPerStep;
+    static constexpr double fMinGain = 0.05; // throughput gain needed to go on doubling
+
+    PerfStage* fLatency;
+    PerfStage* fSamples;
+    std::atomic<size_t> fCurrent;
+
+    mutable std::mutex fMutex;
+    bool fConverged = false;
+    bool fDescending = false;
+    size_t fBestSize = 0;
+    double fBestThroughput = 0;
+    Clock::time_point fLastEnd; // latest end of a recorded batch
+    uint64_t fCalls = 0, fNs = 0, fWallNs = 0, fStepSamples = 0; // of the current step
+  };
+
+}
+
+#endif
@@ -16,6 +16,8 @@
 #ifndef IPointIdAlg_H
 #define IPointIdAlg_H
 
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/PatchGatherer.h"
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/PerfStats.h"
 #include "larreco/RecoAlg/ImagePatternAlgs/DataProvider/DataProviderAlg.h"
 
 #include "messagefacility/MessageLogger/MessageLogger.h"
@@ -25,10 +27,93 @@
 #include "fhiclcpp/types/Sequence.h"
 #include "cetlib_except/exception.h"
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <new>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 namespace PointIdAlgTools {
+
+  // Allocator for the flat patch batch buffer: aligned storage which back-ends
+  // can hand over to the inference engine without copying.
+  template <typename T, std::size_t Align = 64>
+  struct AlignedAllocator {
+    using value_type = T;
+    template <typename U>
+    struct rebind {
+      using other = AlignedAllocator<U, Align>;
+    };
+
+    AlignedAllocator() noexcept = default;
+    template <typename U>
+    AlignedAllocator(AlignedAllocator<U, Align> const&) noexcept
+    {}
+
+    T*
+    allocate(std::size_t n)
+    {
+      return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+    }
+    void
+    deallocate(T* p, std::size_t) noexcept
+    {
+      ::operator delete(p, std::align_val_t(Align));
+    }
+
+    template <typename U>
+    bool
+    operator==(AlignedAllocator<U, Align> const&) const noexcept
+    {
+      return true;
+    }
+    template <typename U>
+    bool
+    operator!=(AlignedAllocator<U, Align> const&) const noexcept
+    {
+      return false;
+    }
+  };
+
+  // Contiguous [samples, PatchSizeW, PatchSizeD] input: patch after patch, wire after wire.
+  using PatchBatch = std::vector<float, AlignedAllocator<float>>;
+
+  // Score map: outputs evaluated on a regular grid of patch centres, spaced by strideW wires and
+  // strideD downsampled drift bins, only at the grid nodes needed by the points; each point gets
+  // outputs bilinearly interpolated from the 4 surrounding nodes. With 1 x 1 stride nodes are the
+  // (unique) point positions, so in the downscaled full view mode the result is the same as with
+  // patches cut for each point.
+  struct ScoreGrid {
+    std::vector<std::pair<unsigned int, float>> nodes; // [wire, drift] of nodes to evaluate
+    std::vector<std::array<size_t, 4>> corners;        // per point: node indices...
+    std::vector<std::array<float, 4>> weights;         // ...and their weights
+
+    // interpolated outputs of points, from outputs of nodes
+    std::vector<std::vector<float>>
+    interpolate(std::vector<std::vector<float>> const& nodeOutputs) const
+    {
+      std::vector<std::vector<float>> out(corners.size());
+      for (size_t i = 0; i < corners.size(); ++i) {
+        auto const& first = nodeOutputs[corners[i][0]];
+        out[i].assign(first.size(), 0);
+        for (size_t c = 0; c < 4; ++c) {
+          if (weights[i][c] == 0) continue;
+          auto const& v = nodeOutputs[corners[i][c]];
+          for (size_t k = 0; k < v.size(); ++k) {
+            out[i][k] += weights[i][c] * v[k];
+          }
+        }
+      }
+      return out;
+    }
+  };
+
   class IPointIdAlg : virtual public img::DataProviderAlg {
   public:
     struct Config : public img::DataProviderAlg::Config {
@@ -54,6 +139,25 @@ namespace PointIdAlgTools {
       fhicl::Atom<std::string> TritonURL{Name("TritonURL"),
                                          Comment("URL of Nvidia Triton inference server"),
                                          "localhost:8001"};
+      fhicl::Sequence<std::string> TritonURLs{
+        Name("TritonURLs"),
+        Comment("Several Triton servers, each request is sent to the best healthy one; "
+                "empty: TritonURL only"),
+        std::vector<std::string>{}};
+      fhicl::Atom<std::string> TritonRouting{
+        Name("TritonRouting"),
+        Comment("Choice of server: latency (mean request latency seen by this job) or queue "
+                "(mean queue time on the server)"),
+        "latency"};
+      fhicl::Atom<unsigned> TritonRetryDelay{
+        Name("TritonRetryDelay"),
+        Comment("Server which failed is not used for this time [s], then checked again"),
+        30};
+      fhicl::Atom<double> TritonHedgeMs{
+        Name("TritonHedgeMs"),
+        Comment("Request not answered in this time [ms] is also sent to the next best server, "
+                "first result is used; 0: off"),
+        0};
       fhicl::Atom<std::string> TritonModelVersion{
         Name("TritonModelVersion"),
         Comment("Version number of Nvidia Triton inference server model"),
@@ -66,6 +170,73 @@ namespace PointIdAlgTools {
         Name("TritonAllowedTries"),
         Comment("Number of allowed attempts for Nvidia Triton inference server client"),
         1};
+      fhicl::Atom<unsigned> TritonTimeout{
+        Name("TritonTimeout"),
+        Comment("Timeout of Nvidia Triton inference server client requests [s], 0: no timeout"),
+        0};
+      fhicl::Atom<std::string> TritonSharedMemory{
+        Name("TritonSharedMemory"),
+        Comment("Transport via none, system or cuda shared memory, used if server is on this node"),
+        "none"};
+      fhicl::Atom<unsigned> TritonSharedMemorySlots{
+        Name("TritonSharedMemorySlots"),
+        Comment("Shared memory blocks, limit of requests in flight (e.g. EmTrack QueueDepth)"),
+        2};
+      fhicl::Atom<bool> TritonBatching{
+        Name("TritonBatching"),
+        Comment("Merge requests of all tools using the same model into full server batches"),
+        false};
+      fhicl::Atom<unsigned> TritonMaxDelayUs{
+        Name("TritonMaxDelayUs"),
+        Comment("Max time a request waits for merging with others [us]"),
+        2000};
+      fhicl::Atom<std::string> TritonPrecision{
+        Name("TritonPrecision"),
+        Comment("Required model input datatype: FP32, FP16 or BF16 (converted from float here), "
+                "empty: any"),
+        ""};
+      fhicl::Atom<std::string> TritonReferenceModelName{
+        Name("TritonReferenceModelName"),
+        Comment("Model (e.g. FP32 version) compared with the used one on a sample of batches, "
+                "PointIdAlgSonicTriton only; empty: no validation"),
+        ""};
+      fhicl::Atom<unsigned> TritonValidationInterval{
+        Name("TritonValidationInterval"),
+        Comment("One in this many batches is sent also to the reference model"),
+        20};
+      fhicl::Atom<int> TfInterOpThreads{
+        Name("TfInterOpThreads"),
+        Comment("TensorFlow inter-op parallelism threads, 0: all cores"),
+        1};
+      fhicl::Atom<int> TfIntraOpThreads{
+        Name("TfIntraOpThreads"),
+        Comment("TensorFlow intra-op parallelism threads, 0: all cores"),
+        1};
+      fhicl::Sequence<std::string> OnnxProviders{
+        Name("OnnxProviders"),
+        Comment("ONNX Runtime execution providers in order of preference: TensorRT, CUDA, DNNL, "
+                "CPU; those not available are skipped, CPU is always the last resort"),
+        std::vector<std::string>{"CPU"}};
+      fhicl::Atom<int> OnnxDeviceId{Name("OnnxDeviceId"),
+                                    Comment("GPU used by CUDA and TensorRT providers"),
+                                    0};
+      fhicl::Atom<int> OnnxInterOpThreads{
+        Name("OnnxInterOpThreads"),
+        Comment("ONNX Runtime inter-op parallelism threads, 0: all cores"),
+        1};
+      fhicl::Atom<int> OnnxIntraOpThreads{
+        Name("OnnxIntraOpThreads"),
+        Comment("ONNX Runtime intra-op parallelism threads, 0: all cores"),
+        1};
+      fhicl::Atom<std::string> OnnxOptimization{
+        Name("OnnxOptimization"),
+        Comment("ONNX Runtime graph optimization level: none, basic, extended, all"),
+        "all"};
+      fhicl::Atom<unsigned> CudaStreams{
+        Name("CudaStreams"),
+        Comment("In-process GPU tool: CUDA streams, i.e. batches in flight at once, each with its "
+                "own pinned staging buffers and session"),
+        2};
     };
     virtual ~IPointIdAlg() noexcept = default;
 
@@ -77,6 +248,38 @@ namespace PointIdAlgTools {
       std::vector<std::vector<std::vector<float>>> const& inps,
       int samples = -1) const = 0;
 
+    // process samples stored contiguously as [samples, PatchSizeW, PatchSizeD], e.g. filled
+    // with bufferPatches(); back-ends should use the memory directly wherever possible
+    virtual std::vector<std::vector<float>> Run(float const* inps, size_t samples) const = 0;
+
+    // largest batch the back-end processes in one call (e.g. max batch size of the model on
+    // the inference server), larger ones are split; 0: no limit
+    virtual size_t
+    maxBatchSize() const
+    {
+      return 0;
+    }
+
+    // run the model once on a batch of empty patches, so the lazy initialization of the
+    // back-end (kernels, memory pools, server connection) is not paid by the first event;
+    // call before processing starts, the time is not recorded in the stats
+    void
+    warmUp(size_t samples = 1)
+    {
+      if (samples == 0) { return; }
+      if (maxBatchSize() && (samples > maxBatchSize())) { samples = maxBatchSize(); }
+
+      auto stages = std::make_tuple(fPerfPatches, fPerfInput, fPerfInference, fPerfOutput);
+      setPerfStats(nullptr);
+
+      PatchBatch zeros(samples * fPatchSizeW * fPatchSizeD, 0.F);
+      if (Run(zeros.data(), samples).size() != samples) {
+        mf::LogWarning("PointIdAlg") << "Warm-up inference failed.";
+      }
+
+      std::tie(fPerfPatches, fPerfInput, fPerfInference, fPerfOutput) = stages;
+    }
+
     // calculate single-value prediction (2-class probability) for [wire, drift] point
     float
     predictIdValue(unsigned int wire, float drift, size_t outIdx = 0)
@@ -120,18 +323,121 @@ namespace PointIdAlgTools {
     {
       if (points.empty()) { return std::vector<std::vector<float>>(); }
 
-      std::vector<std::vector<std::vector<float>>> inps(
-        points.size(),
-        std::vector<std::vector<float>>(fPatchSizeW, std::vector<float>(fPatchSizeD)));
+      return Run(bufferPatches(points, fPatchBatch), points.size());
+    }
+
+    // Calculate multi-class probabilities for a vector of [wire, drift] points from the score
+    // map evaluated with strideW x strideD spacing, see ScoreGrid
+    std::vector<std::vector<float>>
+    predictIdVectors(const std::vector<std::pair<unsigned int, float>>& points,
+                     size_t strideW,
+                     size_t strideD)
+    {
+      if (points.empty()) { return std::vector<std::vector<float>>(); }
+
+      ScoreGrid grid;
+      makeScoreGrid(points, strideW, strideD, grid);
+      return grid.interpolate(predictIdVectors(grid.nodes));
+    }
+
+    // Grid nodes needed by the points and interpolation weights of the points, in the current view
+    void
+    makeScoreGrid(const std::vector<std::pair<unsigned int, float>>& points,
+                  size_t strideW,
+                  size_t strideD,
+                  ScoreGrid& grid) const
+    {
+      strideW = std::max<size_t>(strideW, 1);
+      strideD = std::max<size_t>(strideD, 1);
+
+      grid.nodes.clear();
+      grid.corners.resize(points.size());
+      grid.weights.resize(points.size());
+
+      // patch is centred in the drift bin of the point, so is the node patch (at the bin middle)
+      const float bin = fDriftWindow;
+      std::unordered_map<uint64_t, size_t> index;
+      auto node = [&](uint64_t iw, uint64_t id) {
+        auto [it, added] = index.emplace((iw << 32) | id, grid.nodes.size());
+        if (added) { grid.nodes.emplace_back(iw * strideW, (id * strideD + 0.5F) * bin); }
+        return it->second;
+      };
+
       for (size_t i = 0; i < points.size(); ++i) {
-        unsigned int wire = points[i].first;
-        float drift = points[i].second;
-        if (!bufferPatch(wire, drift, inps[i])) {
+        const size_t w = points[i].first;
+        const size_t d = (size_t)(points[i].second / bin);
+        const size_t iw = w / strideW, id = d / strideD;
+        const float fw = float(w - iw * strideW) / strideW;
+        const float fd = float(d - id * strideD) / strideD;
+
+        auto& c = grid.corners[i];
+        auto& wgt = grid.weights[i];
+        wgt = {(1 - fw) * (1 - fd), fw * (1 - fd), (1 - fw) * fd, fw * fd};
+        c[0] = node(iw, id);
+        c[1] = (wgt[1] > 0) ? node(iw + 1, id) : c[0];
+        c[2] = (wgt[2] > 0) ? node(iw, id + 1) : c[0];
+        c[3] = (wgt[3] > 0) ? node(iw + 1, id + 1) : c[0];
+      }
+    }
+
+    // Pipelined version of predictIdVectors: submitIdVectors() starts processing of a batch
+    // and may return before results are ready, so the next batch can be prepared meanwhile;
+    // collectIdVectors() returns results of the oldest submitted batch. Patches are read
+    // from the current view at submission. The default implementation is synchronous.
+    virtual void
+    submitIdVectors(const std::vector<std::pair<unsigned int, float>>& points)
+    {
+      fPendingResults.push_back(predictIdVectors(points));
+    }
+    virtual std::vector<std::vector<float>>
+    collectIdVectors()
+    {
+      if (fPendingResults.empty()) {
+        throw cet::exception("PointIdAlg") << "No submitted batch to collect" << std::endl;
+      }
+      auto out = std::move(fPendingResults.front());
+      fPendingResults.pop_front();
+      return out;
+    }
+
+    // Buffer patches of all points into one contiguous batch, the buffer only grows so
+    // that a single allocation is reused for all batches; returns pointer to the data
+    float const*
+    bufferPatches(const std::vector<std::pair<unsigned int, float>>& points, PatchBatch& batch)
+    {
+      nnet::PerfTimer timer(fPerfPatches);
+      const size_t patchSize = fPatchSizeW * fPatchSizeD;
+      if (batch.size() < points.size() * patchSize) { batch.resize(points.size() * patchSize); }
+
+      for (size_t i = 0; i < points.size(); ++i) {
+        if (!bufferPatch(points[i].first, points[i].second, batch.data() + i * patchSize)) {
           throw cet::exception("PointIdAlg") << "Patch buffering failed" << std::endl;
         }
       }
+      return batch.data();
+    }
 
-      return Run(inps);
+    // points with the same key have the same patch: same wire and drift bin in the downscaled
+    // full view mode, or the same wire and drift otherwise
+    uint64_t
+    patchKey(unsigned int wire, float drift) const
+    {
+      uint32_t d;
+      if (fDownscaleFullView) { d = (uint32_t)(int)(drift / fDriftWindow); }
+      else {
+        std::memcpy(&d, &drift, sizeof(d));
+      }
+      return ((uint64_t)wire << 32) | d;
+    }
+
+    // record time of the tool steps in the stats of the calling module, nullptr: no recording
+    void
+    setPerfStats(nnet::PerfStats* perf)
+    {
+      fPerfPatches = perf ? perf->stage("patch buffering") : nullptr;
+      fPerfInput = perf ? perf->stage("input marshalling") : nullptr;
+      fPerfInference = perf ? perf->stage("inference") : nullptr;
+      fPerfOutput = perf ? perf->stage("output unpacking") : nullptr;
     }
 
     std::vector<std::string> const&
@@ -160,6 +466,11 @@ namespace PointIdAlgTools {
     size_t fPatchSizeW, fPatchSizeD;
     std::vector<std::vector<float>> fWireDriftPatch; // patch data around the identified point
     size_t fCurrentWireIdx, fCurrentScaledDrift;
+    PatchBatch fPatchBatch; // contiguous patches of the current batch
+    nnet::PerfStage* fPerfPatches = nullptr;   // bufferPatches()
+    nnet::PerfStage* fPerfInput = nullptr;     // back-end: copy / conversion to the model input
+    nnet::PerfStage* fPerfInference = nullptr; // back-end: model evaluation
+    nnet::PerfStage* fPerfOutput = nullptr;    // back-end: copy of the model outputs
 
     bool
     bufferPatch(size_t wire, float drift, std::vector<std::vector<float>>& patch)
@@ -185,6 +496,46 @@ namespace PointIdAlgTools {
       }
     }
 
+    // write patch around [wire, drift] directly into PatchSizeW x PatchSizeD floats at dst
+    bool
+    bufferPatch(size_t wire, float drift, float* dst)
+    {
+      if (fDownscaleFullView) {
+        // same as patchFromDownsampledView(), without the intermediate 2D vector
+        const int w0 = wire - fPatchSizeW / 2;
+        const int d0 = (int)(drift / fDriftWindow) - fPatchSizeD / 2;
+        auto const& rows = fAlgView.fWireDriftData;
+        const float zero = ZeroLevel();
+
+        // sizes of the models in use have the fixed size version
+        if ((fPatchSizeW == 32) && (fPatchSizeD == 44)) {
+          gatherPatch<32, 44>(rows, w0, d0, zero, dst);
+        }
+        else if ((fPatchSizeW == 44) && (fPatchSizeD == 48)) {
+          gatherPatch<44, 48>(rows, w0, d0, zero, dst);
+        }
+        else if ((fPatchSizeW == 48) && (fPatchSizeD == 48)) {
+          gatherPatch<48, 48>(rows, w0, d0, zero, dst);
+        }
+        else {
+          gatherPatch(rows, w0, d0, fPatchSizeW, fPatchSizeD, zero, dst);
+        }
+        return true;
+      }
+      else {
+        // downsampling is done on the fly, fWireDriftPatch is used as scratch
+        fCurrentWireIdx = 99999;
+        fCurrentScaledDrift = 99999;
+        if (!patchFromOriginalView(wire, drift, fPatchSizeW, fPatchSizeD, fWireDriftPatch)) {
+          return false;
+        }
+        for (size_t w = 0; w < fPatchSizeW; ++w) {
+          std::copy(fWireDriftPatch[w].begin(), fWireDriftPatch[w].end(), dst + w * fPatchSizeD);
+        }
+        return true;
+      }
+    }
+
     bool
     bufferPatch(size_t wire, float drift)
     {
@@ -198,6 +549,9 @@ namespace PointIdAlgTools {
       for (auto& r : fWireDriftPatch)
         r.resize(fPatchSizeD);
     }
+
+  private:
+    std::deque<std::vector<std::vector<float>>> fPendingResults; // default submit/collect
   };
 }
 
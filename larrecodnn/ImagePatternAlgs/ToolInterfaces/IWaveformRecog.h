@@ -1,28 +1,170 @@
 #ifndef IWaveformRecog_H
 #define IWaveformRecog_H
 
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/PerfStats.h"
 #include "canvas/Utilities/Exception.h"
 #include "fhiclcpp/ParameterSet.h"
 #include "cetlib/search_path.h"
 #include "cetlib_except/exception.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <tuple>
 #include <sys/stat.h>
 #include <vector>
 
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 namespace wavrec_tool {
+
+  // out = (in - mean) * invscale, n elements; AVX or SSE when available, scalar tail
+  inline void
+  normalizeWaveform(const float* in,
+                    const float* mean,
+                    const float* invscale,
+                    float* out,
+                    size_t n)
+  {
+    size_t i = 0;
+#if defined(__AVX__)
+    for (; i + 8 <= n; i += 8) {
+      __m256 v = _mm256_sub_ps(_mm256_loadu_ps(in + i), _mm256_loadu_ps(mean + i));
+      _mm256_storeu_ps(out + i, _mm256_mul_ps(v, _mm256_loadu_ps(invscale + i)));
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+      __m128 v = _mm_sub_ps(_mm_loadu_ps(in + i), _mm_loadu_ps(mean + i));
+      _mm_storeu_ps(out + i, _mm_mul_ps(v, _mm_loadu_ps(invscale + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+      out[i] = (in[i] - mean[i]) * invscale[i];
+    }
+  }
+
+  // out = in - pedestal for n raw ADC counts, converted to float in the same pass; SSE when
+  // available, scalar tail
+  inline void
+  subtractPedestal(const short* in, float pedestal, float* out, size_t n)
+  {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 ped = _mm_set1_ps(pedestal);
+    for (; i + 8 <= n; i += 8) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+      __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16); // sign-extended to 32 bits
+      __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+      _mm_storeu_ps(out + i, _mm_sub_ps(_mm_cvtepi32_ps(lo), ped));
+      _mm_storeu_ps(out + i + 4, _mm_sub_ps(_mm_cvtepi32_ps(hi), ped));
+    }
+#endif
+    for (; i < n; ++i) {
+      out[i] = in[i] - pedestal;
+    }
+  }
+
+  // sum of squares and maximum of |x| over n elements, in one pass
+  inline void
+  windowStats(const float* x, size_t n, float& sumsq, float& maxabs)
+  {
+    size_t i = 0;
+    sumsq = 0;
+    maxabs = 0;
+#if defined(__SSE2__)
+    const __m128 signmask = _mm_set1_ps(-0.0F);
+    __m128 vsum = _mm_setzero_ps(), vmax = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+      __m128 v = _mm_loadu_ps(x + i);
+      vsum = _mm_add_ps(vsum, _mm_mul_ps(v, v));
+      vmax = _mm_max_ps(vmax, _mm_andnot_ps(signmask, v));
+    }
+    alignas(16) float s4[4], m4[4];
+    _mm_store_ps(s4, vsum);
+    _mm_store_ps(m4, vmax);
+    sumsq = (s4[0] + s4[1]) + (s4[2] + s4[3]);
+    maxabs = std::max(std::max(m4[0], m4[1]), std::max(m4[2], m4[3]));
+#endif
+    for (; i < n; ++i) {
+      sumsq += x[i] * x[i];
+      maxabs = std::max(maxabs, std::fabs(x[i]));
+    }
+  }
+
   class IWaveformRecog {
   public:
+    // Work buffers owned by the caller, reused between calls to avoid allocations.
+    // One instance per thread.
+    struct Scratch {
+      std::vector<float> adc;             // normalized, zero-padded waveforms
+      std::vector<const float*> windows;  // views on adc, one per scan window
+      std::vector<float> pred;            // [window, class] network outputs
+      std::vector<float> scores;          // [window, class] incl. windows skipped by pre-filter
+      std::vector<size_t> selected;       // windows passing the pre-filter
+      std::vector<size_t> batched;        // waveforms in the current batch
+    };
+
     virtual ~IWaveformRecog() noexcept = default;
 
     // Calculate multi-class probabilities for waveform
     virtual std::vector<std::vector<float>> predictWaveformType(
       const std::vector<std::vector<float>>&) const = 0;
 
+    // Calculate multi-class probabilities for nwindows windows of windowSize() ticks,
+    // each read directly from windows[i]; out is resized to [nwindows, classes].
+    // Returns the number of classes, 0 if inference failed. Default implementation
+    // copies windows for predictWaveformType, back-ends override it to avoid that.
+    virtual size_t
+    predictWaveformWindows(const float* const* windows,
+                           size_t nwindows,
+                           std::vector<float>& out) const
+    {
+      nnet::PerfTimer timer(fPerfInput);
+      std::vector<std::vector<float>> wwv(nwindows);
+      for (size_t i = 0; i < nwindows; ++i) {
+        wwv[i].assign(windows[i], windows[i] + fWindowSize);
+      }
+      timer.next(fPerfInference);
+      auto predv = predictWaveformType(wwv);
+      timer.next(fPerfOutput);
+      if (predv.empty() || predv.size() != nwindows) {
+        out.clear();
+        return 0;
+      }
+      size_t ncls = predv.front().size();
+      out.resize(nwindows * ncls);
+      for (size_t i = 0; i < nwindows; ++i) {
+        std::copy_n(predv[i].begin(), ncls, out.begin() + i * ncls);
+      }
+      return ncls;
+    }
+
+    // run the model once on nwindows empty windows, so the lazy initialization of the
+    // back-end is not paid by the first event; call before processing starts, the time
+    // is not recorded in the stats
+    void
+    warmUp(size_t nwindows = 1)
+    {
+      if ((nwindows == 0) || (fWindowSize == 0)) { return; }
+
+      auto stages = std::make_tuple(fPerfInput, fPerfInference, fPerfOutput);
+      setPerfStats(nullptr);
+
+      std::vector<float> zeros(fWindowSize, 0.F), out;
+      std::vector<const float*> windows(nwindows, zeros.data());
+      if (predictWaveformWindows(windows.data(), nwindows, out) == 0) {
+        std::cout << "WaveformRecog warm-up inference failed." << std::endl;
+      }
+
+      std::tie(fPerfInput, fPerfInference, fPerfOutput) = stages;
+    }
+
     // ---------------------------------------------------------------------
     // Return a vector of booleans of the same size as the input  waveform.
     // The value of each element of the vector represents whether the
@@ -31,23 +173,77 @@ namespace wavrec_tool {
     std::vector<bool>
     findROI(const std::vector<float>& adcin) const
     {
-      std::vector<bool> bvec(fWaveformSize, false);
-      if (adcin.size() != fWaveformSize) { return bvec; }
+      Scratch scratch;
+      std::vector<bool> bvec;
+      findROI(adcin, bvec, scratch);
+      return bvec;
+    }
 
-      std::vector<std::vector<float>> predv = scanWaveform(adcin);
+    // Same as above, result written to caller-owned bvec, no allocation if buffers are reused
+    void
+    findROI(const std::vector<float>& adcin, std::vector<bool>& bvec, Scratch& scratch) const
+    {
+      bvec.assign(fWaveformSize, false);
+      if (adcin.size() != fWaveformSize) { return; }
 
-      // .. set to true all bins in the output vector that are in windows identified as signals
-      int j1;
-      for (unsigned int i = 0; i < fNumStrides; i++) {
-        j1 = i * fStrideLength;
-        if (predv[i][0] > fCnnPredCut) { std::fill_n(bvec.begin() + j1, fWindowSize, true); }
-      }
-      // .. last window is a special case
-      if (predv[fNumStrides][0] > fCnnPredCut) {
-        j1 = fNumStrides * fStrideLength;
-        std::fill_n(bvec.begin() + j1, fLastWindowSize, true);
+      size_t ncls = scanWaveform(adcin, scratch);
+      if (ncls) { roiFromPrediction(scanScores(scratch), ncls, bvec); }
+    }
+
+    // ---------------------------------------------------------------------
+    // Batched version of findROI: windows of many waveforms are collected
+    // and sent to the network together, in batches of at least batchSize
+    // windows (rounded up to complete waveforms). Waveforms of wrong size
+    // give all-false results, as in findROI.
+    // ---------------------------------------------------------------------
+    std::vector<std::vector<bool>>
+    findROIs(const std::vector<std::vector<float>>& adcins, size_t batchSize) const
+    {
+      Scratch scratch;
+      std::vector<std::vector<bool>> result;
+      findROIs(adcins, batchSize, result, scratch);
+      return result;
+    }
+
+    void
+    findROIs(const std::vector<std::vector<float>>& adcins,
+             size_t batchSize,
+             std::vector<std::vector<bool>>& result,
+             Scratch& scratch) const
+    {
+      result.resize(adcins.size());
+
+      const size_t nwin = numWindows();
+      const size_t wavesPerBatch = std::max<size_t>(1, (batchSize + nwin - 1) / nwin);
+      const size_t padded = paddedSize();
+
+      auto& batched = scratch.batched;
+      batched.clear();
+      scratch.adc.resize(std::min(wavesPerBatch, adcins.size()) * padded);
+      scratch.windows.clear();
+      scratch.selected.clear();
+
+      for (size_t w = 0; w < adcins.size(); ++w) {
+        result[w].assign(fWaveformSize, false);
+        if (adcins[w].size() == fWaveformSize) {
+          appendWindows(
+            adcins[w], scratch.adc.data() + batched.size() * padded, batched.size() * nwin, scratch);
+          batched.push_back(w);
+        }
+
+        if (!batched.empty() && (batched.size() == wavesPerBatch || w + 1 == adcins.size())) {
+          size_t ncls = predictSelected(batched.size() * nwin, scratch);
+          if (ncls) {
+            const float* scores = usePreFilter() ? scratch.scores.data() : scratch.pred.data();
+            for (size_t b = 0; b < batched.size(); ++b) {
+              roiFromPrediction(scores + b * nwin * ncls, ncls, result[batched[b]]);
+            }
+          }
+          scratch.windows.clear();
+          scratch.selected.clear();
+          batched.clear();
+        }
       }
-      return bvec;
     }
 
     // -------------------------------------------------------------
@@ -58,24 +254,74 @@ namespace wavrec_tool {
     std::vector<float>
     predROI(const std::vector<float>& adcin) const
     {
-      std::vector<float> fvec(fWaveformSize, 0.);
-      if (adcin.size() != fWaveformSize) { return fvec; }
+      Scratch scratch;
+      std::vector<float> fvec;
+      predROI(adcin, fvec, scratch);
+      return fvec;
+    }
 
-      std::vector<std::vector<float>> predv = scanWaveform(adcin);
+    // Same as above, result written to caller-owned fvec
+    void
+    predROI(const std::vector<float>& adcin, std::vector<float>& fvec, Scratch& scratch) const
+    {
+      fvec.assign(fWaveformSize, 0.);
+      if (adcin.size() != fWaveformSize) { return; }
+
+      size_t ncls = scanWaveform(adcin, scratch);
+      if (!ncls) { return; }
+      const float* predv = scanScores(scratch);
 
       // .. set value in each bin of output vector to the prediction for the window it is in
       int j1;
       for (unsigned int i = 0; i < fNumStrides; i++) {
         j1 = i * fStrideLength;
-        std::fill_n(fvec.begin() + j1, fWindowSize, predv[i][0]);
+        std::fill_n(fvec.begin() + j1, fWindowSize, predv[i * ncls]);
       }
       // .. last window is a special case
       j1 = fNumStrides * fStrideLength;
-      std::fill_n(fvec.begin() + j1, fLastWindowSize, predv[fNumStrides][0]);
-      return fvec;
+      std::fill_n(fvec.begin() + j1, fLastWindowSize, predv[fNumStrides * ncls]);
+    }
+
+    // Number of scan windows (network inputs) per waveform
+    unsigned int
+    numWindows() const
+    {
+      return fNumStrides + 1;
+    }
+
+    // Number of ticks in each scan window
+    unsigned int
+    windowSize() const
+    {
+      return fWindowSize;
+    }
+
+    // Windows scanned so far, and how many of them skipped the network due to the pre-filter
+    size_t
+    numScannedWindows() const
+    {
+      return fNScannedWindows;
+    }
+    size_t
+    numSkippedWindows() const
+    {
+      return fNSkippedWindows;
+    }
+
+    // record time of the tool steps in the stats of the calling module, nullptr: no recording
+    void
+    setPerfStats(nnet::PerfStats* perf)
+    {
+      fPerfInput = perf ? perf->stage("input marshalling") : nullptr;
+      fPerfInference = perf ? perf->stage("inference") : nullptr;
+      fPerfOutput = perf ? perf->stage("output unpacking") : nullptr;
     }
 
   protected:
+    nnet::PerfStage* fPerfInput = nullptr;     // back-end: copy of windows to the model input
+    nnet::PerfStage* fPerfInference = nullptr; // back-end: model evaluation
+    nnet::PerfStage* fPerfOutput = nullptr;    // back-end: copy of the model outputs
+
     std::string
     findFile(const char* fileName) const
     {
@@ -97,6 +343,15 @@ namespace wavrec_tool {
     {
       fCnnPredCut = pset.get<float>("CnnPredCut", 0.5);
       fWaveformSize = pset.get<unsigned int>("WaveformSize", 0); // 6000
+
+      // ... reduced precision and the validation against a reference model are available
+      // ... in the PointIdAlg Triton tools only, waveform tools run the model as it is
+      for (auto const& key : {"TritonPrecision", "TritonReferenceModelName"}) {
+        if (pset.has_key(key)) {
+          throw art::Exception(art::errors::Configuration)
+            << key << " is not supported by the waveform recognition tools" << std::endl;
+        }
+      }
       std::string fMeanFilename = pset.get<std::string>("MeanFilename", "");
       std::string fScaleFilename = pset.get<std::string>("ScaleFilename", "");
 
@@ -141,6 +396,17 @@ namespace wavrec_tool {
         std::fill(scalevec.begin(), scalevec.end(), fCnnScale);
       }
 
+      invscalevec.resize(scalevec.size());
+      for (size_t i = 0; i < scalevec.size(); ++i) {
+        invscalevec[i] = 1.0F / scalevec[i];
+      }
+
+      // .. cheap pre-filter on the input waveform (ADC units): windows with RMS and peak
+      // .. |ADC| below the enabled cuts are not sent to the network and get all scores 0;
+      // .. a zero cut is disabled, both zero switch the filter off
+      fPreFilterRmsCut = pset.get<float>("PreFilterRmsCut", 0.);
+      fPreFilterPeakCut = pset.get<float>("PreFilterPeakCut", 0.);
+
       fWindowSize = pset.get<unsigned int>("ScanWindowSize", 0); // 200
       fStrideLength = pset.get<unsigned int>("StrideLength", 0); // 150
 
@@ -162,6 +428,7 @@ namespace wavrec_tool {
 
   private:
     std::vector<float> scalevec;
+    std::vector<float> invscalevec; // 1/scale, multiplied instead of dividing per tick
     std::vector<float> meanvec;
     float fCnnMean;
     float fCnnScale;
@@ -171,41 +438,114 @@ namespace wavrec_tool {
     unsigned int fStrideLength; // Offset (in #time ticks) between scan windows
     unsigned int fNumStrides;
     unsigned int fLastWindowSize;
+    float fPreFilterRmsCut;
+    float fPreFilterPeakCut;
+
+    mutable std::atomic<size_t> fNScannedWindows{0};
+    mutable std::atomic<size_t> fNSkippedWindows{0};
+
+    bool
+    usePreFilter() const
+    {
+      return (fPreFilterRmsCut > 0) || (fPreFilterPeakCut > 0);
+    }
+
+    // .. true if the window of n ticks of the input waveform may contain signal
+    bool
+    passPreFilter(const float* x, size_t n) const
+    {
+      float sumsq, maxabs;
+      windowStats(x, n, sumsq, maxabs);
+      return ((fPreFilterPeakCut > 0) && (maxabs >= fPreFilterPeakCut)) ||
+             ((fPreFilterRmsCut > 0) && (sumsq >= fPreFilterRmsCut * fPreFilterRmsCut * n));
+    }
 
-    std::vector<std::vector<float>>
-    scanWaveform(const std::vector<float>& adcin) const
+    // .. run network on the selected windows out of ntotal, returns number of classes;
+    // .. with the pre-filter on, [ntotal, class] scores are expanded to scratch.scores
+    size_t
+    predictSelected(size_t ntotal, Scratch& scratch) const
     {
-      // .. rescale input waveform for CNN
-      std::vector<float> adc(fWaveformSize);
-      for (size_t itck = 0; itck < fWaveformSize; ++itck) {
-        adc[itck] = (adcin[itck] - meanvec[itck]) / scalevec[itck];
+      fNScannedWindows += ntotal;
+      if (!usePreFilter()) {
+        return predictWaveformWindows(scratch.windows.data(), scratch.windows.size(), scratch.pred);
       }
 
-      // .. create a vector of windows
-      std::vector<std::vector<float>> wwv(fNumStrides + 1, std::vector<float>(fWindowSize, 0.));
+      fNSkippedWindows += ntotal - scratch.selected.size();
+      size_t ncls = 1; // all windows skipped: a single zero score per window is enough
+      if (!scratch.selected.empty()) {
+        ncls =
+          predictWaveformWindows(scratch.windows.data(), scratch.windows.size(), scratch.pred);
+        if (!ncls) { return 0; }
+      }
+      scratch.scores.assign(ntotal * ncls, 0.F);
+      for (size_t i = 0; i < scratch.selected.size(); ++i) {
+        std::copy_n(
+          scratch.pred.begin() + i * ncls, ncls, scratch.scores.begin() + scratch.selected[i] * ncls);
+      }
+      return ncls;
+    }
+
+    const float*
+    scanScores(const Scratch& scratch) const
+    {
+      return usePreFilter() ? scratch.scores.data() : scratch.pred.data();
+    }
+
+    // .. normalized waveform buffer length: all windows, including the last one, fit without copy
+    size_t
+    paddedSize() const
+    {
+      return fNumStrides * fStrideLength + fWindowSize;
+    }
+
+    // .. windows of one waveform, network outputs in scratch.pred, returns number of classes
+    size_t
+    scanWaveform(const std::vector<float>& adcin, Scratch& scratch) const
+    {
+      scratch.adc.resize(paddedSize());
+      scratch.windows.clear();
+      scratch.selected.clear();
+      appendWindows(adcin, scratch.adc.data(), 0, scratch);
+
+      // ... use waveform recognition CNN to perform inference on each window
+      return predictSelected(numWindows(), scratch);
+    }
 
-      // .. fill each window with adc values
-      unsigned int j1, j2, k;
+    // .. rescale input waveform for CNN into adc (paddedSize() long), zero-padded after the
+    // .. waveform end, and append views on its fNumStrides + 1 windows; with the pre-filter
+    // .. on only windows passing it are appended, their indexes (from first on) are kept
+    void
+    appendWindows(const std::vector<float>& adcin, float* adc, size_t first, Scratch& scratch) const
+    {
+      normalizeWaveform(adcin.data(), meanvec.data(), invscalevec.data(), adc, fWaveformSize);
+      std::fill(adc + fWaveformSize, adc + paddedSize(), 0.F);
+
+      const bool filter = usePreFilter();
+      for (unsigned int i = 0; i <= fNumStrides; i++) {
+        if (filter) {
+          size_t n = (i < fNumStrides) ? fWindowSize : fLastWindowSize;
+          if (!passPreFilter(adcin.data() + i * fStrideLength, n)) { continue; }
+          scratch.selected.push_back(first + i);
+        }
+        scratch.windows.push_back(adc + i * fStrideLength);
+      }
+    }
+
+    // .. ROI mask from the predictions [window, class] of one waveform
+    void
+    roiFromPrediction(const float* predv, size_t ncls, std::vector<bool>& bvec) const
+    {
+      // .. set to true all bins in the output vector that are in windows identified as signals
+      int j1;
       for (unsigned int i = 0; i < fNumStrides; i++) {
         j1 = i * fStrideLength;
-        j2 = j1 + fWindowSize;
-        k = 0;
-        for (unsigned int j = j1; j < j2; j++) {
-          wwv[i][k] = adc[j];
-          k++;
-        }
+        if (predv[i * ncls] > fCnnPredCut) { std::fill_n(bvec.begin() + j1, fWindowSize, true); }
       }
       // .. last window is a special case
-      j1 = fNumStrides * fStrideLength;
-      j2 = j1 + fLastWindowSize;
-      k = 0;
-      for (unsigned int j = j1; j < j2; j++) {
-        wwv[fNumStrides][k] = adc[j];
-        k++;
+      if (predv[fNumStrides * ncls] > fCnnPredCut) {
+        j1 = fNumStrides * fStrideLength;
+        std::fill_n(bvec.begin() + j1, fLastWindowSize, true);
       }
-
-      // ... use waveform recognition CNN to perform inference on each window
-      return predictWaveformType(wwv);
     }
   };
 }
@@ -0,0 +1,81 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Patch gatherer: copy of a [wire, drift] window of the downsampled view into a flat buffer.
+//
+//      Each wire row is written once: the drift range inside the view is one memcpy, the
+//      padding at the view edges is filled around it, so there are no per-element checks.
+//      Patch sizes known at compile time (gatherPatch<W, D>) make the interior rows fixed size
+//      copies which the compiler turns into vector moves; other sizes use the runtime version.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PatchGatherer_H
+#define PatchGatherer_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+namespace PointIdAlgTools {
+
+  namespace detail {
+
+    // drifts [d0, d0 + nd) of the row into dst, zero outside of the row
+    inline void
+    gatherRow(std::vector<float> const& row, int d0, int nd, float zero, float* dst)
+    {
+      const int len = row.size();
+      const int beg = std::clamp(-d0, 0, nd);         // first column inside the row
+      const int end = std::clamp(len - d0, beg, nd);  // end of columns inside the row
+      std::fill_n(dst, beg, zero);
+      if (end > beg) { std::memcpy(dst + beg, row.data() + d0 + beg, (end - beg) * sizeof(float)); }
+      std::fill_n(dst + end, nd - end, zero);
+    }
+
+  }
+
+  // PatchSizeW x PatchSizeD window starting at [w0, d0] into dst, zero outside of the view
+  template <int PatchSizeW, int PatchSizeD>
+  inline void
+  gatherPatch(std::vector<std::vector<float>> const& rows, int w0, int d0, float zero, float* dst)
+  {
+    const int wsize = rows.size();
+    for (int i = 0; i < PatchSizeW; ++i, dst += PatchSizeD) {
+      const int w = w0 + i;
+      if ((w < 0) || (w >= wsize)) { std::fill_n(dst, PatchSizeD, zero); }
+      else if ((d0 >= 0) && (d0 + PatchSizeD <= (int)rows[w].size())) {
+        std::memcpy(dst, rows[w].data() + d0, PatchSizeD * sizeof(float));
+      }
+      else {
+        detail::gatherRow(rows[w], d0, PatchSizeD, zero, dst);
+      }
+    }
+  }
+
+  // same for sizes set at run time; as in img::DataProviderAlg::patchFromDownsampledView()
+  // a patch of odd size is filled up to the even size, the last wire / drift is left zero
+  inline void
+  gatherPatch(std::vector<std::vector<float>> const& rows,
+              int w0,
+              int d0,
+              size_t patchSizeW,
+              size_t patchSizeD,
+              float zero,
+              float* dst)
+  {
+    const int wsize = rows.size();
+    const int nw = 2 * (patchSizeW / 2), nd = 2 * (patchSizeD / 2);
+    for (int i = 0; i < nw; ++i, dst += patchSizeD) {
+      const int w = w0 + i;
+      if ((w < 0) || (w >= wsize)) { std::fill_n(dst, nd, zero); }
+      else {
+        detail::gatherRow(rows[w], d0, nd, zero, dst);
+      }
+      std::fill_n(dst + nd, patchSizeD - nd, zero);
+    }
+    std::fill_n(dst, (patchSizeW - nw) * patchSizeD, zero);
+  }
+
+}
+
+#endif
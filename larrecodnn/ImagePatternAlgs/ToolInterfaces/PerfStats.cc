@@ -0,0 +1,180 @@
+#include "larrecodnn/ImagePatternAlgs/ToolInterfaces/PerfStats.h"
+
+#include "messagefacility/MessageLogger/MessageLogger.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <sstream>
+
+namespace {
+
+  std::string
+  jsonString(std::string const& s)
+  {
+    std::string out = "\"";
+    for (char c : s) {
+      if ((c == '"') || (c == '\\')) { out += '\\'; }
+      out += c;
+    }
+    return out + "\"";
+  }
+
+  std::mutex registryMutex;
+  std::map<std::string, std::unique_ptr<nnet::PerfStats>> registry;
+
+}
+
+uint64_t
+nnet::PerfStage::quantile(double q) const
+{
+  const uint64_t n = calls();
+  if (!n) { return 0; }
+
+  const uint64_t rank = std::max<uint64_t>(1, uint64_t(q * n + 0.5));
+  uint64_t cumulated = 0;
+  for (size_t b = 0; b < NBins; ++b) {
+    cumulated += binCount(b);
+    if (cumulated >= rank) {
+      uint64_t edge = b ? ((b < 64) ? (uint64_t(1) << b) - 1 : ~uint64_t(0)) : 0;
+      return std::min(edge, max());
+    }
+  }
+  return max();
+}
+
+nnet::PerfStage*
+nnet::PerfStats::stage(std::string const& name, PerfStage::Unit unit)
+{
+  std::lock_guard<std::mutex> lock(fMutex);
+  for (auto& s : fStages) {
+    if (s.name() == name) { return &s; }
+  }
+  return &fStages.emplace_back(name, unit);
+}
+
+std::string
+nnet::PerfStats::table() const
+{
+  std::lock_guard<std::mutex> lock(fMutex);
+
+  size_t width = 5;
+  for (auto const& s : fStages) {
+    width = std::max(width, s.name().size());
+  }
+
+  std::ostringstream out;
+  char line[256];
+  auto section = [&](PerfStage::Unit unit, char const* title, double scale, double totalScale) {
+    bool header = false;
+    for (auto const& s : fStages) {
+      if ((s.unit() != unit) || !s.calls()) continue;
+      if (!header) {
+        std::snprintf(line,
+                      sizeof(line),
+                      "  %-*s %10s %12s %10s %10s %10s %10s %10s\n",
+                      int(width),
+                      title,
+                      "calls",
+                      (unit == PerfStage::Unit::Time) ? "total[ms]" : "total",
+                      "mean",
+                      "p50",
+                      "p90",
+                      "p99",
+                      "max");
+        out << line;
+        header = true;
+      }
+      std::snprintf(line,
+                    sizeof(line),
+                    "  %-*s %10llu %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                    int(width),
+                    s.name().c_str(),
+                    (unsigned long long)s.calls(),
+                    s.sum() * totalScale,
+                    double(s.sum()) / s.calls() * scale,
+                    s.quantile(0.5) * scale,
+                    s.quantile(0.9) * scale,
+                    s.quantile(0.99) * scale,
+                    s.max() * scale);
+      out << line;
+    }
+  };
+
+  out << "Performance of " << fModule << ":\n";
+  section(PerfStage::Unit::Time, "time [us]", 1.e-3, 1.e-6);
+  section(PerfStage::Unit::Count, "count", 1., 1.);
+  return out.str();
+}
+
+void
+nnet::PerfStats::writeJson(std::ostream& out) const
+{
+  std::lock_guard<std::mutex> lock(fMutex);
+
+  out << "{\"module\": " << jsonString(fModule) << ", \"stages\": [";
+  for (size_t i = 0; i < fStages.size(); ++i) {
+    auto const& s = fStages[i];
+    out << (i ? ", " : "") << "{\"name\": " << jsonString(s.name()) << ", \"unit\": "
+        << ((s.unit() == PerfStage::Unit::Time) ? "\"ns\"" : "\"count\"")
+        << ", \"calls\": " << s.calls() << ", \"sum\": " << s.sum() << ", \"max\": " << s.max()
+        << ", \"p50\": " << s.quantile(0.5) << ", \"p90\": " << s.quantile(0.9)
+        << ", \"p99\": " << s.quantile(0.99) << ", \"histogram\": [";
+
+    // non-empty bins as [lower edge, entries]
+    bool first = true;
+    for (size_t b = 0; b < PerfStage::NBins; ++b) {
+      const uint64_t n = s.binCount(b);
+      if (!n) continue;
+      out << (first ? "" : ", ") << "[" << (b ? uint64_t(1) << (b - 1) : 0) << ", " << n << "]";
+      first = false;
+    }
+    out << "]}";
+  }
+  out << "]}";
+}
+
+void
+nnet::PerfStats::report(std::string const& jsonFile) const
+{
+  mf::LogInfo("PerfStats") << table();
+
+  if (!jsonFile.empty() && !PerfRegistry::writeJson(jsonFile)) {
+    mf::LogWarning("PerfStats") << "failed writing performance report to " << jsonFile;
+  }
+}
+
+nnet::PerfStats&
+nnet::PerfRegistry::stats(std::string const& module)
+{
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto& entry = registry[module];
+  if (!entry) { entry = std::make_unique<PerfStats>(module); }
+  return *entry;
+}
+
+bool
+nnet::PerfRegistry::writeJson(std::string const& path)
+{
+  std::lock_guard<std::mutex> lock(registryMutex);
+
+  // written to a temporary file first, so readers never see a partial report
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp);
+    if (!out) { return false; }
+    out << "{\"modules\": [";
+    bool first = true;
+    for (auto const& [module, stats] : registry) {
+      out << (first ? "" : ",") << "\n  ";
+      stats->writeJson(out);
+      first = false;
+    }
+    out << "\n]}\n";
+    if (!out) { return false; }
+  }
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
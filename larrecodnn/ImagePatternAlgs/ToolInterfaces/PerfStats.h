@@ -0,0 +1,187 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Class:       PerfStats
+// File:        PerfStats.h
+//
+//      Always-on instrumentation of the CNN modules and tools: time spent in the processing steps
+//      (view setup, patch buffering, input marshalling, inference, output unpacking) and counts
+//      such as hits or windows per event. Each module gets its PerfStats from the process-wide
+//      PerfRegistry and passes it to its tools; at the end of job the module report() prints a
+//      table and, if requested, writes stats of all modules to a JSON file.
+//
+//      Recording is a few relaxed atomic increments, safe from any thread; stages are looked up
+//      by name once, when tools and modules are set up, and a null stage records nothing.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PerfStats_H
+#define PerfStats_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace nnet {
+
+  // One instrumented quantity: duration of a step [ns] or a count; the histogram has power
+  // of 2 bins, bin b > 0 holds values in [2^(b-1), 2^b), bin 0 holds zeros
+  class PerfStage {
+  public:
+    enum class Unit { Time, Count };
+    static constexpr size_t NBins = 65;
+
+    PerfStage(std::string name, Unit unit) : fName(std::move(name)), fUnit(unit) {}
+
+    void
+    add(uint64_t value)
+    {
+      fCalls.fetch_add(1, std::memory_order_relaxed);
+      fSum.fetch_add(value, std::memory_order_relaxed);
+      uint64_t max = fMax.load(std::memory_order_relaxed);
+      while ((value > max) && !fMax.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+      fBins[bin(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static size_t
+    bin(uint64_t value)
+    {
+      return value ? 64 - __builtin_clzll(value) : 0;
+    }
+
+    std::string const&
+    name() const
+    {
+      return fName;
+    }
+    Unit
+    unit() const
+    {
+      return fUnit;
+    }
+    uint64_t
+    calls() const
+    {
+      return fCalls.load(std::memory_order_relaxed);
+    }
+    uint64_t
+    sum() const
+    {
+      return fSum.load(std::memory_order_relaxed);
+    }
+    uint64_t
+    max() const
+    {
+      return fMax.load(std::memory_order_relaxed);
+    }
+    uint64_t
+    binCount(size_t b) const
+    {
+      return fBins[b].load(std::memory_order_relaxed);
+    }
+
+    // upper edge of the histogram bin containing the q-quantile, at most the max value
+    uint64_t quantile(double q) const;
+
+  private:
+    std::string fName;
+    Unit fUnit;
+    std::atomic<uint64_t> fCalls{0};
+    std::atomic<uint64_t> fSum{0};
+    std::atomic<uint64_t> fMax{0};
+    std::array<std::atomic<uint64_t>, NBins> fBins{};
+  };
+
+  // Adds the time from construction (or from the previous next()) to the stage when stopped,
+  // destroyed or moved to the next stage; no clock reads without a stage
+  class PerfTimer {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit PerfTimer(PerfStage* stage) : fStage(stage)
+    {
+      if (fStage) { fStart = Clock::now(); }
+    }
+    ~PerfTimer() { stop(); }
+
+    PerfTimer(PerfTimer const&) = delete;
+    PerfTimer& operator=(PerfTimer const&) = delete;
+
+    // record the current stage and start timing the next one (which may be null)
+    void
+    next(PerfStage* stage)
+    {
+      if (fStage || stage) {
+        auto now = Clock::now();
+        if (fStage) { fStage->add(elapsed(now)); }
+        fStart = now;
+      }
+      fStage = stage;
+    }
+
+    void
+    stop()
+    {
+      if (fStage) {
+        fStage->add(elapsed(Clock::now()));
+        fStage = nullptr;
+      }
+    }
+
+  private:
+    uint64_t
+    elapsed(Clock::time_point now) const
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(now - fStart).count();
+    }
+
+    PerfStage* fStage;
+    Clock::time_point fStart;
+  };
+
+  // Stages of one module and of the tools it uses
+  class PerfStats {
+  public:
+    explicit PerfStats(std::string module) : fModule(std::move(module)) {}
+
+    PerfStats(PerfStats const&) = delete;
+    PerfStats& operator=(PerfStats const&) = delete;
+
+    // stage with this name, added on first use; the pointer stays valid until the end of job
+    PerfStage* stage(std::string const& name, PerfStage::Unit unit = PerfStage::Unit::Time);
+
+    std::string const&
+    module() const
+    {
+      return fModule;
+    }
+
+    // text table of all stages, in the order they were added
+    std::string table() const;
+    void writeJson(std::ostream& out) const;
+
+    // end of job: table printed to the log, stats of all modules written to jsonFile if not empty
+    void report(std::string const& jsonFile) const;
+
+  private:
+    std::string fModule;
+    mutable std::mutex fMutex;
+    std::deque<PerfStage> fStages; // deque: stage addresses stay valid as it grows
+  };
+
+  // Process-wide stats of all modules, by module label
+  class PerfRegistry {
+  public:
+    static PerfStats& stats(std::string const& module);
+    // {"modules": [...]} with all modules registered so far
+    static bool writeJson(std::string const& path);
+  };
+
+}
+
+#endif
@@ -4,12 +4,17 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include "larrecodnn/ImagePatternAlgs/ToolInterfaces/IPointIdAlg.h"
+#include "larrecodnn/ImagePatternAlgs/NuSonic/Triton/TritonBatcher.h"
 #include "larrecodnn/ImagePatternAlgs/NuSonic/Triton/TritonClient.h"
 #include "art/Utilities/ToolMacros.h"
 #include "messagefacility/MessageLogger/MessageLogger.h"
 #include "fhiclcpp/types/Table.h"
 #include "fhiclcpp/ParameterSet.h"
 
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -19,12 +24,39 @@ namespace PointIdAlgTools {
   class PointIdAlgSonicTriton : public IPointIdAlg {
   public:
     explicit PointIdAlgSonicTriton(fhicl::Table<Config> const& table);
+    ~PointIdAlgSonicTriton() override;
 
     std::vector<float> Run(std::vector<std::vector<float>> const& inp2d) const override;
     std::vector<std::vector<float>> Run(std::vector<std::vector<std::vector<float>>> const& inps,
                                         int samples = -1) const override;
+    std::vector<std::vector<float>> Run(float const* inps, size_t samples) const override;
+
+    void submitIdVectors(const std::vector<std::pair<unsigned int, float>>& points) override;
+    std::vector<std::vector<float>> collectIdVectors() override;
+
+    size_t maxBatchSize() const override
+    {
+      return triton_batcher ? triton_batcher->maxBatchSize() : triton_client->maxBatchSize();
+    }
 
   private:
+    // order of network outputs, from NNetOutputPattern matched against outputs on server
+    void resolveOutputs(std::vector<std::string> const& patterns,
+                        std::map<std::string, int64_t> const& available);
+    std::vector<std::vector<float>> readOutputs(size_t samples) const;
+    std::vector<std::vector<float>> readOutputs(lartriton::TritonBatcher::Result const& res) const;
+
+    // outputs of the reference model for one in fValidationInterval batches, empty otherwise
+    std::vector<std::vector<float>> sampleReference(float const* inps, size_t samples) const;
+    // accumulate deviations of the outputs from the reference ones
+    void validate(std::vector<std::vector<float>> const& ref,
+                  std::vector<std::vector<float>> const& out) const;
+
+    std::vector<std::string> fOutputNames;
+    std::vector<size_t> fOutputSizes;   // values per sample of each output
+    std::vector<size_t> fOutputOffsets; // where each output goes in the result of a sample
+    size_t fNOutputValues;              // total values per sample
+
     std::string fTritonModelName;
     std::string fTritonURL;
     bool fTritonVerbose;
@@ -33,6 +65,20 @@ namespace PointIdAlgTools {
     unsigned fTritonAllowedTries;
 
     std::unique_ptr<lartriton::TritonClient> triton_client;
+
+    // requests merged with other tools of the job, if enabled
+    std::shared_ptr<lartriton::TritonBatcher> triton_batcher;
+    std::deque<lartriton::TritonBatcher::Ticket> fTickets; // submitted, not collected
+
+    // reduced precision validation: same inputs sent to the reference model
+    std::string fReferenceModelName;
+    std::unique_ptr<lartriton::TritonClient> fReference;
+    unsigned fValidationInterval;
+    mutable size_t fNBatches = 0;
+    mutable size_t fNValidated = 0;     // samples compared
+    mutable std::vector<double> fSumDev, fMaxDev;  // per output, |out - ref| of all values
+    mutable std::vector<size_t> fNChanged;         // per output, samples with a different max class
+    std::deque<std::vector<std::vector<float>>> fPendingReference; // per submitted batch
   };
 
   // ------------------------------------------------------
@@ -52,19 +98,76 @@ namespace PointIdAlgTools {
     fTritonVerbose = table().TritonVerbose();
     fTritonModelVersion = table().TritonModelVersion();
     fTritonAllowedTries = table().TritonAllowedTries();
+    fTritonTimeout = table().TritonTimeout();
 
     // ... Create parameter set for Triton inference client
     fhicl::ParameterSet TritonPset;
     TritonPset.put("serverURL",fTritonURL);
+    TritonPset.put("serverURLs", table().TritonURLs());
+    TritonPset.put("routing", table().TritonRouting());
+    TritonPset.put("retryDelay", table().TritonRetryDelay());
+    TritonPset.put("hedgeMs", table().TritonHedgeMs());
     TritonPset.put("verbose",fTritonVerbose);
     TritonPset.put("modelName",fTritonModelName);
     TritonPset.put("modelVersion",fTritonModelVersion);
     TritonPset.put("timeout",fTritonTimeout);
     TritonPset.put("allowedTries",fTritonAllowedTries);
     TritonPset.put("outputs","[]");
+    TritonPset.put("sharedMemory", table().TritonSharedMemory());
+    TritonPset.put("sharedMemorySlots", table().TritonSharedMemorySlots());
     
-    // ... Create the Triton inference client
-    triton_client = std::make_unique<lartriton::TritonClient>(TritonPset);
+    // ... Create the Triton inference client, or get the shared batching one
+    if (table().TritonBatching()) {
+      triton_batcher = lartriton::TritonBatcher::instance(TritonPset, table().TritonMaxDelayUs());
+      mf::LogInfo("PointIdAlgSonicTriton") << "requests merged by the process-wide batcher";
+    }
+    else {
+      triton_client = std::make_unique<lartriton::TritonClient>(TritonPset);
+    }
+
+    // ... Resolve outputs once: names, sizes and offsets in the per-sample results
+    std::map<std::string, int64_t> available;
+    if (triton_batcher) { available = triton_batcher->outputSizes(); }
+    else {
+      for (auto const& [name, output] : triton_client->output()) {
+        available[name] = output.sizeDims();
+      }
+    }
+    std::vector<std::string> patterns;
+    if (!table().NNetOutputPattern(patterns)) { patterns = {"em_trk_none_netout", "michel_netout"}; }
+    resolveOutputs(patterns, available);
+
+    // ... FP16/BF16 models get inputs converted from float and outputs back by the client
+    std::string const& datatype = triton_batcher ? triton_batcher->inputDatatype()
+                                                 : triton_client->input().begin()->second.dname();
+    if (!table().TritonPrecision().empty() && (table().TritonPrecision() != datatype)) {
+      throw cet::exception("PointIdAlgSonicTriton")
+        << "model " << fTritonModelName << " takes " << datatype << " input, "
+        << table().TritonPrecision() << " requested" << std::endl;
+    }
+    mf::LogInfo("PointIdAlgSonicTriton") << "input datatype: " << datatype;
+
+    // ... Reference model used to validate the outputs
+    fReferenceModelName = table().TritonReferenceModelName();
+    fValidationInterval = std::max(1u, table().TritonValidationInterval());
+    if (!fReferenceModelName.empty()) {
+      fhicl::ParameterSet RefPset = TritonPset;
+      RefPset.put_or_replace("modelName", fReferenceModelName);
+      RefPset.put_or_replace("modelVersion", std::string(""));
+      RefPset.put_or_replace("sharedMemory", std::string("none"));
+      fReference = std::make_unique<lartriton::TritonClient>(RefPset);
+      for (auto const& name : fOutputNames) {
+        if (!fReference->output().count(name)) {
+          throw cet::exception("PointIdAlgSonicTriton")
+            << "Reference model " << fReferenceModelName << " has no output " << name << std::endl;
+        }
+      }
+      fSumDev.assign(fOutputNames.size(), 0);
+      fMaxDev.assign(fOutputNames.size(), 0);
+      fNChanged.assign(fOutputNames.size(), 0);
+      mf::LogInfo("PointIdAlgSonicTriton")
+        << "one in " << fValidationInterval << " batches compared with " << fReferenceModelName;
+    }
 
     mf::LogInfo("PointIdAlgSonicTriton") << "url: " << fTritonURL;
     mf::LogInfo("PointIdAlgSonicTriton") << "model name: " << fTritonModelName;
@@ -76,15 +179,39 @@ namespace PointIdAlgTools {
     resizePatch();
   }
 
+  // ------------------------------------------------------
+  PointIdAlgSonicTriton::~PointIdAlgSonicTriton()
+  {
+    if (!fNValidated) { return; }
+
+    mf::LogInfo log("PointIdAlgSonicTriton");
+    log << fTritonModelName << " vs " << fReferenceModelName << " on " << fNValidated << " samples:";
+    for (size_t o = 0; o < fOutputNames.size(); ++o) {
+      log << "\n  " << fOutputNames[o] << ": mean |dev| "
+          << fSumDev[o] / (fNValidated * fOutputSizes[o]) << ", max |dev| " << fMaxDev[o]
+          << ", max class changed for " << 100.0 * fNChanged[o] / fNValidated << "%";
+    }
+  }
+
   // ------------------------------------------------------
   std::vector<float>
   PointIdAlgSonicTriton::Run(std::vector<std::vector<float>> const& inp2d) const
   {
     size_t nrows = inp2d.size();
 
+    if (triton_batcher || fReference) {
+      std::vector<float> flat;
+      for (auto const& row : inp2d) {
+        flat.insert(flat.end(), row.begin(), row.end());
+      }
+      auto out = Run(flat.data(), 1);
+      return out.empty() ? std::vector<float>() : out.front();
+    }
+
     triton_client->setBatchSize(1);	// set batch size
 
     // ~~~~ Initialize the inputs
+    nnet::PerfTimer timer(fPerfInput);
     auto& triton_input = triton_client->input().begin()->second;
 
     auto data1 = std::make_shared<lartriton::TritonInput<float>>();
@@ -100,21 +227,12 @@ namespace PointIdAlgTools {
     triton_input.toServer(data1);	// convert to server format
     
     // ~~~~ Send inference request
+    timer.next(fPerfInference);
     triton_client->dispatch();
 
     // ~~~~ Retrieve inference results
-    const auto& triton_output0 = triton_client->output().at("em_trk_none_netout/Softmax");
-    const auto& prob0 = triton_output0.fromServer<float>();
-    auto ncat0 = triton_output0.sizeDims();
-
-    const auto& triton_output1 = triton_client->output().at("michel_netout/Sigmoid");
-    const auto& prob1 = triton_output1.fromServer<float>();
-    auto ncat1 = triton_output1.sizeDims();
-
-    std::vector<float> out;
-    out.reserve(ncat0+ncat1);
-    out.insert(out.end(), prob0[0].begin(), prob0[0].end());
-    out.insert(out.end(), prob1[0].begin(), prob1[0].end());
+    timer.next(fPerfOutput);
+    auto out = readOutputs(1).front();
 
     triton_client->reset();
 
@@ -134,9 +252,20 @@ namespace PointIdAlgTools {
     size_t usamples = samples;
     size_t nrows = inps.front().size();
 
+    if (triton_batcher || fReference) {
+      std::vector<float> flat;
+      for (size_t idx = 0; idx < usamples; ++idx) {
+        for (auto const& row : inps[idx]) {
+          flat.insert(flat.end(), row.begin(), row.end());
+        }
+      }
+      return Run(flat.data(), usamples);
+    }
+
     triton_client->setBatchSize(usamples);	// set batch size
 
     // ~~~~ Initialize the inputs
+    nnet::PerfTimer timer(fPerfInput);
     auto& triton_input = triton_client->input().begin()->second;
 
     auto data1 = std::make_shared<lartriton::TritonInput<float>>();
@@ -153,31 +282,258 @@ namespace PointIdAlgTools {
     triton_input.toServer(data1);	// convert to server format
 
     // ~~~~ Send inference request
+    timer.next(fPerfInference);
     triton_client->dispatch();
 
     // ~~~~ Retrieve inference results
-    const auto& triton_output0 = triton_client->output().at("em_trk_none_netout/Softmax");
-    const auto& prob0 = triton_output0.fromServer<float>();
-    auto ncat0 = triton_output0.sizeDims();
+    timer.next(fPerfOutput);
+    auto out = readOutputs(usamples);
 
-    const auto& triton_output1 = triton_client->output().at("michel_netout/Sigmoid");
-    const auto& prob1 = triton_output1.fromServer<float>();
-    auto ncat1 = triton_output1.sizeDims();
+    triton_client->reset();
+
+    return out;
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgSonicTriton::Run(float const* inps, size_t samples) const
+  {
+    if ((samples == 0) || !inps) { return std::vector<std::vector<float>>(); }
+
+    auto ref = sampleReference(inps, samples);
 
     std::vector<std::vector<float>> out;
-    out.reserve(usamples);
-    for(unsigned i = 0; i < usamples; i++) {
-      out.emplace_back();
-      auto& img = out.back();
-      img.reserve(ncat0+ncat1);
-      img.insert(img.end(), prob0[i].begin(), prob0[i].end());
-      img.insert(img.end(), prob1[i].begin(), prob1[i].end());
+    nnet::PerfTimer timer(fPerfInput);
+    if (triton_batcher) {
+      auto ticket = triton_batcher->submit(inps, samples);
+      timer.next(fPerfInference); // incl. waiting for the batch to be merged with others
+      auto res = triton_batcher->collect(ticket);
+      timer.next(fPerfOutput);
+      out = readOutputs(res);
+    }
+    else {
+      triton_client->setBatchSize(samples);	// set batch size
+
+      // ~~~~ Contiguous batch is passed to the server without a copy
+      auto& triton_input = triton_client->input().begin()->second;
+      triton_input.toServer(inps, samples);
+
+      // ~~~~ Send inference request
+      timer.next(fPerfInference);
+      triton_client->dispatch();
+
+      // ~~~~ Retrieve inference results
+      timer.next(fPerfOutput);
+      out = readOutputs(samples);
+
+      triton_client->reset();
+    }
+    timer.stop();
+
+    validate(ref, out);
+    return out;
+  }
+
+  // ------------------------------------------------------
+  void
+  PointIdAlgSonicTriton::submitIdVectors(const std::vector<std::pair<unsigned int, float>>& points)
+  {
+    if (triton_batcher) {
+      // ~~~~ data is copied to the batcher queue, buffer can be refilled right after
+      float const* data = points.empty() ? nullptr : bufferPatches(points, fPatchBatch);
+      nnet::PerfTimer timer(fPerfInput);
+      fTickets.push_back(triton_batcher->submit(data, points.size()));
+      timer.stop();
+      fPendingReference.push_back(sampleReference(data, points.size()));
+      return;
+    }
+
+    // ~~~~ inputs go to the shared memory slot of this request, which must not hold
+    // ~~~~ inputs of a request still in flight
+    if (!triton_client->canDispatch()) {
+      throw cet::exception("PointIdAlgSonicTriton")
+        << "All " << triton_client->inFlight() << " shared memory slots are in use, "
+        << "collect a batch first or increase TritonSharedMemorySlots" << std::endl;
+    }
+
+    triton_client->setBatchSize(points.size()); // set batch size
+
+    // ~~~~ Patches are read by the client while the request is sent, so the
+    // ~~~~ buffer can be refilled for the next batch right after
+    float const* data = nullptr;
+    if (!points.empty()) {
+      auto& triton_input = triton_client->input().begin()->second;
+      float* shm = triton_input.sharedMemoryBuffer<float>();
+      if (shm) {
+        // ~~~~ patches written straight into the server's shared memory
+        nnet::PerfTimer timer(fPerfPatches);
+        const size_t patchSize = fPatchSizeW * fPatchSizeD;
+        for (size_t i = 0; i < points.size(); ++i) {
+          if (!bufferPatch(points[i].first, points[i].second, shm + i * patchSize)) {
+            throw cet::exception("PointIdAlgSonicTriton") << "Patch buffering failed" << std::endl;
+          }
+        }
+        timer.next(fPerfInput);
+        triton_input.toServer(shm, points.size());
+        data = shm;
+      }
+      else {
+        data = bufferPatches(points, fPatchBatch);
+        nnet::PerfTimer timer(fPerfInput);
+        triton_input.toServer(data, points.size());
+      }
     }
+    fPendingReference.push_back(sampleReference(data, points.size()));
+
+    triton_client->dispatchAsync();
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgSonicTriton::collectIdVectors()
+  {
+    if (triton_batcher) {
+      if (fTickets.empty()) {
+        throw cet::exception("PointIdAlgSonicTriton") << "No submitted batch to collect" << std::endl;
+      }
+      auto ticket = std::move(fTickets.front());
+      fTickets.pop_front();
+      nnet::PerfTimer timer(fPerfInference); // time still waited for the result
+      auto res = triton_batcher->collect(ticket);
+      timer.next(fPerfOutput);
+      auto out = readOutputs(res);
+      timer.stop();
+      validate(fPendingReference.front(), out);
+      fPendingReference.pop_front();
+      return out;
+    }
+
+    nnet::PerfTimer timer(fPerfInference); // time still waited for the result
+    triton_client->wait();
+
+    timer.next(fPerfOutput);
+    auto out = readOutputs(triton_client->output().begin()->second.batchSize());
+    timer.stop();
 
     triton_client->reset();
 
+    validate(fPendingReference.front(), out);
+    fPendingReference.pop_front();
     return out;
   }
 
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgSonicTriton::readOutputs(size_t samples) const
+  {
+    std::vector<std::vector<float>> out(samples, std::vector<float>(fNOutputValues));
+
+    // ~~~~ one map lookup per output, then per-sample spans copied to their offsets
+    for (size_t o = 0; o < fOutputNames.size(); ++o) {
+      auto const& prob = triton_client->output().at(fOutputNames[o]).fromServer<float>();
+      for (size_t i = 0; i < samples; ++i) {
+        std::copy(prob[i].begin(), prob[i].end(), out[i].begin() + fOutputOffsets[o]);
+      }
+    }
+    return out;
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgSonicTriton::readOutputs(lartriton::TritonBatcher::Result const& res) const
+  {
+    std::vector<std::vector<float>> out(res.samples, std::vector<float>(fNOutputValues));
+
+    for (size_t o = 0; o < fOutputNames.size(); ++o) {
+      auto const& prob = res.data.at(fOutputNames[o]);
+      const size_t n = fOutputSizes[o];
+      for (size_t i = 0; i < res.samples; ++i) {
+        std::copy_n(prob.begin() + i * n, n, out[i].begin() + fOutputOffsets[o]);
+      }
+    }
+    return out;
+  }
+
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgSonicTriton::sampleReference(float const* inps, size_t samples) const
+  {
+    if (!fReference || !inps || !samples || (fNBatches++ % fValidationInterval)) { return {}; }
+
+    fReference->setBatchSize(samples);
+    fReference->input().begin()->second.toServer(inps, samples);
+    fReference->dispatch();
+
+    std::vector<std::vector<float>> out(samples, std::vector<float>(fNOutputValues));
+    for (size_t o = 0; o < fOutputNames.size(); ++o) {
+      auto const& prob = fReference->output().at(fOutputNames[o]).fromServer<float>();
+      for (size_t i = 0; i < samples; ++i) {
+        std::copy(prob[i].begin(), prob[i].end(), out[i].begin() + fOutputOffsets[o]);
+      }
+    }
+    fReference->reset();
+    return out;
+  }
+
+  // ------------------------------------------------------
+  void
+  PointIdAlgSonicTriton::validate(std::vector<std::vector<float>> const& ref,
+                                  std::vector<std::vector<float>> const& out) const
+  {
+    if (ref.empty()) { return; }
+
+    for (size_t i = 0; i < out.size(); ++i) {
+      for (size_t o = 0; o < fOutputNames.size(); ++o) {
+        auto r = ref[i].begin() + fOutputOffsets[o], v = out[i].begin() + fOutputOffsets[o];
+        for (size_t k = 0; k < fOutputSizes[o]; ++k) {
+          double dev = std::fabs(v[k] - r[k]);
+          fSumDev[o] += dev;
+          fMaxDev[o] = std::max(fMaxDev[o], dev);
+        }
+        if ((fOutputSizes[o] > 1) && (std::max_element(r, r + fOutputSizes[o]) - r !=
+                                      std::max_element(v, v + fOutputSizes[o]) - v)) {
+          ++fNChanged[o];
+        }
+      }
+    }
+    fNValidated += out.size();
+  }
+
+  // ------------------------------------------------------
+  void
+  PointIdAlgSonicTriton::resolveOutputs(std::vector<std::string> const& patterns,
+                                        std::map<std::string, int64_t> const& available)
+  {
+    // outputs with names containing the patterns, in the pattern order
+    for (auto const& pattern : patterns) {
+      bool found = false;
+      for (auto const& [name, size] : available) {
+        if (name.find(pattern) == std::string::npos) { continue; }
+        found = true;
+        if (std::find(fOutputNames.begin(), fOutputNames.end(), name) != fOutputNames.end()) {
+          continue;
+        }
+        if (size <= 0) {
+          throw cet::exception("PointIdAlgSonicTriton")
+            << "Output " << name << " has variable dimensions" << std::endl;
+        }
+        fOutputNames.push_back(name);
+        fOutputSizes.push_back(size);
+      }
+      if (!found) {
+        throw cet::exception("PointIdAlgSonicTriton")
+          << "No model output matching " << pattern << std::endl;
+      }
+    }
+
+    fNOutputValues = 0;
+    for (size_t o = 0; o < fOutputNames.size(); ++o) {
+      fOutputOffsets.push_back(fNOutputValues);
+      fNOutputValues += fOutputSizes[o];
+      mf::LogInfo("PointIdAlgSonicTriton")
+        << "output " << o << ": " << fOutputNames[o] << " (" << fOutputSizes[o] << " values)";
+    }
+  }
+
 }
 DEFINE_ART_CLASS_TOOL(PointIdAlgTools::PointIdAlgSonicTriton)
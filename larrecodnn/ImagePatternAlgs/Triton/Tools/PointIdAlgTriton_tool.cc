@@ -4,7 +4,9 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include "larrecodnn/ImagePatternAlgs/ToolInterfaces/IPointIdAlg.h"
+#include "larrecodnn/ImagePatternAlgs/NuSonic/Triton/triton_utils.h"
 #include "art/Utilities/ToolMacros.h"
+#include "canvas/Utilities/Exception.h"
 #include "fhiclcpp/types/Table.h"
 #include "fhiclcpp/ParameterSet.h"
 #include "cetlib_except/exception.h"
@@ -16,6 +18,7 @@ namespace ni = nvidia::inferenceserver;
 namespace nic = nvidia::inferenceserver::client;
 
 #include <algorithm>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -29,8 +32,16 @@ namespace PointIdAlgTools {
     std::vector<float> Run(std::vector<std::vector<float>> const& inp2d) const override;
     std::vector<std::vector<float>> Run(std::vector<std::vector<std::vector<float>>> const& inps,
                                         int samples = -1) const override;
+    std::vector<std::vector<float>> Run(float const* inps, size_t samples) const override;
+
+    size_t maxBatchSize() const override { return triton_maxbatch; }
 
   private:
+    // send contiguous [samples, rows, cols] block, in chunks of max batch size if needed
+    std::vector<std::vector<float>> infer(float const* inps, size_t samples) const;
+    // copy n values of output o starting at first, up-converted if the model uses FP16/BF16
+    void readOutput(size_t o, uint8_t const* data, size_t first, size_t n, float* dst) const;
+
     std::string fTritonModelName;
     std::string fTritonURL;
     bool fTritonVerbose;
@@ -41,10 +52,26 @@ namespace PointIdAlgTools {
     inference::ModelConfigResponse triton_modcfg;
     mutable std::vector<int64_t> triton_inpshape;
     nic::InferOptions triton_options;
+    size_t triton_maxbatch; // 0 if model does not limit the batch size
+
+    // created once, reused by all requests
+    std::unique_ptr<nic::InferInput> triton_input;
+    std::vector<std::unique_ptr<nic::InferRequestedOutput>> triton_outputs;
+    std::vector<const nic::InferRequestedOutput*> triton_outputs_ptr;
 
+    // staging for nested-vector inputs: grows to the largest batch sent, never shrinks
+    mutable PatchBatch fStaging;
 
+    // datatypes of the model tensors, FP16/BF16 ones are exchanged as float and converted here
+    std::string triton_inptype;
+    std::vector<std::string> triton_outtypes;
+    mutable std::vector<uint16_t> fReducedStaging;
   };
 
+  namespace {
+    bool isReduced(std::string const& dtype) { return (dtype == "FP16") || (dtype == "BF16"); }
+  }
+
   // ------------------------------------------------------
   PointIdAlgTriton::PointIdAlgTriton(fhicl::Table<Config> const& table)
     : img::DataProviderAlg(table()), triton_options("")
@@ -62,6 +89,14 @@ namespace PointIdAlgTools {
     fTritonVerbose = table().TritonVerbose();
     fTritonModelVersion = table().TritonModelVersion();
 
+    // ... Comparison with a reference model is implemented in PointIdAlgSonicTriton only
+    if (!table().TritonReferenceModelName().empty()) {
+      throw art::Exception(art::errors::Configuration)
+        << "PointIdAlgTriton: TritonReferenceModelName is not supported by this tool, "
+        << "use tool_type PointIdAlgSonicTriton for the validation against a reference model"
+        << std::endl;
+    }
+
     // ... Create the Triton inference client
     auto err = nic::InferenceServerGrpcClient::Create(&triton_client, fTritonURL, fTritonVerbose);
     if (!err.IsOk()) {
@@ -80,6 +115,7 @@ namespace PointIdAlgTools {
       throw cet::exception("PointIdAlgTriton")
             << "error: failed to get model config: " << err << std::endl;
     }
+    triton_maxbatch = triton_modcfg.config().max_batch_size();
 
     // ... Set up shape vector needed when creating inference input
     triton_inpshape.push_back(1);	// initialize batch_size to 1
@@ -87,6 +123,37 @@ namespace PointIdAlgTools {
     triton_inpshape.push_back(triton_modmet.inputs(0).shape(2));
     triton_inpshape.push_back(triton_modmet.inputs(0).shape(3));
 
+    // ... Check the datatype of the served model if a precision is requested
+    triton_inptype = triton_modmet.inputs(0).datatype();
+    if (!table().TritonPrecision().empty() && (table().TritonPrecision() != triton_inptype)) {
+      throw cet::exception("PointIdAlgTriton")
+        << "model " << fTritonModelName << " takes " << triton_inptype << " input, "
+        << table().TritonPrecision() << " requested" << std::endl;
+    }
+    if (isReduced(triton_inptype)) {
+      mf::LogInfo("PointIdAlgTriton") << triton_inptype << " input, converted from float";
+    }
+
+    // ... Create input and requested outputs once, only shape and data change per request
+    nic::InferInput* input;
+    err = nic::InferInput::Create(
+      &input, triton_modmet.inputs(0).name(), triton_inpshape, triton_modmet.inputs(0).datatype());
+    if (!err.IsOk()) {
+      throw cet::exception("PointIdAlgTriton") << "unable to get input: " << err << std::endl;
+    }
+    triton_input.reset(input);
+
+    for (int o = 0; o < 2; ++o) {
+      nic::InferRequestedOutput* output;
+      err = nic::InferRequestedOutput::Create(&output, triton_modmet.outputs(o).name());
+      if (!err.IsOk()) {
+        throw cet::exception("PointIdAlgTriton") << "unable to get output: " << err << std::endl;
+      }
+      triton_outputs.emplace_back(output);
+      triton_outputs_ptr.push_back(output);
+      triton_outtypes.push_back(triton_modmet.outputs(o).datatype());
+    }
+
     // ... Set up Triton inference client options
     triton_options.model_name_ = fTritonModelName;
     triton_options.model_version_ = fTritonModelVersion;
@@ -105,72 +172,20 @@ namespace PointIdAlgTools {
   std::vector<float>
   PointIdAlgTriton::Run(std::vector<std::vector<float>> const& inp2d) const
   {
-    size_t nrows = inp2d.size(), ncols = inp2d.front().size();
-
-    triton_inpshape.at(0) = 1;	// set batch size
-
-    // ~~~~ Initialize the inputs
+    if (inp2d.empty() || inp2d.front().empty()) { return std::vector<float>(); }
 
-    nic::InferInput* triton_input;
-    auto err = nic::InferInput::Create(
-    	&triton_input, triton_modmet.inputs(0).name(), triton_inpshape, triton_modmet.inputs(0).datatype() );
-    if (!err.IsOk()) {
-      throw cet::exception("PointIdAlgTriton")
-        << "unable to get input: " << err << std::endl;
-    }
-    std::shared_ptr<nic::InferInput> triton_input_ptr(triton_input);
-    std::vector<nic::InferInput*> triton_inputs = {triton_input_ptr.get()};
-
-    // ~~~~ Register the mem address of 1st byte of image and #bytes in image
-
-    err = triton_input_ptr->Reset();
-    if (!err.IsOk()) {
-      throw cet::exception("PointIdAlgTriton")
-        << "failed resetting Triton model input: " << err << std::endl;
-    }
-
-    size_t sbuff_byte_size = (nrows * ncols) * sizeof(float);
-    std::vector<float> fa(sbuff_byte_size);
+    size_t nrows = inp2d.size(), ncols = inp2d.front().size();
+    if (fStaging.size() < nrows * ncols) { fStaging.resize(nrows * ncols); }
 
     // ..flatten the 2d array into contiguous 1d block
+    nnet::PerfTimer timer(fPerfInput);
     for (size_t ir = 0; ir < nrows; ++ir) {
-      std::copy(inp2d[ir].begin(), inp2d[ir].end(), fa.begin() + (ir * ncols));
-    }
-    err = triton_input_ptr->AppendRaw(reinterpret_cast<uint8_t*>(fa.data()), sbuff_byte_size);
-    if (!err.IsOk()) {
-      throw cet::exception("PointIdAlgTriton") << "failed setting Triton input: " << err << std::endl;
-    }
-
-    // ~~~~ Send inference request
-
-    nic::InferResult* results;
-
-    err = triton_client->Infer(&results, triton_options, triton_inputs);
-    if (!err.IsOk()) {
-      throw cet::exception("PointIdAlgTriton") 
-         << "failed sending Triton synchronous infer request: " << err << std::endl;
+      std::copy(inp2d[ir].begin(), inp2d[ir].end(), fStaging.begin() + (ir * ncols));
     }
-    std::shared_ptr<nic::InferResult> results_ptr;
-    results_ptr.reset(results);
-
-    // ~~~~ Retrieve inference results
-
-    std::vector<float> out;
+    timer.stop();
 
-    const float *prb0;
-    size_t rbuff0_byte_size;	    // size of result buffer in bytes
-    results_ptr->RawData(triton_modmet.outputs(0).name(), (const uint8_t**)&prb0, &rbuff0_byte_size);
-    size_t ncat0 = rbuff0_byte_size/sizeof(float);
-
-    const float *prb1;
-    size_t rbuff1_byte_size;	    // size of result buffer in bytes
-    results_ptr->RawData(triton_modmet.outputs(1).name(), (const uint8_t**)&prb1, &rbuff1_byte_size);
-    size_t ncat1 = rbuff1_byte_size/sizeof(float);
-
-    for(unsigned j = 0; j < ncat0; j++) out.push_back(*(prb0 + j ));
-    for(unsigned j = 0; j < ncat1; j++) out.push_back(*(prb1 + j ));
-
-    return out;
+    auto out = infer(fStaging.data(), 1);
+    return out.empty() ? std::vector<float>() : std::move(out.front());
   }
 
   // ------------------------------------------------------
@@ -185,78 +200,129 @@ namespace PointIdAlgTools {
 
     size_t usamples = samples;
     size_t nrows = inps.front().size(), ncols = inps.front().front().size();
+    size_t patchSize = nrows * ncols;
+    if (fStaging.size() < usamples * patchSize) { fStaging.resize(usamples * patchSize); }
 
-    triton_inpshape.at(0) = usamples;	// set batch size
+    // ~~~~ Flatten all samples into the contiguous staging block
+    nnet::PerfTimer timer(fPerfInput);
+    for (size_t idx = 0; idx < usamples; ++idx) {
+      for (size_t ir = 0; ir < nrows; ++ir) {
+        std::copy(inps[idx][ir].begin(), inps[idx][ir].end(),
+                  fStaging.begin() + (idx * patchSize + ir * ncols));
+      }
+    }
+    timer.stop();
 
-    // ~~~~ Initialize the inputs
+    return infer(fStaging.data(), usamples);
+  }
 
-    nic::InferInput* triton_input;
-    auto err = nic::InferInput::Create(
-    	&triton_input, triton_modmet.inputs(0).name(), triton_inpshape, triton_modmet.inputs(0).datatype() );
-    if (!err.IsOk()) {
-      throw cet::exception("PointIdAlgTriton")
-        << "unable to get input: " << err << std::endl;
-    }
-    std::shared_ptr<nic::InferInput> triton_input_ptr(triton_input);
-    std::vector<nic::InferInput*> triton_inputs = {triton_input_ptr.get()};
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgTriton::Run(float const* inps, size_t samples) const
+  {
+    if ((samples == 0) || !inps) { return std::vector<std::vector<float>>(); }
 
-    // ~~~~ For each sample, register the mem address of 1st byte of image and #bytes in image
-    err = triton_input_ptr->Reset();
-    if (!err.IsOk()) {
-      throw cet::exception("PointIdAlgTriton")
-        << "failed resetting Triton model input: " << err << std::endl;
-    }
+    // ~~~~ Contiguous batch is registered directly, no staging copy needed
+    return infer(inps, samples);
+  }
 
-    size_t sbuff_byte_size = (nrows * ncols) * sizeof(float);
-    std::vector<std::vector<float>> fa(usamples, std::vector<float>(sbuff_byte_size));
+  // ------------------------------------------------------
+  std::vector<std::vector<float>>
+  PointIdAlgTriton::infer(float const* inps, size_t samples) const
+  {
+    std::vector<std::vector<float>> out;
+    out.reserve(samples);
 
-    for (size_t idx = 0; idx < usamples; ++idx) {
-      // ..first flatten the 2d array into contiguous 1d block
-      for (size_t ir = 0; ir < nrows; ++ir) {
-        std::copy(inps[idx][ir].begin(), inps[idx][ir].end(), fa[idx].begin() + (ir * ncols));
+    const size_t patchSize = triton_inpshape[1] * triton_inpshape[2] * triton_inpshape[3];
+    const size_t chunk = (triton_maxbatch > 0) ? triton_maxbatch : samples;
+
+    for (size_t first = 0; first < samples; first += chunk) {
+      size_t nb = std::min(chunk, samples - first);
+
+      nnet::PerfTimer timer(fPerfInput);
+      triton_inpshape.at(0) = nb; // set batch size
+
+      // ~~~~ Register the whole batch with one call, data is read when the request is sent
+      auto err = triton_input->Reset();
+      if (!err.IsOk()) {
+        throw cet::exception("PointIdAlgTriton")
+          << "failed resetting Triton model input: " << err << std::endl;
       }
-      err = triton_input_ptr->AppendRaw(reinterpret_cast<uint8_t*>(fa[idx].data()), sbuff_byte_size);
+      err = triton_input->SetShape(triton_inpshape);
       if (!err.IsOk()) {
         throw cet::exception("PointIdAlgTriton")
-          << "failed setting Triton input: " << err << std::endl;
+          << "failed setting Triton input shape: " << err << std::endl;
+      }
+      const uint8_t* raw = reinterpret_cast<const uint8_t*>(inps + first * patchSize);
+      size_t nbytes = nb * patchSize * sizeof(float);
+      if (isReduced(triton_inptype)) {
+        // ~~~~ converted to the model datatype, half of the bytes sent
+        if (fReducedStaging.size() < nb * patchSize) { fReducedStaging.resize(nb * patchSize); }
+        if (triton_inptype == "FP16") {
+          triton_utils::floatToHalf(inps + first * patchSize, fReducedStaging.data(), nb * patchSize);
+        }
+        else {
+          triton_utils::floatToBFloat16(inps + first * patchSize, fReducedStaging.data(), nb * patchSize);
+        }
+        raw = reinterpret_cast<const uint8_t*>(fReducedStaging.data());
+        nbytes = nb * patchSize * sizeof(uint16_t);
+      }
+      err = triton_input->AppendRaw(raw, nbytes);
+      if (!err.IsOk()) {
+        throw cet::exception("PointIdAlgTriton") << "failed setting Triton input: " << err << std::endl;
       }
-    }
 
-    // ~~~~ Send inference request
+      // ~~~~ Send inference request
 
-    nic::InferResult* results;
+      timer.next(fPerfInference);
+      nic::InferResult* results;
+      std::vector<nic::InferInput*> triton_inputs = {triton_input.get()};
 
-    err = triton_client->Infer(&results, triton_options, triton_inputs);
-    if (!err.IsOk()) {
-      throw cet::exception("PointIdAlgTriton") 
-         << "failed sending Triton synchronous infer request: " << err << std::endl;
-    }
-    std::shared_ptr<nic::InferResult> results_ptr;
-    results_ptr.reset(results);
+      err = triton_client->Infer(&results, triton_options, triton_inputs, triton_outputs_ptr);
+      if (!err.IsOk()) {
+        throw cet::exception("PointIdAlgTriton")
+           << "failed sending Triton synchronous infer request: " << err << std::endl;
+      }
+      std::unique_ptr<nic::InferResult> results_ptr(results);
 
-    // ~~~~ Retrieve inference results
+      // ~~~~ Retrieve inference results
 
-    std::vector<std::vector<float>> out;
+      timer.next(fPerfOutput);
+      const uint8_t *prb0;
+      size_t rbuff0_byte_size;	    // size of result buffer in bytes
+      results_ptr->RawData(triton_modmet.outputs(0).name(), &prb0, &rbuff0_byte_size);
+      size_t ncat0 = rbuff0_byte_size/(nb*(isReduced(triton_outtypes[0]) ? sizeof(uint16_t) : sizeof(float)));
+
+      const uint8_t *prb1;
+      size_t rbuff1_byte_size;	    // size of result buffer in bytes
+      results_ptr->RawData(triton_modmet.outputs(1).name(), &prb1, &rbuff1_byte_size);
+      size_t ncat1 = rbuff1_byte_size/(nb*(isReduced(triton_outtypes[1]) ? sizeof(uint16_t) : sizeof(float)));
 
-    const float *prb0;
-    size_t rbuff0_byte_size;	    // size of result buffer in bytes
-    results_ptr->RawData(triton_modmet.outputs(0).name(), (const uint8_t**)&prb0, &rbuff0_byte_size);
-    size_t ncat0 = rbuff0_byte_size/(usamples*sizeof(float));
-
-    const float *prb1;
-    size_t rbuff1_byte_size;	    // size of result buffer in bytes
-    results_ptr->RawData(triton_modmet.outputs(1).name(), (const uint8_t**)&prb1, &rbuff1_byte_size);
-    size_t ncat1 = rbuff1_byte_size/(usamples*sizeof(float));
-
-    for(unsigned i = 0; i < usamples; i++) {
-      std::vector<float> vprb;
-      for(unsigned j = 0; j < ncat0; j++) vprb.push_back(*(prb0 + i*ncat0 + j ));
-      for(unsigned j = 0; j < ncat1; j++) vprb.push_back(*(prb1 + i*ncat1 + j ));
-      out.push_back(vprb);
+      for(unsigned i = 0; i < nb; i++) {
+        out.emplace_back(ncat0 + ncat1);
+        readOutput(0, prb0, i*ncat0, ncat0, out.back().data());
+        readOutput(1, prb1, i*ncat1, ncat1, out.back().data() + ncat0);
+      }
     }
 
     return out;
   }
 
+  // ------------------------------------------------------
+  void
+  PointIdAlgTriton::readOutput(size_t o, uint8_t const* data, size_t first, size_t n, float* dst) const
+  {
+    auto const& dtype = triton_outtypes[o];
+    if (dtype == "FP16") {
+      triton_utils::halfToFloat(reinterpret_cast<const uint16_t*>(data) + first, dst, n);
+    }
+    else if (dtype == "BF16") {
+      triton_utils::bfloat16ToFloat(reinterpret_cast<const uint16_t*>(data) + first, dst, n);
+    }
+    else {
+      std::copy_n(reinterpret_cast<const float*>(data) + first, n, dst);
+    }
+  }
+
 }
 DEFINE_ART_CLASS_TOOL(PointIdAlgTools::PointIdAlgTriton)
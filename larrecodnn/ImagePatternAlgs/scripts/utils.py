@@ -1,4 +1,4 @@
-from ROOT import TFile
+from ROOT import TFile, TTree
 from root_numpy import hist2array
 
 import numpy as np
@@ -30,10 +30,24 @@ def get_event_bounds(A, drift_margin = 0):
     end_ind = np.min([A.shape[1], np.where(cum > cum[-1]*0.995)[0][0] + drift_margin])
     return start_ind, end_ind
 
+# maps of the tree entry written by PointIdTrainingData with DumpToTree: true
+def get_tree_maps(tree, entry):
+    tree.GetEntry(entry)
+    shape = (tree.w1 - tree.w0, tree.d1 - tree.d0)
+    A_raw = np.asarray(tree.raw, dtype=np.float32).reshape(shape)
+    A_deposit = np.zeros(A_raw.size, dtype=np.float32)
+    A_deposit[np.asarray(tree.dep_idx, dtype=np.int64)] = np.asarray(tree.dep_val, dtype=np.float32)
+    A_pdg = np.zeros(A_raw.size, dtype=np.int32)
+    A_pdg[np.asarray(tree.pdg_idx, dtype=np.int64)] = np.asarray(tree.pdg_val, dtype=np.int32)
+    return A_raw, A_deposit.reshape(shape), A_pdg.reshape(shape)
+
+# folder: directory with text files, ROOT file with histograms, or tree (fname is then the entry number)
 def get_data(folder, fname, drift_margin = 0, crop = True, blur = None, white_noise = 0, coherent_noise = 0):
     print 'Reading', fname
     try:
-        if isinstance(folder, TFile):  # read from ROOT file
+        if isinstance(folder, TTree):  # read from ROOT tree
+            A_raw, A_deposit, A_pdg = get_tree_maps(folder, fname)
+        elif isinstance(folder, TFile):  # read from ROOT file
             A_raw     = hist2array(folder.Get(fname + '_raw'))
             A_deposit = hist2array(folder.Get(fname + '_deposit'))
             A_pdg     = hist2array(folder.Get(fname + '_pdg'))